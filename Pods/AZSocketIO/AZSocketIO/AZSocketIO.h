@@ -49,6 +49,8 @@ typedef enum {
 NS_ENUM(NSUInteger, AZSocketIOError) {
     AZSocketIOErrorConnection   = 100,
     AZSocketIOErrorArgs         = 3000,
+    AZSocketIOErrorAckTimeout   = 3001,
+    AZSocketIOErrorAckCancelled = 3002,
 };
 
 /**
@@ -182,6 +184,20 @@ NS_ENUM(NSUInteger, AZSocketIOError) {
  */
 - (BOOL)send:(id)data error:(NSError *__autoreleasing *)error ack:(void (^)())callback;
 
+/**
+ Sends a normal message to the socket.io server.
+ 
+ Like `send:error:ackWithArgs:`, but gives up on the ACK after `ackTimeout` seconds.
+ 
+ @param data The data to be sent to the socket.io server. If this data is not an `NSString`, the data will be encoded as JSON.
+ @param error If there is a problem encoding the message, upon return contains an instance of NSError that describes the problem.
+ @param callback A block that will be executed using the ACK args from the socket.io server.
+ @param failure A block that will be executed instead if the ACK times out (`AZSocketIOErrorAckTimeout`) or the connection is lost first (`AZSocketIOErrorAckCancelled`).
+ 
+ @return `YES` if the message was dispatched immediately, `NO` if it was queued.
+ */
+- (BOOL)send:(id)data error:(NSError *__autoreleasing *)error ackWithArgs:(void (^)(NSArray *data))callback failure:(void (^)(NSError *error))failure;
+
 /**
  Emits a namespaced message to the socket.io server.
  
@@ -193,6 +209,26 @@ NS_ENUM(NSUInteger, AZSocketIOError) {
  */
 - (BOOL)emit:(NSString *)name args:(id)args error:(NSError * __autoreleasing *)error;
 
+/**
+ Emits a namespaced message to the socket.io server.
+ 
+ Like `emit:args:error:ackWithArgs:`, but gives up on the ACK after `ackTimeout` seconds.
+ 
+ @param name The name of the event.
+ @param args The arguements to emit with the event.
+ @param error If there is a problem encoding the message, upon return contains an instance of NSError that describes the problem.
+ @param callback A block that will be executed using the ACK args from the socket.io server.
+ @param failure A block that will be executed instead if the ACK times out (`AZSocketIOErrorAckTimeout`) or the connection is lost first (`AZSocketIOErrorAckCancelled`).
+ 
+ @return `YES` if the message was dispatched immediately, `NO` if it was queued.
+ */
+- (BOOL)emit:(NSString *)name args:(id)args error:(NSError *__autoreleasing *)error ackWithArgs:(void (^)(NSArray *data))callback failure:(void (^)(NSError *error))failure;
+
+/**
+ How long, in seconds, to wait for an ACK before giving up on it. Callbacks for ACKs that time out, or are still outstanding when the connection closes or fails, are released; if a failure block was given it is called instead. Zero waits until the connection is lost. Defaults to '30'.
+ */
+@property(nonatomic, assign)NSTimeInterval ackTimeout;
+
 /**
  Emits a namespaced message to the socket.io server.
  
@@ -221,6 +257,26 @@ NS_ENUM(NSUInteger, AZSocketIOError) {
  */
 - (BOOL)emit:(NSString *)name args:(id)args error:(NSError *__autoreleasing *)error ack:(void (^)())callback;
 
+/**
+ How long, in seconds, a sent packet waits for others to join it before the batch is handed to the transport. Packets sent within the window go out in one transport write where the transport supports it. Zero still batches whatever queues up while a write is pending or the socket is not yet connected. Defaults to '0.01'.
+ */
+@property(nonatomic, assign)NSTimeInterval coalescingInterval;
+
+/**
+ How often, in seconds, transports that can ping the server do so. A connection whose pings go unanswered twice in a row fails and is reconnected, well before the socket.io heartbeat timeout would notice. Zero turns pings off. Defaults to '5'.
+ */
+@property(nonatomic, assign)NSTimeInterval keepaliveInterval;
+
+/**
+ Whether the websocket transport runs on SocketRocket's socket backend instead of its run loop backend. The socket backend looks up the host and opens the TCP connection while the handshake is under way, so the websocket doesn't start from nothing once it has a session id. Set it before connecting. Defaults to 'NO'.
+ */
+@property(nonatomic, assign)BOOL usesSocketBackend;
+
+/**
+ The number of bytes the transport has been handed but hasn't written to the network yet, or '0' if the transport doesn't say. Packets still waiting to be coalesced aren't counted. Callers that can send faster than the network drains should hold off while this is high.
+ */
+@property(nonatomic, readonly)uint64_t bufferedAmount;
+
 ///-------------------------------------
 /// @name Routing Events From the Server
 ///-------------------------------------
@@ -23,9 +23,12 @@
 #import "AZWebsocketTransport.h"
 #import "AZxhrTransport.h"
 #import "AZSocketIOPacket.h"
+#import "AZSocketIOAckRegistry.h"
 #import <AFNetworking.h>
 
 #define PROTOCOL_VERSION @"1"
+// How long packets refused by a full transport wait before they are offered again.
+#define FLUSH_RETRY_INTERVAL 0.1
 
 NSString * const AZSocketIODefaultNamespace = @"";
 
@@ -36,14 +39,21 @@ NSString * const AZSocketIODefaultNamespace = @"";
 @property(nonatomic, copy, readwrite)NSString *endpoint;
 
 @property(nonatomic, strong)NSOperationQueue *queue;
+@property(nonatomic, strong)NSMutableArray *pendingPackets;
+@property(nonatomic, assign)BOOL flushScheduled;
+
+@property(nonatomic, strong)dispatch_queue_t decodeQueue;
+@property(nonatomic, strong)NSMutableData *decodeBuffer;
+@property(nonatomic, strong)NSMutableArray *pendingDeliveries;
+@property(nonatomic, assign)BOOL deliveryScheduled;
 
 @property(nonatomic, strong)ConnectedBlock connectionBlock;
 
 @property(nonatomic, strong)AFHTTPRequestOperationManager *httpClient;
 @property(nonatomic, strong)NSDictionary *transportMap;
 
-@property(nonatomic, strong)NSMutableDictionary *ackCallbacks;
-@property(nonatomic, assign)NSUInteger ackCount;
+@property(nonatomic, strong)AZSocketIOAckRegistry *ackRegistry;
+@property(nonatomic, strong)dispatch_source_t ackTimer;
 @property(nonatomic, strong)NSTimer *heartbeatTimer;
 @property(nonatomic, assign)NSUInteger connectionAttempts;
 
@@ -94,12 +104,20 @@ NSString * const AZSocketIODefaultNamespace = @"";
         self.httpClient.responseSerializer = [AFHTTPResponseSerializer serializer];
         self.httpClient.responseSerializer.stringEncoding = NSUTF8StringEncoding;
         
-        self.ackCallbacks = [NSMutableDictionary dictionary];
-        self.ackCount = 0;
+        self.ackRegistry = [[AZSocketIOAckRegistry alloc] init];
+        self.ackTimeout = 30;
         self.specificEventBlocks = [NSMutableDictionary new];
         
         self.queue = [[NSOperationQueue alloc] init];
+        self.queue.maxConcurrentOperationCount = 1;
         [self.queue setSuspended:YES];
+        self.pendingPackets = [NSMutableArray array];
+        self.coalescingInterval = 0.01;
+        self.keepaliveInterval = 5;
+        
+        self.decodeQueue = dispatch_queue_create("AZSocketIO.decode", DISPATCH_QUEUE_SERIAL);
+        self.decodeBuffer = [NSMutableData data];
+        self.pendingDeliveries = [NSMutableArray array];
         
         self.transports = [NSMutableSet setWithObjects:@"websocket", @"xhr-polling", nil];
         self.transportMap = @{ @"websocket" : [AZWebsocketTransport class], @"xhr-polling" : [AZxhrTransport class] };
@@ -113,6 +131,17 @@ NSString * const AZSocketIODefaultNamespace = @"";
     return self;
 }
 
+// The websocket's DNS lookup and TCP connection happen while the handshake GET is under way, so
+// the websocket doesn't start from nothing once it has a session id.
+- (void)prewarmWebsocket
+{
+    if (!self.usesSocketBackend || ![self.transports containsObject:@"websocket"]) {
+        return;
+    }
+    NSInteger port = [self.port integerValue] ?: (self.secureConnections ? 443 : 80);
+    [[SRSocketBackend sharedBackend] prewarmConnectionToHost:self.host port:(uint16_t)port];
+}
+
 - (void)setReconnectionDelay:(NSTimeInterval)reconnectionDelay
 {
     _reconnectionDelay = reconnectionDelay;
@@ -125,6 +154,7 @@ NSString * const AZSocketIODefaultNamespace = @"";
     self.state = AZSocketIOStateConnecting;
     self.connectionBlock = success;
     self.errorBlock = failure;
+    [self prewarmWebsocket];
     NSString *urlString = [NSString stringWithFormat:@"socket.io/%@", PROTOCOL_VERSION];
     [self.httpClient GET:urlString
                   parameters:nil
@@ -218,15 +248,20 @@ NSString * const AZSocketIODefaultNamespace = @"";
 #pragma mark data sending
 - (BOOL)send:(id)data error:(NSError *__autoreleasing *)error ack:(ACKCallback)callback
 {
-    return [self send:data error:error ack:callback argCount:0];
+    return [self send:data error:error ack:callback argCount:0 failure:nil];
 }
 
 - (BOOL)send:(id)data error:(NSError *__autoreleasing *)error ackWithArgs:(ACKCallbackWithArgs)callback
 {
-    return [self send:data error:error ack:callback argCount:1];
+    return [self send:data error:error ack:callback argCount:1 failure:nil];
+}
+
+- (BOOL)send:(id)data error:(NSError *__autoreleasing *)error ackWithArgs:(ACKCallbackWithArgs)callback failure:(ErrorBlock)failure
+{
+    return [self send:data error:error ack:callback argCount:1 failure:failure];
 }
 
-- (BOOL)send:(id)data error:(NSError *__autoreleasing *)error ack:(id)callback argCount:(NSUInteger)argCount
+- (BOOL)send:(id)data error:(NSError *__autoreleasing *)error ack:(id)callback argCount:(NSUInteger)argCount failure:(ErrorBlock)failure
 {
     AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] init];
     
@@ -244,8 +279,7 @@ NSString * const AZSocketIODefaultNamespace = @"";
     }
     
     if (callback != NULL) {
-        packet.Id = [NSString stringWithFormat:@"%d", self.ackCount++];
-        [self.ackCallbacks setObject:callback forKey:packet.Id];
+        packet.Id = [self registerAck:callback failure:failure];
         if (argCount > 0) {
             packet.Id = [packet.Id stringByAppendingString:@"+"];
         }
@@ -269,15 +303,20 @@ NSString * const AZSocketIODefaultNamespace = @"";
 
 - (BOOL)emit:(NSString *)name args:(id)args error:(NSError *__autoreleasing *)error ack:(ACKCallback)callback
 {
-    return [self emit:name args:args error:error ack:callback argCount:0];
+    return [self emit:name args:args error:error ack:callback argCount:0 failure:nil];
 }
 
 - (BOOL)emit:(NSString *)name args:(id)args error:(NSError *__autoreleasing *)error ackWithArgs:(ACKCallbackWithArgs)callback
 {
-    return [self emit:name args:args error:error ack:callback argCount:1];
+    return [self emit:name args:args error:error ack:callback argCount:1 failure:nil];
 }
 
-- (BOOL)emit:(NSString *)name args:(id)args error:(NSError *__autoreleasing *)error ack:(id)callback argCount:(NSUInteger)argCount
+- (BOOL)emit:(NSString *)name args:(id)args error:(NSError *__autoreleasing *)error ackWithArgs:(ACKCallbackWithArgs)callback failure:(ErrorBlock)failure
+{
+    return [self emit:name args:args error:error ack:callback argCount:1 failure:failure];
+}
+
+- (BOOL)emit:(NSString *)name args:(id)args error:(NSError *__autoreleasing *)error ack:(id)callback argCount:(NSUInteger)argCount failure:(ErrorBlock)failure
 {
     AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] init];
     packet.type = EVENT;
@@ -304,13 +343,14 @@ NSString * const AZSocketIODefaultNamespace = @"";
     }
     
     packet.data = [[NSString alloc] initWithData:jsonData encoding:NSUTF8StringEncoding];
-    packet.Id = [NSString stringWithFormat:@"%d", self.ackCount++];
     
     if (callback != NULL) {
-        [self.ackCallbacks setObject:callback forKey:packet.Id];
+        packet.Id = [self registerAck:callback failure:failure];
         if (argCount > 0) {
             packet.Id = [packet.Id stringByAppendingString:@"+"];
         }
+    } else {
+        packet.Id = [NSString stringWithFormat:@"%lu", (unsigned long)[self.ackRegistry nextAckId]];
     }
     
     return [self sendPacket:packet error:error];
@@ -324,12 +364,134 @@ NSString * const AZSocketIODefaultNamespace = @"";
 - (BOOL)sendPacket:(AZSocketIOPacket *)packet error:(NSError * __autoreleasing *)error
 {
     packet.endpoint = self.endpoint;
-    [self.queue addOperation:[NSBlockOperation blockOperationWithBlock:^{
-        [self.transport send:[packet encode]];
-    }]];
+    
+    // Packets wait in pendingPackets until a single flush operation sends everything queued by then.
+    BOOL scheduleFlush;
+    @synchronized(self.pendingPackets) {
+        [self.pendingPackets addObject:packet];
+        scheduleFlush = !self.flushScheduled;
+        self.flushScheduled = YES;
+    }
+    
+    if (scheduleFlush) {
+        [self scheduleFlushAfter:self.coalescingInterval];
+    }
     return !self.queue.isSuspended;
 }
 
+- (void)scheduleFlushAfter:(NSTimeInterval)delay
+{
+    NSOperation *flush = [NSBlockOperation blockOperationWithBlock:^{
+        [self flushPendingPackets];
+    }];
+    if (delay > 0) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            [self.queue addOperation:flush];
+        });
+    } else {
+        [self.queue addOperation:flush];
+    }
+}
+
+- (uint64_t)bufferedAmount
+{
+    id<AZSocketIOTransport> transport = self.transport;
+    if ([transport respondsToSelector:@selector(bufferedAmount)]) {
+        return transport.bufferedAmount;
+    }
+    return 0;
+}
+
+- (void)flushPendingPackets
+{
+    NSArray *packets;
+    @synchronized(self.pendingPackets) {
+        packets = [self.pendingPackets copy];
+        [self.pendingPackets removeAllObjects];
+        self.flushScheduled = NO;
+    }
+    
+    if ([packets count] == 0) {
+        return;
+    }
+    if ([self.transport respondsToSelector:@selector(sendPackets:)]) {
+        if (![self.transport sendPackets:packets]) {
+            // Nothing was sent, so the batch goes back in front of whatever was queued since.
+            BOOL scheduleFlush;
+            @synchronized(self.pendingPackets) {
+                [self.pendingPackets insertObjects:packets atIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, [packets count])]];
+                scheduleFlush = !self.flushScheduled;
+                self.flushScheduled = YES;
+            }
+            if (scheduleFlush) {
+                [self scheduleFlushAfter:FLUSH_RETRY_INTERVAL];
+            }
+        }
+    } else {
+        for (AZSocketIOPacket *packet in packets) {
+            [self.transport send:[packet encode]];
+        }
+    }
+}
+
+#pragma mark ACKs
+
+- (NSString *)registerAck:(id)callback failure:(ErrorBlock)failure
+{
+    NSUInteger ackId = [self.ackRegistry registerCallback:callback failure:failure timeout:self.ackTimeout];
+    if (self.ackTimeout > 0) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self startAckTimer];
+        });
+    }
+    return [NSString stringWithFormat:@"%lu", (unsigned long)ackId];
+}
+
+// Ticks the registry's timing wheel on the main queue while ACKs are outstanding.
+- (void)startAckTimer
+{
+    if (self.ackTimer) {
+        return;
+    }
+    
+    uint64_t interval = (uint64_t)(self.ackRegistry.tickInterval * NSEC_PER_SEC);
+    self.ackTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+    dispatch_source_set_timer(self.ackTimer, dispatch_time(DISPATCH_TIME_NOW, interval), interval, interval / 10);
+    __weak AZSocketIO *weakSelf = self;
+    dispatch_source_set_event_handler(self.ackTimer, ^{
+        [weakSelf ackTimerFired];
+    });
+    dispatch_resume(self.ackTimer);
+}
+
+- (void)ackTimerFired
+{
+    [self.ackRegistry expireAcks];
+    if (self.ackRegistry.count == 0) {
+        [self stopAckTimer];
+    }
+}
+
+- (void)stopAckTimer
+{
+    if (self.ackTimer) {
+        dispatch_source_cancel(self.ackTimer);
+        self.ackTimer = nil;
+    }
+}
+
+- (void)cancelAcks
+{
+    [self stopAckTimer];
+    NSError *error = [NSError errorWithDomain:AZDOMAIN code:AZSocketIOErrorAckCancelled userInfo:@{NSLocalizedDescriptionKey: @"The connection was lost before the ACK arrived"}];
+    [self.ackRegistry cancelAllWithError:error];
+}
+
+- (void)dealloc
+{
+    [self stopAckTimer];
+}
+
 #pragma mark event callback registration
 
 - (void)addCallbackForEventName:(NSString *)name callback:(EventReceivedBlock)block
@@ -403,11 +565,7 @@ NSString * const AZSocketIODefaultNamespace = @"";
 {
     [self startHeartbeatTimeout];
     AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] initWithString:message];
-    AZSocketIOACKMessage *ackMessage; ACKCallback callback;
     switch (packet.type) {
-        case DISCONNECT:
-            [self disconnect];
-            break;
         case CONNECT:
         {
             if (self.endpoint) {
@@ -426,50 +584,12 @@ NSString * const AZSocketIODefaultNamespace = @"";
             [self.transport send:message];
             break;
         case MESSAGE:
-            if (self.messageReceivedBlock) {
-                self.messageReceivedBlock(packet.data);
-            }
-            break;
         case JSON_MESSAGE:
-        {
-            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-                id outData = [NSJSONSerialization JSONObjectWithData:[packet.data dataUsingEncoding:NSUTF8StringEncoding] options:0 error:nil];
-                [self performSelectorOnMainThread:@selector(didParseJSONMessage:)
-                                       withObject:outData waitUntilDone:NO];
-            });
-            break;
-        }
         case EVENT:
-        {
-            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-                id outData = [NSJSONSerialization JSONObjectWithData:[packet.data dataUsingEncoding:NSUTF8StringEncoding] options:0 error:nil];
-                [self performSelectorOnMainThread:@selector(didParseJSONEvent:)
-                                       withObject:outData waitUntilDone:NO];
-            });
-            break;
-        }
         case ACK:
-            ackMessage = [[AZSocketIOACKMessage alloc] initWithPacket:packet];
-            callback = [self.ackCallbacks objectForKey:ackMessage.messageId];
-            if (callback != NULL) {
-                if (ackMessage.args.count > 0) {
-                    callback(ackMessage.args);
-                } else {
-                    callback();
-                }
-            }
-            [self.ackCallbacks removeObjectForKey:ackMessage.messageId];
-            break;
+        case DISCONNECT:
         case ERROR:
-            [self disconnect];
-            if (![self reconnect]) {
-                if (self.errorBlock) {
-                    NSMutableDictionary *errorDetail = [NSMutableDictionary dictionary];
-                    [errorDetail setValue:packet.data forKey:NSLocalizedDescriptionKey];
-                    NSError *error = [NSError errorWithDomain:AZDOMAIN code:AZSocketIOErrorConnection userInfo:errorDetail];
-                    self.errorBlock(error);
-                }
-            }
+            [self decodePacket:packet];
             break;
         default:
             break;
@@ -486,6 +606,7 @@ NSString * const AZSocketIODefaultNamespace = @"";
 {
     self.state = AZSocketIOStateDisconnected;
     [self.queue setSuspended:YES];
+    [self cancelAcks];
     if (self.disconnectedBlock) {
         self.disconnectedBlock();
     }
@@ -495,6 +616,7 @@ NSString * const AZSocketIODefaultNamespace = @"";
 {
     self.state = AZSocketIOStateDisconnected;
     [self.queue setSuspended:YES];
+    [self cancelAcks];
     if (![self reconnect] && self.errorBlock) {
         self.errorBlock(error);
     }
@@ -502,6 +624,127 @@ NSString * const AZSocketIODefaultNamespace = @"";
 
 #pragma mark - Parse response
 
+// Data packets are decoded one at a time on decodeQueue, so they come out in the order they
+// arrived, and are handed to the main thread in batches, still in that order. DISCONNECT and
+// ERROR take the same path, so they never overtake messages that arrived before them.
+- (void)decodePacket:(AZSocketIOPacket *)packet
+{
+    dispatch_async(self.decodeQueue, ^{
+        dispatch_block_t delivery = [self deliveryForPacket:packet];
+        
+        BOOL scheduleDelivery;
+        @synchronized(self.pendingDeliveries) {
+            [self.pendingDeliveries addObject:delivery];
+            scheduleDelivery = !self.deliveryScheduled;
+            self.deliveryScheduled = YES;
+        }
+        if (scheduleDelivery) {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [self deliverPendingPackets];
+            });
+        }
+    });
+}
+
+// Runs on decodeQueue.
+- (dispatch_block_t)deliveryForPacket:(AZSocketIOPacket *)packet
+{
+    switch (packet.type) {
+        case MESSAGE:
+        {
+            NSString *data = packet.data;
+            return ^{
+                if (self.messageReceivedBlock) {
+                    self.messageReceivedBlock(data);
+                }
+            };
+        }
+        case JSON_MESSAGE:
+        {
+            id outData = [self JSONObjectFromPacket:packet];
+            return ^{
+                [self didParseJSONMessage:outData];
+            };
+        }
+        case EVENT:
+        {
+            id outData = [self JSONObjectFromPacket:packet];
+            return ^{
+                [self didParseJSONEvent:outData];
+            };
+        }
+        case DISCONNECT:
+            return ^{
+                [self disconnect];
+            };
+        case ERROR:
+        {
+            NSString *reason = packet.data;
+            return ^{
+                [self didReceiveError:reason];
+            };
+        }
+        case ACK:
+        default:
+        {
+            AZSocketIOACKMessage *ackMessage = [[AZSocketIOACKMessage alloc] initWithPacket:packet];
+            return ^{
+                [self didParseACK:ackMessage];
+            };
+        }
+    }
+}
+
+// Runs on decodeQueue, which owns decodeBuffer.
+- (id)JSONObjectFromPacket:(AZSocketIOPacket *)packet
+{
+    NSUInteger length = [packet getUTF8Data:self.decodeBuffer];
+    if (length == 0) {
+        return nil;
+    }
+    NSData *data = [NSData dataWithBytesNoCopy:[self.decodeBuffer mutableBytes] length:length freeWhenDone:NO];
+    return [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+}
+
+- (void)deliverPendingPackets
+{
+    NSArray *deliveries;
+    @synchronized(self.pendingDeliveries) {
+        deliveries = [self.pendingDeliveries copy];
+        [self.pendingDeliveries removeAllObjects];
+        self.deliveryScheduled = NO;
+    }
+    
+    for (dispatch_block_t delivery in deliveries) {
+        delivery();
+    }
+}
+
+- (void)didReceiveError:(NSString *)reason
+{
+    [self disconnect];
+    if (![self reconnect]) {
+        if (self.errorBlock) {
+            NSMutableDictionary *errorDetail = [NSMutableDictionary dictionary];
+            [errorDetail setValue:reason forKey:NSLocalizedDescriptionKey];
+            NSError *error = [NSError errorWithDomain:AZDOMAIN code:AZSocketIOErrorConnection userInfo:errorDetail];
+            self.errorBlock(error);
+        }
+    }
+}
+
+- (void)didParseACK:(AZSocketIOACKMessage *)ackMessage
+{
+    ACKCallback callback = [self.ackRegistry takeCallbackForAckId:[ackMessage.messageId integerValue]];
+    if (callback != NULL) {
+        if (ackMessage.args.count > 0) {
+            callback(ackMessage.args);
+        } else {
+            callback();
+        }
+    }
+}
+
 - (void)didParseJSONMessage:(id)outData
 {
     if (self.messageReceivedBlock) {
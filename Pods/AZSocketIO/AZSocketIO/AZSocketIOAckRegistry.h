@@ -0,0 +1,106 @@
+//
+//  AZSocketIOAckRegistry.h
+//  AZSocketIO
+//
+//  Copyright 2012 Patrick Shields
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+
+#import <Foundation/Foundation.h>
+
+typedef void (^AZSocketIOAckFailureBlock)(NSError *error);
+
+/**
+ `AZSocketIOAckRegistry` keeps the callbacks waiting for ACKs from the socket.io server, keyed by integer message id.
+ 
+ Deadlines are kept in a timing wheel: a ring of slots `tickInterval` seconds apart, so registering, acknowledging and expiring an ACK each take constant time however many are outstanding. The registry doesn't schedule anything itself; its owner calls `expireAcks` every tick while `count` is non-zero.
+ 
+ The registry can be used from any thread. Failure blocks are called on the thread that expires or cancels the ACKs, outside the registry's lock.
+ */
+@interface AZSocketIOAckRegistry : NSObject
+
+/**
+ How far apart, in seconds, the slots of the wheel are. An ACK fails at most this long after its deadline.
+ */
+@property(nonatomic, assign, readonly)NSTimeInterval tickInterval;
+
+/**
+ The number of ACKs currently outstanding.
+ */
+@property(nonatomic, assign, readonly)NSUInteger count;
+
+/**
+ The clock deadlines are measured against, in seconds. Defaults to a monotonic clock, so changes to the system time don't move deadlines.
+ */
+@property(nonatomic, copy)NSTimeInterval (^clock)(void);
+
+/**
+ Initializes a registry with a 0.25 second tick and 256 slots.
+ */
+- (id)init;
+
+/**
+ Initializes a registry.
+ 
+ This is the designated initializer.
+ 
+ @param tickInterval The time between slots of the wheel, in seconds.
+ @param slotCount The number of slots. Deadlines further away than `tickInterval * slotCount` take more than one turn of the wheel.
+ 
+ @return the initialized registry.
+ */
+- (id)initWithTickInterval:(NSTimeInterval)tickInterval slotCount:(NSUInteger)slotCount;
+
+/**
+ Returns a fresh message id without registering anything for it. Ids count up from 1, as in the socket.io JavaScript client.
+ */
+- (NSUInteger)nextAckId;
+
+/**
+ Registers a callback under a fresh message id.
+ 
+ @param callback The block to hand back when the ACK arrives.
+ @param failure A block called with an error if the ACK times out or is cancelled. May be `nil`.
+ @param timeout Seconds to wait for the ACK. Zero or less waits until the ACK arrives or is cancelled.
+ 
+ @return The message id to send the packet with.
+ */
+- (NSUInteger)registerCallback:(id)callback failure:(AZSocketIOAckFailureBlock)failure timeout:(NSTimeInterval)timeout;
+
+/**
+ Removes the callback registered under a message id.
+ 
+ @param ackId The message id from the server's ACK packet.
+ 
+ @return The callback, or `nil` if none is outstanding for that id.
+ */
+- (id)takeCallbackForAckId:(NSUInteger)ackId;
+
+/**
+ Fails every ACK whose deadline has passed with an `AZSocketIOErrorAckTimeout` error.
+ 
+ @return The number of ACKs that timed out.
+ */
+- (NSUInteger)expireAcks;
+
+/**
+ Fails every outstanding ACK.
+ 
+ @param error The error to pass to the failure blocks.
+ 
+ @return The number of ACKs that were cancelled.
+ */
+- (NSUInteger)cancelAllWithError:(NSError *)error;
+@end
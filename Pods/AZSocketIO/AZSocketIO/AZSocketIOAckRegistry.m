@@ -0,0 +1,193 @@
+//
+//  AZSocketIOAckRegistry.m
+//  AZSocketIO
+//
+//  Copyright 2012 Patrick Shields
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+
+#import "AZSocketIOAckRegistry.h"
+#import "AZSocketIO.h"
+#import <mach/mach_time.h>
+
+static NSTimeInterval AZSocketIOMonotonicTime(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (double)mach_absolute_time() * timebase.numer / timebase.denom / NSEC_PER_SEC;
+}
+
+@interface AZSocketIOAck : NSObject
+@property(nonatomic, assign)NSUInteger ackId;
+@property(nonatomic, strong)id callback;
+@property(nonatomic, copy)AZSocketIOAckFailureBlock failure;
+// The wheel tick the ACK fails on, or 0 if it never times out.
+@property(nonatomic, assign)uint64_t deadlineTick;
+@end
+
+@implementation AZSocketIOAck
+@end
+
+@implementation AZSocketIOAckRegistry {
+    NSMutableDictionary *_acks;
+    NSArray *_slots;
+    NSUInteger _lastAckId;
+    NSTimeInterval _origin;
+    // The last tick expireAcks has handled.
+    uint64_t _currentTick;
+}
+
+- (id)init
+{
+    return [self initWithTickInterval:0.25 slotCount:256];
+}
+
+- (id)initWithTickInterval:(NSTimeInterval)tickInterval slotCount:(NSUInteger)slotCount
+{
+    NSParameterAssert(tickInterval > 0);
+    NSParameterAssert(slotCount > 0);
+    
+    self = [super init];
+    if (self) {
+        _tickInterval = tickInterval;
+        _acks = [NSMutableDictionary dictionary];
+        NSMutableArray *slots = [NSMutableArray arrayWithCapacity:slotCount];
+        for (NSUInteger i = 0; i < slotCount; i++) {
+            [slots addObject:[NSMutableSet set]];
+        }
+        _slots = slots;
+        self.clock = ^{
+            return AZSocketIOMonotonicTime();
+        };
+    }
+    return self;
+}
+
+- (void)setClock:(NSTimeInterval (^)(void))clock
+{
+    @synchronized(self) {
+        _clock = [clock copy];
+        _origin = _clock() - _currentTick * _tickInterval;
+    }
+}
+
+- (NSUInteger)count
+{
+    @synchronized(self) {
+        return [_acks count];
+    }
+}
+
+- (NSUInteger)nextAckId
+{
+    @synchronized(self) {
+        return ++_lastAckId;
+    }
+}
+
+- (NSUInteger)registerCallback:(id)callback failure:(AZSocketIOAckFailureBlock)failure timeout:(NSTimeInterval)timeout
+{
+    AZSocketIOAck *ack = [[AZSocketIOAck alloc] init];
+    ack.callback = callback;
+    ack.failure = failure;
+    
+    @synchronized(self) {
+        ack.ackId = ++_lastAckId;
+        if (timeout > 0) {
+            // Round up, so an ACK never fails early; it can fail up to a tick late.
+            uint64_t deadlineTick = (uint64_t)ceil((_clock() + timeout - _origin) / _tickInterval);
+            ack.deadlineTick = MAX(deadlineTick, _currentTick + 1);
+            [_slots[(NSUInteger)(ack.deadlineTick % [_slots count])] addObject:ack];
+        }
+        [_acks setObject:ack forKey:@(ack.ackId)];
+    }
+    return ack.ackId;
+}
+
+- (id)takeCallbackForAckId:(NSUInteger)ackId
+{
+    @synchronized(self) {
+        AZSocketIOAck *ack = [_acks objectForKey:@(ackId)];
+        if (ack == nil) {
+            return nil;
+        }
+        [_acks removeObjectForKey:@(ackId)];
+        if (ack.deadlineTick) {
+            [_slots[(NSUInteger)(ack.deadlineTick % [_slots count])] removeObject:ack];
+        }
+        return ack.callback;
+    }
+}
+
+- (NSUInteger)expireAcks
+{
+    NSMutableArray *expired = [NSMutableArray array];
+    @synchronized(self) {
+        NSTimeInterval elapsed = _clock() - _origin;
+        uint64_t targetTick = elapsed > 0 ? (uint64_t)floor(elapsed / _tickInterval) : 0;
+        if (targetTick <= _currentTick) {
+            return 0;
+        }
+        
+        // After a long gap every slot is visited once, at the latest tick that maps to it.
+        uint64_t slotCount = [_slots count];
+        uint64_t firstTick = targetTick - _currentTick > slotCount ? targetTick - slotCount + 1 : _currentTick + 1;
+        for (uint64_t tick = firstTick; tick <= targetTick; tick++) {
+            NSMutableSet *slot = _slots[(NSUInteger)(tick % slotCount)];
+            NSSet *due = [slot objectsPassingTest:^BOOL(AZSocketIOAck *ack, BOOL *stop) {
+                return ack.deadlineTick <= tick;
+            }];
+            for (AZSocketIOAck *ack in due) {
+                [slot removeObject:ack];
+                [_acks removeObjectForKey:@(ack.ackId)];
+                [expired addObject:ack];
+            }
+        }
+        _currentTick = targetTick;
+    }
+    
+    [expired sortUsingDescriptors:@[[NSSortDescriptor sortDescriptorWithKey:@"deadlineTick" ascending:YES],
+                                    [NSSortDescriptor sortDescriptorWithKey:@"ackId" ascending:YES]]];
+    NSError *error = [NSError errorWithDomain:AZDOMAIN code:AZSocketIOErrorAckTimeout userInfo:@{NSLocalizedDescriptionKey: @"Timed out waiting for an ACK"}];
+    for (AZSocketIOAck *ack in expired) {
+        if (ack.failure) {
+            ack.failure(error);
+        }
+    }
+    return [expired count];
+}
+
+- (NSUInteger)cancelAllWithError:(NSError *)error
+{
+    NSArray *cancelled;
+    @synchronized(self) {
+        cancelled = [[_acks allValues] sortedArrayUsingDescriptors:@[[NSSortDescriptor sortDescriptorWithKey:@"ackId" ascending:YES]]];
+        [_acks removeAllObjects];
+        for (NSMutableSet *slot in _slots) {
+            [slot removeAllObjects];
+        }
+    }
+    
+    for (AZSocketIOAck *ack in cancelled) {
+        if (ack.failure) {
+            ack.failure(error);
+        }
+    }
+    return [cancelled count];
+}
+
+@end
@@ -76,6 +76,39 @@ typedef enum {
  @return A string containing the serialized packet data.
  */
 - (NSString *)encode;
+
+/**
+ Writes the packet data as UTF-8 into a reusable buffer, growing it as needed. A parsed packet whose data hasn't been read yet is converted straight from the original string.
+ 
+ @param buffer The buffer to write to.
+ 
+ @return The number of bytes written.
+ */
+- (NSUInteger)getUTF8Data:(NSMutableData *)buffer;
+
+/**
+ Appends the serialized packet to a buffer, the same way `encode` serializes it.
+ 
+ @param buffer The string to append to. It can be reused across packets.
+ */
+- (void)encodeIntoString:(NSMutableString *)buffer;
+
+/**
+ Appends several packets to a buffer as one socket.io payload. A single packet is written as is; more than one are each prefixed with `\ufffd[length]\ufffd`.
+ 
+ @param packets The `AZSocketIOPacket` objects to send together.
+ @param buffer The string to append to.
+ */
++ (void)encodePayload:(NSArray *)packets intoString:(NSMutableString *)buffer;
+
+/**
+ Splits a socket.io payload into the serialized packets it carries.
+ 
+ @param payload A payload as sent by the server, either one packet or several length-prefixed ones.
+ 
+ @return An array of serialized packets. It is empty if the payload is malformed.
+ */
++ (NSArray *)decodePayload:(NSString *)payload;
 @end
 
 @interface AZSocketIOACKMessage : NSObject
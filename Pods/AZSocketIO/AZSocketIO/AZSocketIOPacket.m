@@ -20,22 +20,133 @@
 
 #import "AZSocketIOPacket.h"
 
-@interface AZSocketIOPacket ()
-+ (NSRegularExpression *)regex;
-+ (NSString *)captureOrEmptyString:(NSString *)whole range:(NSRange)range;
-@end
+typedef struct {
+    NSRange type;
+    NSRange Id;
+    NSRange endpoint;
+    NSRange data;
+} AZSocketIOPacketRanges;
+
+// Single pass equivalent of firstMatchInString: with the pattern
+// ([^:]+):([0-9]+)?(\+)?:([^:]+)?:?([\s\S]*)? that packets used to be parsed with.
+// Ranges are into the string; groups that didn't take part come back empty.
+static AZSocketIOPacketRanges AZSocketIOPacketScan(CFStringRef string)
+{
+    AZSocketIOPacketRanges ranges = {0};
+    CFIndex length = CFStringGetLength(string);
+    CFStringInlineBuffer buffer;
+    CFStringInitInlineBuffer(string, &buffer, CFRangeMake(0, length));
+    
+    // The type is the first non-empty run of non-colons whose colon is followed by [0-9]*\+?:
+    CFIndex segmentStart = 0;
+    for (CFIndex colon = 0; colon < length; colon++) {
+        if (CFStringGetCharacterFromInlineBuffer(&buffer, colon) != ':') {
+            continue;
+        }
+        
+        if (colon > segmentStart) {
+            CFIndex i = colon + 1;
+            UniChar c = 0;
+            while (i < length && (c = CFStringGetCharacterFromInlineBuffer(&buffer, i)) >= '0' && c <= '9') {
+                i++;
+            }
+            CFIndex idEnd = i;
+            if (i < length && c == '+') {
+                i++;
+                c = i < length ? CFStringGetCharacterFromInlineBuffer(&buffer, i) : 0;
+            }
+            
+            if (i < length && c == ':') {
+                ranges.type = NSMakeRange(segmentStart, colon - segmentStart);
+                ranges.Id = NSMakeRange(colon + 1, idEnd - colon - 1);
+                
+                CFIndex endpointStart = ++i;
+                while (i < length && CFStringGetCharacterFromInlineBuffer(&buffer, i) != ':') {
+                    i++;
+                }
+                ranges.endpoint = NSMakeRange(endpointStart, i - endpointStart);
+                if (i < length) {
+                    i++;
+                }
+                ranges.data = NSMakeRange(i, length - i);
+                return ranges;
+            }
+        }
+        segmentStart = colon + 1;
+    }
+    return ranges;
+}
+
+// -[NSString intValue] for the common case of a few plain digits, without making the substring.
+static int AZSocketIOIntValue(NSString *string, NSRange range)
+{
+    if (range.length == 0 || range.length > 9) {
+        return [[string substringWithRange:range] intValue];
+    }
+    
+    int value = 0;
+    for (NSUInteger i = range.location; i < NSMaxRange(range); i++) {
+        unichar c = [string characterAtIndex:i];
+        if (c < '0' || c > '9') {
+            return [[string substringWithRange:range] intValue];
+        }
+        value = value * 10 + (c - '0');
+    }
+    return value;
+}
+
+static const UniChar AZSocketIOPayloadDelimiter = 0xfffd;
+
+static NSUInteger AZSocketIODecimalLength(long long value)
+{
+    NSUInteger length = value < 0 ? 2 : 1;
+    for (value = llabs(value); value >= 10; value /= 10) {
+        length++;
+    }
+    return length;
+}
+
+static void AZSocketIOAppendDecimal(NSMutableString *buffer, long long value)
+{
+    UniChar digits[24];
+    NSUInteger i = sizeof(digits) / sizeof(digits[0]);
+    unsigned long long magnitude = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+    do {
+        digits[--i] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        digits[--i] = '-';
+    }
+    CFStringAppendCharacters((__bridge CFMutableStringRef)buffer, digits + i, sizeof(digits) / sizeof(digits[0]) - i);
+}
+
+// nil fields come out the way %@ used to format them.
+static NSString *AZSocketIOFieldString(NSString *string)
+{
+    return string ?: @"(null)";
+}
 
-@implementation AZSocketIOPacket
+@implementation AZSocketIOPacket {
+    // The parsed string. Id, endpoint and data are only cut out of it when first asked for.
+    NSString *_source;
+    NSRange _idRange;
+    NSRange _endpointRange;
+    NSRange _dataRange;
+}
 @synthesize type;
-@synthesize Id;
+@synthesize Id = _Id;
 @synthesize ack;
-@synthesize endpoint;
-@synthesize data;
+@synthesize endpoint = _endpoint;
+@synthesize data = _data;
 
 - (id)init
 {
     self = [super init];
     if (self) {
+        _idRange.location = NSNotFound;
+        _endpointRange.location = NSNotFound;
+        _dataRange.location = NSNotFound;
         self.data = @"";
         self.endpoint = @"";
     }
@@ -46,44 +157,178 @@
 {
     self = [self init];
     if (self) {
-        NSTextCheckingResult *result = [[AZSocketIOPacket regex] firstMatchInString:packetString
-                                                                            options:0 
-                                                                              range:NSMakeRange(0, [packetString length])];
+        packetString = [packetString copy];
+        AZSocketIOPacketRanges ranges = AZSocketIOPacketScan((__bridge CFStringRef)packetString);
         
-        NSString *typeString = [packetString substringWithRange:[result rangeAtIndex:1]];
-        self.type = typeString.length == 0 ? -1 : [typeString intValue];
-        self.Id = [AZSocketIOPacket captureOrEmptyString:packetString range:[result rangeAtIndex:2]];
+        self.type = ranges.type.length == 0 ? -1 : AZSocketIOIntValue(packetString, ranges.type);
         
+        // The id capture never includes the '+', so ack was never set by the regex either.
         self.ack = NO;
-        if (([self.Id length] > 0) &&
-            ([[self.Id substringFromIndex:[self.Id length]-1] isEqualToString:@"+"])) {
-            self.ack = YES;
-        }
         
-        self.endpoint = [AZSocketIOPacket captureOrEmptyString:packetString range:[result rangeAtIndex:4]];
-        self.data = [AZSocketIOPacket captureOrEmptyString:packetString range:[result rangeAtIndex:5]];
+        _source = packetString;
+        _Id = nil;
+        _endpoint = nil;
+        _data = nil;
+        _idRange = ranges.Id;
+        _endpointRange = ranges.endpoint;
+        _dataRange = ranges.data;
     }
     return self;
 }
 
-- (NSString *)encode
+- (NSString *)Id
 {
-    NSString *idString;
-    if (self.Id != nil) {
-        idString = self.Id;
-        if (self.ack) {
-            idString = [idString stringByAppendingString:@"+"];
-        }
-    } else {
-        idString = @"";
+    if (_idRange.location != NSNotFound) {
+        _Id = _idRange.length ? [_source substringWithRange:_idRange] : @"";
+        _idRange.location = NSNotFound;
+    }
+    return _Id;
+}
+
+- (void)setId:(NSString *)newId
+{
+    _Id = newId;
+    _idRange.location = NSNotFound;
+}
+
+- (NSString *)endpoint
+{
+    if (_endpointRange.location != NSNotFound) {
+        _endpoint = _endpointRange.length ? [_source substringWithRange:_endpointRange] : @"";
+        _endpointRange.location = NSNotFound;
+    }
+    return _endpoint;
+}
+
+- (void)setEndpoint:(NSString *)newEndpoint
+{
+    _endpoint = newEndpoint;
+    _endpointRange.location = NSNotFound;
+}
+
+- (NSString *)data
+{
+    if (_dataRange.location != NSNotFound) {
+        _data = _dataRange.length ? [_source substringWithRange:_dataRange] : @"";
+        _dataRange.location = NSNotFound;
+    }
+    return _data;
+}
+
+- (void)setData:(NSString *)newData
+{
+    _data = newData;
+    _dataRange.location = NSNotFound;
+}
+
+- (NSUInteger)getUTF8Data:(NSMutableData *)buffer
+{
+    NSString *string = _data;
+    CFRange range = CFRangeMake(0, [_data length]);
+    if (_dataRange.location != NSNotFound) {
+        string = _source;
+        range = CFRangeMake(_dataRange.location, _dataRange.length);
+    }
+    if (range.length == 0) {
+        return 0;
     }
     
+    CFIndex capacity = CFStringGetMaximumSizeForEncoding(range.length, kCFStringEncodingUTF8);
+    if ([buffer length] < (NSUInteger)capacity) {
+        [buffer setLength:capacity];
+    }
+    CFIndex used = 0;
+    CFStringGetBytes((__bridge CFStringRef)string, range, kCFStringEncodingUTF8, 0, false, [buffer mutableBytes], capacity, &used);
+    return used;
+}
+
+// Number of UTF-16 units encodeIntoString: will append, which is what payload lengths count.
+- (NSUInteger)encodedLength
+{
+    NSUInteger length = AZSocketIODecimalLength((int)self.type) + 3;
+    if (self.Id != nil) {
+        length += [self.Id length] + (self.ack ? 1 : 0);
+    }
+    length += [AZSocketIOFieldString(self.endpoint) length];
+    length += [AZSocketIOFieldString(self.data) length];
+    return length;
+}
+
+- (void)encodeIntoString:(NSMutableString *)buffer
+{
     // Message encoding format (https://github.com/LearnBoost/socket.io-spec#encoding) 
     // [message type] ':' [message id ('+')] ':' [message endpoint] (':' [message data])
-    NSString *encodedString = [NSString stringWithFormat:@"%d:%@:%@:%@", self.type, idString, self.endpoint, self.data];
+    AZSocketIOAppendDecimal(buffer, (int)self.type);
+    [buffer appendString:@":"];
+    if (self.Id != nil) {
+        [buffer appendString:self.Id];
+        if (self.ack) {
+            [buffer appendString:@"+"];
+        }
+    }
+    [buffer appendString:@":"];
+    [buffer appendString:AZSocketIOFieldString(self.endpoint)];
+    [buffer appendString:@":"];
+    [buffer appendString:AZSocketIOFieldString(self.data)];
+}
+
+- (NSString *)encode
+{
+    NSMutableString *encodedString = [NSMutableString stringWithCapacity:[self encodedLength]];
+    [self encodeIntoString:encodedString];
     return encodedString;
 }
 
++ (void)encodePayload:(NSArray *)packets intoString:(NSMutableString *)buffer
+{
+    if ([packets count] == 1) {
+        [[packets firstObject] encodeIntoString:buffer];
+        return;
+    }
+    
+    for (AZSocketIOPacket *packet in packets) {
+        CFStringAppendCharacters((__bridge CFMutableStringRef)buffer, &AZSocketIOPayloadDelimiter, 1);
+        AZSocketIOAppendDecimal(buffer, [packet encodedLength]);
+        CFStringAppendCharacters((__bridge CFMutableStringRef)buffer, &AZSocketIOPayloadDelimiter, 1);
+        [packet encodeIntoString:buffer];
+    }
+}
+
++ (NSArray *)decodePayload:(NSString *)payload
+{
+    CFIndex length = CFStringGetLength((__bridge CFStringRef)payload);
+    if (length == 0 || [payload characterAtIndex:0] != AZSocketIOPayloadDelimiter) {
+        return @[payload ?: @""];
+    }
+    
+    // \ufffd[length]\ufffd[packet], repeated.
+    NSMutableArray *packets = [NSMutableArray array];
+    CFStringInlineBuffer buffer;
+    CFStringInitInlineBuffer((__bridge CFStringRef)payload, &buffer, CFRangeMake(0, length));
+    CFIndex i = 0;
+    while (i < length) {
+        if (CFStringGetCharacterFromInlineBuffer(&buffer, i++) != AZSocketIOPayloadDelimiter) {
+            return @[];
+        }
+        
+        CFIndex packetLength = 0;
+        CFIndex digitsStart = i;
+        UniChar c = 0;
+        while (i < length && (c = CFStringGetCharacterFromInlineBuffer(&buffer, i)) >= '0' && c <= '9' && i - digitsStart < 9) {
+            packetLength = packetLength * 10 + (c - '0');
+            i++;
+        }
+        if (i == digitsStart || i >= length || c != AZSocketIOPayloadDelimiter || packetLength > length - i - 1) {
+            return @[];
+        }
+        i++;
+        
+        [packets addObject:[payload substringWithRange:NSMakeRange(i, packetLength)]];
+        i += packetLength;
+    }
+    return packets;
+}
+
 - (NSString *)description
 {
     NSArray *pieces = [NSArray arrayWithObjects:[NSString stringWithFormat:@"<%@: %p>", NSStringFromClass([self class]), self],
@@ -93,29 +338,13 @@
     return [pieces componentsJoinedByString:@"\n\t"];
 }
 
-+ (NSRegularExpression *)regex
-{
-    static NSRegularExpression *regex;
-    static dispatch_once_t onceToken;
-    dispatch_once(&onceToken, ^{
-        regex = [NSRegularExpression regularExpressionWithPattern:@"([^:]+):([0-9]+)?(\\+)?:([^:]+)?:?([\\s\\S]*)?"
-                                                          options:NSRegularExpressionCaseInsensitive
-                                                            error:nil];
-    });
-    return regex;
-}
-
-
+@end
 
-+ (NSString *)captureOrEmptyString:(NSString *)whole range:(NSRange)range
+// Line terminators, which the '.' in the old ack pattern stopped at.
+static BOOL AZSocketIOIsLineTerminator(UniChar c)
 {
-    if (range.length <= 0) {
-        return @"";
-    } else {
-        return [whole substringWithRange:range];
-    }
+    return (c >= 0x0a && c <= 0x0d) || c == 0x85 || c == 0x2028 || c == 0x2029;
 }
-@end
 
 @implementation AZSocketIOACKMessage
 @synthesize messageId;
@@ -129,30 +358,45 @@
                         format:@"Packet data is: %@", packet.data];
         }
         
-        NSTextCheckingResult *result = [[AZSocketIOACKMessage ackRegex] firstMatchInString:packet.data
-                                                                                   options:0
-                                                                                     range:NSMakeRange(0, [packet.data length])];
-        self.messageId = [packet.data substringWithRange:[result rangeAtIndex:1]];
+        // Same as firstMatchInString: with ([0-9]+)\+?(.*): the id is the first run of digits,
+        // then an optional '+', and the args run to the end of the line.
+        NSString *ackString = packet.data;
+        CFIndex length = CFStringGetLength((__bridge CFStringRef)ackString);
+        CFStringInlineBuffer buffer;
+        CFStringInitInlineBuffer((__bridge CFStringRef)ackString, &buffer, CFRangeMake(0, length));
         
-        if ([result rangeAtIndex:1].length != [result range].length) {
-            NSString *ackData = [packet.data substringWithRange:[result rangeAtIndex:2]];
-            self.args = [NSJSONSerialization JSONObjectWithData:[ackData dataUsingEncoding:NSUTF8StringEncoding]        
-                                                        options:NSJSONReadingMutableContainers 
-                                                          error:nil];
+        CFIndex i = 0;
+        UniChar c = 0;
+        while (i < length && ((c = CFStringGetCharacterFromInlineBuffer(&buffer, i)) < '0' || c > '9')) {
+            i++;
+        }
+        CFIndex idStart = i;
+        while (i < length && (c = CFStringGetCharacterFromInlineBuffer(&buffer, i)) >= '0' && c <= '9') {
+            i++;
+        }
+        NSRange idRange = NSMakeRange(idStart, i - idStart);
+        
+        if (idRange.length == 0) {
+            self.messageId = @"";
+        } else {
+            self.messageId = [ackString substringWithRange:idRange];
+            
+            if (i < length && c == '+') {
+                i++;
+            }
+            CFIndex argsStart = i;
+            while (i < length && !AZSocketIOIsLineTerminator(CFStringGetCharacterFromInlineBuffer(&buffer, i))) {
+                i++;
+            }
+            
+            if (NSMaxRange(idRange) != (NSUInteger)i) {
+                NSString *ackData = [ackString substringWithRange:NSMakeRange(argsStart, i - argsStart)];
+                self.args = [NSJSONSerialization JSONObjectWithData:[ackData dataUsingEncoding:NSUTF8StringEncoding]        
+                                                            options:NSJSONReadingMutableContainers 
+                                                              error:nil];
+            }
         }
     }
     return self;
 }
-
-+ (NSRegularExpression *)ackRegex
-{
-    static NSRegularExpression *regex;
-    static dispatch_once_t onceToken;
-    dispatch_once(&onceToken, ^{
-        regex = [NSRegularExpression regularExpressionWithPattern:@"([0-9]+)\\+?(.*)"
-                                                          options:NSRegularExpressionCaseInsensitive
-                                                            error:nil];
-    });
-    return regex;
-}
 @end
\ No newline at end of file
@@ -80,4 +80,22 @@
  @param msg A serialized encoded message.
  */
 - (void)send:(NSString*)msg;
+
+@optional
+
+/**
+ Sends several packets with as few writes as the transport allows.
+ 
+ If a transport doesn't implement this, each packet is encoded and passed to `send:` in turn.
+ 
+ @param packets The `AZSocketIOPacket` objects to send, in order.
+ 
+ @return `NO` if the transport refused the batch because its buffer is full. None of the packets were sent, and the caller should offer them again later.
+ */
+- (BOOL)sendPackets:(NSArray *)packets;
+
+/**
+ The number of bytes handed to the transport that haven't been written to the network yet.
+ */
+@property(nonatomic, readonly)uint64_t bufferedAmount;
 @end
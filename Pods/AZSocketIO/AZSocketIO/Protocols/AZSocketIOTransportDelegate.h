@@ -89,4 +89,20 @@
  @return The current session Id.
  */
 - (NSString*)sessionId;
+
+@optional
+
+/**
+ Allows the transport to retrieve how often, in seconds, to check that the server is still there.
+ 
+ @return The keepalive interval, or '0' for none.
+ */
+- (NSTimeInterval)keepaliveInterval;
+
+/**
+ Allows the websocket transport to ask whether to run on SocketRocket's socket backend, which picks up the connection opened during the handshake.
+ 
+ @return `YES` for the socket backend, `NO` for SocketRocket's default run loop backend.
+ */
+- (BOOL)usesSocketBackend;
 @end
@@ -20,6 +20,7 @@
 
 #import "AZWebsocketTransport.h"
 #import "AZSocketIOTransportDelegate.h"
+#import "AZSocketIOPacket.h"
 
 @interface AZWebsocketTransport ()
 @property(nonatomic, weak)id<AZSocketIOTransportDelegate> delegate;
@@ -48,7 +49,14 @@
                                [self.delegate sessionId]];
         NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:urlString]];
         self.websocket = [[SRWebSocket alloc] initWithURLRequest:request];
+        // Picks up the connection AZSocketIO pre-warmed during the handshake.
+        if ([self.delegate respondsToSelector:@selector(usesSocketBackend)] && [self.delegate usesSocketBackend]) {
+            self.websocket.ioBackend = [SRSocketBackend sharedBackend];
+        }
         self.websocket.delegate = self;
+        if ([self.delegate respondsToSelector:@selector(keepaliveInterval)]) {
+            self.websocket.keepaliveInterval = [self.delegate keepaliveInterval];
+        }
     }
     return self;
 }
@@ -62,11 +70,32 @@
 }
 - (void)send:(NSString *)msg
 {
-    [self.websocket send:msg];
-    if ([self.delegate respondsToSelector:@selector(didSendMessage)]) {
+    if ([self.websocket send:msg priority:SRMessagePriorityNormal] && [self.delegate respondsToSelector:@selector(didSendMessage)]) {
         [self.delegate didSendMessage];
     }
 }
+- (BOOL)sendPackets:(NSArray *)packets
+{
+    // socket.io only reads length-prefixed payloads from polling transports, so every
+    // packet still gets its own frame. The frames are handed over together to share writes.
+    NSMutableArray *messages = [NSMutableArray arrayWithCapacity:[packets count]];
+    for (AZSocketIOPacket *packet in packets) {
+        [messages addObject:[packet encode]];
+    }
+    if (![self.websocket sendMessages:messages]) {
+        return NO;
+    }
+    if ([self.delegate respondsToSelector:@selector(didSendMessage)]) {
+        for (NSUInteger i = 0; i < [messages count]; i++) {
+            [self.delegate didSendMessage];
+        }
+    }
+    return YES;
+}
+- (uint64_t)bufferedAmount
+{
+    return self.websocket.bufferedAmount;
+}
 - (void)disconnect
 {
     self.websocket.delegate = nil;
@@ -21,10 +21,12 @@
 #import "AZxhrTransport.h"
 #import <AFNetworking.h>
 #import "AZSocketIOTransportDelegate.h"
+#import "AZSocketIOPacket.h"
 
 @interface AZxhrTransport ()
 @property(nonatomic, weak)id<AZSocketIOTransportDelegate> delegate;
 @property(nonatomic, readwrite, assign)BOOL connected;
+@property(nonatomic, strong)NSMutableString *payloadBuffer;
 @end
 
 @implementation AZxhrTransport
@@ -42,13 +44,8 @@
                      [self.delegate didOpen];
                  }
                  NSString *responseString = [self stringFromData:responseObject];
-                 NSArray *messages = [responseString componentsSeparatedByString:@"\ufffd"];
-                 if ([messages count] > 0) {
-                     for (NSString *message in messages) {
-                         [self.delegate didReceiveMessage:message];
-                     }
-                 } else {
-                     [self.delegate didReceiveMessage:responseString];
+                 for (NSString *message in [AZSocketIOPacket decodePayload:responseString]) {
+                     [self.delegate didReceiveMessage:message];
                  }
                  
                  if (self.connected) {
@@ -77,6 +74,10 @@
     }
 }
 - (void)send:(NSString*)msg
+{
+    [self post:msg messageCount:1];
+}
+- (void)post:(NSString *)msg messageCount:(NSUInteger)messageCount
 {
     NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:self.client.baseURL];
     request.HTTPMethod = @"POST";
@@ -84,15 +85,30 @@
     [request setValue:@"text/plain; charset=UTF-8" forHTTPHeaderField:@"Content-Type"];
     [request setValue:@"Keep-Alive" forHTTPHeaderField:@"Connection"];
     
-    [self.client HTTPRequestOperationWithRequest:request
-                                         success:^(AFHTTPRequestOperation *operation, id responseObject) {
-                                             if ([self.delegate respondsToSelector:@selector(didSendMessage)]) {
-                                                 [self.delegate didSendMessage];
-                                             }
-                                         }
-                                         failure:^(AFHTTPRequestOperation *operation, NSError *error) {
-                                             [self.delegate didFailWithError:error];
-                                         }];
+    AFHTTPRequestOperation *postOperation = [self.client HTTPRequestOperationWithRequest:request
+                                                                                 success:^(AFHTTPRequestOperation *operation, id responseObject) {
+                                                                                     if ([self.delegate respondsToSelector:@selector(didSendMessage)]) {
+                                                                                         for (NSUInteger i = 0; i < messageCount; i++) {
+                                                                                             [self.delegate didSendMessage];
+                                                                                         }
+                                                                                     }
+                                                                                 }
+                                                                                 failure:^(AFHTTPRequestOperation *operation, NSError *error) {
+                                                                                     [self.delegate didFailWithError:error];
+                                                                                 }];
+    [self.client.operationQueue addOperation:postOperation];
+}
+- (BOOL)sendPackets:(NSArray *)packets
+{
+    // One POST carries the whole batch as a length-prefixed payload.
+    if (self.payloadBuffer == nil) {
+        self.payloadBuffer = [NSMutableString string];
+    }
+    [AZSocketIOPacket encodePayload:packets intoString:self.payloadBuffer];
+    NSString *payload = [self.payloadBuffer copy];
+    [self.payloadBuffer setString:@""];
+    [self post:payload messageCount:[packets count]];
+    return YES;
 }
 - (id)initWithDelegate:(id<AZSocketIOTransportDelegate>)_delegate secureConnections:(BOOL)_secureConnections
 {
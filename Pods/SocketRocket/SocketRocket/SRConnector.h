@@ -0,0 +1,76 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Getting from a host name to a connected TCP socket in as few round trips as possible: resolved
+// addresses are cached, and the addresses of both families are raced against each other.
+
+#import <Foundation/Foundation.h>
+
+#pragma mark - SRHostResolver
+
+// addresses are NSData holding a struct sockaddr each, with the port left at 0.
+typedef void (^SRResolveCompletion)(NSArray *addresses, NSError *error);
+
+// Looks host names up with getaddrinfo and keeps the answers for cacheLifetime. Concurrent lookups
+// of the same name share one query. Thread safe.
+@interface SRHostResolver : NSObject
+
++ (instancetype)sharedResolver;
+
+// getaddrinfo doesn't say how long a record may be kept, so every answer is kept this long.
+// Defaults to 60 seconds; 0 turns the cache off.
+@property (nonatomic, assign) NSTimeInterval cacheLifetime;
+
+// getaddrinfo calls made so far. Answers from the cache don't count.
+@property (nonatomic, readonly) NSUInteger lookupCount;
+
+// Addresses come back in the order to try them: getaddrinfo's first, then alternating between
+// IPv6 and IPv4 (RFC 8305, section 4). completion is called on queue.
+- (void)resolveHost:(NSString *)host queue:(dispatch_queue_t)queue completion:(SRResolveCompletion)completion;
+
+// Starts a lookup, if the cache doesn't already have an answer, so a later connection needn't wait.
+- (void)prefetchHost:(NSString *)host;
+
+// Answers for host that never expire and never go to getaddrinfo, like /etc/hosts. nil removes them.
+- (void)setAddresses:(NSArray *)addresses forHost:(NSString *)host;
+
+// Forgets the cached answer, as after connections to all of its addresses have failed.
+- (void)invalidateHost:(NSString *)host;
+
+@end
+
+#pragma mark - SRConnector
+
+// fd is a connected non-blocking socket that the completion now owns, or -1 with error set.
+typedef void (^SRConnectCompletion)(int fd, NSError *error);
+
+// Connects to a host the way RFC 8305 ("Happy Eyeballs") describes: the first address is tried,
+// and each following one is started attemptDelay later, or as soon as an attempt fails. The
+// first attempt to connect wins and the rest are closed, so one unreachable family costs
+// attemptDelay instead of a TCP timeout.
+@interface SRConnector : NSObject
+
+- (id)initWithResolver:(SRHostResolver *)resolver;
+
+@property (nonatomic, readonly) SRHostResolver *resolver;
+
+// Defaults to 250 ms.
+@property (nonatomic, assign) NSTimeInterval attemptDelay;
+
+// completion is called on queue.
+- (void)connectToHost:(NSString *)host port:(uint16_t)port queue:(dispatch_queue_t)queue completion:(SRConnectCompletion)completion;
+
+@end
@@ -0,0 +1,492 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+#import "SRConnector.h"
+
+#import <CFNetwork/CFNetwork.h>
+#import <errno.h>
+#import <fcntl.h>
+#import <netdb.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <sys/socket.h>
+#import <unistd.h>
+
+#if OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+#define sr_dispatch_retain(x)
+#define sr_dispatch_release(x)
+#else
+#define sr_dispatch_retain(x) dispatch_retain(x)
+#define sr_dispatch_release(x) dispatch_release(x)
+#endif
+
+#if !__has_feature(objc_arc)
+#error SocketRocket must be compiled with ARC enabled
+#endif
+
+#pragma mark - SRHostResolver
+
+@interface _SRResolvedHost : NSObject
+
+@property (nonatomic, strong) NSArray *addresses;
+// INFINITY for addresses given to setAddresses:forHost:.
+@property (nonatomic, assign) CFAbsoluteTime expiresAt;
+
+@end
+
+@implementation _SRResolvedHost
+@end
+
+// getaddrinfo's first address keeps its place; after it the two families take turns.
+static NSArray *SRInterleaveAddressFamilies(NSArray *addresses)
+{
+    if (addresses.count < 2) {
+        return addresses;
+    }
+    sa_family_t firstFamily = ((const struct sockaddr *)[[addresses objectAtIndex:0] bytes])->sa_family;
+    NSMutableArray *preferred = [[NSMutableArray alloc] init];
+    NSMutableArray *other = [[NSMutableArray alloc] init];
+    for (NSData *address in addresses) {
+        const struct sockaddr *sockaddr = address.bytes;
+        [sockaddr->sa_family == firstFamily ? preferred : other addObject:address];
+    }
+
+    NSMutableArray *ordered = [[NSMutableArray alloc] initWithCapacity:addresses.count];
+    for (NSUInteger i = 0; i < preferred.count || i < other.count; i++) {
+        if (i < preferred.count) {
+            [ordered addObject:[preferred objectAtIndex:i]];
+        }
+        if (i < other.count) {
+            [ordered addObject:[other objectAtIndex:i]];
+        }
+    }
+    return ordered;
+}
+
+@implementation SRHostResolver {
+    // Guards everything below.
+    dispatch_queue_t _queue;
+    NSMutableDictionary *_resolvedHosts;
+    // Completions waiting on a lookup in flight, by host.
+    NSMutableDictionary *_waiters;
+    NSUInteger _lookupCount;
+}
+
+@synthesize cacheLifetime = _cacheLifetime;
+
++ (instancetype)sharedResolver;
+{
+    static SRHostResolver *sharedResolver = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedResolver = [[self alloc] init];
+    });
+    return sharedResolver;
+}
+
+- (id)init;
+{
+    self = [super init];
+    if (self) {
+        _queue = dispatch_queue_create("com.squareup.SocketRocket.SRHostResolver", DISPATCH_QUEUE_SERIAL);
+        _resolvedHosts = [[NSMutableDictionary alloc] init];
+        _waiters = [[NSMutableDictionary alloc] init];
+        _cacheLifetime = 60;
+    }
+    return self;
+}
+
+- (void)dealloc;
+{
+    sr_dispatch_release(_queue);
+}
+
+- (NSUInteger)lookupCount;
+{
+    __block NSUInteger lookupCount;
+    dispatch_sync(_queue, ^{
+        lookupCount = _lookupCount;
+    });
+    return lookupCount;
+}
+
+- (NSArray *)_cachedAddressesForHost:(NSString *)host;
+{
+    _SRResolvedHost *resolved = [_resolvedHosts objectForKey:host];
+    if (resolved && resolved.expiresAt > CFAbsoluteTimeGetCurrent()) {
+        return resolved.addresses;
+    }
+    [_resolvedHosts removeObjectForKey:host];
+    return nil;
+}
+
+- (void)resolveHost:(NSString *)host queue:(dispatch_queue_t)queue completion:(SRResolveCompletion)completion;
+{
+    NSString *key = host.lowercaseString;
+    SRResolveCompletion deliver = ^(NSArray *addresses, NSError *error) {
+        dispatch_async(queue, ^{
+            completion(addresses, error);
+        });
+    };
+
+    dispatch_async(_queue, ^{
+        NSArray *cached = [self _cachedAddressesForHost:key];
+        if (cached) {
+            deliver(cached, nil);
+            return;
+        }
+        NSMutableArray *waiters = [_waiters objectForKey:key];
+        if (waiters) {
+            [waiters addObject:deliver];
+            return;
+        }
+        [_waiters setObject:[NSMutableArray arrayWithObject:deliver] forKey:key];
+        _lookupCount++;
+
+        // getaddrinfo blocks, so it runs off the resolver's queue.
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            struct addrinfo hints = {0};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_protocol = IPPROTO_TCP;
+            struct addrinfo *results = NULL;
+            int status = getaddrinfo(key.UTF8String, NULL, &hints, &results);
+
+            NSMutableArray *addresses = [[NSMutableArray alloc] init];
+            for (struct addrinfo *result = results; result; result = result->ai_next) {
+                [addresses addObject:[NSData dataWithBytes:result->ai_addr length:result->ai_addrlen]];
+            }
+            if (results) {
+                freeaddrinfo(results);
+            }
+
+            NSArray *ordered = nil;
+            NSError *error = nil;
+            if (status != 0 || addresses.count == 0) {
+                NSString *reason = status ? @(gai_strerror(status)) : @"No addresses";
+                error = [NSError errorWithDomain:(__bridge NSString *)kCFErrorDomainCFNetwork code:kCFHostErrorUnknown userInfo:@{NSLocalizedDescriptionKey:reason}];
+            } else {
+                ordered = SRInterleaveAddressFamilies(addresses);
+            }
+
+            dispatch_async(_queue, ^{
+                if (ordered && _cacheLifetime > 0 && ![_resolvedHosts objectForKey:key]) {
+                    _SRResolvedHost *resolved = [[_SRResolvedHost alloc] init];
+                    resolved.addresses = ordered;
+                    resolved.expiresAt = CFAbsoluteTimeGetCurrent() + _cacheLifetime;
+                    [_resolvedHosts setObject:resolved forKey:key];
+                }
+                NSArray *waiting = [_waiters objectForKey:key];
+                [_waiters removeObjectForKey:key];
+                for (SRResolveCompletion waiter in waiting) {
+                    waiter(ordered, error);
+                }
+            });
+        });
+    });
+}
+
+- (void)prefetchHost:(NSString *)host;
+{
+    [self resolveHost:host queue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completion:^(NSArray *addresses, NSError *error) {
+    }];
+}
+
+- (void)setAddresses:(NSArray *)addresses forHost:(NSString *)host;
+{
+    NSString *key = host.lowercaseString;
+    addresses = [addresses copy];
+    dispatch_async(_queue, ^{
+        if (!addresses) {
+            [_resolvedHosts removeObjectForKey:key];
+            return;
+        }
+        _SRResolvedHost *resolved = [[_SRResolvedHost alloc] init];
+        resolved.addresses = SRInterleaveAddressFamilies(addresses);
+        resolved.expiresAt = INFINITY;
+        [_resolvedHosts setObject:resolved forKey:key];
+    });
+}
+
+- (void)invalidateHost:(NSString *)host;
+{
+    NSString *key = host.lowercaseString;
+    dispatch_async(_queue, ^{
+        _SRResolvedHost *resolved = [_resolvedHosts objectForKey:key];
+        if (resolved.expiresAt != INFINITY) {
+            [_resolvedHosts removeObjectForKey:key];
+        }
+    });
+}
+
+@end
+
+#pragma mark - SRConnector
+
+static NSData *SRAddressWithPort(NSData *address, uint16_t port)
+{
+    NSMutableData *copy = [address mutableCopy];
+    struct sockaddr *sockaddr = copy.mutableBytes;
+    if (sockaddr->sa_family == AF_INET6) {
+        ((struct sockaddr_in6 *)sockaddr)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in *)sockaddr)->sin_port = htons(port);
+    }
+    return copy;
+}
+
+// One connect() in flight, watched by a write source, which fires once it succeeds or fails.
+@interface _SRConnectAttempt : NSObject
+
+- (id)initWithFD:(int)fd queue:(dispatch_queue_t)queue handler:(void (^)(_SRConnectAttempt *attempt))handler;
+
+@property (nonatomic, readonly) int fd;
+
+// Stops watching. The socket is closed too, unless it is being kept.
+- (void)cancelKeepingSocket:(BOOL)keepSocket;
+
+@end
+
+@implementation _SRConnectAttempt {
+    dispatch_source_t _source;
+}
+
+@synthesize fd = _fd;
+
+- (id)initWithFD:(int)fd queue:(dispatch_queue_t)queue handler:(void (^)(_SRConnectAttempt *attempt))handler;
+{
+    self = [super init];
+    if (self) {
+        _fd = fd;
+        _source = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, fd, 0, queue);
+        __weak _SRConnectAttempt *weakSelf = self;
+        dispatch_source_set_event_handler(_source, ^{
+            _SRConnectAttempt *attempt = weakSelf;
+            if (attempt) {
+                handler(attempt);
+            }
+        });
+        dispatch_resume(_source);
+    }
+    return self;
+}
+
+- (void)dealloc;
+{
+    [self cancelKeepingSocket:NO];
+}
+
+- (void)cancelKeepingSocket:(BOOL)keepSocket;
+{
+    if (!_source) {
+        return;
+    }
+    // The source has to be done with the descriptor before it's closed.
+    int fd = _fd;
+    dispatch_source_set_cancel_handler(_source, ^{
+        if (!keepSocket) {
+            close(fd);
+        }
+    });
+    dispatch_source_cancel(_source);
+    sr_dispatch_release(_source);
+    _source = nil;
+}
+
+@end
+
+// Races connections to a host's addresses until one connects or all have failed.
+@interface _SRConnectRace : NSObject
+
+- (id)initWithAddresses:(NSArray *)addresses port:(uint16_t)port attemptDelay:(NSTimeInterval)attemptDelay completion:(SRConnectCompletion)completion;
+
+- (void)start;
+
+@end
+
+@implementation _SRConnectRace {
+    NSArray *_addresses;
+    uint16_t _port;
+    NSTimeInterval _attemptDelay;
+    SRConnectCompletion _completion;
+
+    // Everything below is only touched here.
+    dispatch_queue_t _queue;
+    NSMutableArray *_attempts;
+    NSUInteger _nextAddress;
+    // Bumped whenever an attempt starts, so an earlier delayed start knows it's stale.
+    NSUInteger _delayGeneration;
+    int _lastError;
+    BOOL _finished;
+}
+
+- (id)initWithAddresses:(NSArray *)addresses port:(uint16_t)port attemptDelay:(NSTimeInterval)attemptDelay completion:(SRConnectCompletion)completion;
+{
+    self = [super init];
+    if (self) {
+        _addresses = addresses;
+        _port = port;
+        _attemptDelay = attemptDelay;
+        _completion = [completion copy];
+        _queue = dispatch_queue_create("com.squareup.SocketRocket.SRConnectRace", DISPATCH_QUEUE_SERIAL);
+        _attempts = [[NSMutableArray alloc] init];
+        _lastError = ECONNREFUSED;
+    }
+    return self;
+}
+
+- (void)dealloc;
+{
+    sr_dispatch_release(_queue);
+}
+
+- (void)start;
+{
+    dispatch_async(_queue, ^{
+        [self _startNextAttempt];
+    });
+}
+
+- (void)_startNextAttempt;
+{
+    while (!_finished && _nextAddress < _addresses.count) {
+        NSData *address = SRAddressWithPort([_addresses objectAtIndex:_nextAddress++], _port);
+        const struct sockaddr *sockaddr = address.bytes;
+
+        int fd = socket(sockaddr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+        if (fd < 0) {
+            _lastError = errno;
+            continue;
+        }
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        if (connect(fd, sockaddr, (socklen_t)address.length) == 0) {
+            [self _finishWithSocket:fd];
+            return;
+        }
+        if (errno != EINPROGRESS) {
+            _lastError = errno;
+            close(fd);
+            continue;
+        }
+
+        _SRConnectAttempt *attempt = [[_SRConnectAttempt alloc] initWithFD:fd queue:_queue handler:^(_SRConnectAttempt *finished) {
+            [self _attemptDidFinish:finished];
+        }];
+        [_attempts addObject:attempt];
+
+        NSUInteger generation = ++_delayGeneration;
+        if (_nextAddress < _addresses.count) {
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_attemptDelay * NSEC_PER_SEC)), _queue, ^{
+                if (generation == _delayGeneration) {
+                    [self _startNextAttempt];
+                }
+            });
+        }
+        return;
+    }
+
+    if (!_finished && _attempts.count == 0) {
+        _finished = YES;
+        _completion(-1, [NSError errorWithDomain:NSPOSIXErrorDomain code:_lastError userInfo:nil]);
+        _completion = nil;
+    }
+}
+
+- (void)_attemptDidFinish:(_SRConnectAttempt *)attempt;
+{
+    if (_finished) {
+        return;
+    }
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(attempt.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+
+    [_attempts removeObject:attempt];
+    if (error) {
+        // No point waiting out the delay for an address that has already failed.
+        _lastError = error;
+        [attempt cancelKeepingSocket:NO];
+        [self _startNextAttempt];
+        return;
+    }
+    [attempt cancelKeepingSocket:YES];
+    [self _finishWithSocket:attempt.fd];
+}
+
+- (void)_finishWithSocket:(int)fd;
+{
+    _finished = YES;
+    _delayGeneration++;
+    for (_SRConnectAttempt *attempt in _attempts) {
+        [attempt cancelKeepingSocket:NO];
+    }
+    [_attempts removeAllObjects];
+    _completion(fd, nil);
+    _completion = nil;
+}
+
+@end
+
+@implementation SRConnector
+
+@synthesize resolver = _resolver;
+@synthesize attemptDelay = _attemptDelay;
+
+- (id)init;
+{
+    return [self initWithResolver:[SRHostResolver sharedResolver]];
+}
+
+- (id)initWithResolver:(SRHostResolver *)resolver;
+{
+    self = [super init];
+    if (self) {
+        _resolver = resolver;
+        _attemptDelay = 0.25;
+    }
+    return self;
+}
+
+- (void)connectToHost:(NSString *)host port:(uint16_t)port queue:(dispatch_queue_t)queue completion:(SRConnectCompletion)completion;
+{
+    SRHostResolver *resolver = _resolver;
+    NSTimeInterval attemptDelay = _attemptDelay;
+
+    [resolver resolveHost:host queue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) completion:^(NSArray *addresses, NSError *error) {
+        if (error) {
+            dispatch_async(queue, ^{
+                completion(-1, error);
+            });
+            return;
+        }
+        _SRConnectRace *race = [[_SRConnectRace alloc] initWithAddresses:addresses port:port attemptDelay:attemptDelay completion:^(int fd, NSError *raceError) {
+            if (fd < 0) {
+                // The addresses may have moved; look them up again next time.
+                [resolver invalidateHost:host];
+            }
+            dispatch_async(queue, ^{
+                completion(fd, raceError);
+            });
+        }];
+        [race start];
+    }];
+}
+
+@end
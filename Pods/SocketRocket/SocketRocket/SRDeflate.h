@@ -0,0 +1,180 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// permessage-deflate (RFC 7692) compression contexts on top of zlib's raw deflate.
+// Each message is compressed with a sync flush and sent without the trailing
+// 00 00 FF FF, which the receiving side puts back before the message ends.
+// Plain C, needs libz.
+
+#ifndef SRDeflate_h
+#define SRDeflate_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+// zlib's raw deflate can't produce an 8 bit window, so 9 is the smallest we use or offer.
+static const int SRDeflateMinWindowBits = 9;
+static const int SRDeflateMaxWindowBits = 15;
+
+static const uint8_t SRDeflateMessageTail[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+typedef struct {
+    z_stream stream;
+    bool initialized;
+    bool noContextTakeover;     // Start every message with an empty window.
+} SRDeflater;
+
+typedef struct {
+    z_stream stream;
+    bool initialized;
+    bool noContextTakeover;
+} SRInflater;
+
+static inline int SRDeflateClampWindowBits(int windowBits)
+{
+    return windowBits < SRDeflateMinWindowBits ? SRDeflateMinWindowBits : windowBits > SRDeflateMaxWindowBits ? SRDeflateMaxWindowBits : windowBits;
+}
+
+// memLevel is zlib's 1-9 trade between memory (about 1 << (memLevel + 9) bytes) and ratio.
+static inline bool SRDeflaterInit(SRDeflater *deflater, int windowBits, int memLevel, bool noContextTakeover)
+{
+    memset(deflater, 0, sizeof(*deflater));
+    memLevel = memLevel < 1 ? 1 : memLevel > MAX_MEM_LEVEL ? MAX_MEM_LEVEL : memLevel;
+    if (deflateInit2(&deflater->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -SRDeflateClampWindowBits(windowBits), memLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    deflater->initialized = true;
+    deflater->noContextTakeover = noContextTakeover;
+    return true;
+}
+
+static inline void SRDeflaterFree(SRDeflater *deflater)
+{
+    if (deflater->initialized) {
+        deflateEnd(&deflater->stream);
+        deflater->initialized = false;
+    }
+}
+
+// Room SRDeflaterCompressMessage needs for a message of length bytes.
+static inline size_t SRDeflaterBound(SRDeflater *deflater, size_t length)
+{
+    // deflateBound assumes Z_FINISH; a sync flush adds at most an empty stored block.
+    if (length > UINT32_MAX) {
+        return length + (length >> 10) + 64;
+    }
+    return deflateBound(&deflater->stream, (uLong)length) + 16;
+}
+
+// Compresses one whole message into dst, which must hold SRDeflaterBound bytes, and
+// returns the compressed length without the message tail, or SIZE_MAX on failure.
+static inline size_t SRDeflaterCompressMessage(SRDeflater *deflater, const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    z_stream *stream = &deflater->stream;
+    size_t written = 0;
+
+    do {
+        uInt chunk = length > UINT32_MAX ? UINT32_MAX : (uInt)length;
+        stream->next_in = (Bytef *)src;
+        stream->avail_in = chunk;
+        stream->next_out = dst + written;
+        stream->avail_out = capacity - written > UINT32_MAX ? UINT32_MAX : (uInt)(capacity - written);
+
+        bool last = chunk == length;
+        uInt availOut = stream->avail_out;
+        int result = deflate(stream, last ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        written += availOut - stream->avail_out;
+        if ((result != Z_OK && result != Z_BUF_ERROR) || stream->avail_in != 0 || (last && stream->avail_out == 0)) {
+            // Out of room (or zlib trouble); the stream is in an unknown state, so start over.
+            deflateReset(stream);
+            return SIZE_MAX;
+        }
+
+        src += chunk;
+        length -= chunk;
+    } while (length);
+
+    if (written >= sizeof(SRDeflateMessageTail) && memcmp(dst + written - sizeof(SRDeflateMessageTail), SRDeflateMessageTail, sizeof(SRDeflateMessageTail)) == 0) {
+        written -= sizeof(SRDeflateMessageTail);
+    }
+
+    if (deflater->noContextTakeover) {
+        deflateReset(stream);
+    }
+    return written;
+}
+
+static inline bool SRInflaterInit(SRInflater *inflater, int windowBits, bool noContextTakeover)
+{
+    memset(inflater, 0, sizeof(*inflater));
+    // SRWebSocket always passes SRDeflateMaxWindowBits, since a 15 bit window reads data compressed
+    // with any smaller one.
+    if (inflateInit2(&inflater->stream, -SRDeflateClampWindowBits(windowBits)) != Z_OK) {
+        return false;
+    }
+    inflater->initialized = true;
+    inflater->noContextTakeover = noContextTakeover;
+    return true;
+}
+
+static inline void SRInflaterFree(SRInflater *inflater)
+{
+    if (inflater->initialized) {
+        inflateEnd(&inflater->stream);
+        inflater->initialized = false;
+    }
+}
+
+// Inflates as much of *src as fits in dst, advancing *src and *length past the input
+// used. Returns the number of bytes written to dst, or -1 if the input is corrupt.
+// Keep calling while input remains or dst came back full. Once a message's last frame
+// has been fed in, feed SRDeflateMessageTail the same way and call SRInflaterEndMessage.
+static inline ptrdiff_t SRInflaterInflate(SRInflater *inflater, const uint8_t **src, size_t *length, uint8_t *dst, size_t capacity)
+{
+    z_stream *stream = &inflater->stream;
+    stream->next_in = (Bytef *)*src;
+    stream->avail_in = *length > UINT32_MAX ? UINT32_MAX : (uInt)*length;
+    stream->next_out = dst;
+    stream->avail_out = capacity > UINT32_MAX ? UINT32_MAX : (uInt)capacity;
+
+    uInt availIn = stream->avail_in;
+    uInt availOut = stream->avail_out;
+    int result = inflate(stream, Z_SYNC_FLUSH);
+
+    size_t used = availIn - stream->avail_in;
+    *src += used;
+    *length -= used;
+
+    if (result == Z_STREAM_END) {
+        // The sender finished a block with BFINAL set; whatever follows is a new stream.
+        inflateReset(stream);
+    } else if (result != Z_OK && result != Z_BUF_ERROR) {
+        return -1;
+    }
+    return (ptrdiff_t)(availOut - stream->avail_out);
+}
+
+static inline void SRInflaterEndMessage(SRInflater *inflater)
+{
+    if (inflater->noContextTakeover) {
+        inflateReset(&inflater->stream);
+    }
+}
+
+#endif
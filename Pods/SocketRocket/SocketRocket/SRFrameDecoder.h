@@ -0,0 +1,309 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Incremental WebSocket frame decoder. It is fed whatever bytes have arrived, in pieces of any
+// size, and reports one event per call: a frame header, a chunk of payload (unmasked in place),
+// or the end of a frame. It never allocates and never looks past the bytes it is given; a header
+// split across calls is gathered in the decoder itself. Plain C, not thread-safe.
+
+#ifndef SRFrameDecoder_h
+#define SRFrameDecoder_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "SRMask.h"
+
+typedef enum {
+    SRFrameEventNone,       // Every byte given was used; more are needed.
+    SRFrameEventHeader,     // decoder->header describes a new frame.
+    SRFrameEventPayload,    // A chunk of the current frame's payload.
+    SRFrameEventFrameEnd,   // The current frame's payload is complete.
+    SRFrameEventError,      // decoder->error says why. The decoder stays failed.
+} SRFrameEvent;
+
+typedef enum {
+    SRFrameErrorNone,
+    SRFrameErrorReservedBits,
+    SRFrameErrorReservedOpcode,
+    SRFrameErrorUnexpectedContinuation,
+    SRFrameErrorExpectedContinuation,
+    SRFrameErrorMasking,
+    SRFrameErrorFragmentedControl,
+    SRFrameErrorControlTooLong,
+    SRFrameErrorLengthTooLarge,
+} SRFrameError;
+
+typedef struct {
+    bool fin;
+    bool compressed;        // RSV1 on the first frame of a data message, when compression is allowed.
+    uint8_t opcode;         // As sent, so 0 for continuation frames.
+    uint8_t messageOpcode;  // The opcode of the message a data frame belongs to, or of the control frame.
+    bool masked;
+    uint8_t maskKey[4];
+    uint64_t payloadLength;
+} SRFrameHeader;
+
+typedef enum {
+    SRFrameDecoderStateHeader,
+    SRFrameDecoderStateExtendedLength,
+    SRFrameDecoderStateMaskKey,
+    SRFrameDecoderStatePayload,
+    SRFrameDecoderStateFailed,
+} SRFrameDecoderState;
+
+typedef struct {
+    // A server reads masked frames and a client unmasked ones; anything else is an error.
+    bool expectsMasking;
+    // Set once permessage-deflate is agreed, so RSV1 may mark a compressed message.
+    bool allowsCompression;
+
+    SRFrameDecoderState state;
+    SRFrameError error;
+    SRFrameHeader header;
+    uint64_t payloadRemaining;
+
+    // The opcode of the data message still waiting for its final frame, 0 between messages.
+    uint8_t messageOpcode;
+    uint8_t maskOffset;
+
+    // Header bytes gathered so far for the current state.
+    uint8_t pending[8];
+    size_t pendingLength;
+} SRFrameDecoder;
+
+static inline void SRFrameDecoderInit(SRFrameDecoder *decoder, bool expectsMasking)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->expectsMasking = expectsMasking;
+}
+
+static inline bool SRFrameOpcodeIsControl(uint8_t opcode)
+{
+    return (opcode & 0x08) != 0;
+}
+
+static inline const char *SRFrameErrorDescription(SRFrameError error)
+{
+    switch (error) {
+        case SRFrameErrorNone:
+            return "No error";
+        case SRFrameErrorReservedBits:
+            return "Server used RSV bits";
+        case SRFrameErrorReservedOpcode:
+            return "Unknown opcode";
+        case SRFrameErrorUnexpectedContinuation:
+            return "cannot continue a message";
+        case SRFrameErrorExpectedContinuation:
+            return "all data frames after the initial data frame must have opcode 0";
+        case SRFrameErrorMasking:
+            return "Client must receive unmasked data";
+        case SRFrameErrorFragmentedControl:
+            return "Fragmented control frames not allowed";
+        case SRFrameErrorControlTooLong:
+            return "Control frames cannot have payloads larger than 126 bytes";
+        case SRFrameErrorLengthTooLarge:
+            return "Frame length too large";
+    }
+    return "Unknown error";
+}
+
+// Moves bytes into decoder->pending until it holds needed of them. Returns true once it does.
+static inline bool SRFrameDecoderGather(SRFrameDecoder *decoder, size_t needed, uint8_t **bytes, size_t *length)
+{
+    size_t take = needed - decoder->pendingLength;
+    if (take > *length) {
+        take = *length;
+    }
+    memcpy(decoder->pending + decoder->pendingLength, *bytes, take);
+    decoder->pendingLength += take;
+    *bytes += take;
+    *length -= take;
+
+    if (decoder->pendingLength < needed) {
+        return false;
+    }
+    decoder->pendingLength = 0;
+    return true;
+}
+
+static inline SRFrameEvent SRFrameDecoderFail(SRFrameDecoder *decoder, SRFrameError error)
+{
+    decoder->state = SRFrameDecoderStateFailed;
+    decoder->error = error;
+    return SRFrameEventError;
+}
+
+// Called with the first two bytes of a frame in decoder->pending.
+static inline SRFrameEvent SRFrameDecoderParseHeader(SRFrameDecoder *decoder)
+{
+    uint8_t first = decoder->pending[0];
+    uint8_t second = decoder->pending[1];
+    uint8_t opcode = first & 0x0F;
+    bool fin = (first & 0x80) != 0;
+    uint8_t rsv = first & 0x70;
+    bool masked = (second & 0x80) != 0;
+    uint8_t length = second & 0x7F;
+    bool control = SRFrameOpcodeIsControl(opcode);
+
+    if ((opcode > 0x2 && opcode < 0x8) || opcode > 0xA) {
+        return SRFrameDecoderFail(decoder, SRFrameErrorReservedOpcode);
+    }
+    if (control) {
+        if (!fin) {
+            return SRFrameDecoderFail(decoder, SRFrameErrorFragmentedControl);
+        }
+        if (length > 125) {
+            return SRFrameDecoderFail(decoder, SRFrameErrorControlTooLong);
+        }
+    } else if (opcode == 0 && decoder->messageOpcode == 0) {
+        return SRFrameDecoderFail(decoder, SRFrameErrorUnexpectedContinuation);
+    } else if (opcode != 0 && decoder->messageOpcode != 0) {
+        return SRFrameDecoderFail(decoder, SRFrameErrorExpectedContinuation);
+    }
+
+    bool compressed = rsv == 0x40 && decoder->allowsCompression && !control && opcode != 0;
+    if (rsv && !compressed) {
+        return SRFrameDecoderFail(decoder, SRFrameErrorReservedBits);
+    }
+    if (masked != decoder->expectsMasking) {
+        return SRFrameDecoderFail(decoder, SRFrameErrorMasking);
+    }
+
+    SRFrameHeader *header = &decoder->header;
+    memset(header, 0, sizeof(*header));
+    header->fin = fin;
+    header->compressed = compressed;
+    header->opcode = opcode;
+    header->messageOpcode = control || opcode ? opcode : decoder->messageOpcode;
+    header->masked = masked;
+    header->payloadLength = length;
+
+    if (!control) {
+        decoder->messageOpcode = fin ? 0 : header->messageOpcode;
+    }
+    return SRFrameEventNone;
+}
+
+static inline SRFrameEvent SRFrameDecoderBeginPayload(SRFrameDecoder *decoder)
+{
+    decoder->state = SRFrameDecoderStatePayload;
+    decoder->payloadRemaining = decoder->header.payloadLength;
+    decoder->maskOffset = 0;
+    return SRFrameEventHeader;
+}
+
+// Decodes from the start of bytes[0, length) up to the next event. *consumed is set to the number
+// of bytes used, which the caller drops before the next call. For SRFrameEventPayload, *payload
+// points into bytes, at *payloadLength bytes that have been unmasked in place.
+static inline SRFrameEvent SRFrameDecoderDecode(SRFrameDecoder *decoder, uint8_t *bytes, size_t length, size_t *consumed, uint8_t **payload, size_t *payloadLength)
+{
+    uint8_t *cursor = bytes;
+    size_t remaining = length;
+    SRFrameEvent event = SRFrameEventNone;
+    *payload = NULL;
+    *payloadLength = 0;
+
+    while (event == SRFrameEventNone) {
+        switch (decoder->state) {
+            case SRFrameDecoderStateHeader: {
+                if (!SRFrameDecoderGather(decoder, 2, &cursor, &remaining)) {
+                    goto done;
+                }
+                event = SRFrameDecoderParseHeader(decoder);
+                if (event == SRFrameEventNone) {
+                    if (decoder->header.payloadLength >= 126) {
+                        decoder->state = SRFrameDecoderStateExtendedLength;
+                    } else if (decoder->header.masked) {
+                        decoder->state = SRFrameDecoderStateMaskKey;
+                    } else {
+                        event = SRFrameDecoderBeginPayload(decoder);
+                    }
+                }
+                break;
+            }
+
+            case SRFrameDecoderStateExtendedLength: {
+                size_t size = decoder->header.payloadLength == 126 ? 2 : 8;
+                if (!SRFrameDecoderGather(decoder, size, &cursor, &remaining)) {
+                    goto done;
+                }
+                uint64_t payloadLength = 0;
+                for (size_t i = 0; i < size; i++) {
+                    payloadLength = (payloadLength << 8) | decoder->pending[i];
+                }
+                if (payloadLength >> 63) {
+                    event = SRFrameDecoderFail(decoder, SRFrameErrorLengthTooLarge);
+                    break;
+                }
+                decoder->header.payloadLength = payloadLength;
+                if (decoder->header.masked) {
+                    decoder->state = SRFrameDecoderStateMaskKey;
+                } else {
+                    event = SRFrameDecoderBeginPayload(decoder);
+                }
+                break;
+            }
+
+            case SRFrameDecoderStateMaskKey: {
+                if (!SRFrameDecoderGather(decoder, SRMaskKeyLength, &cursor, &remaining)) {
+                    goto done;
+                }
+                memcpy(decoder->header.maskKey, decoder->pending, SRMaskKeyLength);
+                event = SRFrameDecoderBeginPayload(decoder);
+                break;
+            }
+
+            case SRFrameDecoderStatePayload: {
+                if (decoder->payloadRemaining == 0) {
+                    decoder->state = SRFrameDecoderStateHeader;
+                    event = SRFrameEventFrameEnd;
+                    break;
+                }
+                if (remaining == 0) {
+                    goto done;
+                }
+                size_t chunk = remaining;
+                if ((uint64_t)chunk > decoder->payloadRemaining) {
+                    chunk = (size_t)decoder->payloadRemaining;
+                }
+                if (decoder->header.masked) {
+                    SRMaskBytes(cursor, cursor, chunk, decoder->header.maskKey, decoder->maskOffset);
+                    decoder->maskOffset = (uint8_t)((decoder->maskOffset + chunk) % SRMaskKeyLength);
+                }
+                *payload = cursor;
+                *payloadLength = chunk;
+                cursor += chunk;
+                remaining -= chunk;
+                decoder->payloadRemaining -= chunk;
+                event = SRFrameEventPayload;
+                break;
+            }
+
+            case SRFrameDecoderStateFailed:
+                event = SRFrameEventError;
+                break;
+        }
+    }
+
+done:
+    *consumed = (size_t)(cursor - bytes);
+    return event;
+}
+
+#endif
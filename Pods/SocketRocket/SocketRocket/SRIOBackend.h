@@ -0,0 +1,132 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Where an SRWebSocket's bytes come from. A backend hands each socket a connection, and the
+// socket reads, writes and hears about readiness through it, always on the socket's work queue.
+
+#import <Foundation/Foundation.h>
+#import <Security/Security.h>
+#import "SRConnector.h"
+
+typedef NS_ENUM(NSInteger, SRIOEvent) {
+    SRIOEventOpened,        // Connected, and through the TLS handshake for secure connections.
+    SRIOEventReadable,
+    SRIOEventWritable,
+    SRIOEventEnded,         // The peer closed its end. error is set if that wasn't clean.
+    SRIOEventFailed,
+};
+
+typedef void (^SRIOEventHandler)(SRIOEvent event, NSError *error);
+
+#pragma mark - SRIOConnection
+
+// One connection. Every method must be called on the work queue the connection was made for,
+// and eventHandler is always called there too.
+@protocol SRIOConnection <NSObject>
+
+@property (nonatomic, copy) SRIOEventHandler eventHandler;
+
+// kCFStreamSSLValidatesCertificateChain and kCFStreamSSLPeerName are honoured by every backend.
+// Set before -open; nil, the default, makes a plain connection.
+@property (nonatomic, copy) NSDictionary *SSLSettings;
+
+// The server's trust once the TLS handshake is under way, NULL before then or without TLS.
+@property (nonatomic, readonly) SecTrustRef peerTrust;
+
+// YES after -open until -close or a failure.
+@property (nonatomic, readonly, getter=isActive) BOOL active;
+
+@property (nonatomic, readonly) BOOL hasBytesAvailable;
+@property (nonatomic, readonly) BOOL hasSpaceAvailable;
+
+// Why the last read or write returned -1.
+@property (nonatomic, readonly) NSError *error;
+
+- (void)open;
+- (void)close;
+
+// Both return the number of bytes moved, 0 when the connection isn't ready, or -1 on error.
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length;
+- (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)length;
+
+@end
+
+#pragma mark - SRIOBackend
+
+@protocol SRIOBackend <NSObject>
+
+// host and port come from the socket's URL. Connections with equal affinity keys share whatever
+// the backend shares between connections, such as a network thread; nil leaves it to the backend.
+- (id <SRIOConnection>)connectionToHost:(NSString *)host port:(uint16_t)port affinityKey:(id)affinityKey workQueue:(dispatch_queue_t)workQueue;
+
+@end
+
+#pragma mark - SRRunLoopBackend
+
+// NSStream pairs scheduled on a pool of network threads, each running its own run loop. Stream
+// events are passed on to the socket's work queue. Sockets without an affinity key are dealt out
+// to the threads in turn.
+@interface SRRunLoopBackend : NSObject <SRIOBackend>
+
+// One thread per active processor, up to 8. This is what SRWebSocket uses unless told otherwise.
++ (instancetype)sharedBackend;
+
+- (id)initWithThreadCount:(NSUInteger)threadCount;
+
+@property (nonatomic, readonly) NSUInteger threadCount;
+
+// The run loop of the thread a connection with this key would get.
+- (NSRunLoop *)runLoopForAffinityKey:(id)affinityKey;
+- (NSRunLoop *)runLoopAtIndex:(NSUInteger)index;
+
+@end
+
+#pragma mark - SRSocketBackend
+
+// Non-blocking BSD sockets watched by dispatch sources that target the socket's own work queue,
+// so stream events never hop between threads. Sockets are connected by an SRConnector, so
+// addresses are cached and raced. TLS goes through Secure Transport, which resumes the last
+// session with the same host and port rather than starting a new one.
+@interface SRSocketBackend : NSObject <SRIOBackend>
+
++ (instancetype)sharedBackend;
+
+// With a connector on +[SRHostResolver sharedResolver].
+- (id)init;
+- (id)initWithConnector:(SRConnector *)connector;
+
+@property (nonatomic, readonly) SRConnector *connector;
+
+// Connects to host ahead of time, so a socket opened to it within prewarmLifetime finds its TCP
+// connection already made. A socket opened while this is still connecting waits for it.
+- (void)prewarmConnectionToHost:(NSString *)host port:(uint16_t)port;
+
+// How long a pre-warmed connection waits to be used before it is closed. Defaults to 30 seconds.
+@property (nonatomic, assign) NSTimeInterval prewarmLifetime;
+
+@end
+
+#pragma mark - SRStreamConnection
+
+// The connection SRRunLoopBackend makes, for callers that schedule it on run loops of their own.
+@interface SRStreamConnection : NSObject <SRIOConnection, NSStreamDelegate>
+
+- (id)initWithHost:(NSString *)host port:(uint16_t)port workQueue:(dispatch_queue_t)workQueue;
+
+- (void)scheduleInRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode;
+- (void)removeFromRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode;
+
+@end
@@ -0,0 +1,961 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+#import "SRIOBackend.h"
+
+#import <errno.h>
+#import <sys/socket.h>
+#import <unistd.h>
+
+#if OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+#define sr_dispatch_retain(x)
+#define sr_dispatch_release(x)
+#else
+#define sr_dispatch_retain(x) dispatch_retain(x)
+#define sr_dispatch_release(x) dispatch_release(x)
+#endif
+
+#if !__has_feature(objc_arc)
+#error SocketRocket must be compiled with ARC enabled
+#endif
+
+static NSError *SRIOPOSIXError(int code)
+{
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:nil];
+}
+
+static NSError *SRIOSSLError(OSStatus status)
+{
+    return [NSError errorWithDomain:NSOSStatusErrorDomain code:status userInfo:nil];
+}
+
+#pragma mark - SRStreamConnection
+
+// A CFStream socket pair. Stream events arrive on whichever run loop the pair is scheduled on
+// and are passed to the work queue from there.
+@implementation SRStreamConnection {
+    dispatch_queue_t _workQueue;
+    NSInputStream *_inputStream;
+    NSOutputStream *_outputStream;
+    NSMutableSet *_scheduledRunLoops;
+}
+
+@synthesize eventHandler = _eventHandler;
+@synthesize SSLSettings = _SSLSettings;
+
+- (id)initWithHost:(NSString *)host port:(uint16_t)port workQueue:(dispatch_queue_t)workQueue;
+{
+    self = [super init];
+    if (self) {
+        _workQueue = workQueue;
+        sr_dispatch_retain(_workQueue);
+        _scheduledRunLoops = [[NSMutableSet alloc] init];
+
+        CFReadStreamRef readStream = NULL;
+        CFWriteStreamRef writeStream = NULL;
+        CFStreamCreatePairWithSocketToHost(NULL, (__bridge CFStringRef)host, port, &readStream, &writeStream);
+        _inputStream = CFBridgingRelease(readStream);
+        _outputStream = CFBridgingRelease(writeStream);
+        _inputStream.delegate = self;
+        _outputStream.delegate = self;
+    }
+    return self;
+}
+
+- (void)dealloc;
+{
+    _inputStream.delegate = nil;
+    _outputStream.delegate = nil;
+    [_inputStream close];
+    [_outputStream close];
+    sr_dispatch_release(_workQueue);
+}
+
+- (void)scheduleInRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode;
+{
+    [_outputStream scheduleInRunLoop:runLoop forMode:mode];
+    [_inputStream scheduleInRunLoop:runLoop forMode:mode];
+    [_scheduledRunLoops addObject:@[runLoop, mode]];
+}
+
+- (void)removeFromRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode;
+{
+    [_outputStream removeFromRunLoop:runLoop forMode:mode];
+    [_inputStream removeFromRunLoop:runLoop forMode:mode];
+    [_scheduledRunLoops removeObject:@[runLoop, mode]];
+}
+
+- (SecTrustRef)peerTrust;
+{
+    return (__bridge SecTrustRef)[_outputStream propertyForKey:(__bridge id)kCFStreamPropertySSLPeerTrust];
+}
+
+- (BOOL)isActive;
+{
+    return _inputStream.streamStatus != NSStreamStatusNotOpen && _inputStream.streamStatus != NSStreamStatusClosed;
+}
+
+- (BOOL)hasBytesAvailable;
+{
+    return _inputStream.hasBytesAvailable;
+}
+
+- (BOOL)hasSpaceAvailable;
+{
+    return _outputStream.hasSpaceAvailable;
+}
+
+- (NSError *)error;
+{
+    return _inputStream.streamError ?: _outputStream.streamError;
+}
+
+- (void)open;
+{
+    if (_SSLSettings) {
+        [_outputStream setProperty:(__bridge id)kCFStreamSocketSecurityLevelNegotiatedSSL forKey:(__bridge id)kCFStreamPropertySocketSecurityLevel];
+        [_outputStream setProperty:_SSLSettings forKey:(__bridge id)kCFStreamPropertySSLSettings];
+    }
+    [_outputStream open];
+    [_inputStream open];
+}
+
+- (void)close;
+{
+    [_outputStream close];
+    [_inputStream close];
+    for (NSArray *runLoop in [_scheduledRunLoops copy]) {
+        [self removeFromRunLoop:[runLoop objectAtIndex:0] forMode:[runLoop objectAtIndex:1]];
+    }
+}
+
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length;
+{
+    return [_inputStream read:buffer maxLength:length];
+}
+
+- (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)length;
+{
+    return [_outputStream write:buffer maxLength:length];
+}
+
+- (void)stream:(NSStream *)aStream handleEvent:(NSStreamEvent)eventCode;
+{
+    dispatch_async(_workQueue, ^{
+        SRIOEventHandler handler = _eventHandler;
+        if (!handler) {
+            return;
+        }
+        switch (eventCode) {
+            case NSStreamEventOpenCompleted:
+                // The output side opening only means writes may start.
+                handler(aStream == _inputStream ? SRIOEventOpened : SRIOEventWritable, nil);
+                break;
+            case NSStreamEventHasBytesAvailable:
+                handler(SRIOEventReadable, nil);
+                break;
+            case NSStreamEventHasSpaceAvailable:
+                handler(SRIOEventWritable, nil);
+                break;
+            case NSStreamEventErrorOccurred:
+                handler(SRIOEventFailed, aStream.streamError);
+                break;
+            case NSStreamEventEndEncountered:
+                handler(SRIOEventEnded, aStream.streamError);
+                break;
+            default:
+                break;
+        }
+    });
+}
+
+@end
+
+#pragma mark - SRRunLoopBackend
+
+@interface _SRRunLoopThread : NSThread
+
+@property (nonatomic, readonly) NSRunLoop *runLoop;
+
+@end
+
+@implementation SRRunLoopBackend {
+    NSArray *_threads;
+    NSUInteger _nextThread;
+}
+
++ (instancetype)sharedBackend;
+{
+    static SRRunLoopBackend *sharedBackend = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedBackend = [[self alloc] initWithThreadCount:MIN(MAX([NSProcessInfo processInfo].activeProcessorCount, (NSUInteger)1), (NSUInteger)8)];
+    });
+    return sharedBackend;
+}
+
+- (id)initWithThreadCount:(NSUInteger)threadCount;
+{
+    self = [super init];
+    if (self) {
+        NSMutableArray *threads = [[NSMutableArray alloc] init];
+        for (NSUInteger i = 0; i < MAX(threadCount, (NSUInteger)1); i++) {
+            _SRRunLoopThread *thread = [[_SRRunLoopThread alloc] init];
+            thread.name = [NSString stringWithFormat:@"com.squareup.SocketRocket.NetworkThread.%lu", (unsigned long)i];
+            [thread start];
+            [threads addObject:thread];
+        }
+        _threads = threads;
+    }
+    return self;
+}
+
+- (NSUInteger)threadCount;
+{
+    return _threads.count;
+}
+
+- (NSRunLoop *)runLoopAtIndex:(NSUInteger)index;
+{
+    return [[_threads objectAtIndex:index % _threads.count] runLoop];
+}
+
+- (NSRunLoop *)runLoopForAffinityKey:(id)affinityKey;
+{
+    NSUInteger index = 0;
+    if (affinityKey) {
+        index = [affinityKey hash];
+    } else {
+        @synchronized (self) {
+            index = _nextThread++;
+        }
+    }
+    return [self runLoopAtIndex:index];
+}
+
+- (id <SRIOConnection>)connectionToHost:(NSString *)host port:(uint16_t)port affinityKey:(id)affinityKey workQueue:(dispatch_queue_t)workQueue;
+{
+    SRStreamConnection *connection = [[SRStreamConnection alloc] initWithHost:host port:port workQueue:workQueue];
+    [connection scheduleInRunLoop:[self runLoopForAffinityKey:affinityKey] forMode:NSDefaultRunLoopMode];
+    return connection;
+}
+
+@end
+
+@implementation _SRRunLoopThread {
+    dispatch_group_t _waitGroup;
+}
+
+@synthesize runLoop = _runLoop;
+
+- (void)dealloc
+{
+    sr_dispatch_release(_waitGroup);
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        _waitGroup = dispatch_group_create();
+        dispatch_group_enter(_waitGroup);
+    }
+    return self;
+}
+
+- (void)main;
+{
+    @autoreleasepool {
+        _runLoop = [NSRunLoop currentRunLoop];
+        dispatch_group_leave(_waitGroup);
+
+        // Add an empty run loop source to prevent runloop from spinning.
+        CFRunLoopSourceContext sourceCtx = {
+            .version = 0,
+            .info = NULL,
+            .retain = NULL,
+            .release = NULL,
+            .copyDescription = NULL,
+            .equal = NULL,
+            .hash = NULL,
+            .schedule = NULL,
+            .cancel = NULL,
+            .perform = NULL
+        };
+        CFRunLoopSourceRef source = CFRunLoopSourceCreate(NULL, 0, &sourceCtx);
+        CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+        CFRelease(source);
+
+        while ([_runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]) {
+
+        }
+        assert(NO);
+    }
+}
+
+- (NSRunLoop *)runLoop;
+{
+    dispatch_group_wait(_waitGroup, DISPATCH_TIME_FOREVER);
+    return _runLoop;
+}
+
+@end
+
+#pragma mark - SRSocketConnection
+
+// What Secure Transport's I/O functions get as their connection.
+typedef struct {
+    int fd;
+    // Set when the socket last refused a write, so the handshake knows to wait for room.
+    BOOL writeBlocked;
+} SRSocketSSLIO;
+
+// Secure Transport moves its records through these, straight on the non-blocking socket.
+static OSStatus SRSocketSSLRead(SSLConnectionRef connection, void *data, size_t *length)
+{
+    int fd = ((const SRSocketSSLIO *)connection)->fd;
+    size_t requested = *length;
+    size_t done = 0;
+    while (done < requested) {
+        ssize_t count = recv(fd, (uint8_t *)data + done, requested - done, 0);
+        if (count > 0) {
+            done += count;
+        } else if (count < 0 && errno == EINTR) {
+            continue;
+        } else {
+            *length = done;
+            if (count == 0) {
+                return errSSLClosedGraceful;
+            }
+            return errno == EAGAIN ? errSSLWouldBlock : errSSLClosedAbort;
+        }
+    }
+    *length = done;
+    return noErr;
+}
+
+static OSStatus SRSocketSSLWrite(SSLConnectionRef connection, const void *data, size_t *length)
+{
+    SRSocketSSLIO *io = (SRSocketSSLIO *)connection;
+    int fd = io->fd;
+    size_t requested = *length;
+    size_t done = 0;
+    io->writeBlocked = NO;
+    while (done < requested) {
+        ssize_t count = send(fd, (const uint8_t *)data + done, requested - done, 0);
+        if (count >= 0) {
+            done += count;
+        } else if (errno != EINTR) {
+            *length = done;
+            io->writeBlocked = errno == EAGAIN;
+            return io->writeBlocked ? errSSLWouldBlock : errSSLClosedAbort;
+        }
+    }
+    *length = done;
+    return noErr;
+}
+
+@interface SRSocketBackend ()
+
+// A pre-warmed socket if there is one, otherwise a new one from the connector. completion is
+// called on workQueue.
+- (void)_connectToHost:(NSString *)host port:(uint16_t)port workQueue:(dispatch_queue_t)workQueue completion:(SRConnectCompletion)completion;
+
+@end
+
+// A non-blocking socket with a read and a write dispatch source on the work queue. The read
+// source stays resumed once connected; the write source only runs while a write is waiting for
+// room, since a writable socket would otherwise fire it continuously.
+@interface SRSocketConnection : NSObject <SRIOConnection>
+
+- (id)initWithHost:(NSString *)host port:(uint16_t)port backend:(SRSocketBackend *)backend workQueue:(dispatch_queue_t)workQueue;
+
+@end
+
+@implementation SRSocketConnection {
+    NSString *_host;
+    uint16_t _port;
+    SRSocketBackend *_backend;
+    dispatch_queue_t _workQueue;
+
+    int _fd;
+    dispatch_source_t _readSource;
+    dispatch_source_t _writeSource;
+    BOOL _writeSourceSuspended;
+
+    BOOL _connected;
+    BOOL _opened;
+    BOOL _readable;
+    BOOL _writable;
+    BOOL _ended;
+    NSError *_error;
+
+    SSLContextRef _ssl;
+    SRSocketSSLIO _sslIO;
+    SecTrustRef _peerTrust;
+    // Bytes Secure Transport has taken into its own buffer but not yet put on the socket.
+    size_t _sslWriteBuffered;
+}
+
+@synthesize eventHandler = _eventHandler;
+@synthesize SSLSettings = _SSLSettings;
+@synthesize active = _active;
+
+- (id)initWithHost:(NSString *)host port:(uint16_t)port backend:(SRSocketBackend *)backend workQueue:(dispatch_queue_t)workQueue;
+{
+    self = [super init];
+    if (self) {
+        _host = [host copy];
+        _port = port;
+        _backend = backend;
+        _workQueue = workQueue;
+        sr_dispatch_retain(_workQueue);
+        _fd = -1;
+    }
+    return self;
+}
+
+- (void)dealloc;
+{
+    [self _closeSocket];
+    if (_ssl) {
+        CFRelease(_ssl);
+    }
+    if (_peerTrust) {
+        CFRelease(_peerTrust);
+    }
+    sr_dispatch_release(_workQueue);
+}
+
+- (SecTrustRef)peerTrust;
+{
+    return _peerTrust;
+}
+
+- (NSError *)error;
+{
+    return _error;
+}
+
+- (BOOL)hasBytesAvailable;
+{
+    size_t buffered = 0;
+    if (_ssl && _opened) {
+        SSLGetBufferedReadSize(_ssl, &buffered);
+    }
+    return _opened && (_readable || buffered > 0);
+}
+
+- (BOOL)hasSpaceAvailable;
+{
+    return _opened && _writable;
+}
+
+- (void)_emit:(SRIOEvent)event error:(NSError *)error;
+{
+    SRIOEventHandler handler = _eventHandler;
+    if (handler && (_active || event == SRIOEventFailed)) {
+        handler(event, error);
+    }
+}
+
+- (void)_fail:(NSError *)error;
+{
+    if (!_active) {
+        return;
+    }
+    _active = NO;
+    [self _closeSocket];
+    [self _emit:SRIOEventFailed error:error];
+}
+
+#pragma mark Connecting
+
+- (void)open;
+{
+    _active = YES;
+    [_backend _connectToHost:_host port:_port workQueue:_workQueue completion:^(int fd, NSError *error) {
+        if (!_active) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        if (fd < 0) {
+            [self _fail:error];
+            return;
+        }
+        [self _watchSocket:fd];
+        [self _didConnect];
+    }];
+}
+
+- (void)_watchSocket:(int)fd;
+{
+    _fd = fd;
+    __weak SRSocketConnection *weakSelf = self;
+
+    // The descriptor is closed once both sources are done with it.
+    __block int sourcesLeft = 2;
+    dispatch_block_t closeSocket = ^{
+        if (--sourcesLeft == 0) {
+            close(fd);
+        }
+    };
+
+    _readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, _workQueue);
+    dispatch_source_set_event_handler(_readSource, ^{
+        [weakSelf _socketReadable];
+    });
+    dispatch_source_set_cancel_handler(_readSource, closeSocket);
+
+    // Left suspended until a write finds the socket full.
+    _writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, fd, 0, _workQueue);
+    dispatch_source_set_event_handler(_writeSource, ^{
+        [weakSelf _socketWritable];
+    });
+    dispatch_source_set_cancel_handler(_writeSource, closeSocket);
+    _writeSourceSuspended = YES;
+}
+
+- (void)_closeSocket;
+{
+    if (_readSource) {
+        if (!_connected) {
+            // Never resumed, and a suspended source can't finish cancelling.
+            dispatch_resume(_readSource);
+        }
+        dispatch_source_cancel(_readSource);
+        sr_dispatch_release(_readSource);
+        _readSource = nil;
+    }
+    if (_writeSource) {
+        if (_writeSourceSuspended) {
+            dispatch_resume(_writeSource);
+            _writeSourceSuspended = NO;
+        }
+        dispatch_source_cancel(_writeSource);
+        sr_dispatch_release(_writeSource);
+        _writeSource = nil;
+    }
+    _fd = -1;
+    _connected = NO;
+    _opened = NO;
+}
+
+- (void)_didConnect;
+{
+    _connected = YES;
+    _writable = YES;
+    dispatch_resume(_readSource);
+
+    if (!_SSLSettings) {
+        _opened = YES;
+        [self _emit:SRIOEventOpened error:nil];
+        return;
+    }
+
+    _ssl = SSLCreateContext(NULL, kSSLClientSide, kSSLStreamType);
+    NSString *peerName = [_SSLSettings objectForKey:(__bridge id)kCFStreamSSLPeerName] ?: _host;
+    SSLSetIOFuncs(_ssl, SRSocketSSLRead, SRSocketSSLWrite);
+    _sslIO.fd = _fd;
+    SSLSetConnection(_ssl, &_sslIO);
+    SSLSetPeerDomainName(_ssl, peerName.UTF8String, strlen(peerName.UTF8String));
+    // Secure Transport caches sessions by peer ID, so a reconnect resumes the last session with
+    // this server and saves a round trip of the handshake.
+    NSString *peerID = [NSString stringWithFormat:@"%@:%u", peerName, _port];
+    SSLSetPeerID(_ssl, peerID.UTF8String, strlen(peerID.UTF8String));
+    // The chain is checked here rather than inside Secure Transport, so the trust is always
+    // available for certificate pinning.
+    SSLSetSessionOption(_ssl, kSSLSessionOptionBreakOnServerAuth, true);
+    [self _continueHandshake];
+}
+
+- (void)_continueHandshake;
+{
+    OSStatus status = SSLHandshake(_ssl);
+
+    if (status == errSSLPeerAuthCompleted) {
+        SecTrustRef trust = NULL;
+        SSLCopyPeerTrust(_ssl, &trust);
+        _peerTrust = trust;
+
+        NSNumber *validates = [_SSLSettings objectForKey:(__bridge id)kCFStreamSSLValidatesCertificateChain];
+        if (!validates || validates.boolValue) {
+            SecTrustResultType result = kSecTrustResultInvalid;
+            if (!trust || SecTrustEvaluate(trust, &result) != errSecSuccess || (result != kSecTrustResultUnspecified && result != kSecTrustResultProceed)) {
+                [self _fail:SRIOSSLError(errSSLXCertChainInvalid)];
+                return;
+            }
+        }
+        [self _continueHandshake];
+        return;
+    }
+
+    if (status == errSSLWouldBlock) {
+        // Otherwise it's waiting on the server, and the read source will bring it back.
+        if (_sslIO.writeBlocked) {
+            [self _waitForWritable];
+        }
+        return;
+    }
+
+    if (status != noErr) {
+        [self _fail:SRIOSSLError(status)];
+        return;
+    }
+
+    _opened = YES;
+    [self _emit:SRIOEventOpened error:nil];
+}
+
+#pragma mark Events
+
+- (void)_socketReadable;
+{
+    if (!_connected) {
+        return;
+    }
+    if (_ssl && !_opened) {
+        [self _continueHandshake];
+        return;
+    }
+
+    _readable = YES;
+    [self _emit:SRIOEventReadable error:nil];
+
+    // Secure Transport may hold decrypted bytes the socket no longer shows as readable.
+    size_t buffered = 0;
+    if (_ssl && _opened && SSLGetBufferedReadSize(_ssl, &buffered) == noErr && buffered > 0) {
+        __weak SRSocketConnection *weakSelf = self;
+        dispatch_async(_workQueue, ^{
+            [weakSelf _socketReadable];
+        });
+    }
+}
+
+- (void)_socketWritable;
+{
+    if (_writeSourceSuspended) {
+        return;
+    }
+    dispatch_suspend(_writeSource);
+    _writeSourceSuspended = YES;
+    _writable = YES;
+
+    if (_ssl && !_opened) {
+        [self _continueHandshake];
+        return;
+    }
+    [self _emit:SRIOEventWritable error:nil];
+}
+
+- (void)_waitForWritable;
+{
+    _writable = NO;
+    if (_writeSourceSuspended) {
+        _writeSourceSuspended = NO;
+        dispatch_resume(_writeSource);
+    }
+}
+
+- (void)_didEnd;
+{
+    _readable = NO;
+    if (_ended) {
+        return;
+    }
+    _ended = YES;
+    // Reported after the read that found it has returned.
+    __weak SRSocketConnection *weakSelf = self;
+    dispatch_async(_workQueue, ^{
+        [weakSelf _emit:SRIOEventEnded error:nil];
+    });
+}
+
+#pragma mark Reading and writing
+
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length;
+{
+    if (!_opened || length == 0) {
+        return 0;
+    }
+
+    if (_ssl) {
+        size_t processed = 0;
+        OSStatus status = SSLRead(_ssl, buffer, length, &processed);
+        if (status == errSSLWouldBlock) {
+            _readable = NO;
+        } else if (status == errSSLClosedGraceful || status == errSSLClosedNoNotify) {
+            [self _didEnd];
+        } else if (status != noErr && processed == 0) {
+            _error = SRIOSSLError(status);
+            return -1;
+        }
+        return processed;
+    }
+
+    ssize_t count;
+    do {
+        count = recv(_fd, buffer, length, 0);
+    } while (count < 0 && errno == EINTR);
+
+    if (count > 0) {
+        if ((size_t)count < length) {
+            _readable = NO;
+        }
+        return count;
+    }
+    if (count == 0) {
+        [self _didEnd];
+        return 0;
+    }
+    if (errno == EAGAIN) {
+        _readable = NO;
+        return 0;
+    }
+    _error = SRIOPOSIXError(errno);
+    return -1;
+}
+
+- (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)length;
+{
+    if (!_opened || !_writable || length == 0) {
+        return 0;
+    }
+
+    if (_ssl) {
+        size_t processed = 0;
+        OSStatus status;
+        if (_sslWriteBuffered) {
+            // Whatever Secure Transport took last time was the start of this same buffer; it
+            // only counts as written once it has reached the socket.
+            status = SSLWrite(_ssl, NULL, 0, &processed);
+            if (status == noErr) {
+                processed = _sslWriteBuffered;
+                _sslWriteBuffered = 0;
+            }
+        } else {
+            status = SSLWrite(_ssl, buffer, length, &processed);
+            if (status == errSSLWouldBlock) {
+                _sslWriteBuffered = length;
+                processed = 0;
+            }
+        }
+        if (status == errSSLWouldBlock) {
+            [self _waitForWritable];
+            return 0;
+        }
+        if (status != noErr) {
+            _error = SRIOSSLError(status);
+            return -1;
+        }
+        return processed;
+    }
+
+    ssize_t count;
+    do {
+        count = send(_fd, buffer, length, 0);
+    } while (count < 0 && errno == EINTR);
+
+    if (count >= 0) {
+        if ((size_t)count < length) {
+            [self _waitForWritable];
+        }
+        return count;
+    }
+    if (errno == EAGAIN) {
+        [self _waitForWritable];
+        return 0;
+    }
+    _error = SRIOPOSIXError(errno);
+    return -1;
+}
+
+- (void)close;
+{
+    if (!_active) {
+        return;
+    }
+    _active = NO;
+    if (_ssl && _opened) {
+        SSLClose(_ssl);
+    }
+    [self _closeSocket];
+}
+
+@end
+
+#pragma mark - SRSocketBackend
+
+// A pre-warmed socket nobody has asked for yet.
+@interface _SRParkedSocket : NSObject
+
+@property (nonatomic, assign) int fd;
+
+@end
+
+@implementation _SRParkedSocket
+@end
+
+static NSString *SRSocketKey(NSString *host, uint16_t port)
+{
+    return [NSString stringWithFormat:@"%@:%u", host.lowercaseString, port];
+}
+
+// An idle connection has nothing to read and hasn't been closed, so a peek finds no bytes yet.
+static BOOL SRSocketIsIdle(int fd)
+{
+    uint8_t byte;
+    ssize_t count = recv(fd, &byte, sizeof(byte), MSG_PEEK);
+    return count < 0 && errno == EAGAIN;
+}
+
+@implementation SRSocketBackend {
+    // Guards everything below.
+    dispatch_queue_t _queue;
+    // Arrays of _SRParkedSocket by SRSocketKey, oldest first.
+    NSMutableDictionary *_parkedSockets;
+    // Completions waiting on a pre-warm still connecting, by SRSocketKey.
+    NSMutableDictionary *_prewarmWaiters;
+}
+
+@synthesize connector = _connector;
+@synthesize prewarmLifetime = _prewarmLifetime;
+
++ (instancetype)sharedBackend;
+{
+    static SRSocketBackend *sharedBackend = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedBackend = [[self alloc] init];
+    });
+    return sharedBackend;
+}
+
+- (id)init;
+{
+    return [self initWithConnector:[[SRConnector alloc] initWithResolver:[SRHostResolver sharedResolver]]];
+}
+
+- (id)initWithConnector:(SRConnector *)connector;
+{
+    self = [super init];
+    if (self) {
+        _connector = connector;
+        _prewarmLifetime = 30;
+        _queue = dispatch_queue_create("com.squareup.SocketRocket.SRSocketBackend", DISPATCH_QUEUE_SERIAL);
+        _parkedSockets = [[NSMutableDictionary alloc] init];
+        _prewarmWaiters = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc;
+{
+    for (NSArray *parked in _parkedSockets.allValues) {
+        for (_SRParkedSocket *socket in parked) {
+            close(socket.fd);
+        }
+    }
+    sr_dispatch_release(_queue);
+}
+
+- (id <SRIOConnection>)connectionToHost:(NSString *)host port:(uint16_t)port affinityKey:(id)affinityKey workQueue:(dispatch_queue_t)workQueue;
+{
+    // Every socket already has its own work queue, which is all the affinity there is here.
+    return [[SRSocketConnection alloc] initWithHost:host port:port backend:self workQueue:workQueue];
+}
+
+- (void)prewarmConnectionToHost:(NSString *)host port:(uint16_t)port;
+{
+    NSString *key = SRSocketKey(host, port);
+    dispatch_async(_queue, ^{
+        if ([_prewarmWaiters objectForKey:key] || [[_parkedSockets objectForKey:key] count]) {
+            return;
+        }
+        [_prewarmWaiters setObject:[[NSMutableArray alloc] init] forKey:key];
+        
+        [_connector connectToHost:host port:port queue:_queue completion:^(int fd, NSError *error) {
+            NSMutableArray *waiters = [_prewarmWaiters objectForKey:key];
+            [_prewarmWaiters removeObjectForKey:key];
+            
+            // The first socket that asked while this was connecting gets it, and any others
+            // make their own.
+            if (waiters.count) {
+                SRConnectCompletion first = [waiters objectAtIndex:0];
+                first(fd, error);
+                for (NSUInteger i = 1; i < waiters.count; i++) {
+                    [_connector connectToHost:host port:port queue:_queue completion:[waiters objectAtIndex:i]];
+                }
+            } else if (fd >= 0) {
+                [self _parkSocket:fd key:key];
+            }
+        }];
+    });
+}
+
+- (void)_parkSocket:(int)fd key:(NSString *)key;
+{
+    _SRParkedSocket *socket = [[_SRParkedSocket alloc] init];
+    socket.fd = fd;
+    NSMutableArray *parked = [_parkedSockets objectForKey:key];
+    if (!parked) {
+        parked = [[NSMutableArray alloc] init];
+        [_parkedSockets setObject:parked forKey:key];
+    }
+    [parked addObject:socket];
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_prewarmLifetime * NSEC_PER_SEC)), _queue, ^{
+        if ([parked indexOfObjectIdenticalTo:socket] != NSNotFound) {
+            [parked removeObjectIdenticalTo:socket];
+            close(socket.fd);
+        }
+    });
+}
+
+- (void)_connectToHost:(NSString *)host port:(uint16_t)port workQueue:(dispatch_queue_t)workQueue completion:(SRConnectCompletion)completion;
+{
+    NSString *key = SRSocketKey(host, port);
+    SRConnectCompletion deliver = ^(int fd, NSError *error) {
+        dispatch_async(workQueue, ^{
+            completion(fd, error);
+        });
+    };
+    
+    dispatch_async(_queue, ^{
+        NSMutableArray *parked = [_parkedSockets objectForKey:key];
+        while (parked.count) {
+            _SRParkedSocket *socket = [parked objectAtIndex:0];
+            [parked removeObjectAtIndex:0];
+            // The server may have given up on it while it waited.
+            if (SRSocketIsIdle(socket.fd)) {
+                deliver(socket.fd, nil);
+                return;
+            }
+            close(socket.fd);
+        }
+        
+        NSMutableArray *waiters = [_prewarmWaiters objectForKey:key];
+        if (waiters) {
+            [waiters addObject:deliver];
+            return;
+        }
+        [_connector connectToHost:host port:port queue:workQueue completion:completion];
+    });
+}
+
+@end
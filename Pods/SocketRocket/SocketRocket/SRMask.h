@@ -0,0 +1,102 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Plain C so it can be compiled and benchmarked outside of Foundation.
+
+#ifndef SRMask_h
+#define SRMask_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Define SR_MASK_NO_SIMD to leave only the word loop, as the standalone tests do to check it.
+#if !defined(SR_MASK_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SR_MASK_AVX2
+#define SR_MASK_SSE2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SR_MASK_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SR_MASK_NEON
+#endif
+#endif
+
+static const size_t SRMaskKeyLength = 4;
+
+// Reference implementation, one byte at a time.
+static inline void SRMaskBytesScalar(uint8_t *dst, const uint8_t *src, size_t length, const uint8_t *maskKey, size_t maskOffset)
+{
+    for (size_t i = 0; i < length; i++) {
+        dst[i] = src[i] ^ maskKey[(maskOffset + i) % SRMaskKeyLength];
+    }
+}
+
+// XORs length bytes of src with the 4 byte masking key and writes them to dst.
+// maskOffset is the number of payload bytes already masked with this key, so a
+// frame can be unmasked across several reads. dst may equal src.
+static inline void SRMaskBytes(uint8_t *dst, const uint8_t *src, size_t length, const uint8_t *maskKey, size_t maskOffset)
+{
+    // Rotate the key so pattern[0] lines up with src[0]. Every block below is a
+    // multiple of 4 bytes long, so the pattern never has to be rotated again.
+    uint8_t pattern[16];
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = maskKey[(maskOffset + i) % SRMaskKeyLength];
+    }
+
+    size_t i = 0;
+
+#if defined(SR_MASK_AVX2)
+    const __m256i key256 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)pattern));
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(block, key256));
+    }
+#endif
+
+#if defined(SR_MASK_SSE2)
+    const __m128i key128 = _mm_loadu_si128((const __m128i *)pattern);
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(block, key128));
+    }
+#elif defined(SR_MASK_NEON)
+    const uint8x16_t key128 = vld1q_u8(pattern);
+    for (; i + 16 <= length; i += 16) {
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), key128));
+    }
+#endif
+
+    // Word at a time for whatever is left (or everything, without SIMD).
+    // memcpy keeps the loads legal on unaligned buffers and compiles to a single move.
+    uint64_t key64;
+    memcpy(&key64, pattern, sizeof(key64));
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, src + i, sizeof(word));
+        word ^= key64;
+        memcpy(dst + i, &word, sizeof(word));
+    }
+
+    for (; i < length; i++) {
+        dst[i] = src[i] ^ pattern[i % SRMaskKeyLength];
+    }
+}
+
+#endif
@@ -0,0 +1,175 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Growable byte ring used for the socket read path. Bytes are read from the
+// stream straight into the free space and consumed in place from the front, so
+// nothing is ever compacted. Plain C, not thread-safe.
+
+#ifndef SRRingBuffer_h
+#define SRRingBuffer_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    uint8_t *bytes;
+    size_t capacity;    // Always a power of two.
+    size_t start;       // Index of the first readable byte.
+    size_t length;      // Number of readable bytes.
+} SRRingBuffer;
+
+static inline bool SRRingBufferInit(SRRingBuffer *ring, size_t capacity)
+{
+    size_t size = 64;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring->bytes = (uint8_t *)malloc(size);
+    ring->capacity = ring->bytes ? size : 0;
+    ring->start = 0;
+    ring->length = 0;
+    return ring->bytes != NULL;
+}
+
+static inline void SRRingBufferFree(SRRingBuffer *ring)
+{
+    free(ring->bytes);
+    ring->bytes = NULL;
+    ring->capacity = 0;
+    ring->start = 0;
+    ring->length = 0;
+}
+
+static inline void SRRingBufferReset(SRRingBuffer *ring)
+{
+    ring->start = 0;
+    ring->length = 0;
+}
+
+// Copies the first length readable bytes to dst without consuming them.
+static inline void SRRingBufferCopyBytes(const SRRingBuffer *ring, uint8_t *dst, size_t length)
+{
+    size_t first = ring->capacity - ring->start;
+    if (length <= first) {
+        memcpy(dst, ring->bytes + ring->start, length);
+    } else {
+        memcpy(dst, ring->bytes + ring->start, first);
+        memcpy(dst + first, ring->bytes, length - first);
+    }
+}
+
+// Makes room for at least additional more bytes, doubling the capacity as needed.
+static inline bool SRRingBufferReserve(SRRingBuffer *ring, size_t additional)
+{
+    if (ring->capacity - ring->length >= additional) {
+        return true;
+    }
+
+    size_t capacity = ring->capacity ? ring->capacity : 64;
+    while (capacity - ring->length < additional) {
+        if (capacity > SIZE_MAX / 2) {
+            return false;
+        }
+        capacity <<= 1;
+    }
+
+    uint8_t *bytes = (uint8_t *)malloc(capacity);
+    if (!bytes) {
+        return false;
+    }
+    if (ring->length) {
+        SRRingBufferCopyBytes(ring, bytes, ring->length);
+    }
+    free(ring->bytes);
+    ring->bytes = bytes;
+    ring->capacity = capacity;
+    ring->start = 0;
+    return true;
+}
+
+// Points bytes at the first readable byte and returns how many follow contiguously.
+static inline size_t SRRingBufferReadableBytes(const SRRingBuffer *ring, const uint8_t **bytes)
+{
+    *bytes = ring->bytes + ring->start;
+    size_t contiguous = ring->capacity - ring->start;
+    return ring->length < contiguous ? ring->length : contiguous;
+}
+
+// Points bytes at the first free byte and returns how much free space follows contiguously.
+static inline size_t SRRingBufferWritableBytes(SRRingBuffer *ring, uint8_t **bytes)
+{
+    size_t end = (ring->start + ring->length) & (ring->capacity - 1);
+    *bytes = ring->bytes + end;
+    if (ring->length == ring->capacity) {
+        return 0;
+    }
+    return end >= ring->start ? ring->capacity - end : ring->start - end;
+}
+
+// Marks length bytes written at the location returned by SRRingBufferWritableBytes as readable.
+static inline void SRRingBufferCommit(SRRingBuffer *ring, size_t length)
+{
+    ring->length += length;
+}
+
+static inline bool SRRingBufferAppend(SRRingBuffer *ring, const uint8_t *src, size_t length)
+{
+    if (!SRRingBufferReserve(ring, length)) {
+        return false;
+    }
+    while (length) {
+        uint8_t *dst = NULL;
+        size_t chunk = SRRingBufferWritableBytes(ring, &dst);
+        chunk = chunk < length ? chunk : length;
+        memcpy(dst, src, chunk);
+        SRRingBufferCommit(ring, chunk);
+        src += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+static inline void SRRingBufferConsume(SRRingBuffer *ring, size_t length)
+{
+    ring->start = (ring->start + length) & (ring->capacity - 1);
+    ring->length -= length;
+    if (ring->length == 0) {
+        // Keep the free space in one piece when we've caught up.
+        ring->start = 0;
+    }
+}
+
+// Rearranges the buffer so every readable byte is contiguous and returns a pointer to them.
+// Only needed by consumers that scan for a delimiter, like the HTTP header reader.
+static inline const uint8_t *SRRingBufferLinearize(SRRingBuffer *ring)
+{
+    if (ring->start + ring->length > ring->capacity) {
+        uint8_t *bytes = (uint8_t *)malloc(ring->capacity);
+        if (!bytes) {
+            return NULL;
+        }
+        SRRingBufferCopyBytes(ring, bytes, ring->length);
+        free(ring->bytes);
+        ring->bytes = bytes;
+        ring->start = 0;
+    }
+    return ring->bytes + ring->start;
+}
+
+#endif
@@ -0,0 +1,114 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Incremental UTF-8 validator (RFC 3629: no overlongs, surrogates or code points
+// past U+10FFFF). It is a table driven DFA whose state is carried from one call
+// to the next, so each chunk of a text message is scanned once as it arrives.
+// Plain C.
+
+#ifndef SRUTF8_h
+#define SRUTF8_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t SRUTF8State;
+
+enum {
+    SRUTF8Accept = 0,   // On a code point boundary.
+    SRUTF8Reject = 1,   // Not UTF-8, whatever follows.
+    // Anything else: inside a multi-byte sequence.
+};
+
+// Byte classes:
+//  0: 00..7F   1: 80..8F   2: 90..9F   3: A0..BF   4: C0..C1, F5..FF
+//  5: C2..DF   6: E0       7: E1..EC, EE..EF       8: ED
+//  9: F0      10: F1..F3  11: F4
+static const uint8_t SRUTF8ByteClass[256] = {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+    3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
+    4,4,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+    6,7,7,7,7,7,7,7,7,7,7,7,7,8,7,7, 9,10,10,10,11,4,4,4,4,4,4,4,4,4,4,4,
+};
+
+// States:
+//  0: accept   1: reject   2: need 1 more   3: need 2 more   4: need 3 more
+//  5: after E0 (next A0..BF)   6: after ED (next 80..9F)
+//  7: after F0 (next 90..BF)   8: after F4 (next 80..8F)
+static const uint8_t SRUTF8Transition[9][12] = {
+    {0, 1, 1, 1, 1, 2, 5, 3, 6, 7, 4, 8},
+    {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
+    {1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1},
+    {1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1},
+    {1, 3, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1},
+    {1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1},
+    {1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1},
+    {1, 1, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1},
+    {1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
+};
+
+// Runs length more bytes through the validator, starting from state (SRUTF8Accept for a
+// new message), and returns the new state. Stops early once the input is rejected.
+// If completeLength isn't NULL it is set to the number of leading bytes that end on a code
+// point boundary, or 0 if no code point was completed in this chunk.
+static inline SRUTF8State SRUTF8Validate(SRUTF8State state, const uint8_t *bytes, size_t length, size_t *completeLength)
+{
+    size_t complete = 0;
+    size_t i = 0;
+
+    while (i < length) {
+        if (state == SRUTF8Accept) {
+            // ASCII fast path: skip 8 bytes at a time while none has the high bit set.
+            while (i + sizeof(uint64_t) <= length) {
+                uint64_t word;
+                memcpy(&word, bytes + i, sizeof(word));
+                if (word & 0x8080808080808080ULL) {
+                    break;
+                }
+                i += sizeof(uint64_t);
+                complete = i;
+            }
+            while (i < length && bytes[i] < 0x80) {
+                i++;
+                complete = i;
+            }
+            if (i == length) {
+                break;
+            }
+        }
+
+        state = SRUTF8Transition[state][SRUTF8ByteClass[bytes[i]]];
+        i++;
+
+        if (state == SRUTF8Accept) {
+            complete = i;
+        } else if (state == SRUTF8Reject) {
+            break;
+        }
+    }
+
+    if (completeLength) {
+        *completeLength = complete;
+    }
+    return state;
+}
+
+#endif
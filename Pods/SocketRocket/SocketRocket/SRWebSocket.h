@@ -16,6 +16,7 @@
 
 #import <Foundation/Foundation.h>
 #import <Security/SecCertificate.h>
+#import "SRIOBackend.h"
 
 typedef NS_ENUM(NSInteger, SRReadyState) {
     SR_CONNECTING   = 0,
@@ -37,6 +38,20 @@ typedef enum SRStatusCode : NSInteger {
     SRStatusCodeMessageTooBig = 1009,
 } SRStatusCode;
 
+typedef NS_ENUM(NSInteger, SRMessagePriority) {
+    SRMessagePriorityNormal = 0,
+    // Refused first when maxBufferedAmount is reached.
+    SRMessagePriorityLow    = 1,
+};
+
+// What send:priority: does with a message that would take bufferedAmount past maxBufferedAmount.
+typedef NS_ENUM(NSInteger, SROverflowPolicy) {
+    // Low priority messages are refused; normal ones are still queued.
+    SROverflowPolicyDropLowPriority = 0,
+    // Every message is refused.
+    SROverflowPolicyReject          = 1,
+};
+
 @class SRWebSocket;
 
 extern NSString *const SRWebSocketErrorDomain;
@@ -46,6 +61,35 @@ extern NSString *const SRHTTPResponseErrorKey;
 
 @protocol SRWebSocketDelegate;
 
+#pragma mark - SRPerMessageDeflateOptions
+
+// What to offer for the permessage-deflate extension (RFC 7692). The server decides what is used.
+@interface SRPerMessageDeflateOptions : NSObject <NSCopying>
+
+// Largest LZ77 window, as a power of two, for messages we send and messages we receive.
+// 9-15, defaults to 15. A smaller window costs ratio but saves compressor memory. Received
+// messages are always inflated with a 15 bit window, which reads any smaller one.
+@property (nonatomic, assign) NSInteger clientMaxWindowBits;
+@property (nonatomic, assign) NSInteger serverMaxWindowBits;
+
+// Ask for each message to be compressed on its own, without reference to earlier ones.
+// Defaults to NO, which compresses repetitive traffic like SDP much better but keeps each
+// context's window alive between messages.
+@property (nonatomic, assign) BOOL clientNoContextTakeover;
+@property (nonatomic, assign) BOOL serverNoContextTakeover;
+
+// zlib memLevel (1-9) for our compressor. Defaults to 8.
+@property (nonatomic, assign) NSInteger memoryLevel;
+
+// Messages shorter than this many bytes are sent uncompressed. Defaults to 64.
+@property (nonatomic, assign) NSUInteger compressionThreshold;
+
+// Most bytes a compressed message may inflate to while it is buffered, 0 for no limit.
+// Messages that go over close the connection with SRStatusCodeMessageTooBig. Defaults to 16MB.
+@property (nonatomic, assign) NSUInteger maxInflatedMessageSize;
+
+@end
+
 #pragma mark - SRWebSocket
 
 @interface SRWebSocket : NSObject <NSStreamDelegate>
@@ -61,6 +105,62 @@ extern NSString *const SRHTTPResponseErrorKey;
 // Optional array of cookies (NSHTTPCookie objects) to apply to the connections
 @property (nonatomic, readwrite) NSArray * requestCookies;
 
+// Maximum number of bytes read from the input stream per read call. Defaults to 16384.
+// The read buffer grows past this as needed, so this only bounds each read. Set it before -open.
+@property (nonatomic, assign) NSUInteger readChunkSize;
+
+// When YES, text and binary messages are handed to webSocket:didReceiveMessageFragment:isFinal:
+// piece by piece as they are read, instead of being buffered whole for webSocket:didReceiveMessage:.
+// Defaults to NO. Set it before -open.
+@property (nonatomic, assign) BOOL deliversMessageFragments;
+
+// Set to offer permessage-deflate in the opening handshake. nil (the default) offers no extensions.
+// Set it before -open.
+@property (nonatomic, copy) SRPerMessageDeflateOptions *perMessageDeflateOptions;
+
+// Where the socket's connection comes from. nil (the default) means +[SRRunLoopBackend sharedBackend].
+// Set it before -open.
+@property (nonatomic, strong) id <SRIOBackend> ioBackend;
+
+// Sockets with equal keys are kept on the same network thread by backends that have several.
+// nil (the default) spreads sockets across them. Set it before -open.
+@property (nonatomic, strong) id networkAffinityKey;
+
+// Bytes handed to send: and friends that haven't been written to the connection yet, counting
+// frame headers once they are queued. Safe to read from any thread.
+@property (nonatomic, readonly) uint64_t bufferedAmount;
+
+// Most bytes that may be buffered before sends are refused as overflowPolicy says, 0 (the
+// default) for no limit. A message is refused only if it would take bufferedAmount past this.
+@property (nonatomic, assign) uint64_t maxBufferedAmount;
+@property (nonatomic, assign) SROverflowPolicy overflowPolicy;
+
+// The delegate hears when bufferedAmount goes above highWaterMark, then once when it falls back
+// to lowWaterMark or below. A highWaterMark of 0 (the default) turns the callbacks off.
+@property (nonatomic, assign) uint64_t highWaterMark;
+@property (nonatomic, assign) uint64_t lowWaterMark;
+
+// Pings the server every keepaliveInterval seconds, each ping with a payload of its own, and
+// times how long its pong takes. 0 (the default) sends no pings. Set it before -open.
+@property (nonatomic, assign) NSTimeInterval keepaliveInterval;
+
+// A ping is missed when its pong hasn't come back by the time the next one is due. After this
+// many in a row the socket fails with error 2148, so a dead connection is noticed within
+// (maxMissedPongs + 1) * keepaliveInterval rather than at the TCP timeout. 0 never gives up.
+// Defaults to 2.
+@property (nonatomic, assign) NSUInteger maxMissedPongs;
+
+// From keepalive pongs, in seconds, and 0 until the first one. Smoothed the way TCP smooths its
+// own (RFC 6298); roundTripTimeVariation is the mean deviation, so it doubles as jitter.
+// Safe to read from any thread.
+@property (nonatomic, readonly) NSTimeInterval roundTripTime;
+@property (nonatomic, readonly) NSTimeInterval smoothedRoundTripTime;
+@property (nonatomic, readonly) NSTimeInterval roundTripTimeVariation;
+@property (nonatomic, readonly) NSUInteger missedPongCount;
+
+// YES once the server has accepted permessage-deflate.
+@property (nonatomic, readonly) BOOL perMessageDeflateEnabled;
+
 // This returns the negotiated protocol.
 // It will be nil until after the handshake completes.
 @property (nonatomic, readonly, copy) NSString *protocol;
@@ -80,7 +180,8 @@ extern NSString *const SRHTTPResponseErrorKey;
 - (void)setDelegateOperationQueue:(NSOperationQueue*) queue;
 - (void)setDelegateDispatchQueue:(dispatch_queue_t) queue;
 
-// By default, it will schedule itself on +[NSRunLoop SR_networkRunLoop] using defaultModes.
+// By default, it is given a connection by ioBackend. Scheduling it on run loops before -open
+// bypasses the backend for a stream connection scheduled on exactly those run loops.
 - (void)scheduleInRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode;
 - (void)unscheduleFromRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode;
 
@@ -90,9 +191,19 @@ extern NSString *const SRHTTPResponseErrorKey;
 - (void)close;
 - (void)closeWithCode:(NSInteger)code reason:(NSString *)reason;
 
-// Send a UTF8 String or Data.
+// Send a UTF8 String or Data. The same as send:priority: with SRMessagePriorityNormal, so the
+// message is dropped without notice if it doesn't fit and overflowPolicy is SROverflowPolicyReject.
+// Callers that set a limit should use send:priority: and check what it returns.
 - (void)send:(id)data;
 
+// Returns NO, and drops the message, if maxBufferedAmount doesn't leave room for it.
+- (BOOL)send:(id)data priority:(SRMessagePriority)priority;
+
+// Send several messages, each in its own frame. The frames are queued together, so
+// small ones share writes to the socket instead of going out one at a time.
+// Returns NO, and sends none of them, if maxBufferedAmount doesn't leave room for them all.
+- (BOOL)sendMessages:(NSArray *)messages;
+
 // Send Data (can be nil) in a ping message.
 - (void)sendPing:(NSData *)data;
 
@@ -113,6 +224,21 @@ extern NSString *const SRHTTPResponseErrorKey;
 - (void)webSocket:(SRWebSocket *)webSocket didCloseWithCode:(NSInteger)code reason:(NSString *)reason wasClean:(BOOL)wasClean;
 - (void)webSocket:(SRWebSocket *)webSocket didReceivePong:(NSData *)pongPayload;
 
+// Called for each keepalive pong, whose payloads aren't passed to webSocket:didReceivePong:.
+// The socket's roundTripTime properties already include this sample.
+- (void)webSocket:(SRWebSocket *)webSocket didMeasureRoundTripTime:(NSTimeInterval)roundTripTime;
+
+// See highWaterMark. Callers that produce data faster than the network takes it should hold
+// off between these two.
+- (void)webSocket:(SRWebSocket *)webSocket bufferedAmountDidRiseAboveHighWaterMark:(uint64_t)bufferedAmount;
+- (void)webSocket:(SRWebSocket *)webSocket bufferedAmountDidFallToLowWaterMark:(uint64_t)bufferedAmount;
+
+// Used instead of webSocket:didReceiveMessage: when deliversMessageFragments is set.
+// fragment is an NSString for text messages (always whole code points) or NSData for binary ones.
+// Concatenating the fragments up to and including the one with isFinal set gives the message.
+// The final fragment may be empty.
+- (void)webSocket:(SRWebSocket *)webSocket didReceiveMessageFragment:(id)fragment isFinal:(BOOL)isFinal;
+
 @end
 
 #pragma mark - NSURLRequest (CertificateAdditions)
@@ -16,14 +16,11 @@
 
 
 #import "SRWebSocket.h"
-
-#if TARGET_OS_IPHONE
-#define HAS_ICU
-#endif
-
-#ifdef HAS_ICU
-#import <unicode/utf8.h>
-#endif
+#import "SRMask.h"
+#import "SRRingBuffer.h"
+#import "SRUTF8.h"
+#import "SRDeflate.h"
+#import "SRFrameDecoder.h"
 
 #if TARGET_OS_IPHONE
 #import <Endian.h>
@@ -33,6 +30,8 @@
 
 #import <CommonCrypto/CommonDigest.h>
 #import <Security/SecRandom.h>
+#import <mach/mach_time.h>
+#import <stdatomic.h>
 
 #if OS_OBJECT_USE_OBJC_RETAIN_RELEASE
 #define sr_dispatch_retain(x)
@@ -59,19 +58,8 @@ typedef enum  {
     // B-F reserved.
 } SROpCode;
 
-typedef struct {
-    BOOL fin;
-//  BOOL rsv1;
-//  BOOL rsv2;
-//  BOOL rsv3;
-    uint8_t opcode;
-    BOOL masked;
-    uint64_t payload_length;
-} frame_header;
-
 static NSString *const SRWebSocketAppendToSecKeyString = @"258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
-static inline int32_t validate_dispatch_data_partial_string(NSData *data);
 static inline void SRFastLog(NSString *format, ...);
 
 @interface NSData (SRWebSocket)
@@ -97,13 +85,6 @@ static inline void SRFastLog(NSString *format, ...);
 @end
 
 
-@interface _SRRunLoopThread : NSThread
-
-@property (nonatomic, readonly) NSRunLoop *runLoop;
-
-@end
-
-
 static NSString *newSHA1String(const char *bytes, size_t length) {
     uint8_t md[CC_SHA1_DIGEST_LENGTH];
 
@@ -151,18 +132,13 @@ typedef size_t (^stream_scanner)(NSData *collected_data);
 
 typedef void (^data_callback)(SRWebSocket *webSocket,  NSData *data);
 
+// Only the opening handshake is read through consumers; frames go through SRFrameDecoder.
 @interface SRIOConsumer : NSObject {
     stream_scanner _scanner;
     data_callback _handler;
-    size_t _bytesNeeded;
-    BOOL _readToCurrentFrame;
-    BOOL _unmaskBytes;
 }
 @property (nonatomic, copy, readonly) stream_scanner consumer;
 @property (nonatomic, copy, readonly) data_callback handler;
-@property (nonatomic, assign) size_t bytesNeeded;
-@property (nonatomic, assign, readonly) BOOL readToCurrentFrame;
-@property (nonatomic, assign, readonly) BOOL unmaskBytes;
 
 @end
 
@@ -171,12 +147,12 @@ typedef void (^data_callback)(SRWebSocket *webSocket,  NSData *data);
 
 - (id)initWithBufferCapacity:(NSUInteger)poolSize;
 
-- (SRIOConsumer *)consumerWithScanner:(stream_scanner)scanner handler:(data_callback)handler bytesNeeded:(size_t)bytesNeeded readToCurrentFrame:(BOOL)readToCurrentFrame unmaskBytes:(BOOL)unmaskBytes;
+- (SRIOConsumer *)consumerWithScanner:(stream_scanner)scanner handler:(data_callback)handler;
 - (void)returnConsumer:(SRIOConsumer *)consumer;
 
 @end
 
-@interface SRWebSocket ()  <NSStreamDelegate>
+@interface SRWebSocket ()
 
 @property (nonatomic) SRReadyState readyState;
 
@@ -201,21 +177,51 @@ typedef void (^data_callback)(SRWebSocket *webSocket,  NSData *data);
     dispatch_queue_t _workQueue;
     NSMutableArray *_consumers;
 
-    NSInputStream *_inputStream;
-    NSOutputStream *_outputStream;
+    id <SRIOConnection> _connection;
    
-    NSMutableData *_readBuffer;
-    NSUInteger _readBufferOffset;
+    SRRingBuffer _readBuffer;
  
-    NSMutableData *_outputBuffer;
-    NSUInteger _outputBufferOffset;
-
+    // Frames waiting to be written, in order. Payloads are referenced, not copied into one buffer.
+    NSMutableArray *_outputSegments;
+    NSUInteger _outputSegmentOffset;
+    size_t _outputBufferedAmount;
+    // Set while sendMessages: queues its frames, so they are written together afterwards.
+    BOOL _holdWrites;
+    // _outputBufferedAmount plus the payloads of sends still on their way to the work queue.
+    // Atomic, since send: reserves room on the caller's thread.
+    _Atomic(int64_t) _bufferedAmount;
+    // Set between the high and low water mark callbacks.
+    BOOL _aboveHighWaterMark;
+    
+    dispatch_source_t _keepaliveTimer;
+    // Sequence number for the next keepalive ping, which is also its payload. Starts at random.
+    uint64_t _keepaliveSequence;
+    // Send times of keepalive pings still waiting for their pong, by sequence number.
+    NSMutableDictionary *_keepalivePings;
+    // Written on the work queue from keepalive pongs; atomic so the getters can be read from any thread.
+    _Atomic(NSTimeInterval) _roundTripTime;
+    _Atomic(NSTimeInterval) _smoothedRoundTripTime;
+    _Atomic(NSTimeInterval) _roundTripTimeVariation;
+    _Atomic(NSUInteger) _missedPongCount;
+
+    // Set once the handshake is done and the read buffer holds frames.
+    BOOL _readingFrames;
+    SRFrameDecoder _frameDecoder;
+    // Control frames are at most 125 bytes, so their payload is gathered here.
+    uint8_t _controlFrameBytes[125];
+    size_t _controlFrameLength;
+    
     uint8_t _currentFrameOpcode;
-    size_t _currentFrameCount;
-    size_t _readOpCount;
-    uint32_t _currentStringScanPosition;
+    size_t _currentStringScanPosition;
+    SRUTF8State _currentUTF8State;
+    BOOL _currentMessageCompressed;
     NSMutableData *_currentFrameData;
     
+    // permessage-deflate contexts, set up once the server accepts the extension.
+    SRDeflater _deflater;
+    SRInflater _inflater;
+    NSMutableData *_deflateBuffer;
+    
     NSString *_closeReason;
     
     NSString *_secKey;
@@ -223,9 +229,6 @@ typedef void (^data_callback)(SRWebSocket *webSocket,  NSData *data);
     
     BOOL _pinnedCertFound;
     
-    uint8_t _currentReadMaskKey[4];
-    size_t _currentReadMaskOffset;
-
     BOOL _consumerStopped;
     
     BOOL _closeWhenFinishedWriting;
@@ -253,9 +256,23 @@ typedef void (^data_callback)(SRWebSocket *webSocket,  NSData *data);
 @synthesize url = _url;
 @synthesize readyState = _readyState;
 @synthesize protocol = _protocol;
+@synthesize readChunkSize = _readChunkSize;
+@synthesize deliversMessageFragments = _deliversMessageFragments;
+@synthesize perMessageDeflateOptions = _perMessageDeflateOptions;
+@synthesize perMessageDeflateEnabled = _perMessageDeflateEnabled;
+@synthesize ioBackend = _ioBackend;
+@synthesize networkAffinityKey = _networkAffinityKey;
+@synthesize maxBufferedAmount = _maxBufferedAmount;
+@synthesize overflowPolicy = _overflowPolicy;
+@synthesize highWaterMark = _highWaterMark;
+@synthesize lowWaterMark = _lowWaterMark;
+@synthesize keepaliveInterval = _keepaliveInterval;
+@synthesize maxMissedPongs = _maxMissedPongs;
 
 static __strong NSData *CRLFCRLF;
 
+static const NSUInteger SRDefaultReadChunkSize = 16384;
+
 + (void)initialize;
 {
     CRLFCRLF = [[NSData alloc] initWithBytes:"\r\n\r\n" length:4];
@@ -326,8 +343,12 @@ static __strong NSData *CRLFCRLF;
     _delegateDispatchQueue = dispatch_get_main_queue();
     sr_dispatch_retain(_delegateDispatchQueue);
     
-    _readBuffer = [[NSMutableData alloc] init];
-    _outputBuffer = [[NSMutableData alloc] init];
+    _readChunkSize = SRDefaultReadChunkSize;
+    SRRingBufferInit(&_readBuffer, _readChunkSize * 2);
+    _outputSegments = [[NSMutableArray alloc] init];
+    
+    _maxMissedPongs = 2;
+    _keepalivePings = [[NSMutableDictionary alloc] init];
     
     _currentFrameData = [[NSMutableData alloc] init];
 
@@ -337,8 +358,6 @@ static __strong NSData *CRLFCRLF;
     
     _scheduledRunloops = [[NSMutableSet alloc] init];
     
-    [self _initializeStreams];
-    
     // default handlers
 }
 
@@ -349,11 +368,10 @@ static __strong NSData *CRLFCRLF;
 
 - (void)dealloc
 {
-    _inputStream.delegate = nil;
-    _outputStream.delegate = nil;
-
-    [_inputStream close];
-    [_outputStream close];
+    _connection.eventHandler = nil;
+    [_connection close];
+    
+    [self _stopKeepalive];
     
     if (_workQueue) {
         sr_dispatch_release(_workQueue);
@@ -369,6 +387,15 @@ static __strong NSData *CRLFCRLF;
         sr_dispatch_release(_delegateDispatchQueue);
         _delegateDispatchQueue = NULL;
     }
+    
+    SRRingBufferFree(&_readBuffer);
+    SRDeflaterFree(&_deflater);
+    SRInflaterFree(&_inflater);
+}
+
+- (void)setReadChunkSize:(NSUInteger)readChunkSize;
+{
+    _readChunkSize = readChunkSize ?: SRDefaultReadChunkSize;
 }
 
 #ifndef NDEBUG
@@ -457,10 +484,17 @@ static __strong NSData *CRLFCRLF;
         _protocol = negotiatedProtocol;
     }
     
+    if (![self _negotiatePerMessageDeflate]) {
+        return;
+    }
+    
     self.readyState = SR_OPEN;
     
     if (!_didFail) {
-        [self _readFrameNew];
+        SRFrameDecoderInit(&_frameDecoder, false);
+        _frameDecoder.allowsCompression = _perMessageDeflateEnabled;
+        _readingFrames = YES;
+        [self _startKeepalive];
     }
 
     [self _performDelegateBlock:^{
@@ -470,6 +504,70 @@ static __strong NSData *CRLFCRLF;
     }];
 }
 
+// Checks the server's Sec-WebSocket-Extensions against our permessage-deflate offer and sets up
+// the compression contexts. Fails the connection and returns NO if the answer isn't acceptable.
+- (BOOL)_negotiatePerMessageDeflate;
+{
+    NSString *extensions = CFBridgingRelease(CFHTTPMessageCopyHeaderFieldValue(_receivedHTTPHeaders, CFSTR("Sec-WebSocket-Extensions")));
+    if (extensions.length == 0) {
+        return YES;
+    }
+    
+    NSCharacterSet *whitespace = [NSCharacterSet whitespaceCharacterSet];
+    NSCharacterSet *nonDigits = [[NSCharacterSet decimalDigitCharacterSet] invertedSet];
+    NSArray *parameters = [extensions componentsSeparatedByString:@";"];
+    NSString *failure = nil;
+    
+    int clientWindowBits = SRDeflateClampWindowBits((int)_perMessageDeflateOptions.clientMaxWindowBits);
+    int serverWindowBits = SRDeflateClampWindowBits((int)_perMessageDeflateOptions.serverMaxWindowBits);
+    BOOL clientNoContextTakeover = _perMessageDeflateOptions.clientNoContextTakeover;
+    BOOL serverNoContextTakeover = NO;
+    
+    if (!_perMessageDeflateOptions || [extensions rangeOfString:@","].location != NSNotFound || ![[parameters[0] stringByTrimmingCharactersInSet:whitespace] isEqualToString:@"permessage-deflate"]) {
+        failure = @"Server specified Sec-WebSocket-Extensions that weren't requested";
+    }
+    
+    NSMutableSet *seenNames = [[NSMutableSet alloc] init];
+    for (NSUInteger i = 1; i < parameters.count && !failure; i++) {
+        NSArray *pair = [parameters[i] componentsSeparatedByString:@"="];
+        NSString *name = [[pair[0] stringByTrimmingCharactersInSet:whitespace] lowercaseString];
+        NSString *value = pair.count > 1 ? [[pair[1] stringByTrimmingCharactersInSet:whitespace] stringByTrimmingCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"\""]] : nil;
+        BOOL validBits = value.length > 0 && value.length <= 2 && [value rangeOfCharacterFromSet:nonDigits].location == NSNotFound && value.intValue >= 8 && value.intValue <= SRDeflateMaxWindowBits;
+        
+        if (pair.count > 2 || [seenNames containsObject:name]) {
+            failure = @"Invalid permessage-deflate parameters";
+        } else if ([name isEqualToString:@"server_no_context_takeover"] && !value) {
+            serverNoContextTakeover = YES;
+        } else if ([name isEqualToString:@"client_no_context_takeover"] && !value) {
+            clientNoContextTakeover = YES;
+        } else if ([name isEqualToString:@"client_max_window_bits"] && validBits) {
+            if (value.intValue < SRDeflateMinWindowBits) {
+                failure = @"Server asked for a compression window smaller than 512 bytes";
+            }
+            clientWindowBits = MIN(clientWindowBits, value.intValue);
+        } else if (![name isEqualToString:@"server_max_window_bits"] || !validBits || value.intValue > serverWindowBits) {
+            // server_max_window_bits only limits the server's compressor, so it just has to be within our offer
+            failure = [NSString stringWithFormat:@"Invalid permessage-deflate parameter %@", parameters[i]];
+        }
+        [seenNames addObject:name];
+    }
+    
+    if (failure) {
+        [self _failWithError:[NSError errorWithDomain:SRWebSocketErrorDomain code:2133 userInfo:@{NSLocalizedDescriptionKey:failure}]];
+        return NO;
+    }
+    
+    // The inflater always gets the largest window. It can read anything compressed with a smaller
+    // one, so a server that leaves server_max_window_bits out or picks its own can't trip it up.
+    if (!SRDeflaterInit(&_deflater, clientWindowBits, (int)_perMessageDeflateOptions.memoryLevel, clientNoContextTakeover) || !SRInflaterInit(&_inflater, SRDeflateMaxWindowBits, serverNoContextTakeover)) {
+        [self _failWithError:[NSError errorWithDomain:SRWebSocketErrorDomain code:2147 userInfo:@{NSLocalizedDescriptionKey:@"Could not set up permessage-deflate"}]];
+        return NO;
+    }
+    
+    _deflateBuffer = [[NSMutableData alloc] init];
+    _perMessageDeflateEnabled = YES;
+    return YES;
+}
 
 - (void)_readHTTPHeader;
 {
@@ -546,6 +644,24 @@ static __strong NSData *CRLFCRLF;
     if (_requestedProtocols) {
         CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Sec-WebSocket-Protocol"), (__bridge CFStringRef)[_requestedProtocols componentsJoinedByString:@", "]);
     }
+    
+    if (_perMessageDeflateOptions) {
+        // client_max_window_bits is always offered so the server may pick a smaller window for us.
+        NSInteger clientWindowBits = SRDeflateClampWindowBits((int)_perMessageDeflateOptions.clientMaxWindowBits);
+        NSInteger serverWindowBits = SRDeflateClampWindowBits((int)_perMessageDeflateOptions.serverMaxWindowBits);
+        NSMutableArray *offer = [NSMutableArray arrayWithObject:@"permessage-deflate"];
+        [offer addObject:clientWindowBits < SRDeflateMaxWindowBits ? [NSString stringWithFormat:@"client_max_window_bits=%ld", (long)clientWindowBits] : @"client_max_window_bits"];
+        if (serverWindowBits < SRDeflateMaxWindowBits) {
+            [offer addObject:[NSString stringWithFormat:@"server_max_window_bits=%ld", (long)serverWindowBits]];
+        }
+        if (_perMessageDeflateOptions.clientNoContextTakeover) {
+            [offer addObject:@"client_no_context_takeover"];
+        }
+        if (_perMessageDeflateOptions.serverNoContextTakeover) {
+            [offer addObject:@"server_no_context_takeover"];
+        }
+        CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Sec-WebSocket-Extensions"), (__bridge CFStringRef)[offer componentsJoinedByString:@"; "]);
+    }
 
     [_urlRequest.allHTTPHeaderFields enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
         CFHTTPMessageSetHeaderFieldValue(request, (__bridge CFStringRef)key, (__bridge CFStringRef)obj);
@@ -559,7 +675,7 @@ static __strong NSData *CRLFCRLF;
     [self _readHTTPHeader];
 }
 
-- (void)_initializeStreams;
+- (id <SRIOConnection>)_makeConnection;
 {
     assert(_url.port.unsignedIntValue <= UINT32_MAX);
     uint32_t port = _url.port.unsignedIntValue;
@@ -572,25 +688,24 @@ static __strong NSData *CRLFCRLF;
     }
     NSString *host = _url.host;
     
-    CFReadStreamRef readStream = NULL;
-    CFWriteStreamRef writeStream = NULL;
-    
-    CFStreamCreatePairWithSocketToHost(NULL, (__bridge CFStringRef)host, port, &readStream, &writeStream);
-    
-    _outputStream = CFBridgingRelease(writeStream);
-    _inputStream = CFBridgingRelease(readStream);
+    // Run loops picked by the caller take precedence over the backend's own threads.
+    if (_scheduledRunloops.count) {
+        SRStreamConnection *connection = [[SRStreamConnection alloc] initWithHost:host port:port workQueue:_workQueue];
+        for (NSArray *runLoop in _scheduledRunloops) {
+            [connection scheduleInRunLoop:[runLoop objectAtIndex:0] forMode:[runLoop objectAtIndex:1]];
+        }
+        return connection;
+    }
     
-    _inputStream.delegate = self;
-    _outputStream.delegate = self;
+    id <SRIOBackend> backend = _ioBackend ?: [SRRunLoopBackend sharedBackend];
+    return [backend connectionToHost:host port:port affinityKey:_networkAffinityKey workQueue:_workQueue];
 }
 
-- (void)_updateSecureStreamOptions;
+- (NSDictionary *)_secureConnectionSettings;
 {
     if (_secure) {
         NSMutableDictionary *SSLOptions = [[NSMutableDictionary alloc] init];
         
-        [_outputStream setProperty:(__bridge id)kCFStreamSocketSecurityLevelNegotiatedSSL forKey:(__bridge id)kCFStreamPropertySocketSecurityLevel];
-        
         // If we're using pinned certs, don't validate the certificate chain
         if ([_urlRequest SR_SSLPinnedCertificates].count) {
             [SSLOptions setValue:@NO forKey:(__bridge id)kCFStreamSSLValidatesCertificateChain];
@@ -605,36 +720,40 @@ static __strong NSData *CRLFCRLF;
             SRFastLog(@"Allowing connection to any root cert");
         }
         
-        [_outputStream setProperty:SSLOptions
-                            forKey:(__bridge id)kCFStreamPropertySSLSettings];
+        return SSLOptions;
     }
+    return nil;
 }
 
 - (void)openConnection;
 {
-    [self _updateSecureStreamOptions];
-    
-    if (!_scheduledRunloops.count) {
-        [self scheduleInRunLoop:[NSRunLoop SR_networkRunLoop] forMode:NSDefaultRunLoopMode];
-    }
+    _connection = [self _makeConnection];
+    _connection.SSLSettings = [self _secureConnectionSettings];
     
+    __weak SRWebSocket *weakSelf = self;
+    _connection.eventHandler = ^(SRIOEvent event, NSError *error) {
+        [weakSelf _handleIOEvent:event error:error];
+    };
     
-    [_outputStream open];
-    [_inputStream open];
+    dispatch_async(_workQueue, ^{
+        [_connection open];
+    });
 }
 
 - (void)scheduleInRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode;
 {
-    [_outputStream scheduleInRunLoop:aRunLoop forMode:mode];
-    [_inputStream scheduleInRunLoop:aRunLoop forMode:mode];
+    if ([_connection isKindOfClass:[SRStreamConnection class]]) {
+        [(SRStreamConnection *)_connection scheduleInRunLoop:aRunLoop forMode:mode];
+    }
     
     [_scheduledRunloops addObject:@[aRunLoop, mode]];
 }
 
 - (void)unscheduleFromRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode;
 {
-    [_outputStream removeFromRunLoop:aRunLoop forMode:mode];
-    [_inputStream removeFromRunLoop:aRunLoop forMode:mode];
+    if ([_connection isKindOfClass:[SRStreamConnection class]]) {
+        [(SRStreamConnection *)_connection removeFromRunLoop:aRunLoop forMode:mode];
+    }
     
     [_scheduledRunloops removeObject:@[aRunLoop, mode]];
 }
@@ -729,26 +848,179 @@ static __strong NSData *CRLFCRLF;
     if (_closeWhenFinishedWriting) {
             return;
     }
-    [_outputBuffer appendData:data];
-    [self _pumpWriting];
+    [self _enqueueOutputSegment:data];
+    if (!_holdWrites) {
+        [self _pumpWriting];
+    }
+}
+
+- (void)_writeHeader:(NSData *)header payload:(NSData *)payload;
+{
+    [self assertOnWorkQueue];
+    
+    if (_closeWhenFinishedWriting) {
+        return;
+    }
+    [self _enqueueOutputSegment:header];
+    [self _enqueueOutputSegment:payload];
+    if (!_holdWrites) {
+        [self _pumpWriting];
+    }
+}
+
+- (void)_enqueueOutputSegment:(NSData *)segment;
+{
+    if (segment.length == 0) {
+        return;
+    }
+    [_outputSegments addObject:segment];
+    _outputBufferedAmount += segment.length;
+    atomic_fetch_add(&_bufferedAmount, (int64_t)segment.length);
+}
+
+- (uint64_t)bufferedAmount;
+{
+    return (uint64_t)atomic_load(&_bufferedAmount);
+}
+
+- (NSTimeInterval)roundTripTime;
+{
+    return atomic_load(&_roundTripTime);
+}
+
+- (NSTimeInterval)smoothedRoundTripTime;
+{
+    return atomic_load(&_smoothedRoundTripTime);
+}
+
+- (NSTimeInterval)roundTripTimeVariation;
+{
+    return atomic_load(&_roundTripTimeVariation);
+}
+
+- (NSUInteger)missedPongCount;
+{
+    return atomic_load(&_missedPongCount);
+}
+
+static uint64_t SRMessageLength(id message)
+{
+    if ([message isKindOfClass:[NSString class]]) {
+        return [(NSString *)message lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    }
+    return [(NSData *)message length];
+}
+
+// Adds length to _bufferedAmount unless that would go past maxBufferedAmount and the policy
+// refuses the message. The caller gives it back with _releaseBufferedAmount: once the message
+// is queued, when it is counted again as output segments.
+- (BOOL)_reserveBufferedAmount:(uint64_t)length priority:(SRMessagePriority)priority;
+{
+    uint64_t limit = self.maxBufferedAmount;
+    BOOL bounded = limit > 0 && (priority == SRMessagePriorityLow || self.overflowPolicy == SROverflowPolicyReject);
+    
+    int64_t current = atomic_load(&_bufferedAmount);
+    do {
+        if (bounded && (uint64_t)current + length > limit) {
+            return NO;
+        }
+        // A failed exchange reloads current, so the limit is checked again against the new value
+    } while (!atomic_compare_exchange_weak(&_bufferedAmount, &current, current + (int64_t)length));
+    return YES;
+}
+
+- (void)_releaseBufferedAmount:(uint64_t)length;
+{
+    atomic_fetch_sub(&_bufferedAmount, (int64_t)length);
+}
+
+- (void)_checkWaterMarks;
+{
+    [self assertOnWorkQueue];
+    
+    uint64_t high = self.highWaterMark;
+    if (high == 0) {
+        return;
+    }
+    uint64_t amount = self.bufferedAmount;
+    
+    if (!_aboveHighWaterMark && amount > high) {
+        _aboveHighWaterMark = YES;
+        [self _performDelegateBlock:^{
+            if ([self.delegate respondsToSelector:@selector(webSocket:bufferedAmountDidRiseAboveHighWaterMark:)]) {
+                [self.delegate webSocket:self bufferedAmountDidRiseAboveHighWaterMark:amount];
+            }
+        }];
+    } else if (_aboveHighWaterMark && amount <= self.lowWaterMark) {
+        _aboveHighWaterMark = NO;
+        [self _performDelegateBlock:^{
+            if ([self.delegate respondsToSelector:@selector(webSocket:bufferedAmountDidFallToLowWaterMark:)]) {
+                [self.delegate webSocket:self bufferedAmountDidFallToLowWaterMark:amount];
+            }
+        }];
+    }
+}
+
+- (void)_sendMessage:(id)data;
+{
+    if ([data isKindOfClass:[NSString class]]) {
+        [self _sendFrameWithOpcode:SROpCodeTextFrame data:[(NSString *)data dataUsingEncoding:NSUTF8StringEncoding]];
+    } else if ([data isKindOfClass:[NSData class]]) {
+        [self _sendFrameWithOpcode:SROpCodeBinaryFrame data:data];
+    } else if (data == nil) {
+        [self _sendFrameWithOpcode:SROpCodeTextFrame data:data];
+    } else {
+        assert(NO);
+    }
 }
 
 - (void)send:(id)data;
+{
+    [self send:data priority:SRMessagePriorityNormal];
+}
+
+- (BOOL)send:(id)data priority:(SRMessagePriority)priority;
 {
     NSAssert(self.readyState != SR_CONNECTING, @"Invalid State: Cannot call send: until connection is open");
     // TODO: maybe not copy this for performance
     data = [data copy];
+    uint64_t length = SRMessageLength(data);
+    if (![self _reserveBufferedAmount:length priority:priority]) {
+        return NO;
+    }
     dispatch_async(_workQueue, ^{
-        if ([data isKindOfClass:[NSString class]]) {
-            [self _sendFrameWithOpcode:SROpCodeTextFrame data:[(NSString *)data dataUsingEncoding:NSUTF8StringEncoding]];
-        } else if ([data isKindOfClass:[NSData class]]) {
-            [self _sendFrameWithOpcode:SROpCodeBinaryFrame data:data];
-        } else if (data == nil) {
-            [self _sendFrameWithOpcode:SROpCodeTextFrame data:data];
-        } else {
-            assert(NO);
+        // Writes wait until the reservation is given back, so the water marks never see the
+        // message counted twice.
+        _holdWrites = YES;
+        [self _sendMessage:data];
+        _holdWrites = NO;
+        [self _releaseBufferedAmount:length];
+        [self _pumpWriting];
+    });
+    return YES;
+}
+
+- (BOOL)sendMessages:(NSArray *)messages;
+{
+    NSAssert(self.readyState != SR_CONNECTING, @"Invalid State: Cannot call send: until connection is open");
+    messages = [[NSArray alloc] initWithArray:messages copyItems:YES];
+    uint64_t length = 0;
+    for (id data in messages) {
+        length += SRMessageLength(data);
+    }
+    if (![self _reserveBufferedAmount:length priority:SRMessagePriorityNormal]) {
+        return NO;
+    }
+    dispatch_async(_workQueue, ^{
+        _holdWrites = YES;
+        for (id data in messages) {
+            [self _sendMessage:data];
         }
+        _holdWrites = NO;
+        [self _releaseBufferedAmount:length];
+        [self _pumpWriting];
     });
+    return YES;
 }
 
 - (void)sendPing:(NSData *)data;
@@ -774,6 +1046,9 @@ static __strong NSData *CRLFCRLF;
 - (void)handlePong:(NSData *)pongData;
 {
     SRFastLog(@"Received pong");
+    if ([self _handleKeepalivePong:pongData]) {
+        return;
+    }
     [self _performDelegateBlock:^{
         if ([self.delegate respondsToSelector:@selector(webSocket:didReceivePong:)]) {
             [self.delegate webSocket:self didReceivePong:pongData];
@@ -781,6 +1056,126 @@ static __strong NSData *CRLFCRLF;
     }];
 }
 
+#pragma mark - Keepalive
+
+// Pings older than this many intervals are forgotten, so their pongs are treated as anyone's.
+static const uint64_t SRKeepalivePingWindow = 16;
+
+static NSTimeInterval SRMonotonicTime(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (NSTimeInterval)mach_absolute_time() * timebase.numer / timebase.denom / NSEC_PER_SEC;
+}
+
+- (void)_startKeepalive;
+{
+    [self assertOnWorkQueue];
+    if (_keepaliveInterval <= 0 || _keepaliveTimer) {
+        return;
+    }
+    
+    // Random, so our pings are unlikely to share payloads with the delegate's, but well clear of
+    // wrapping around.
+    uint32_t base = 0;
+    SecRandomCopyBytes(kSecRandomDefault, sizeof(base), (uint8_t *)&base);
+    _keepaliveSequence = (uint64_t)base << 16;
+    
+    _keepaliveTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _workQueue);
+    uint64_t interval = (uint64_t)(_keepaliveInterval * NSEC_PER_SEC);
+    dispatch_source_set_timer(_keepaliveTimer, dispatch_time(DISPATCH_TIME_NOW, interval), interval, interval / 10);
+    __weak SRWebSocket *weakSelf = self;
+    dispatch_source_set_event_handler(_keepaliveTimer, ^{
+        [weakSelf _sendKeepalivePing];
+    });
+    dispatch_resume(_keepaliveTimer);
+}
+
+- (void)_stopKeepalive;
+{
+    if (_keepaliveTimer) {
+        dispatch_source_cancel(_keepaliveTimer);
+        sr_dispatch_release(_keepaliveTimer);
+        _keepaliveTimer = NULL;
+    }
+    [_keepalivePings removeAllObjects];
+}
+
+- (void)_sendKeepalivePing;
+{
+    [self assertOnWorkQueue];
+    if (self.readyState != SR_OPEN) {
+        [self _stopKeepalive];
+        return;
+    }
+    
+    if ([_keepalivePings objectForKey:@(_keepaliveSequence - 1)]) {
+        NSUInteger missed = atomic_fetch_add(&_missedPongCount, 1) + 1;
+        SRFastLog(@"Missed %lu keepalive pongs", (unsigned long)missed);
+        if (_maxMissedPongs > 0 && missed >= _maxMissedPongs) {
+            [self _stopKeepalive];
+            [self _failWithError:[NSError errorWithDomain:SRWebSocketErrorDomain code:2148 userInfo:@{NSLocalizedDescriptionKey:[NSString stringWithFormat:@"No pong for %lu keepalive pings", (unsigned long)missed]}]];
+            return;
+        }
+    }
+    
+    uint64_t sequence = _keepaliveSequence++;
+    [_keepalivePings removeObjectForKey:@(sequence - SRKeepalivePingWindow)];
+    [_keepalivePings setObject:@(SRMonotonicTime()) forKey:@(sequence)];
+    
+    uint64_t payload = EndianU64_NtoB(sequence);
+    [self _sendFrameWithOpcode:SROpCodePing data:[NSData dataWithBytes:&payload length:sizeof(payload)]];
+}
+
+// Returns NO for pongs that don't answer one of our keepalive pings.
+- (BOOL)_handleKeepalivePong:(NSData *)pongData;
+{
+    [self assertOnWorkQueue];
+    if (pongData.length != sizeof(uint64_t)) {
+        return NO;
+    }
+    uint64_t payload;
+    memcpy(&payload, pongData.bytes, sizeof(payload));
+    uint64_t sequence = EndianU64_BtoN(payload);
+    NSNumber *sentAt = [_keepalivePings objectForKey:@(sequence)];
+    if (!sentAt) {
+        return NO;
+    }
+    
+    // A server need only answer the latest ping it has seen (RFC 6455 5.5.3), so this pong
+    // answers every ping before it too.
+    for (NSNumber *key in [_keepalivePings allKeys]) {
+        if (key.unsignedLongLongValue <= sequence) {
+            [_keepalivePings removeObjectForKey:key];
+        }
+    }
+    atomic_store(&_missedPongCount, 0);
+    
+    // Only this queue writes them, so the loads here see the last values stored.
+    NSTimeInterval sample = SRMonotonicTime() - sentAt.doubleValue;
+    NSTimeInterval smoothed = atomic_load(&_smoothedRoundTripTime);
+    NSTimeInterval variation = atomic_load(&_roundTripTimeVariation);
+    if (smoothed == 0) {
+        smoothed = sample;
+        variation = sample / 2;
+    } else {
+        variation = 0.75 * variation + 0.25 * fabs(smoothed - sample);
+        smoothed = 0.875 * smoothed + 0.125 * sample;
+    }
+    atomic_store(&_roundTripTime, sample);
+    atomic_store(&_smoothedRoundTripTime, smoothed);
+    atomic_store(&_roundTripTimeVariation, variation);
+    
+    [self _performDelegateBlock:^{
+        if ([self.delegate respondsToSelector:@selector(webSocket:didMeasureRoundTripTime:)]) {
+            [self.delegate webSocket:self didMeasureRoundTripTime:sample];
+        }
+    }];
+    return YES;
+}
+
 - (void)_handleMessage:(id)message
 {
     SRFastLog(@"Received message");
@@ -789,6 +1184,43 @@ static __strong NSData *CRLFCRLF;
     }];
 }
 
+// Hands everything buffered for the current message to the delegate and drops it from _currentFrameData.
+// Text holds back a trailing partial UTF-8 sequence until the rest of it arrives with the next chunk.
+- (void)_deliverMessageFragmentIsFinal:(BOOL)isFinal;
+{
+    BOOL isText = _currentFrameOpcode == SROpCodeTextFrame;
+    NSUInteger deliverableSize = isText ? _currentStringScanPosition : _currentFrameData.length;
+    
+    if (isFinal && isText && _currentUTF8State != SRUTF8Accept) {
+        // A text message can't end in the middle of a code point.
+        [self closeWithCode:SRStatusCodeInvalidUTF8 reason:@"Text frames must be valid UTF-8"];
+        dispatch_async(_workQueue, ^{
+            [self closeConnection];
+        });
+        return;
+    }
+    
+    if (deliverableSize == 0 && !isFinal) {
+        return;
+    }
+    
+    NSData *fragmentData = [_currentFrameData subdataWithRange:NSMakeRange(0, deliverableSize)];
+    [_currentFrameData replaceBytesInRange:NSMakeRange(0, deliverableSize) withBytes:NULL length:0];
+    
+    id fragment = fragmentData;
+    if (isText) {
+        _currentStringScanPosition -= deliverableSize;
+        fragment = [[NSString alloc] initWithData:fragmentData encoding:NSUTF8StringEncoding];
+    }
+    
+    SRFastLog(@"Received message fragment");
+    [self _performDelegateBlock:^{
+        if ([self.delegate respondsToSelector:@selector(webSocket:didReceiveMessageFragment:isFinal:)]) {
+            [self.delegate webSocket:self didReceiveMessageFragment:fragment isFinal:isFinal];
+        }
+    }];
+}
+
 
 static inline BOOL closeCodeIsValid(int closeCode) {
     if (closeCode < 1000) {
@@ -867,6 +1299,7 @@ static inline BOOL closeCodeIsValid(int closeCode) {
 {
     [self assertOnWorkQueue];
     SRFastLog(@"Trying to disconnect");
+    [self _stopKeepalive];
     _closeWhenFinishedWriting = YES;
     [self _pumpWriting];
 }
@@ -875,17 +1308,17 @@ static inline BOOL closeCodeIsValid(int closeCode) {
 {                
     // Check that the current data is valid UTF8
     
-    BOOL isControlFrame = (opcode == SROpCodePing || opcode == SROpCodePong || opcode == SROpCodeConnectionClose);
-    if (!isControlFrame) {
-        [self _readFrameNew];
-    } else {
-        dispatch_async(_workQueue, ^{
-            [self _readFrameContinue];
-        });
+    BOOL isControlFrame = SRFrameOpcodeIsControl(opcode);
+    if (!isControlFrame && _currentMessageCompressed && ![self _finishInflatingMessage]) {
+        return;
     }
     
     switch (opcode) {
         case SROpCodeTextFrame: {
+            if (_deliversMessageFragments) {
+                [self _deliverMessageFragmentIsFinal:YES];
+                break;
+            }
             NSString *str = [[NSString alloc] initWithData:frameData encoding:NSUTF8StringEncoding];
             if (str == nil && frameData) {
                 [self closeWithCode:SRStatusCodeInvalidUTF8 reason:@"Text frames must be valid UTF-8"];
@@ -899,6 +1332,10 @@ static inline BOOL closeCodeIsValid(int closeCode) {
             break;
         }
         case SROpCodeBinaryFrame:
+            if (_deliversMessageFragments) {
+                [self _deliverMessageFragmentIsFinal:YES];
+                break;
+            }
             [self _handleMessage:[frameData copy]];
             break;
         case SROpCodeConnectionClose:
@@ -917,61 +1354,6 @@ static inline BOOL closeCodeIsValid(int closeCode) {
     }
 }
 
-- (void)_handleFrameHeader:(frame_header)frame_header curData:(NSData *)curData;
-{
-    assert(frame_header.opcode != 0);
-    
-    if (self.readyState != SR_OPEN) {
-        return;
-    }
-    
-    
-    BOOL isControlFrame = (frame_header.opcode == SROpCodePing || frame_header.opcode == SROpCodePong || frame_header.opcode == SROpCodeConnectionClose);
-    
-    if (isControlFrame && !frame_header.fin) {
-        [self _closeWithProtocolError:@"Fragmented control frames not allowed"];
-        return;
-    }
-    
-    if (isControlFrame && frame_header.payload_length >= 126) {
-        [self _closeWithProtocolError:@"Control frames cannot have payloads larger than 126 bytes"];
-        return;
-    }
-    
-    if (!isControlFrame) {
-        _currentFrameOpcode = frame_header.opcode;
-        _currentFrameCount += 1;
-    }
-    
-    if (frame_header.payload_length == 0) {
-        if (isControlFrame) {
-            [self _handleFrameWithData:curData opCode:frame_header.opcode];
-        } else {
-            if (frame_header.fin) {
-                [self _handleFrameWithData:_currentFrameData opCode:frame_header.opcode];
-            } else {
-                // TODO add assert that opcode is not a control;
-                [self _readFrameContinue];
-            }
-        }
-    } else {
-        assert(frame_header.payload_length <= SIZE_T_MAX);
-        [self _addConsumerWithDataLength:(size_t)frame_header.payload_length callback:^(SRWebSocket *self, NSData *newData) {
-            if (isControlFrame) {
-                [self _handleFrameWithData:newData opCode:frame_header.opcode];
-            } else {
-                if (frame_header.fin) {
-                    [self _handleFrameWithData:self->_currentFrameData opCode:frame_header.opcode];
-                } else {
-                    // TODO add assert that opcode is not a control;
-                    [self _readFrameContinue];
-                }
-                
-            }
-        } readToCurrentFrame:!isControlFrame unmaskBytes:frame_header.masked];
-    }
-}
-
 /* From RFC:
 
  0                   1                   2                   3
@@ -995,144 +1377,196 @@ static inline BOOL closeCodeIsValid(int closeCode) {
  */
 
 static const uint8_t SRFinMask          = 0x80;
-static const uint8_t SROpCodeMask       = 0x0F;
-static const uint8_t SRRsvMask          = 0x70;
+static const uint8_t SRRsv1Mask         = 0x40;
 static const uint8_t SRMaskMask         = 0x80;
-static const uint8_t SRPayloadLenMask   = 0x7F;
 
 
-- (void)_readFrameContinue;
+// Sets up for the first frame of a data message. Control frames in between leave this alone.
+- (void)_handleFrameHeader:(const SRFrameHeader *)header;
 {
-    assert((_currentFrameCount == 0 && _currentFrameOpcode == 0) || (_currentFrameCount > 0 && _currentFrameOpcode > 0));
+    if (SRFrameOpcodeIsControl(header->opcode)) {
+        _controlFrameLength = 0;
+        return;
+    }
+    
+    if (header->opcode != 0) {
+        [_currentFrameData setLength:0];
+        _currentFrameOpcode = header->opcode;
+        _currentStringScanPosition = 0;
+        _currentUTF8State = SRUTF8Accept;
+        _currentMessageCompressed = header->compressed;
+    }
+}
 
-    [self _addConsumerWithDataLength:2 callback:^(SRWebSocket *self, NSData *data) {
-        __block frame_header header = {0};
-        
-        const uint8_t *headerBuffer = data.bytes;
-        assert(data.length >= 2);
-        
-        if (headerBuffer[0] & SRRsvMask) {
-            [self _closeWithProtocolError:@"Server used RSV bits"];
-            return;
-        }
-        
-        uint8_t receivedOpcode = (SROpCodeMask & headerBuffer[0]);
-        
-        BOOL isControlFrame = (receivedOpcode == SROpCodePing || receivedOpcode == SROpCodePong || receivedOpcode == SROpCodeConnectionClose);
-        
-        if (!isControlFrame && receivedOpcode != 0 && self->_currentFrameCount > 0) {
-            [self _closeWithProtocolError:@"all data frames after the initial data frame must have opcode 0"];
-            return;
-        }
-        
-        if (receivedOpcode == 0 && self->_currentFrameCount == 0) {
-            [self _closeWithProtocolError:@"cannot continue a message"];
-            return;
+// Returns NO if the payload closed the connection.
+- (BOOL)_handleFramePayload:(const uint8_t *)bytes length:(size_t)length;
+{
+    if (SRFrameOpcodeIsControl(_frameDecoder.header.opcode)) {
+        memcpy(_controlFrameBytes + _controlFrameLength, bytes, length);
+        _controlFrameLength += length;
+        return YES;
+    }
+    
+    NSUInteger frameOffset = _currentFrameData.length;
+    if (_currentMessageCompressed) {
+        if (![self _inflateBytes:bytes length:length]) {
+            return NO;
         }
-        
-        header.opcode = receivedOpcode == 0 ? self->_currentFrameOpcode : receivedOpcode;
-        
-        header.fin = !!(SRFinMask & headerBuffer[0]);
-        
-        
-        header.masked = !!(SRMaskMask & headerBuffer[1]);
-        header.payload_length = SRPayloadLenMask & headerBuffer[1];
-        
-        headerBuffer = NULL;
-        
-        if (header.masked) {
-            [self _closeWithProtocolError:@"Client must receive unmasked data"];
+    } else {
+        [_currentFrameData appendBytes:bytes length:length];
+    }
+    
+    if (_currentFrameOpcode == SROpCodeTextFrame && ![self _validateTextFromOffset:frameOffset]) {
+        return NO;
+    }
+    
+    // The chunk that completes a frame is delivered at the end of the frame, which knows if it's the last one.
+    if (_deliversMessageFragments && _frameDecoder.payloadRemaining > 0) {
+        [self _deliverMessageFragmentIsFinal:NO];
+    }
+    return YES;
+}
+
+- (void)_handleFrameEnd;
+{
+    const SRFrameHeader *header = &_frameDecoder.header;
+    
+    if (SRFrameOpcodeIsControl(header->opcode)) {
+        [self _handleFrameWithData:[NSData dataWithBytes:_controlFrameBytes length:_controlFrameLength] opCode:header->opcode];
+        return;
+    }
+    
+    if (!header->fin) {
+        if (_deliversMessageFragments) {
+            [self _deliverMessageFragmentIsFinal:NO];
         }
-        
-        size_t extra_bytes_needed = header.masked ? sizeof(_currentReadMaskKey) : 0;
-        
-        if (header.payload_length == 126) {
-            extra_bytes_needed += sizeof(uint16_t);
-        } else if (header.payload_length == 127) {
-            extra_bytes_needed += sizeof(uint64_t);
+        return;
+    }
+    
+    [self _handleFrameWithData:_currentFrameData opCode:_currentFrameOpcode];
+    [_currentFrameData setLength:0];
+}
+
+// Runs the frame decoder over the front of the read buffer up to its next event.
+// Returns true if did work
+- (BOOL)_pumpFrameDecoder;
+{
+    uint8_t *bytes = NULL;
+    size_t length = SRRingBufferReadableBytes(&_readBuffer, (const uint8_t **)&bytes);
+    
+    size_t consumed = 0;
+    uint8_t *payload = NULL;
+    size_t payloadLength = 0;
+    SRFrameEvent event = SRFrameDecoderDecode(&_frameDecoder, bytes, length, &consumed, &payload, &payloadLength);
+    
+    switch (event) {
+        case SRFrameEventNone:
+            // A header split across the end of the ring has been taken in; the rest is at the front.
+            SRRingBufferConsume(&_readBuffer, consumed);
+            return consumed > 0;
+            
+        case SRFrameEventHeader:
+            SRRingBufferConsume(&_readBuffer, consumed);
+            [self _handleFrameHeader:&_frameDecoder.header];
+            return YES;
+            
+        case SRFrameEventPayload: {
+            // The payload is read in place, so it's only dropped from the buffer afterwards.
+            BOOL handled = [self _handleFramePayload:payload length:payloadLength];
+            SRRingBufferConsume(&_readBuffer, consumed);
+            return handled;
         }
+            
+        case SRFrameEventFrameEnd:
+            [self _handleFrameEnd];
+            return YES;
+            
+        case SRFrameEventError:
+            _readingFrames = NO;
+            [self _closeWithProtocolError:@(SRFrameErrorDescription(_frameDecoder.error))];
+            return NO;
+    }
+    return NO;
+}
+
+// Small segments are gathered into a single write of up to this size, so a burst
+// of small messages doesn't cost one stream write (and one TLS record) each.
+static const size_t SRGatherWriteSize = 16384;
+
+// Copies queued bytes, starting at the unwritten part of the first segment, into buffer.
+- (size_t)_gatherOutputSegmentsIntoBuffer:(uint8_t *)buffer capacity:(size_t)capacity;
+{
+    size_t gathered = 0;
+    NSUInteger offset = _outputSegmentOffset;
+    for (NSData *segment in _outputSegments) {
+        size_t length = MIN(segment.length - offset, capacity - gathered);
+        memcpy(buffer + gathered, (const uint8_t *)segment.bytes + offset, length);
+        gathered += length;
+        offset = 0;
         
-        if (extra_bytes_needed == 0) {
-            [self _handleFrameHeader:header curData:self->_currentFrameData];
-        } else {
-            [self _addConsumerWithDataLength:extra_bytes_needed callback:^(SRWebSocket *self, NSData *data) {
-                size_t mapped_size = data.length;
-                #pragma unused (mapped_size)
-                const void *mapped_buffer = data.bytes;
-                size_t offset = 0;
-                
-                if (header.payload_length == 126) {
-                    assert(mapped_size >= sizeof(uint16_t));
-                    uint16_t newLen = EndianU16_BtoN(*(uint16_t *)(mapped_buffer));
-                    header.payload_length = newLen;
-                    offset += sizeof(uint16_t);
-                } else if (header.payload_length == 127) {
-                    assert(mapped_size >= sizeof(uint64_t));
-                    header.payload_length = EndianU64_BtoN(*(uint64_t *)(mapped_buffer));
-                    offset += sizeof(uint64_t);
-                } else {
-                    assert(header.payload_length < 126 && header.payload_length >= 0);
-                }
-                
-                if (header.masked) {
-                    assert(mapped_size >= sizeof(_currentReadMaskOffset) + offset);
-                    memcpy(self->_currentReadMaskKey, ((uint8_t *)mapped_buffer) + offset, sizeof(self->_currentReadMaskKey));
-                }
-                
-                [self _handleFrameHeader:header curData:self->_currentFrameData];
-            } readToCurrentFrame:NO unmaskBytes:NO];
+        if (gathered == capacity) {
+            break;
         }
-    } readToCurrentFrame:NO unmaskBytes:NO];
+    }
+    return gathered;
 }
 
-- (void)_readFrameNew;
+- (void)_consumeOutputBytes:(size_t)length;
 {
-    dispatch_async(_workQueue, ^{
-        [_currentFrameData setLength:0];
-        
-        _currentFrameOpcode = 0;
-        _currentFrameCount = 0;
-        _readOpCount = 0;
-        _currentStringScanPosition = 0;
-        
-        [self _readFrameContinue];
-    });
+    assert(length <= _outputBufferedAmount);
+    _outputBufferedAmount -= length;
+    atomic_fetch_sub(&_bufferedAmount, (int64_t)length);
+    
+    while (length > 0) {
+        NSData *segment = [_outputSegments objectAtIndex:0];
+        size_t remaining = segment.length - _outputSegmentOffset;
+        if (length < remaining) {
+            _outputSegmentOffset += length;
+            break;
+        }
+        length -= remaining;
+        _outputSegmentOffset = 0;
+        [_outputSegments removeObjectAtIndex:0];
+    }
 }
 
 - (void)_pumpWriting;
 {
     [self assertOnWorkQueue];
     
-    NSUInteger dataLength = _outputBuffer.length;
-    if (dataLength - _outputBufferOffset > 0 && _outputStream.hasSpaceAvailable) {
-        NSInteger bytesWritten = [_outputStream write:_outputBuffer.bytes + _outputBufferOffset maxLength:dataLength - _outputBufferOffset];
+    while (_outputBufferedAmount > 0 && _connection.hasSpaceAvailable) {
+        NSData *segment = [_outputSegments objectAtIndex:0];
+        const uint8_t *bytes = (const uint8_t *)segment.bytes + _outputSegmentOffset;
+        size_t length = segment.length - _outputSegmentOffset;
+        
+        uint8_t gatherBuffer[SRGatherWriteSize];
+        if (length < SRGatherWriteSize && _outputSegments.count > 1) {
+            length = [self _gatherOutputSegmentsIntoBuffer:gatherBuffer capacity:SRGatherWriteSize];
+            bytes = gatherBuffer;
+        }
+        
+        NSInteger bytesWritten = [_connection write:bytes maxLength:length];
         if (bytesWritten == -1) {
             [self _failWithError:[NSError errorWithDomain:SRWebSocketErrorDomain code:2145 userInfo:[NSDictionary dictionaryWithObject:@"Error writing to stream" forKey:NSLocalizedDescriptionKey]]];
              return;
         }
         
-        _outputBufferOffset += bytesWritten;
+        [self _consumeOutputBytes:bytesWritten];
         
-        if (_outputBufferOffset > 4096 && _outputBufferOffset > (_outputBuffer.length >> 1)) {
-            _outputBuffer = [[NSMutableData alloc] initWithBytes:(char *)_outputBuffer.bytes + _outputBufferOffset length:_outputBuffer.length - _outputBufferOffset];
-            _outputBufferOffset = 0;
+        if ((size_t)bytesWritten < length) {
+            break;
         }
     }
     
+    [self _checkWaterMarks];
+    
     if (_closeWhenFinishedWriting && 
-        _outputBuffer.length - _outputBufferOffset == 0 && 
-        (_inputStream.streamStatus != NSStreamStatusNotOpen &&
-         _inputStream.streamStatus != NSStreamStatusClosed) &&
+        _outputBufferedAmount == 0 && 
+        _connection.isActive &&
         !_sentClose) {
         _sentClose = YES;
             
-        [_outputStream close];
-        [_inputStream close];
-        
-        
-        for (NSArray *runLoop in [_scheduledRunloops copy]) {
-            [self unscheduleFromRunLoop:[runLoop objectAtIndex:0] forMode:[runLoop objectAtIndex:1]];
-        }
+        [_connection close];
         
         if (!_failed) {
             [self _performDelegateBlock:^{
@@ -1149,22 +1583,7 @@ static const uint8_t SRPayloadLenMask   = 0x7F;
 - (void)_addConsumerWithScanner:(stream_scanner)consumer callback:(data_callback)callback;
 {
     [self assertOnWorkQueue];
-    [self _addConsumerWithScanner:consumer callback:callback dataLength:0];
-}
-
-- (void)_addConsumerWithDataLength:(size_t)dataLength callback:(data_callback)callback readToCurrentFrame:(BOOL)readToCurrentFrame unmaskBytes:(BOOL)unmaskBytes;
-{   
-    [self assertOnWorkQueue];
-    assert(dataLength);
-    
-    [_consumers addObject:[_consumerPool consumerWithScanner:nil handler:callback bytesNeeded:dataLength readToCurrentFrame:readToCurrentFrame unmaskBytes:unmaskBytes]];
-    [self _pumpScanner];
-}
-
-- (void)_addConsumerWithScanner:(stream_scanner)consumer callback:(data_callback)callback dataLength:(size_t)dataLength;
-{    
-    [self assertOnWorkQueue];
-    [_consumers addObject:[_consumerPool consumerWithScanner:consumer handler:callback bytesNeeded:dataLength readToCurrentFrame:NO unmaskBytes:NO]];
+    [_consumers addObject:[_consumerPool consumerWithScanner:consumer handler:callback]];
     [self _pumpScanner];
 }
 
@@ -1212,101 +1631,112 @@ static const char CRLFCRLFBytes[] = {'\r', '\n', '\r', '\n'};
     }
     
     if (!_consumers.count) {
-        return didWork;
+        return _readingFrames ? [self _pumpFrameDecoder] : didWork;
     }
     
-    size_t curSize = _readBuffer.length - _readBufferOffset;
+    size_t curSize = _readBuffer.length;
     if (!curSize) {
         return didWork;
     }
     
     SRIOConsumer *consumer = [_consumers objectAtIndex:0];
     
-    size_t bytesNeeded = consumer.bytesNeeded;
-    
-    size_t foundSize = 0;
-    if (consumer.consumer) {
-        NSData *tempView = [NSData dataWithBytesNoCopy:(char *)_readBuffer.bytes + _readBufferOffset length:_readBuffer.length - _readBufferOffset freeWhenDone:NO];  
-        foundSize = consumer.consumer(tempView);
-    } else {
-        assert(consumer.bytesNeeded);
-        if (curSize >= bytesNeeded) {
-            foundSize = bytesNeeded;
-        } else if (consumer.readToCurrentFrame) {
-            foundSize = curSize;
-        }
+    const uint8_t *readBytes = SRRingBufferLinearize(&_readBuffer);
+    if (!readBytes) {
+        [self _failWithError:[NSError errorWithDomain:SRWebSocketErrorDomain code:2146 userInfo:[NSDictionary dictionaryWithObject:@"Unable to allocate read buffer" forKey:NSLocalizedDescriptionKey]]];
+        return didWork;
     }
+    NSData *tempView = [NSData dataWithBytesNoCopy:(void *)readBytes length:curSize freeWhenDone:NO];
+    size_t foundSize = consumer.consumer(tempView);
     
-    NSData *slice = nil;
-    if (consumer.readToCurrentFrame || foundSize) {
-        NSRange sliceRange = NSMakeRange(_readBufferOffset, foundSize);
-        slice = [_readBuffer subdataWithRange:sliceRange];
+    if (foundSize) {
+        NSMutableData *slice = [[NSMutableData alloc] initWithLength:foundSize];
+        SRRingBufferCopyBytes(&_readBuffer, slice.mutableBytes, foundSize);
+        SRRingBufferConsume(&_readBuffer, foundSize);
         
-        _readBufferOffset += foundSize;
-        
-        if (_readBufferOffset > 4096 && _readBufferOffset > (_readBuffer.length >> 1)) {
-            _readBuffer = [[NSMutableData alloc] initWithBytes:(char *)_readBuffer.bytes + _readBufferOffset length:_readBuffer.length - _readBufferOffset];            _readBufferOffset = 0;
+        [_consumers removeObjectAtIndex:0];
+        consumer.handler(self, slice);
+        [_consumerPool returnConsumer:consumer];
+        didWork = YES;
+    }
+    return didWork;
+}
+
+// Runs the text appended to _currentFrameData from offset on through the UTF-8 validator.
+// Only new bytes are scanned; the validator state carries any partial code point over from
+// the previous chunk. Closes the connection and returns NO if the text isn't valid.
+- (BOOL)_validateTextFromOffset:(NSUInteger)offset;
+{
+    size_t length = _currentFrameData.length - offset;
+    if (length == 0) {
+        return YES;
+    }
+    
+    size_t completeSize = 0;
+    _currentUTF8State = SRUTF8Validate(_currentUTF8State, (const uint8_t *)_currentFrameData.bytes + offset, length, &completeSize);
+    
+    if (_currentUTF8State == SRUTF8Reject) {
+        [self closeWithCode:SRStatusCodeInvalidUTF8 reason:@"Text frames must be valid UTF-8"];
+        dispatch_async(_workQueue, ^{
+            [self closeConnection];
+        });
+        return NO;
+    } else if (completeSize) {
+        _currentStringScanPosition = offset + completeSize;
+    }
+    return YES;
+}
+
+// Output room added to _currentFrameData per inflate call, unless the input suggests more.
+static const size_t SRInflateChunkSize = 4096;
+
+// Inflates compressed payload onto the end of _currentFrameData. Closes the connection and
+// returns NO on corrupt data or once the buffered message outgrows maxInflatedMessageSize.
+- (BOOL)_inflateBytes:(const uint8_t *)bytes length:(size_t)length;
+{
+    NSUInteger maxSize = _perMessageDeflateOptions.maxInflatedMessageSize;
+    size_t room = 0;
+    ptrdiff_t written = 0;
+    
+    do {
+        NSUInteger offset = _currentFrameData.length;
+        room = MAX(length * 4, SRInflateChunkSize);
+        if (maxSize) {
+            // One byte past the cap is enough to tell that the message is over it.
+            room = MIN(room, maxSize - MIN(offset, maxSize) + 1);
         }
         
-        if (consumer.unmaskBytes) {
-            NSMutableData *mutableSlice = [slice mutableCopy];
-            
-            NSUInteger len = mutableSlice.length;
-            uint8_t *bytes = mutableSlice.mutableBytes;
-            
-            for (NSUInteger i = 0; i < len; i++) {
-                bytes[i] = bytes[i] ^ _currentReadMaskKey[_currentReadMaskOffset % sizeof(_currentReadMaskKey)];
-                _currentReadMaskOffset += 1;
-            }
-            
-            slice = mutableSlice;
+        [_currentFrameData setLength:offset + room];
+        written = SRInflaterInflate(&_inflater, &bytes, &length, (uint8_t *)_currentFrameData.mutableBytes + offset, room);
+        [_currentFrameData setLength:offset + MAX(written, 0)];
+        
+        if (written < 0) {
+            [self _closeWithProtocolError:@"Invalid compressed data"];
+            return NO;
         }
         
-        if (consumer.readToCurrentFrame) {
-            [_currentFrameData appendData:slice];
-            
-            _readOpCount += 1;
-            
-            if (_currentFrameOpcode == SROpCodeTextFrame) {
-                // Validate UTF8 stuff.
-                size_t currentDataSize = _currentFrameData.length;
-                if (_currentFrameOpcode == SROpCodeTextFrame && currentDataSize > 0) {
-                    // TODO: Optimize the crap out of this.  Don't really have to copy all the data each time
-                    
-                    size_t scanSize = currentDataSize - _currentStringScanPosition;
-                    
-                    NSData *scan_data = [_currentFrameData subdataWithRange:NSMakeRange(_currentStringScanPosition, scanSize)];
-                    int32_t valid_utf8_size = validate_dispatch_data_partial_string(scan_data);
-                    
-                    if (valid_utf8_size == -1) {
-                        [self closeWithCode:SRStatusCodeInvalidUTF8 reason:@"Text frames must be valid UTF-8"];
-                        dispatch_async(_workQueue, ^{
-                            [self closeConnection];
-                        });
-                        return didWork;
-                    } else {
-                        _currentStringScanPosition += valid_utf8_size;
-                    }
-                } 
-                
-            }
-            
-            consumer.bytesNeeded -= foundSize;
-            
-            if (consumer.bytesNeeded == 0) {
-                [_consumers removeObjectAtIndex:0];
-                consumer.handler(self, nil);
-                [_consumerPool returnConsumer:consumer];
-                didWork = YES;
-            }
-        } else if (foundSize) {
-            [_consumers removeObjectAtIndex:0];
-            consumer.handler(self, slice);
-            [_consumerPool returnConsumer:consumer];
-            didWork = YES;
+        if (maxSize && _currentFrameData.length > maxSize) {
+            [self closeWithCode:SRStatusCodeMessageTooBig reason:@"Message too big"];
+            dispatch_async(_workQueue, ^{
+                [self closeConnection];
+            });
+            return NO;
         }
+    } while (length || (size_t)written == room);
+    
+    return YES;
+}
+
+// Puts back the 00 00 FF FF the sender dropped, so the last of the message comes out.
+- (BOOL)_finishInflatingMessage;
+{
+    NSUInteger offset = _currentFrameData.length;
+    if (![self _inflateBytes:SRDeflateMessageTail length:sizeof(SRDeflateMessageTail)]) {
+        return NO;
     }
-    return didWork;
+    SRInflaterEndMessage(&_inflater);
+    
+    return _currentFrameOpcode != SROpCodeTextFrame || [self _validateTextFromOffset:offset];
 }
 
 -(void)_pumpScanner;
@@ -1341,29 +1771,12 @@ static const size_t SRFrameHeaderOverhead = 32;
     NSAssert([data isKindOfClass:[NSData class]] || [data isKindOfClass:[NSString class]], @"NSString or NSData");
     
     size_t payloadLength = [data isKindOfClass:[NSString class]] ? [(NSString *)data lengthOfBytesUsingEncoding:NSUTF8StringEncoding] : [data length];
-        
-    NSMutableData *frame = [[NSMutableData alloc] initWithLength:payloadLength + SRFrameHeaderOverhead];
-    if (!frame) {
-        [self closeWithCode:SRStatusCodeMessageTooBig reason:@"Message too big"];
-        return;
-    }
-    uint8_t *frame_buffer = (uint8_t *)[frame mutableBytes];
-    
-    // set fin
-    frame_buffer[0] = SRFinMask | opcode;
     
     BOOL useMask = YES;
 #ifdef NOMASK
     useMask = NO;
 #endif
     
-    if (useMask) {
-    // set the mask and header
-        frame_buffer[1] |= SRMaskMask;
-    }
-    
-    size_t frame_buffer_size = 2;
-    
     const uint8_t *unmasked_payload = NULL;
     if ([data isKindOfClass:[NSData class]]) {
         unmasked_payload = (uint8_t *)[data bytes];
@@ -1373,6 +1786,41 @@ static const size_t SRFrameHeaderOverhead = 32;
         return;
     }
     
+    // Data messages are compressed into _deflateBuffer and framed from there with RSV1 set.
+    BOOL compress = _perMessageDeflateEnabled && (opcode == SROpCodeTextFrame || opcode == SROpCodeBinaryFrame) && payloadLength >= _perMessageDeflateOptions.compressionThreshold;
+    if (compress) {
+        size_t bound = SRDeflaterBound(&_deflater, payloadLength);
+        if (_deflateBuffer.length < bound) {
+            [_deflateBuffer setLength:bound];
+        }
+        size_t compressedLength = SRDeflaterCompressMessage(&_deflater, unmasked_payload, payloadLength, _deflateBuffer.mutableBytes, bound);
+        if (compressedLength == SIZE_MAX) {
+            [self _failWithError:[NSError errorWithDomain:SRWebSocketErrorDomain code:2147 userInfo:@{NSLocalizedDescriptionKey:@"Could not compress message"}]];
+            return;
+        }
+        unmasked_payload = _deflateBuffer.bytes;
+        payloadLength = compressedLength;
+    }
+    
+    // Masking has to produce a new copy of the payload anyway, so it is masked straight
+    // into the frame. Unmasked payloads are queued by reference behind their header.
+    NSMutableData *frame = [[NSMutableData alloc] initWithLength:(useMask ? payloadLength : 0) + SRFrameHeaderOverhead];
+    if (!frame) {
+        [self closeWithCode:SRStatusCodeMessageTooBig reason:@"Message too big"];
+        return;
+    }
+    uint8_t *frame_buffer = (uint8_t *)[frame mutableBytes];
+    
+    // set fin
+    frame_buffer[0] = SRFinMask | opcode | (compress ? SRRsv1Mask : 0);
+    
+    if (useMask) {
+    // set the mask and header
+        frame_buffer[1] |= SRMaskMask;
+    }
+    
+    size_t frame_buffer_size = 2;
+    
     if (payloadLength < 126) {
         frame_buffer[1] |= payloadLength;
     } else if (payloadLength <= UINT16_MAX) {
@@ -1386,21 +1834,19 @@ static const size_t SRFrameHeaderOverhead = 32;
     }
         
     if (!useMask) {
-        for (size_t i = 0; i < payloadLength; i++) {
-            frame_buffer[frame_buffer_size] = unmasked_payload[i];
-            frame_buffer_size += 1;
-        }
-    } else {
-        uint8_t *mask_key = frame_buffer + frame_buffer_size;
-        SecRandomCopyBytes(kSecRandomDefault, sizeof(uint32_t), (uint8_t *)mask_key);
-        frame_buffer_size += sizeof(uint32_t);
+        frame.length = frame_buffer_size;
         
-        // TODO: could probably optimize this with SIMD
-        for (size_t i = 0; i < payloadLength; i++) {
-            frame_buffer[frame_buffer_size] = unmasked_payload[i] ^ mask_key[i % sizeof(uint32_t)];
-            frame_buffer_size += 1;
-        }
+        NSData *payload = [data isKindOfClass:[NSData class]] && !compress ? data : [NSData dataWithBytes:unmasked_payload length:payloadLength];
+        [self _writeHeader:frame payload:payload];
+        return;
     }
+    
+    uint8_t *mask_key = frame_buffer + frame_buffer_size;
+    SecRandomCopyBytes(kSecRandomDefault, sizeof(uint32_t), (uint8_t *)mask_key);
+    frame_buffer_size += sizeof(uint32_t);
+    
+    SRMaskBytes(frame_buffer + frame_buffer_size, unmasked_payload, payloadLength, mask_key, 0);
+    frame_buffer_size += payloadLength;
 
     assert(frame_buffer_size <= [frame length]);
     frame.length = frame_buffer_size;
@@ -1408,13 +1854,15 @@ static const size_t SRFrameHeaderOverhead = 32;
     [self _writeData:frame];
 }
 
-- (void)stream:(NSStream *)aStream handleEvent:(NSStreamEvent)eventCode;
+- (void)_handleIOEvent:(SRIOEvent)event error:(NSError *)error;
 {
-    if (_secure && !_pinnedCertFound && (eventCode == NSStreamEventHasBytesAvailable || eventCode == NSStreamEventHasSpaceAvailable)) {
+    [self assertOnWorkQueue];
+    
+    if (_secure && !_pinnedCertFound && (event == SRIOEventReadable || event == SRIOEventWritable)) {
         
         NSArray *sslCerts = [_urlRequest SR_SSLPinnedCertificates];
         if (sslCerts) {
-            SecTrustRef secTrust = (__bridge SecTrustRef)[aStream propertyForKey:(__bridge id)kCFStreamPropertySSLPeerTrust];
+            SecTrustRef secTrust = _connection.peerTrust;
             if (secTrust) {
                 NSInteger numCerts = SecTrustGetCertificateCount(secTrust);
                 for (NSInteger i = 0; i < numCerts && !_pinnedCertFound; i++) {
@@ -1434,101 +1882,132 @@ static const size_t SRFrameHeaderOverhead = 32;
             }
             
             if (!_pinnedCertFound) {
-                dispatch_async(_workQueue, ^{
-                    [self _failWithError:[NSError errorWithDomain:SRWebSocketErrorDomain code:23556 userInfo:[NSDictionary dictionaryWithObject:[NSString stringWithFormat:@"Invalid server cert"] forKey:NSLocalizedDescriptionKey]]];
-                });
+                [self _failWithError:[NSError errorWithDomain:SRWebSocketErrorDomain code:23556 userInfo:[NSDictionary dictionaryWithObject:[NSString stringWithFormat:@"Invalid server cert"] forKey:NSLocalizedDescriptionKey]]];
                 return;
             }
         }
     }
 
-    dispatch_async(_workQueue, ^{
-        switch (eventCode) {
-            case NSStreamEventOpenCompleted: {
-                SRFastLog(@"NSStreamEventOpenCompleted %@", aStream);
-                if (self.readyState >= SR_CLOSING) {
-                    return;
-                }
-                assert(_readBuffer);
-                
-                if (self.readyState == SR_CONNECTING && aStream == _inputStream) {
-                    [self didConnect];
-                }
-                [self _pumpWriting];
-                [self _pumpScanner];
-                break;
-            }
-                
-            case NSStreamEventErrorOccurred: {
-                SRFastLog(@"NSStreamEventErrorOccurred %@ %@", aStream, [[aStream streamError] copy]);
-                /// TODO specify error better!
-                [self _failWithError:aStream.streamError];
-                _readBufferOffset = 0;
-                [_readBuffer setLength:0];
-                break;
-                
+    switch (event) {
+        case SRIOEventOpened: {
+            SRFastLog(@"SRIOEventOpened %@", _connection);
+            if (self.readyState >= SR_CLOSING) {
+                return;
             }
-                
-            case NSStreamEventEndEncountered: {
-                [self _pumpScanner];
-                SRFastLog(@"NSStreamEventEndEncountered %@", aStream);
-                if (aStream.streamError) {
-                    [self _failWithError:aStream.streamError];
-                } else {
-                    dispatch_async(_workQueue, ^{
-                        if (self.readyState != SR_CLOSED) {
-                            self.readyState = SR_CLOSED;
-                            _selfRetain = nil;
-                        }
-
-                        if (!_sentClose && !_failed) {
-                            _sentClose = YES;
-                            // If we get closed in this state it's probably not clean because we should be sending this when we send messages
-                            [self _performDelegateBlock:^{
-                                if ([self.delegate respondsToSelector:@selector(webSocket:didCloseWithCode:reason:wasClean:)]) {
-                                    [self.delegate webSocket:self didCloseWithCode:SRStatusCodeGoingAway reason:@"Stream end encountered" wasClean:NO];
-                                }
-                            }];
-                        }
-                    });
-                }
-                
-                break;
+            assert(_readBuffer.bytes);
+            
+            if (self.readyState == SR_CONNECTING) {
+                [self didConnect];
             }
-                
-            case NSStreamEventHasBytesAvailable: {
-                SRFastLog(@"NSStreamEventHasBytesAvailable %@", aStream);
-                const int bufferSize = 2048;
-                uint8_t buffer[bufferSize];
-                
-                while (_inputStream.hasBytesAvailable) {
-                    NSInteger bytes_read = [_inputStream read:buffer maxLength:bufferSize];
-                    
-                    if (bytes_read > 0) {
-                        [_readBuffer appendBytes:buffer length:bytes_read];
-                    } else if (bytes_read < 0) {
-                        [self _failWithError:_inputStream.streamError];
+            [self _pumpWriting];
+            [self _pumpScanner];
+            break;
+        }
+            
+        case SRIOEventFailed: {
+            SRFastLog(@"SRIOEventFailed %@ %@", _connection, error);
+            /// TODO specify error better!
+            [self _failWithError:error];
+            SRRingBufferReset(&_readBuffer);
+            break;
+            
+        }
+            
+        case SRIOEventEnded: {
+            [self _pumpScanner];
+            SRFastLog(@"SRIOEventEnded %@", _connection);
+            if (error) {
+                [self _failWithError:error];
+            } else {
+                dispatch_async(_workQueue, ^{
+                    if (self.readyState != SR_CLOSED) {
+                        self.readyState = SR_CLOSED;
+                        _selfRetain = nil;
                     }
-                    
-                    if (bytes_read != bufferSize) {
-                        break;
+
+                    if (!_sentClose && !_failed) {
+                        _sentClose = YES;
+                        // If we get closed in this state it's probably not clean because we should be sending this when we send messages
+                        [self _performDelegateBlock:^{
+                            if ([self.delegate respondsToSelector:@selector(webSocket:didCloseWithCode:reason:wasClean:)]) {
+                                [self.delegate webSocket:self didCloseWithCode:SRStatusCodeGoingAway reason:@"Stream end encountered" wasClean:NO];
+                            }
+                        }];
                     }
-                };
-                [self _pumpScanner];
-                break;
+                });
             }
+            
+            break;
+        }
+            
+        case SRIOEventReadable: {
+            SRFastLog(@"SRIOEventReadable %@", _connection);
+            while (_connection.hasBytesAvailable) {
+                if (!SRRingBufferReserve(&_readBuffer, _readChunkSize)) {
+                    [self _failWithError:[NSError errorWithDomain:SRWebSocketErrorDomain code:2146 userInfo:[NSDictionary dictionaryWithObject:@"Unable to allocate read buffer" forKey:NSLocalizedDescriptionKey]]];
+                    break;
+                }
                 
-            case NSStreamEventHasSpaceAvailable: {
-                SRFastLog(@"NSStreamEventHasSpaceAvailable %@", aStream);
-                [self _pumpWriting];
-                break;
-            }
+                // Read straight into the free space of the read buffer.
+                uint8_t *buffer = NULL;
+                size_t bufferSize = MIN(SRRingBufferWritableBytes(&_readBuffer, &buffer), _readChunkSize);
+                NSInteger bytes_read = [_connection read:buffer maxLength:bufferSize];
                 
-            default:
-                SRFastLog(@"(default)  %@", aStream);
-                break;
+                if (bytes_read > 0) {
+                    SRRingBufferCommit(&_readBuffer, bytes_read);
+                } else if (bytes_read < 0) {
+                    [self _failWithError:_connection.error];
+                }
+                
+                if ((size_t)bytes_read != bufferSize) {
+                    break;
+                }
+            };
+            [self _pumpScanner];
+            break;
         }
-    });
+            
+        case SRIOEventWritable: {
+            SRFastLog(@"SRIOEventWritable %@", _connection);
+            [self _pumpWriting];
+            break;
+        }
+            
+        default:
+            SRFastLog(@"(default)  %@", _connection);
+            break;
+    }
+}
+
+@end
+
+
+@implementation SRPerMessageDeflateOptions
+
+- (id)init;
+{
+    self = [super init];
+    if (self) {
+        _clientMaxWindowBits = 15;
+        _serverMaxWindowBits = 15;
+        _memoryLevel = 8;
+        _compressionThreshold = 64;
+        _maxInflatedMessageSize = 16 * 1024 * 1024;
+    }
+    return self;
+}
+
+- (id)copyWithZone:(NSZone *)zone;
+{
+    SRPerMessageDeflateOptions *options = [[[self class] allocWithZone:zone] init];
+    options.clientMaxWindowBits = _clientMaxWindowBits;
+    options.serverMaxWindowBits = _serverMaxWindowBits;
+    options.clientNoContextTakeover = _clientNoContextTakeover;
+    options.serverNoContextTakeover = _serverNoContextTakeover;
+    options.memoryLevel = _memoryLevel;
+    options.compressionThreshold = _compressionThreshold;
+    options.maxInflatedMessageSize = _maxInflatedMessageSize;
+    return options;
 }
 
 @end
@@ -1536,20 +2015,14 @@ static const size_t SRFrameHeaderOverhead = 32;
 
 @implementation SRIOConsumer
 
-@synthesize bytesNeeded = _bytesNeeded;
 @synthesize consumer = _scanner;
 @synthesize handler = _handler;
-@synthesize readToCurrentFrame = _readToCurrentFrame;
-@synthesize unmaskBytes = _unmaskBytes;
 
-- (void)setupWithScanner:(stream_scanner)scanner handler:(data_callback)handler bytesNeeded:(size_t)bytesNeeded readToCurrentFrame:(BOOL)readToCurrentFrame unmaskBytes:(BOOL)unmaskBytes;
+- (void)setupWithScanner:(stream_scanner)scanner handler:(data_callback)handler;
 {
     _scanner = [scanner copy];
     _handler = [handler copy];
-    _bytesNeeded = bytesNeeded;
-    _readToCurrentFrame = readToCurrentFrame;
-    _unmaskBytes = unmaskBytes;
-    assert(_scanner || _bytesNeeded);
+    assert(_scanner);
 }
 
 
@@ -1576,7 +2049,7 @@ static const size_t SRFrameHeaderOverhead = 32;
     return [self initWithBufferCapacity:8];
 }
 
-- (SRIOConsumer *)consumerWithScanner:(stream_scanner)scanner handler:(data_callback)handler bytesNeeded:(size_t)bytesNeeded readToCurrentFrame:(BOOL)readToCurrentFrame unmaskBytes:(BOOL)unmaskBytes;
+- (SRIOConsumer *)consumerWithScanner:(stream_scanner)scanner handler:(data_callback)handler;
 {
     SRIOConsumer *consumer = nil;
     if (_bufferedConsumers.count) {
@@ -1586,7 +2059,7 @@ static const size_t SRFrameHeaderOverhead = 32;
         consumer = [[SRIOConsumer alloc] init];
     }
     
-    [consumer setupWithScanner:scanner handler:handler bytesNeeded:bytesNeeded readToCurrentFrame:readToCurrentFrame unmaskBytes:unmaskBytes];
+    [consumer setupWithScanner:scanner handler:handler];
     
     return consumer;
 }
@@ -1664,149 +2137,10 @@ static inline void SRFastLog(NSString *format, ...)  {
 #endif
 }
 
-
-#ifdef HAS_ICU
-
-static inline int32_t validate_dispatch_data_partial_string(NSData *data) {
-    if ([data length] > INT32_MAX) {
-        // INT32_MAX is the limit so long as this Framework is using 32 bit ints everywhere.
-        return -1;
-    }
-
-    int32_t size = (int32_t)[data length];
-
-    const void * contents = [data bytes];
-    const uint8_t *str = (const uint8_t *)contents;
-    
-    UChar32 codepoint = 1;
-    int32_t offset = 0;
-    int32_t lastOffset = 0;
-    while(offset < size && codepoint > 0)  {
-        lastOffset = offset;
-        U8_NEXT(str, offset, size, codepoint);
-    }
-    
-    if (codepoint == -1) {
-        // Check to see if the last byte is valid or whether it was just continuing
-        if (!U8_IS_LEAD(str[lastOffset]) || U8_COUNT_TRAIL_BYTES(str[lastOffset]) + lastOffset < (int32_t)size) {
-            
-            size = -1;
-        } else {
-            uint8_t leadByte = str[lastOffset];
-            U8_MASK_LEAD_BYTE(leadByte, U8_COUNT_TRAIL_BYTES(leadByte));
-            
-            for (int i = lastOffset + 1; i < offset; i++) {
-                if (U8_IS_SINGLE(str[i]) || U8_IS_LEAD(str[i]) || !U8_IS_TRAIL(str[i])) {
-                    size = -1;
-                }
-            }
-            
-            if (size != -1) {
-                size = lastOffset;
-            }
-        }
-    }
-    
-    if (size != -1 && ![[NSString alloc] initWithBytesNoCopy:(char *)[data bytes] length:size encoding:NSUTF8StringEncoding freeWhenDone:NO]) {
-        size = -1;
-    }
-    
-    return size;
-}
-
-#else
-
-// This is a hack, and probably not optimal
-static inline int32_t validate_dispatch_data_partial_string(NSData *data) {
-    static const int maxCodepointSize = 3;
-    
-    for (int i = 0; i < maxCodepointSize; i++) {
-        NSString *str = [[NSString alloc] initWithBytesNoCopy:(char *)data.bytes length:data.length - i encoding:NSUTF8StringEncoding freeWhenDone:NO];
-        if (str) {
-            return (int32_t)data.length - i;
-        }
-    }
-    
-    return -1;
-}
-
-#endif
-
-static _SRRunLoopThread *networkThread = nil;
-static NSRunLoop *networkRunLoop = nil;
-
 @implementation NSRunLoop (SRWebSocket)
 
 + (NSRunLoop *)SR_networkRunLoop {
-    static dispatch_once_t onceToken;
-    dispatch_once(&onceToken, ^{
-        networkThread = [[_SRRunLoopThread alloc] init];
-        networkThread.name = @"com.squareup.SocketRocket.NetworkThread";
-        [networkThread start];
-        networkRunLoop = networkThread.runLoop;
-    });
-    
-    return networkRunLoop;
-}
-
-@end
-
-
-@implementation _SRRunLoopThread {
-    dispatch_group_t _waitGroup;
-}
-
-@synthesize runLoop = _runLoop;
-
-- (void)dealloc
-{
-    sr_dispatch_release(_waitGroup);
-}
-
-- (id)init
-{
-    self = [super init];
-    if (self) {
-        _waitGroup = dispatch_group_create();
-        dispatch_group_enter(_waitGroup);
-    }
-    return self;
-}
-
-- (void)main;
-{
-    @autoreleasepool {
-        _runLoop = [NSRunLoop currentRunLoop];
-        dispatch_group_leave(_waitGroup);
-        
-        // Add an empty run loop source to prevent runloop from spinning.
-        CFRunLoopSourceContext sourceCtx = {
-            .version = 0,
-            .info = NULL,
-            .retain = NULL,
-            .release = NULL,
-            .copyDescription = NULL,
-            .equal = NULL,
-            .hash = NULL,
-            .schedule = NULL,
-            .cancel = NULL,
-            .perform = NULL
-        };
-        CFRunLoopSourceRef source = CFRunLoopSourceCreate(NULL, 0, &sourceCtx);
-        CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
-        CFRelease(source);
-        
-        while ([_runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]) {
-            
-        }
-        assert(NO);
-    }
-}
-
-- (NSRunLoop *)runLoop;
-{
-    dispatch_group_wait(_waitGroup, DISPATCH_TIME_FOREVER);
-    return _runLoop;
+    return [[SRRunLoopBackend sharedBackend] runLoopAtIndex:0];
 }
 
 @end
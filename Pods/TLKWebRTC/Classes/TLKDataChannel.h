@@ -0,0 +1,64 @@
+//
+//  TLKDataChannel.h
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import <Foundation/Foundation.h>
+
+@class RTCDataChannel;
+
+@protocol TLKDataChannelDelegate;
+
+// A data channel to one peer with flow control on the sending side. Data handed to send: is
+// queued here and fed to SCTP in chunkSize messages only while the channel's own buffer is below
+// highWaterMark, so a large transfer never piles up inside WebRTC. Once everything queued has
+// drained to lowWaterMark the delegate hears about it and can send more.
+@interface TLKDataChannel : NSObject
+
+// Sends and channel callbacks run on workQueue; delegate calls are made on delegateQueue
+- (instancetype)initWithLabel:(NSString *)label peerID:(NSString *)peerID ordered:(BOOL)ordered workQueue:(dispatch_queue_t)workQueue delegateQueue:(dispatch_queue_t)delegateQueue;
+
+@property (nonatomic, weak) id <TLKDataChannelDelegate> delegate;
+
+@property (readonly, nonatomic, copy) NSString *label;
+// The peer at the other end, filled in by TLKWebRTC once it knows which one that is
+@property (atomic, copy) NSString *peerID;
+@property (readonly, nonatomic, getter=isOrdered) BOOL ordered;
+@property (readonly, nonatomic, getter=isOpen) BOOL open;
+
+// Bytes given to send: that the peer hasn't been sent yet, whether still queued here or inside WebRTC
+@property (readonly, nonatomic) NSUInteger bufferedAmount;
+
+// Defaults: 16 KB chunks, 1 MB high water, 256 KB low water
+@property (nonatomic) NSUInteger chunkSize;
+@property (nonatomic) NSUInteger highWaterMark;
+@property (nonatomic) NSUInteger lowWaterMark;
+
+// Queues data for the peer. On an ordered channel anything longer than chunkSize goes as several
+// messages, which arrive in order, ready to be appended. An unordered channel can't split a message,
+// so it refuses anything longer than chunkSize. Returns NO, sending nothing, for that and once the
+// channel has closed. Can be called from any thread
+- (BOOL)sendData:(NSData *)data;
+- (BOOL)sendString:(NSString *)string;
+
+- (void)close;
+
+// Connects the wrapper to the WebRTC channel it stands for. Call it as soon as the channel exists,
+// on any thread, since messages that arrive before then are lost. nil means the channel couldn't
+// be created, which closes the wrapper
+- (void)attachChannel:(RTCDataChannel *)channel;
+
+@end
+
+@protocol TLKDataChannelDelegate <NSObject>
+@required
+- (void)dataChannel:(TLKDataChannel *)dataChannel didReceiveData:(NSData *)data binary:(BOOL)isBinary;
+
+@optional
+- (void)dataChannelDidOpen:(TLKDataChannel *)dataChannel;
+- (void)dataChannelDidClose:(TLKDataChannel *)dataChannel;
+
+// bufferedAmount has come down to lowWaterMark after being above it: time to send more
+- (void)dataChannelDidReachLowWater:(TLKDataChannel *)dataChannel;
+
+@end
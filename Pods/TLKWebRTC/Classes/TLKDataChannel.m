@@ -0,0 +1,243 @@
+//
+//  TLKDataChannel.m
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import "TLKDataChannel.h"
+
+#import "RTCDataChannel.h"
+
+// One sendData: call, partly sent
+@interface TLKDataChannelPayload : NSObject
+
+@property (nonatomic, strong) NSData *data;
+@property (nonatomic) BOOL binary;
+@property (nonatomic) NSUInteger offset;
+
+@end
+
+@implementation TLKDataChannelPayload
+@end
+
+@interface TLKDataChannel () <RTCDataChannelDelegate>
+
+@property (readwrite, nonatomic, copy) NSString *label;
+@property (readwrite, nonatomic) BOOL ordered;
+
+@property (atomic, strong) RTCDataChannel *channel;
+@property (nonatomic, strong) dispatch_queue_t workQueue;
+@property (nonatomic, strong) dispatch_queue_t delegateQueue;
+
+// Touched on workQueue only
+@property (nonatomic, strong) NSMutableArray *payloads;
+@property (nonatomic) BOOL aboveLowWater;
+@property (nonatomic) BOOL announcedOpen;
+@property (nonatomic) BOOL closed;
+
+@end
+
+@implementation TLKDataChannel {
+    // Bytes accepted by sendData: and not yet handed to WebRTC; written from any thread
+    NSUInteger _queuedBytes;
+    // Set along with clearing _queuedBytes on close, so nothing sent after that is counted
+    BOOL _refusesData;
+}
+
+- (instancetype)initWithLabel:(NSString *)label peerID:(NSString *)peerID ordered:(BOOL)ordered workQueue:(dispatch_queue_t)workQueue delegateQueue:(dispatch_queue_t)delegateQueue {
+    self = [super init];
+    if (self) {
+        _label = [label copy];
+        _peerID = [peerID copy];
+        _ordered = ordered;
+        _workQueue = workQueue;
+        _delegateQueue = delegateQueue;
+        _payloads = [NSMutableArray array];
+        _chunkSize = 16 * 1024;
+        _highWaterMark = 1024 * 1024;
+        _lowWaterMark = 256 * 1024;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    self.channel.delegate = nil;
+}
+
+- (BOOL)isOpen {
+    return self.channel.state == kRTCDataChannelStateOpen;
+}
+
+- (NSUInteger)bufferedAmount {
+    NSUInteger queued;
+    @synchronized (self) {
+        queued = _queuedBytes;
+    }
+    return queued + self.channel.bufferedAmount;
+}
+
+- (void)_notifyDelegate:(void (^)(id <TLKDataChannelDelegate> delegate))block {
+    dispatch_async(self.delegateQueue, ^{
+        id <TLKDataChannelDelegate> delegate = self.delegate;
+        if (delegate) {
+            block(delegate);
+        }
+    });
+}
+
+#pragma mark - Sending
+
+- (BOOL)sendData:(NSData *)data {
+    return [self _send:[data copy] binary:YES];
+}
+
+- (BOOL)sendString:(NSString *)string {
+    return [self _send:[string dataUsingEncoding:NSUTF8StringEncoding] binary:NO];
+}
+
+- (BOOL)_send:(NSData *)data binary:(BOOL)binary {
+    if (data.length == 0) {
+        return YES;
+    }
+    // The pieces of a split message could arrive in any order on an unordered channel, with nothing
+    // to put them back together by, so there a message has to fit in one
+    if (!self.ordered && data.length > self.chunkSize) {
+        return NO;
+    }
+    @synchronized (self) {
+        if (_refusesData) {
+            return NO;
+        }
+        _queuedBytes += data.length;
+    }
+    dispatch_async(self.workQueue, ^{
+        // Sent just before the close; its bytes went when the count was cleared
+        if (self.closed) {
+            return;
+        }
+        TLKDataChannelPayload *payload = [[TLKDataChannelPayload alloc] init];
+        payload.data = data;
+        payload.binary = binary;
+        [self.payloads addObject:payload];
+        [self _pump];
+    });
+    return YES;
+}
+
+// Feeds queued payloads to WebRTC until its buffer reaches the high water mark
+- (void)_pump {
+    RTCDataChannel *channel = self.channel;
+    if (self.closed || channel.state != kRTCDataChannelStateOpen) {
+        return;
+    }
+
+    while (self.payloads.count && channel.bufferedAmount < self.highWaterMark) {
+        TLKDataChannelPayload *payload = self.payloads[0];
+        NSUInteger remaining = payload.data.length - payload.offset;
+        NSUInteger length = self.ordered ? MIN(self.chunkSize, remaining) : remaining;
+        NSData *chunk = payload.offset == 0 && length == payload.data.length ? payload.data : [payload.data subdataWithRange:NSMakeRange(payload.offset, length)];
+        if (![channel sendData:[[RTCDataBuffer alloc] initWithData:chunk isBinary:payload.binary]]) {
+            // SCTP's own queue is full; wait for it to drain
+            break;
+        }
+        payload.offset += length;
+        if (payload.offset == payload.data.length) {
+            [self.payloads removeObjectAtIndex:0];
+        }
+        @synchronized (self) {
+            _queuedBytes -= length;
+        }
+    }
+
+    NSUInteger buffered = self.bufferedAmount;
+    if (buffered > self.lowWaterMark) {
+        self.aboveLowWater = YES;
+    } else if (self.aboveLowWater) {
+        self.aboveLowWater = NO;
+        [self _notifyDelegate:^(id <TLKDataChannelDelegate> delegate) {
+            if ([delegate respondsToSelector:@selector(dataChannelDidReachLowWater:)]) {
+                [delegate dataChannelDidReachLowWater:self];
+            }
+        }];
+    }
+    // Nothing to poll for: WebRTC calls channel:didChangeBufferedAmount: as its buffer drains, which pumps again
+}
+
+- (void)close {
+    dispatch_async(self.workQueue, ^{
+        [self.channel close];
+        [self _didClose];
+    });
+}
+
+- (void)_didClose {
+    if (self.closed) {
+        return;
+    }
+    self.closed = YES;
+    [self.payloads removeAllObjects];
+    @synchronized (self) {
+        _queuedBytes = 0;
+        _refusesData = YES;
+    }
+    [self _notifyDelegate:^(id <TLKDataChannelDelegate> delegate) {
+        if ([delegate respondsToSelector:@selector(dataChannelDidClose:)]) {
+            [delegate dataChannelDidClose:self];
+        }
+    }];
+}
+
+- (void)attachChannel:(RTCDataChannel *)channel {
+    if (!channel) {
+        dispatch_async(self.workQueue, ^{
+            [self _didClose];
+        });
+        return;
+    }
+    self.channel = channel;
+    channel.delegate = self;
+    // A channel the peer opened is usually open by the time we see it
+    if (channel.state == kRTCDataChannelStateOpen) {
+        [self channelDidChangeState:channel];
+    }
+}
+
+#pragma mark - RTCDataChannelDelegate
+
+// These come in on WebRTC's signaling thread and are moved to the work queue
+
+- (void)channelDidChangeState:(RTCDataChannel *)channel {
+    RTCDataChannelState state = channel.state;
+    dispatch_async(self.workQueue, ^{
+        if (state == kRTCDataChannelStateOpen && !self.announcedOpen) {
+            self.announcedOpen = YES;
+            [self _notifyDelegate:^(id <TLKDataChannelDelegate> delegate) {
+                if ([delegate respondsToSelector:@selector(dataChannelDidOpen:)]) {
+                    [delegate dataChannelDidOpen:self];
+                }
+            }];
+            [self _pump];
+        } else if (state == kRTCDataChannelStateClosed) {
+            [self _didClose];
+        }
+    });
+}
+
+// Messages take the work queue too, so they stay behind anything already queued there about this
+// channel, like TLKWebRTC telling its delegate the channel exists
+- (void)channel:(RTCDataChannel *)channel didReceiveMessageWithBuffer:(RTCDataBuffer *)buffer {
+    NSData *data = buffer.data;
+    BOOL binary = buffer.isBinary;
+    dispatch_async(self.workQueue, ^{
+        [self _notifyDelegate:^(id <TLKDataChannelDelegate> delegate) {
+            [delegate dataChannel:self didReceiveData:data binary:binary];
+        }];
+    });
+}
+
+- (void)channel:(RTCDataChannel *)channel didChangeBufferedAmount:(NSUInteger)amount {
+    dispatch_async(self.workQueue, ^{
+        [self _pump];
+    });
+}
+
+@end
@@ -0,0 +1,38 @@
+//
+//  TLKEncodingPolicy.h
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import <Foundation/Foundation.h>
+
+typedef NS_ENUM(NSInteger, TLKEncodingTier) {
+    TLKEncodingTierFull,        // Whatever the media profile allows
+    TLKEncodingTierReduced,     // Capped at reducedVideoBitrate
+    TLKEncodingTierThumbnail    // Capped at thumbnailVideoBitrate
+};
+
+// Decides how much of the shared camera each peer in a room gets. Every peer connection runs its
+// own encoder, so past a few peers full quality for everyone costs more CPU and uplink than the
+// device has. Lower tiers are enforced as video bitrate caps, which the encoder meets by dropping
+// resolution and framerate. Pure: it sees peer IDs only, so subclasses can be tested without WebRTC.
+@interface TLKEncodingPolicy : NSObject
+
+// Peers past these counts drop to the next tier. Defaults: 2 full, 2 reduced, the rest thumbnails
+@property (nonatomic) NSUInteger maxFullQualityPeers;
+@property (nonatomic) NSUInteger maxReducedPeers;
+
+// kbps. Defaults: 300 and 100
+@property (nonatomic) NSUInteger reducedVideoBitrate;
+@property (nonatomic) NSUInteger thumbnailVideoBitrate;
+
+// Peers served first regardless of when they joined, such as the active speaker or a pinned peer,
+// in order of importance
+@property (nonatomic, copy) NSArray *prioritizedPeerIDs;
+
+// peerIDs is in join order. Returns an NSNumber TLKEncodingTier for every one of them
+- (NSDictionary *)tiersForPeerIDs:(NSArray *)peerIDs;
+
+// The video cap for a tier in kbps, 0 for none
+- (NSUInteger)videoBitrateForTier:(TLKEncodingTier)tier;
+
+@end
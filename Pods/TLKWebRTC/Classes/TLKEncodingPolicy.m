@@ -0,0 +1,60 @@
+//
+//  TLKEncodingPolicy.m
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import "TLKEncodingPolicy.h"
+
+@implementation TLKEncodingPolicy
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _maxFullQualityPeers = 2;
+        _maxReducedPeers = 2;
+        _reducedVideoBitrate = 300;
+        _thumbnailVideoBitrate = 100;
+    }
+    return self;
+}
+
+- (NSDictionary *)tiersForPeerIDs:(NSArray *)peerIDs {
+    // Prioritized peers that are actually present go first, then everyone else in join order
+    NSMutableArray *ordered = [NSMutableArray arrayWithCapacity:peerIDs.count];
+    NSSet *present = [NSSet setWithArray:peerIDs];
+    for (NSString *peerID in self.prioritizedPeerIDs) {
+        if ([present containsObject:peerID] && ![ordered containsObject:peerID]) {
+            [ordered addObject:peerID];
+        }
+    }
+    for (NSString *peerID in peerIDs) {
+        if (![ordered containsObject:peerID]) {
+            [ordered addObject:peerID];
+        }
+    }
+
+    NSMutableDictionary *tiers = [NSMutableDictionary dictionaryWithCapacity:ordered.count];
+    [ordered enumerateObjectsUsingBlock:^(NSString *peerID, NSUInteger rank, BOOL *stop) {
+        TLKEncodingTier tier = TLKEncodingTierThumbnail;
+        if (rank < self.maxFullQualityPeers) {
+            tier = TLKEncodingTierFull;
+        } else if (rank < self.maxFullQualityPeers + self.maxReducedPeers) {
+            tier = TLKEncodingTierReduced;
+        }
+        tiers[peerID] = @(tier);
+    }];
+    return tiers;
+}
+
+- (NSUInteger)videoBitrateForTier:(TLKEncodingTier)tier {
+    switch (tier) {
+        case TLKEncodingTierReduced:
+            return self.reducedVideoBitrate;
+        case TLKEncodingTierThumbnail:
+            return self.thumbnailVideoBitrate;
+        default:
+            return 0;
+    }
+}
+
+@end
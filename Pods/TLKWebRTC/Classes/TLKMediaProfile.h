@@ -0,0 +1,59 @@
+//
+//  TLKMediaProfile.h
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import <Foundation/Foundation.h>
+
+@class RTCMediaConstraints;
+
+// A named set of limits on the media exchanged with peers, applied by rewriting SDP and by
+// constraining the local camera. Any setting left at 0 or nil leaves WebRTC's choice alone.
+@interface TLKMediaProfile : NSObject <NSCopying>
+
+- (instancetype)initWithName:(NSString *)name;
+
+// Nothing capped, SDP passes through untouched
++ (instancetype)defaultProfile;
+
+// 500 kbps of video at up to 640x480 and 15 fps, Opus at 32 kbps with FEC and DTX
++ (instancetype)cellularProfile;
+
+// Keeps audio alive on poor links: 150 kbps of video at up to 320x240 and 15 fps, Opus at 24 kbps
+// in 60 ms packets with FEC and DTX
++ (instancetype)lowBandwidthProfile;
+
+@property (readonly, nonatomic, copy) NSString *name;
+
+// kbps, written as b=AS and b=TIAS on the audio or video section
+@property (nonatomic) NSUInteger maxVideoBitrate;
+@property (nonatomic) NSUInteger maxAudioBitrate;
+
+// Codec names such as @"VP8" or @"opus", moved to the front of the m= line in this order.
+// Codecs the SDP doesn't offer are skipped
+@property (nonatomic, copy) NSArray *videoCodecPreference;
+@property (nonatomic, copy) NSArray *audioCodecPreference;
+
+// Opus packet time in milliseconds, written as a=ptime
+@property (nonatomic) NSUInteger opusPacketTime;
+// Boolean NSNumbers for Opus useinbandfec and usedtx; nil leaves the fmtp line as it is
+@property (nonatomic, copy) NSNumber *opusFEC;
+@property (nonatomic, copy) NSNumber *opusDTX;
+
+// Limits for the local camera
+@property (nonatomic) NSUInteger maxVideoWidth;
+@property (nonatomic) NSUInteger maxVideoHeight;
+@property (nonatomic) NSUInteger maxVideoFramerate;
+
+// For a description we created, before it is set locally: every setting above applies
+- (NSString *)localSDPFromSDP:(NSString *)sdp;
+
+// For a peer's description, before it is set remotely. Only the bitrate caps apply; a peer's b=AS
+// is what bounds our send rate, so this is what keeps our uplink within the profile. A lower limit the
+// peer already asked for is kept
+- (NSString *)remoteSDPFromSDP:(NSString *)sdp;
+
+// maxWidth, maxHeight and maxFrameRate for the local video source, or nil when none are set
+- (RTCMediaConstraints *)videoSourceConstraints;
+
+@end
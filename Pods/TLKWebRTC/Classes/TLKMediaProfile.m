@@ -0,0 +1,346 @@
+//
+//  TLKMediaProfile.m
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import "TLKMediaProfile.h"
+
+#import "RTCPair.h"
+#import "RTCMediaConstraints.h"
+
+#pragma mark - SDP rewriting
+
+// Everything below works on one media section at a time: an array of lines without their line
+// breaks, starting with the m= line.
+
+static NSString *TLKSDPMediaKind(NSString *mediaLine)
+{
+    NSRange space = [mediaLine rangeOfString:@" "];
+    if (![mediaLine hasPrefix:@"m="] || space.location == NSNotFound) {
+        return nil;
+    }
+    return [mediaLine substringWithRange:NSMakeRange(2, space.location - 2)];
+}
+
+// The payload type an a=rtpmap: or a=fmtp: line is about, and the rest of the line after it
+static BOOL TLKSDPSplitAttribute(NSString *line, NSString *prefix, NSString **payloadType, NSString **value)
+{
+    if (![line hasPrefix:prefix]) {
+        return NO;
+    }
+    NSRange space = [line rangeOfString:@" " options:0 range:NSMakeRange(prefix.length, line.length - prefix.length)];
+    if (space.location == NSNotFound) {
+        return NO;
+    }
+    *payloadType = [line substringWithRange:NSMakeRange(prefix.length, space.location - prefix.length)];
+    *value = [line substringFromIndex:NSMaxRange(space)];
+    return YES;
+}
+
+// Payload type to codec name, from the a=rtpmap: lines
+static NSDictionary *TLKSDPCodecNames(NSArray *lines)
+{
+    NSMutableDictionary *names = [NSMutableDictionary dictionary];
+    for (NSString *line in lines) {
+        NSString *payloadType = nil;
+        NSString *value = nil;
+        if (TLKSDPSplitAttribute(line, @"a=rtpmap:", &payloadType, &value)) {
+            names[payloadType] = [[value componentsSeparatedByString:@"/"] firstObject];
+        }
+    }
+    return names;
+}
+
+static NSUInteger TLKSDPIndexOfAttribute(NSArray *lines, NSString *prefix, NSString *payloadType)
+{
+    NSString *start = [NSString stringWithFormat:@"%@%@ ", prefix, payloadType];
+    return [lines indexOfObjectPassingTest:^BOOL(NSString *line, NSUInteger idx, BOOL *stop) {
+        return [line hasPrefix:start];
+    }];
+}
+
+// The tightest b=AS or b=TIAS limit in the section in kbps, 0 when it has none
+static NSUInteger TLKSDPBandwidth(NSArray *lines)
+{
+    NSUInteger kbps = 0;
+    for (NSString *line in lines) {
+        NSUInteger value = 0;
+        if ([line hasPrefix:@"b=AS:"]) {
+            value = (NSUInteger)[[line substringFromIndex:5] longLongValue];
+        } else if ([line hasPrefix:@"b=TIAS:"]) {
+            value = (NSUInteger)([[line substringFromIndex:7] longLongValue] / 1000);
+        }
+        if (value && (!kbps || value < kbps)) {
+            kbps = value;
+        }
+    }
+    return kbps;
+}
+
+// b= lines follow i= and c= and come before k= and a= (RFC 4566 section 5), so the caps go right
+// after whichever of those the section has. Old AS and TIAS values are dropped.
+static void TLKSDPSetBandwidth(NSMutableArray *lines, NSUInteger kbps)
+{
+    NSIndexSet *old = [lines indexesOfObjectsPassingTest:^BOOL(NSString *line, NSUInteger idx, BOOL *stop) {
+        return [line hasPrefix:@"b=AS:"] || [line hasPrefix:@"b=TIAS:"];
+    }];
+    [lines removeObjectsAtIndexes:old];
+
+    NSUInteger insertAt = 1;
+    while (insertAt < lines.count && ([lines[insertAt] hasPrefix:@"i="] || [lines[insertAt] hasPrefix:@"c="] || [lines[insertAt] hasPrefix:@"b="])) {
+        insertAt++;
+    }
+    [lines insertObject:[NSString stringWithFormat:@"b=AS:%lu", (unsigned long)kbps] atIndex:insertAt];
+    [lines insertObject:[NSString stringWithFormat:@"b=TIAS:%lu", (unsigned long)kbps * 1000] atIndex:insertAt + 1];
+}
+
+static void TLKSDPPreferCodecs(NSMutableArray *lines, NSArray *preference)
+{
+    NSArray *fields = [lines[0] componentsSeparatedByString:@" "];
+    if (fields.count < 4) {
+        return;
+    }
+    NSArray *payloadTypes = [fields subarrayWithRange:NSMakeRange(3, fields.count - 3)];
+    NSDictionary *names = TLKSDPCodecNames(lines);
+
+    NSMutableArray *ordered = [NSMutableArray arrayWithCapacity:payloadTypes.count];
+    for (NSString *codec in preference) {
+        for (NSString *payloadType in payloadTypes) {
+            NSString *name = names[payloadType];
+            if (name && [name caseInsensitiveCompare:codec] == NSOrderedSame && ![ordered containsObject:payloadType]) {
+                [ordered addObject:payloadType];
+            }
+        }
+    }
+    for (NSString *payloadType in payloadTypes) {
+        if (![ordered containsObject:payloadType]) {
+            [ordered addObject:payloadType];
+        }
+    }
+    lines[0] = [[[fields subarrayWithRange:NSMakeRange(0, 3)] arrayByAddingObjectsFromArray:ordered] componentsJoinedByString:@" "];
+}
+
+// Sets fmtp parameters in a "key=value;key=value" list. Existing keys keep their place, new ones
+// are appended in key order so the output doesn't depend on dictionary ordering.
+static NSString *TLKSDPSetFormatParameters(NSString *parameters, NSDictionary *updates)
+{
+    NSMutableArray *pairs = [NSMutableArray array];
+    NSMutableDictionary *remaining = [updates mutableCopy];
+    for (NSString *pair in [parameters componentsSeparatedByString:@";"]) {
+        if (pair.length == 0) {
+            continue;
+        }
+        NSString *key = [[pair componentsSeparatedByString:@"="] firstObject];
+        NSString *value = remaining[key];
+        if (value) {
+            [pairs addObject:[NSString stringWithFormat:@"%@=%@", key, value]];
+            [remaining removeObjectForKey:key];
+        } else {
+            [pairs addObject:pair];
+        }
+    }
+    for (NSString *key in [[remaining allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+        [pairs addObject:[NSString stringWithFormat:@"%@=%@", key, remaining[key]]];
+    }
+    return [pairs componentsJoinedByString:@";"];
+}
+
+@implementation TLKMediaProfile
+
+- (instancetype)initWithName:(NSString *)name {
+    self = [super init];
+    if (self) {
+        _name = [name copy];
+    }
+    return self;
+}
+
++ (instancetype)defaultProfile {
+    return [[self alloc] initWithName:@"default"];
+}
+
++ (instancetype)cellularProfile {
+    TLKMediaProfile *profile = [[self alloc] initWithName:@"cellular"];
+    profile.maxVideoBitrate = 500;
+    profile.maxAudioBitrate = 32;
+    profile.videoCodecPreference = @[@"VP8"];
+    profile.audioCodecPreference = @[@"opus"];
+    profile.opusFEC = @YES;
+    profile.opusDTX = @YES;
+    profile.maxVideoWidth = 640;
+    profile.maxVideoHeight = 480;
+    profile.maxVideoFramerate = 15;
+    return profile;
+}
+
++ (instancetype)lowBandwidthProfile {
+    TLKMediaProfile *profile = [[self alloc] initWithName:@"low-bandwidth"];
+    profile.maxVideoBitrate = 150;
+    profile.maxAudioBitrate = 24;
+    profile.videoCodecPreference = @[@"VP8"];
+    profile.audioCodecPreference = @[@"opus"];
+    profile.opusPacketTime = 60;
+    profile.opusFEC = @YES;
+    profile.opusDTX = @YES;
+    profile.maxVideoWidth = 320;
+    profile.maxVideoHeight = 240;
+    profile.maxVideoFramerate = 15;
+    return profile;
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+    TLKMediaProfile *copy = [[[self class] allocWithZone:zone] initWithName:self.name];
+    copy.maxVideoBitrate = self.maxVideoBitrate;
+    copy.maxAudioBitrate = self.maxAudioBitrate;
+    copy.videoCodecPreference = self.videoCodecPreference;
+    copy.audioCodecPreference = self.audioCodecPreference;
+    copy.opusPacketTime = self.opusPacketTime;
+    copy.opusFEC = self.opusFEC;
+    copy.opusDTX = self.opusDTX;
+    copy.maxVideoWidth = self.maxVideoWidth;
+    copy.maxVideoHeight = self.maxVideoHeight;
+    copy.maxVideoFramerate = self.maxVideoFramerate;
+    return copy;
+}
+
+#pragma mark - SDP
+
+- (NSString *)localSDPFromSDP:(NSString *)sdp {
+    BOOL rewrites = self.maxVideoBitrate || self.maxAudioBitrate || self.videoCodecPreference.count || self.audioCodecPreference.count ||
+                    self.opusPacketTime || self.opusFEC || self.opusDTX;
+    return rewrites ? [self _SDPFromSDP:sdp local:YES] : sdp;
+}
+
+- (NSString *)remoteSDPFromSDP:(NSString *)sdp {
+    BOOL rewrites = self.maxVideoBitrate || self.maxAudioBitrate;
+    return rewrites ? [self _SDPFromSDP:sdp local:NO] : sdp;
+}
+
+- (NSString *)_SDPFromSDP:(NSString *)sdp local:(BOOL)local {
+    // Lines end in CRLF, but take bare LF too; whatever comes in goes out as CRLF
+    NSMutableArray *lines = [NSMutableArray array];
+    for (NSString *line in [sdp componentsSeparatedByString:@"\n"]) {
+        [lines addObject:[line hasSuffix:@"\r"] ? [line substringToIndex:line.length - 1] : line];
+    }
+    if ([[lines lastObject] length] == 0) {
+        [lines removeLastObject];
+    }
+
+    NSMutableArray *output = [NSMutableArray arrayWithCapacity:lines.count + 8];
+    NSUInteger start = 0;
+    while (start < lines.count) {
+        NSUInteger end = start + 1;
+        while (end < lines.count && ![lines[end] hasPrefix:@"m="]) {
+            end++;
+        }
+        NSMutableArray *section = [[lines subarrayWithRange:NSMakeRange(start, end - start)] mutableCopy];
+        if ([lines[start] hasPrefix:@"m="]) {
+            [self _rewriteMediaSection:section local:local];
+        }
+        [output addObjectsFromArray:section];
+        start = end;
+    }
+    [output addObject:@""];
+    return [output componentsJoinedByString:@"\r\n"];
+}
+
+- (void)_rewriteMediaSection:(NSMutableArray *)lines local:(BOOL)local {
+    NSString *kind = TLKSDPMediaKind(lines[0]);
+    BOOL audio = [kind isEqualToString:@"audio"];
+    if (!audio && ![kind isEqualToString:@"video"]) {
+        return;
+    }
+
+    NSUInteger bitrate = audio ? self.maxAudioBitrate : self.maxVideoBitrate;
+    // The peer's own limit on what it receives stands; ours can only take it lower
+    NSUInteger peerBitrate = local ? 0 : TLKSDPBandwidth(lines);
+    if (bitrate && peerBitrate) {
+        bitrate = MIN(bitrate, peerBitrate);
+    }
+    if (bitrate) {
+        TLKSDPSetBandwidth(lines, bitrate);
+    }
+    if (!local) {
+        return;
+    }
+
+    NSArray *preference = audio ? self.audioCodecPreference : self.videoCodecPreference;
+    if (preference.count) {
+        TLKSDPPreferCodecs(lines, preference);
+    }
+    if (audio) {
+        [self _rewriteOpusInSection:lines];
+    }
+}
+
+- (void)_rewriteOpusInSection:(NSMutableArray *)lines {
+    NSString *opus = nil;
+    NSDictionary *names = TLKSDPCodecNames(lines);
+    for (NSString *payloadType in names) {
+        if ([names[payloadType] caseInsensitiveCompare:@"opus"] == NSOrderedSame) {
+            opus = payloadType;
+            break;
+        }
+    }
+    if (!opus) {
+        return;
+    }
+
+    NSMutableDictionary *updates = [NSMutableDictionary dictionary];
+    if (self.opusFEC) {
+        updates[@"useinbandfec"] = self.opusFEC.boolValue ? @"1" : @"0";
+    }
+    if (self.opusDTX) {
+        updates[@"usedtx"] = self.opusDTX.boolValue ? @"1" : @"0";
+    }
+    if (self.maxAudioBitrate) {
+        updates[@"maxaveragebitrate"] = [NSString stringWithFormat:@"%lu", (unsigned long)self.maxAudioBitrate * 1000];
+    }
+
+    NSUInteger fmtpIndex = TLKSDPIndexOfAttribute(lines, @"a=fmtp:", opus);
+    if (updates.count) {
+        NSString *parameters = @"";
+        if (fmtpIndex != NSNotFound) {
+            NSString *payloadType = nil;
+            TLKSDPSplitAttribute(lines[fmtpIndex], @"a=fmtp:", &payloadType, &parameters);
+        } else {
+            fmtpIndex = TLKSDPIndexOfAttribute(lines, @"a=rtpmap:", opus) + 1;
+            [lines insertObject:@"" atIndex:fmtpIndex];
+        }
+        lines[fmtpIndex] = [NSString stringWithFormat:@"a=fmtp:%@ %@", opus, TLKSDPSetFormatParameters(parameters, updates)];
+    }
+
+    if (self.opusPacketTime) {
+        NSIndexSet *old = [lines indexesOfObjectsPassingTest:^BOOL(NSString *line, NSUInteger idx, BOOL *stop) {
+            return [line hasPrefix:@"a=ptime:"];
+        }];
+        [lines removeObjectsAtIndexes:old];
+        // Next to Opus's own attributes, wherever those ended up after the removal
+        NSUInteger anchor = TLKSDPIndexOfAttribute(lines, @"a=fmtp:", opus);
+        if (anchor == NSNotFound) {
+            anchor = TLKSDPIndexOfAttribute(lines, @"a=rtpmap:", opus);
+        }
+        [lines insertObject:[NSString stringWithFormat:@"a=ptime:%lu", (unsigned long)self.opusPacketTime] atIndex:anchor + 1];
+    }
+}
+
+#pragma mark - Capture
+
+- (RTCMediaConstraints *)videoSourceConstraints {
+    NSMutableArray *mandatory = [NSMutableArray array];
+    if (self.maxVideoWidth) {
+        [mandatory addObject:[[RTCPair alloc] initWithKey:@"maxWidth" value:[NSString stringWithFormat:@"%lu", (unsigned long)self.maxVideoWidth]]];
+    }
+    if (self.maxVideoHeight) {
+        [mandatory addObject:[[RTCPair alloc] initWithKey:@"maxHeight" value:[NSString stringWithFormat:@"%lu", (unsigned long)self.maxVideoHeight]]];
+    }
+    if (self.maxVideoFramerate) {
+        [mandatory addObject:[[RTCPair alloc] initWithKey:@"maxFrameRate" value:[NSString stringWithFormat:@"%lu", (unsigned long)self.maxVideoFramerate]]];
+    }
+    if (mandatory.count == 0) {
+        return nil;
+    }
+    return [[RTCMediaConstraints alloc] initWithMandatoryConstraints:mandatory optionalConstraints:@[]];
+}
+
+@end
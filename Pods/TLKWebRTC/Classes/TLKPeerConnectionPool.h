@@ -0,0 +1,31 @@
+//
+//  TLKPeerConnectionPool.h
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import <Foundation/Foundation.h>
+
+@class RTCPeerConnection;
+
+// Peer connections created ahead of time so a joining peer can take one instead of waiting for
+// one to be built. Claims are refilled in the background, one connection per block on queue, so
+// a refill never holds up other work on that queue for long. Only use it from queue.
+@interface TLKPeerConnectionPool : NSObject
+
+// factory is called on queue whenever the pool is short
+- (instancetype)initWithQueue:(dispatch_queue_t)queue factory:(RTCPeerConnection *(^)(void))factory;
+
+@property (readonly, nonatomic) NSUInteger capacity;
+@property (readonly, nonatomic) NSUInteger count;
+
+// Returns the connections that no longer fit, for the caller to close. Growing starts a refill
+- (NSArray *)resizeToCapacity:(NSUInteger)capacity;
+
+// A ready connection, or nil if the pool is empty. Either way a refill is started
+- (RTCPeerConnection *)claimPeerConnection;
+
+// Empties the pool, for when the connections in it were made with settings that have since changed,
+// and returns them for the caller to close. The pool then refills with fresh ones
+- (NSArray *)drain;
+
+@end
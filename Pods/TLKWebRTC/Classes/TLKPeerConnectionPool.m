@@ -0,0 +1,87 @@
+//
+//  TLKPeerConnectionPool.m
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import "TLKPeerConnectionPool.h"
+
+@interface TLKPeerConnectionPool ()
+
+@property (nonatomic, strong) dispatch_queue_t queue;
+@property (nonatomic, copy) RTCPeerConnection *(^factory)(void);
+@property (nonatomic, strong) NSMutableArray *connections;
+@property (readwrite, nonatomic) NSUInteger capacity;
+@property (nonatomic) BOOL refillScheduled;
+
+@end
+
+@implementation TLKPeerConnectionPool
+
+- (instancetype)initWithQueue:(dispatch_queue_t)queue factory:(RTCPeerConnection *(^)(void))factory {
+    self = [super init];
+    if (self) {
+        _queue = queue;
+        _factory = [factory copy];
+        _connections = [NSMutableArray array];
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+    return self.connections.count;
+}
+
+- (NSArray *)resizeToCapacity:(NSUInteger)capacity {
+    self.capacity = capacity;
+    NSArray *surplus = @[];
+    if (self.connections.count > capacity) {
+        NSRange range = NSMakeRange(capacity, self.connections.count - capacity);
+        surplus = [self.connections subarrayWithRange:range];
+        [self.connections removeObjectsInRange:range];
+    }
+    [self _scheduleRefill];
+    return surplus;
+}
+
+- (RTCPeerConnection *)claimPeerConnection {
+    // Oldest first; they have had the longest to settle
+    RTCPeerConnection *connection = [self.connections firstObject];
+    if (connection) {
+        [self.connections removeObjectAtIndex:0];
+    }
+    [self _scheduleRefill];
+    return connection;
+}
+
+- (NSArray *)drain {
+    NSArray *drained = [self.connections copy];
+    [self.connections removeAllObjects];
+    [self _scheduleRefill];
+    return drained;
+}
+
+- (void)_scheduleRefill {
+    if (self.refillScheduled || self.connections.count >= self.capacity) {
+        return;
+    }
+    self.refillScheduled = YES;
+    __weak TLKPeerConnectionPool *weakSelf = self;
+    dispatch_async(self.queue, ^{
+        TLKPeerConnectionPool *strongSelf = weakSelf;
+        if (!strongSelf) {
+            return;
+        }
+        strongSelf.refillScheduled = NO;
+        if (strongSelf.connections.count < strongSelf.capacity) {
+            RTCPeerConnection *connection = strongSelf.factory();
+            if (!connection) {
+                // Don't spin on a factory that can't deliver; the next claim or resize tries again
+                return;
+            }
+            [strongSelf.connections addObject:connection];
+        }
+        [strongSelf _scheduleRefill];
+    });
+}
+
+@end
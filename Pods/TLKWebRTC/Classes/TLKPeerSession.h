@@ -0,0 +1,78 @@
+//
+//  TLKPeerSession.h
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import <Foundation/Foundation.h>
+
+#import "TLKEncodingPolicy.h"
+
+@class RTCPeerConnection;
+@class RTCICECandidate;
+@class TLKPeerStatsSampler;
+@class TLKStatsHistory;
+
+typedef NS_ENUM(NSInteger, TLKPeerRole) {
+    TLKPeerRoleNone,
+    TLKPeerRoleInitiator,   // We sent the offer
+    TLKPeerRoleReceiver     // We answered the peer's offer
+};
+
+// Everything TLKWebRTC tracks for one remote peer
+@interface TLKPeerSession : NSObject
+
+- (instancetype)initWithIdentifier:(NSString *)identifier peerConnection:(RTCPeerConnection *)peerConnection;
+
+@property (readonly, nonatomic, copy) NSString *identifier;
+@property (readonly, nonatomic, strong) RTCPeerConnection *peerConnection;
+@property (nonatomic) TLKPeerRole role;
+
+// YES on the side that sent the first offer. Only that side offers again, so renegotiation offers can't cross;
+// the other side asks it for one through the delegate
+@property (nonatomic) BOOL offersRenegotiation;
+
+// How much of the local video this peer gets, set by the encoding policy
+@property (nonatomic) TLKEncodingTier encodingTier;
+
+// Where the quality controller has this peer, 0 being the best
+@property (nonatomic) NSUInteger qualityLevel;
+
+// Remote candidates that arrived before the remote description was applied
+@property (readonly, nonatomic, strong) NSMutableArray *pendingICECandidates;
+
+// Local candidates waiting out the batch window before they go to the delegate
+@property (readonly, nonatomic, strong) NSMutableArray *outboundICECandidates;
+
+// Set when an offer is wanted while another negotiation is still in flight; sent once signaling is stable
+@property (nonatomic) BOOL renegotiationNeeded;
+@property (nonatomic) BOOL iceRestartNeeded;
+
+// ICE restarts since the connection was last up, and a counter that invalidates pending restart timers
+@property (nonatomic) NSUInteger iceRestartCount;
+@property (nonatomic) NSUInteger iceRecoveryGeneration;
+
+// Made on the first stats sample
+@property (nonatomic, strong) TLKPeerStatsSampler *statsSampler;
+@property (nonatomic, strong) TLKStatsHistory *statsHistory;
+
+// CFAbsoluteTimeGetCurrent() when the session was created and when it last saw signaling
+@property (readonly, nonatomic) CFAbsoluteTime createdAt;
+@property (nonatomic) CFAbsoluteTime lastActivityAt;
+
+@end
+
+// Sessions indexed both by peer ID and by peer connection, so callbacks from WebRTC,
+// which only carry the connection, find their peer without a scan. Not thread safe.
+@interface TLKPeerSessionTable : NSObject
+
+@property (readonly, nonatomic) NSUInteger count;
+@property (readonly, nonatomic) NSArray *allSessions;
+
+// Replaces any session already registered under the same identifier
+- (void)addSession:(TLKPeerSession *)session;
+- (TLKPeerSession *)removeSessionForID:(NSString *)identifier;
+
+- (TLKPeerSession *)sessionForID:(NSString *)identifier;
+- (TLKPeerSession *)sessionForPeerConnection:(RTCPeerConnection *)peerConnection;
+
+@end
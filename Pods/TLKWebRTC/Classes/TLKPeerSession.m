@@ -0,0 +1,80 @@
+//
+//  TLKPeerSession.m
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import "TLKPeerSession.h"
+
+@implementation TLKPeerSession
+
+- (instancetype)initWithIdentifier:(NSString *)identifier peerConnection:(RTCPeerConnection *)peerConnection {
+    self = [super init];
+    if (self) {
+        _identifier = [identifier copy];
+        _peerConnection = peerConnection;
+        _pendingICECandidates = [NSMutableArray array];
+        _outboundICECandidates = [NSMutableArray array];
+        _createdAt = CFAbsoluteTimeGetCurrent();
+        _lastActivityAt = _createdAt;
+    }
+    return self;
+}
+
+@end
+
+@interface TLKPeerSessionTable ()
+
+@property (nonatomic, strong) NSMutableDictionary *sessionsByID;
+@property (nonatomic, strong) NSMapTable *sessionsByConnection;
+
+@end
+
+@implementation TLKPeerSessionTable
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _sessionsByID = [NSMutableDictionary dictionary];
+        // Connections are matched by identity; RTCPeerConnection doesn't define equality anyway
+        _sessionsByConnection = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                                      valueOptions:NSPointerFunctionsStrongMemory];
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+    return self.sessionsByID.count;
+}
+
+- (NSArray *)allSessions {
+    return [self.sessionsByID allValues];
+}
+
+- (void)addSession:(TLKPeerSession *)session {
+    [self removeSessionForID:session.identifier];
+    [self.sessionsByID setObject:session forKey:session.identifier];
+    if (session.peerConnection) {
+        [self.sessionsByConnection setObject:session forKey:session.peerConnection];
+    }
+}
+
+- (TLKPeerSession *)removeSessionForID:(NSString *)identifier {
+    TLKPeerSession *session = [self.sessionsByID objectForKey:identifier];
+    if (session) {
+        [self.sessionsByID removeObjectForKey:identifier];
+        if (session.peerConnection && [self.sessionsByConnection objectForKey:session.peerConnection] == session) {
+            [self.sessionsByConnection removeObjectForKey:session.peerConnection];
+        }
+    }
+    return session;
+}
+
+- (TLKPeerSession *)sessionForID:(NSString *)identifier {
+    return identifier ? [self.sessionsByID objectForKey:identifier] : nil;
+}
+
+- (TLKPeerSession *)sessionForPeerConnection:(RTCPeerConnection *)peerConnection {
+    return peerConnection ? [self.sessionsByConnection objectForKey:peerConnection] : nil;
+}
+
+@end
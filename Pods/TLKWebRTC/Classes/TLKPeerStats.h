@@ -0,0 +1,78 @@
+//
+//  TLKPeerStats.h
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import <Foundation/Foundation.h>
+
+// Keys that TLKWebRTC adds to each flattened WebRTC stats report, next to the report's own values
+extern NSString * const TLKStatsReportTypeKey;
+extern NSString * const TLKStatsReportIDKey;
+
+// One sample of a peer connection's stats. Rates cover the time since the previous sample
+@interface TLKPeerStats : NSObject
+
+@property (nonatomic, copy) NSString *peerID;
+// Seconds on a monotonic clock that doesn't follow changes to the wall clock; only differences mean anything
+@property (nonatomic) NSTimeInterval timestamp;
+// Seconds since the previous sample; 0 for the first, whose rates are all 0
+@property (nonatomic) NSTimeInterval interval;
+
+// Milliseconds, on the selected candidate pair when there is one
+@property (nonatomic) double roundTripTime;
+// Milliseconds, for what we receive
+@property (nonatomic) double audioJitter;
+@property (nonatomic) double videoJitter;
+
+// Fraction of packets lost, 0 to 1. Send side loss is what the peer reports back to us
+@property (nonatomic) double audioSendLoss;
+@property (nonatomic) double audioReceiveLoss;
+@property (nonatomic) double videoSendLoss;
+@property (nonatomic) double videoReceiveLoss;
+
+// Bits per second
+@property (nonatomic) double audioSendBitrate;
+@property (nonatomic) double audioReceiveBitrate;
+@property (nonatomic) double videoSendBitrate;
+@property (nonatomic) double videoReceiveBitrate;
+
+@property (nonatomic) double videoSendFramerate;
+@property (nonatomic) double videoReceiveFramerate;
+
+// WebRTC's bandwidth estimates, bits per second
+@property (nonatomic) double availableSendBandwidth;
+@property (nonatomic) double availableReceiveBandwidth;
+
+// The candidate pair in use
+@property (nonatomic, copy) NSString *localAddress;
+@property (nonatomic, copy) NSString *remoteAddress;
+@property (nonatomic, copy) NSString *localCandidateType;
+@property (nonatomic, copy) NSString *remoteCandidateType;
+
+@end
+
+// Turns successive sets of reports for one peer connection into TLKPeerStats, keeping the counters
+// from the last set so it can work out rates. Reports are dictionaries of WebRTC's own stats
+// values (googRtt, bytesSent and so on, all strings) plus the TLKStatsReport keys above.
+@interface TLKPeerStatsSampler : NSObject
+
+// time is on the same monotonic clock as TLKPeerStats' timestamp
+- (TLKPeerStats *)statsFromReports:(NSArray *)reports atTime:(NSTimeInterval)time;
+
+@end
+
+// The last capacity samples for a peer, oldest dropped first
+@interface TLKStatsHistory : NSObject
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity;
+
+@property (readonly, nonatomic) NSUInteger capacity;
+@property (readonly, nonatomic) NSUInteger count;
+
+- (void)addStats:(TLKPeerStats *)stats;
+
+// Oldest first
+- (NSArray *)allStats;
+- (TLKPeerStats *)latestStats;
+
+@end
@@ -0,0 +1,194 @@
+//
+//  TLKPeerStats.m
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import "TLKPeerStats.h"
+
+NSString * const TLKStatsReportTypeKey = @".type";
+NSString * const TLKStatsReportIDKey = @".id";
+
+@implementation TLKPeerStats
+@end
+
+// Cumulative counters from one ssrc report
+@interface TLKStatsCounters : NSObject
+
+@property (nonatomic) double bytes;
+@property (nonatomic) double packets;
+@property (nonatomic) double packetsLost;
+
+@end
+
+@implementation TLKStatsCounters
+@end
+
+// Changes in the counters of every ssrc of one kind (audio or video, sent or received) since the last sample
+typedef struct {
+    double bytes;
+    double packets;
+    double packetsLost;
+} TLKStatsDelta;
+
+static double TLKStatsLossRate(TLKStatsDelta delta, BOOL sending) {
+    // A sender's packetsSent already includes what was lost; a receiver never counts lost packets
+    double total = sending ? delta.packets : delta.packets + delta.packetsLost;
+    if (total <= 0) {
+        return 0;
+    }
+    return MIN(1.0, MAX(0.0, delta.packetsLost / total));
+}
+
+@interface TLKPeerStatsSampler ()
+
+// Counters by report ID, from the previous call
+@property (nonatomic, strong) NSMutableDictionary *counters;
+@property (nonatomic) NSTimeInterval lastTime;
+
+@end
+
+@implementation TLKPeerStatsSampler
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _counters = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+- (TLKPeerStats *)statsFromReports:(NSArray *)reports atTime:(NSTimeInterval)time {
+    TLKPeerStats *stats = [[TLKPeerStats alloc] init];
+    stats.timestamp = time;
+    BOOL first = self.lastTime == 0;
+    stats.interval = first ? 0 : MAX(0, time - self.lastTime);
+    self.lastTime = time;
+
+    TLKStatsDelta audioSent = {0}, audioReceived = {0}, videoSent = {0}, videoReceived = {0};
+    NSMutableDictionary *counters = [NSMutableDictionary dictionary];
+    double ssrcRTT = 0;
+
+    for (NSDictionary *report in reports) {
+        NSString *type = report[TLKStatsReportTypeKey];
+
+        if ([type isEqualToString:@"ssrc"]) {
+            BOOL sending = report[@"bytesSent"] != nil;
+            BOOL video = [report[@"mediaType"] isEqualToString:@"video"];
+
+            TLKStatsCounters *current = [[TLKStatsCounters alloc] init];
+            current.bytes = [report[sending ? @"bytesSent" : @"bytesReceived"] doubleValue];
+            current.packets = [report[sending ? @"packetsSent" : @"packetsReceived"] doubleValue];
+            current.packetsLost = MAX(0, [report[@"packetsLost"] doubleValue]);
+            NSString *reportID = report[TLKStatsReportIDKey];
+            if (reportID) {
+                counters[reportID] = current;
+            }
+
+            // A stream seen for the first time, or whose counters went backwards after a restart,
+            // only sets the baseline
+            TLKStatsCounters *previous = reportID ? self.counters[reportID] : nil;
+            if (previous && current.bytes >= previous.bytes && current.packets >= previous.packets && current.packetsLost >= previous.packetsLost) {
+                TLKStatsDelta *delta = video ? (sending ? &videoSent : &videoReceived) : (sending ? &audioSent : &audioReceived);
+                delta->bytes += current.bytes - previous.bytes;
+                delta->packets += current.packets - previous.packets;
+                delta->packetsLost += current.packetsLost - previous.packetsLost;
+            }
+
+            if (sending) {
+                ssrcRTT = MAX(ssrcRTT, [report[@"googRtt"] doubleValue]);
+                if (video) {
+                    stats.videoSendFramerate += [report[@"googFrameRateSent"] doubleValue];
+                }
+            } else {
+                double jitter = [report[@"googJitterReceived"] doubleValue];
+                if (video) {
+                    stats.videoJitter = MAX(stats.videoJitter, jitter);
+                    stats.videoReceiveFramerate += [report[@"googFrameRateReceived"] doubleValue];
+                } else {
+                    stats.audioJitter = MAX(stats.audioJitter, jitter);
+                }
+            }
+        } else if ([type isEqualToString:@"VideoBwe"]) {
+            stats.availableSendBandwidth = [report[@"googAvailableSendBandwidth"] doubleValue];
+            stats.availableReceiveBandwidth = [report[@"googAvailableReceiveBandwidth"] doubleValue];
+        } else if ([type isEqualToString:@"googCandidatePair"] && [report[@"googActiveConnection"] isEqualToString:@"true"]) {
+            stats.roundTripTime = [report[@"googRtt"] doubleValue];
+            stats.localAddress = report[@"googLocalAddress"];
+            stats.remoteAddress = report[@"googRemoteAddress"];
+            stats.localCandidateType = report[@"googLocalCandidateType"];
+            stats.remoteCandidateType = report[@"googRemoteCandidateType"];
+        }
+    }
+
+    // Streams that have gone away are forgotten
+    self.counters = counters;
+
+    if (!stats.localAddress) {
+        stats.roundTripTime = ssrcRTT;
+    }
+
+    if (stats.interval > 0) {
+        stats.audioSendBitrate = audioSent.bytes * 8 / stats.interval;
+        stats.audioReceiveBitrate = audioReceived.bytes * 8 / stats.interval;
+        stats.videoSendBitrate = videoSent.bytes * 8 / stats.interval;
+        stats.videoReceiveBitrate = videoReceived.bytes * 8 / stats.interval;
+        stats.audioSendLoss = TLKStatsLossRate(audioSent, YES);
+        stats.audioReceiveLoss = TLKStatsLossRate(audioReceived, NO);
+        stats.videoSendLoss = TLKStatsLossRate(videoSent, YES);
+        stats.videoReceiveLoss = TLKStatsLossRate(videoReceived, NO);
+    }
+
+    return stats;
+}
+
+@end
+
+@interface TLKStatsHistory ()
+
+@property (nonatomic, strong) NSMutableArray *samples;
+// Index of the oldest sample once the ring is full
+@property (nonatomic) NSUInteger head;
+
+@end
+
+@implementation TLKStatsHistory
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity {
+    self = [super init];
+    if (self) {
+        _capacity = MAX(1, capacity);
+        _samples = [NSMutableArray arrayWithCapacity:_capacity];
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+    return self.samples.count;
+}
+
+- (void)addStats:(TLKPeerStats *)stats {
+    if (self.samples.count < self.capacity) {
+        [self.samples addObject:stats];
+    } else {
+        self.samples[self.head] = stats;
+        self.head = (self.head + 1) % self.capacity;
+    }
+}
+
+- (NSArray *)allStats {
+    if (self.head == 0) {
+        return [self.samples copy];
+    }
+    NSRange newer = NSMakeRange(self.head, self.samples.count - self.head);
+    NSRange older = NSMakeRange(0, self.head);
+    return [[self.samples subarrayWithRange:newer] arrayByAddingObjectsFromArray:[self.samples subarrayWithRange:older]];
+}
+
+- (TLKPeerStats *)latestStats {
+    if (self.samples.count == 0) {
+        return nil;
+    }
+    return self.samples[(self.head + self.samples.count - 1) % self.samples.count];
+}
+
+@end
@@ -0,0 +1,63 @@
+//
+//  TLKQualityController.h
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import <Foundation/Foundation.h>
+
+@class TLKPeerStats;
+@class TLKMediaProfile;
+
+// Moves each peer up and down a ladder of video levels as its link gets worse or better, so a
+// struggling link sheds video before it starts losing audio. Level 0 is the best. A peer steps
+// down one level after degradeSamples congested samples in a row, and up one level only after
+// upgradeSamples clean ones and at least upgradeHoldTime since it last stepped down, so a link
+// that flaps doesn't drag the encoder back and forth.
+//
+// Pure and deterministic: all it sees are the TLKPeerStats passed in, and time comes from their
+// timestamps, so a recorded trace replayed through it gives the same levels every time. Not
+// thread safe.
+@interface TLKQualityController : NSObject
+
+// levels are TLKMediaProfiles, best first. Only their video bitrate, size and framerate limits are used
+- (instancetype)initWithLevels:(NSArray *)levels;
+
+// Uncapped, then 600 kbps at 640x480 and 15 fps, 300 kbps at 352x288 and 15 fps, 150 kbps at
+// 352x288 and 10 fps, and 80 kbps at 192x144 and 7 fps
++ (NSArray *)defaultLevels;
+
+@property (readonly, nonatomic, copy) NSArray *levels;
+
+// A sample is congested when any of these is crossed: send loss as a fraction, round trip time
+// in milliseconds, or a bandwidth estimate below what the level needs. Defaults: 10%, 400 ms
+@property (nonatomic) double degradeLoss;
+@property (nonatomic) double degradeRoundTripTime;
+
+// A sample is clean when loss and round trip time are below these and the bandwidth estimate has
+// upgradeHeadroom times what the next level up needs, or is capped, see below. Defaults: 2%, 250 ms, 1.3
+@property (nonatomic) double upgradeLoss;
+@property (nonatomic) double upgradeRoundTripTime;
+@property (nonatomic) double upgradeHeadroom;
+
+// A level's b=AS caps the bandwidth estimate too, so an estimate sitting at the level's own cap says
+// the cap is holding it there, not that the link is short. An estimate within this fraction of the
+// cap neither counts against the level nor holds back a step up, which is then left to loss and
+// round trip time. Default 0.1
+@property (nonatomic) double cappedEstimateMargin;
+
+// Defaults: 2 samples down, 5 samples and 10 seconds up
+@property (nonatomic) NSUInteger degradeSamples;
+@property (nonatomic) NSUInteger upgradeSamples;
+@property (nonatomic) NSTimeInterval upgradeHoldTime;
+
+// Feeds the peer's latest sample in and returns its level afterwards. Samples without an interval,
+// the first from any sampler, carry no rates and are skipped
+- (NSUInteger)levelAfterStats:(TLKPeerStats *)stats forPeerWithID:(NSString *)peerID;
+
+// 0 for peers it hasn't seen
+- (NSUInteger)levelForPeerWithID:(NSString *)peerID;
+- (void)removePeerWithID:(NSString *)peerID;
+
+- (TLKMediaProfile *)profileForLevel:(NSUInteger)level;
+
+@end
@@ -0,0 +1,147 @@
+//
+//  TLKQualityController.m
+//  Copyright (c) 2014 &yet, LLC and TLKWebRTC contributors
+//
+
+#import "TLKQualityController.h"
+#import "TLKPeerStats.h"
+#import "TLKMediaProfile.h"
+
+// Where one peer is on the ladder and how it got there
+@interface TLKQualityPeerState : NSObject
+
+@property (nonatomic) NSUInteger level;
+@property (nonatomic) NSUInteger congestedCount;
+@property (nonatomic) NSUInteger cleanCount;
+@property (nonatomic) NSTimeInterval lastDowngradeAt;
+
+@end
+
+@implementation TLKQualityPeerState
+@end
+
+static TLKMediaProfile *TLKQualityLevel(NSString *name, NSUInteger kbps, NSUInteger width, NSUInteger height, NSUInteger framerate)
+{
+    TLKMediaProfile *profile = [[TLKMediaProfile alloc] initWithName:name];
+    profile.maxVideoBitrate = kbps;
+    profile.maxVideoWidth = width;
+    profile.maxVideoHeight = height;
+    profile.maxVideoFramerate = framerate;
+    return profile;
+}
+
+@interface TLKQualityController ()
+
+@property (readwrite, nonatomic, copy) NSArray *levels;
+@property (nonatomic, strong) NSMutableDictionary *peers;
+
+@end
+
+@implementation TLKQualityController
+
+- (instancetype)initWithLevels:(NSArray *)levels {
+    self = [super init];
+    if (self) {
+        _levels = levels.count ? [levels copy] : [[self class] defaultLevels];
+        _peers = [NSMutableDictionary dictionary];
+        _degradeLoss = 0.10;
+        _degradeRoundTripTime = 400;
+        _upgradeLoss = 0.02;
+        _upgradeRoundTripTime = 250;
+        _upgradeHeadroom = 1.3;
+        _cappedEstimateMargin = 0.1;
+        _degradeSamples = 2;
+        _upgradeSamples = 5;
+        _upgradeHoldTime = 10;
+    }
+    return self;
+}
+
+- (instancetype)init {
+    return [self initWithLevels:nil];
+}
+
++ (NSArray *)defaultLevels {
+    return @[TLKQualityLevel(@"full", 0, 0, 0, 0),
+             TLKQualityLevel(@"high", 600, 640, 480, 15),
+             TLKQualityLevel(@"medium", 300, 352, 288, 15),
+             TLKQualityLevel(@"low", 150, 352, 288, 10),
+             TLKQualityLevel(@"minimal", 80, 192, 144, 7)];
+}
+
+- (TLKMediaProfile *)profileForLevel:(NSUInteger)level {
+    return self.levels[MIN(level, self.levels.count - 1)];
+}
+
+// Bits per second a level's video needs. An uncapped level needs at least what the next capped one does
+- (double)_bandwidthForLevel:(NSUInteger)level {
+    for (NSUInteger i = level; i < self.levels.count; i++) {
+        NSUInteger kbps = [self.levels[i] maxVideoBitrate];
+        if (kbps) {
+            return kbps * 1000.0;
+        }
+    }
+    return 0;
+}
+
+- (NSUInteger)levelForPeerWithID:(NSString *)peerID {
+    return [self.peers[peerID] level];
+}
+
+- (void)removePeerWithID:(NSString *)peerID {
+    [self.peers removeObjectForKey:peerID];
+}
+
+- (NSUInteger)levelAfterStats:(TLKPeerStats *)stats forPeerWithID:(NSString *)peerID {
+    TLKQualityPeerState *peer = self.peers[peerID];
+    if (!peer) {
+        peer = [[TLKQualityPeerState alloc] init];
+        peer.lastDowngradeAt = -INFINITY;
+        self.peers[peerID] = peer;
+    }
+    if (stats.interval <= 0) {
+        return peer.level;
+    }
+
+    double loss = MAX(stats.videoSendLoss, stats.audioSendLoss);
+    double rtt = stats.roundTripTime;
+    // 0 means WebRTC had no estimate, which says nothing either way
+    double bandwidth = stats.availableSendBandwidth;
+
+    // The estimate can't climb past the level's own cap, so one held at the cap can't show room for the level above
+    double cap = [[self profileForLevel:peer.level] maxVideoBitrate] * 1000.0;
+    BOOL capped = cap > 0 && fabs(bandwidth - cap) <= cap * self.cappedEstimateMargin;
+
+    double needed = [self _bandwidthForLevel:peer.level];
+    BOOL congested = loss > self.degradeLoss || rtt > self.degradeRoundTripTime || (bandwidth > 0 && !capped && bandwidth < needed);
+
+    BOOL clean = NO;
+    if (!congested && peer.level > 0) {
+        double neededAbove = [self _bandwidthForLevel:peer.level - 1] * self.upgradeHeadroom;
+        clean = loss < self.upgradeLoss && rtt < self.upgradeRoundTripTime && (bandwidth == 0 || capped || bandwidth >= neededAbove);
+    }
+
+    if (congested) {
+        peer.cleanCount = 0;
+        peer.congestedCount++;
+        if (peer.congestedCount >= self.degradeSamples && peer.level + 1 < self.levels.count) {
+            peer.level++;
+            peer.congestedCount = 0;
+            peer.lastDowngradeAt = stats.timestamp;
+        }
+    } else if (clean) {
+        peer.congestedCount = 0;
+        peer.cleanCount++;
+        if (peer.cleanCount >= self.upgradeSamples && stats.timestamp - peer.lastDowngradeAt >= self.upgradeHoldTime) {
+            peer.level--;
+            peer.cleanCount = 0;
+        }
+    } else {
+        // Neither bad enough to step down nor good enough to step up: stay put and start counting again
+        peer.congestedCount = 0;
+        peer.cleanCount = 0;
+    }
+    return peer.level;
+}
+
+@end
@@ -11,6 +11,11 @@
 #import "RTCTypes.h"
 
 @class RTCICEServer;
+@class TLKMediaProfile;
+@class TLKEncodingPolicy;
+@class TLKDataChannel;
+@class TLKPeerStats;
+@class TLKQualityController;
 
 @class AVCaptureDevice;
 
@@ -23,13 +28,86 @@
 - (instancetype)initWithVideoDevice:(AVCaptureDevice *)device;
 - (instancetype)initWithVideo:(BOOL)allowVideo;
 
+// Offer/answer handling, candidate flushing and every other peer connection state change run on
+// workQueue, which must be serial; pass NULL to give this instance a queue of its own
+- (instancetype)initWithVideoDevice:(AVCaptureDevice *)device workQueue:(dispatch_queue_t)workQueue;
+
+// As above, capturing within the profile's resolution and framerate limits. nil means the default profile
+- (instancetype)initWithVideoDevice:(AVCaptureDevice *)device workQueue:(dispatch_queue_t)workQueue mediaProfile:(TLKMediaProfile *)mediaProfile;
+
+@property (readonly, nonatomic, strong) dispatch_queue_t workQueue;
+
+// The queue delegate methods are called on, the main queue unless set otherwise
+@property (atomic, strong) dispatch_queue_t delegateQueue;
+
+// Bitrate caps, codec order and Opus settings written into every description before it is set, starting with
+// the next offer or answer. Capture limits only take effect through the initializer, when the local stream is made
+@property (atomic, copy) TLKMediaProfile *mediaProfile;
+
+// Fan-out limits for rooms with several peers: the policy splits peers into tiers, and peers below the full tier
+// get their video capped so the device isn't running a full quality encode for everyone. nil, the default, gives
+// every peer full quality. Can be set from any thread; the tiers are worked out again on the work queue
+@property (nonatomic, strong) TLKEncodingPolicy *encodingPolicy;
+
+// Re-runs the encoding policy, for after its prioritizedPeerIDs or limits have changed
+- (void)refreshEncodingTiers;
+
+// When greater than zero, local ICE candidates for a peer are held for up to this many seconds and handed
+// to the delegate together, see webRTC:didSendICECandidates:forPeerWithID:. 0, the default, sends each one
+// as soon as it is gathered
+@property (atomic) NSTimeInterval candidateBatchInterval;
+
+// When YES, the default, a peer whose ICE connection fails gets an ICE restart. The side that sent the first
+// offer restarts right away; the other side gives it disconnectGracePeriod to do so before restarting itself
+@property (atomic) BOOL restartsICEAutomatically;
+
+// Peer connections to keep ready, local stream attached, so addPeerConnectionForID: can hand one out instead of
+// building it while the peer waits. The pool refills on the work queue after each claim. 0, the default, turns it off
+@property (nonatomic) NSUInteger peerConnectionPoolSize;
+
+// When greater than zero, each peer connection's stats are sampled every this many seconds and handed to the
+// delegate as a TLKPeerStats, see webRTC:didSampleStats:forPeerWithID:. 0, the default, turns sampling off
+@property (nonatomic) NSTimeInterval statsInterval;
+
+// Adapts each peer to its link using the stats samples, so it only runs while statsInterval is set. A peer's level
+// caps the video bitrate sent to it, through renegotiation like the encoding tiers, and the camera runs at the size
+// and framerate of the worst-off peer's level. nil, the default, turns it off. Can be set from any thread
+@property (nonatomic, strong) TLKQualityController *qualityController;
+
+// How many samples to keep per peer for statsHistoryForPeerWithID:completion:. Defaults to 60
+@property (atomic) NSUInteger statsHistoryLength;
+
+// How long a peer may stay Disconnected, which often clears up on its own, before ICE is restarted. Defaults to 3 seconds
+@property (atomic) NSTimeInterval disconnectGracePeriod;
+
 - (void)addPeerConnectionForID:(NSString *)identifier;
 - (void)removePeerConnectionForID:(NSString *)identifier;
 
 - (void)createOfferForPeerWithID:(NSString *)peerID;
 - (void)setRemoteDescription:(RTCSessionDescription *)remoteSDP forPeerWithID:(NSString *)peerID receiver:(BOOL)isReceiver;
+// A candidate for a peer that hasn't been added yet is held until addPeerConnectionForID:, and dropped if
+// removePeerConnectionForID: comes first or the peer isn't added within 30 seconds of its first candidate.
+// Up to 50 are held per peer
 - (void)addICECandidate:(RTCICECandidate *)candidate forPeerWithID:(NSString *)peerID;
 
+// Opens a data channel to the peer; anything sent before it opens is queued. Both kinds are reliable, an ordered
+// channel delivers messages in the order they were sent, an unordered one as soon as each arrives. A channel
+// added after the first offer/answer renegotiates the peer connection
+- (TLKDataChannel *)createDataChannelWithLabel:(NSString *)label ordered:(BOOL)ordered forPeerWithID:(NSString *)peerID;
+
+// Sends an offer with fresh ICE credentials, keeping the peer connection and its media. The answer comes back
+// through setRemoteDescription:forPeerWithID:receiver: like any other, so recovery takes one round trip
+- (void)restartICEForPeerWithID:(NSString *)peerID;
+
+// Renegotiation offers only ever come from the side that sent the first offer, which keeps two offers from crossing.
+// The other side asks for one with webRTC:didRequestRenegotiationRestartingICE:forPeerWithID:, and the app passes
+// the request on to this method on the offering side
+- (void)renegotiateForPeerWithID:(NSString *)peerID restartingICE:(BOOL)restartICE;
+
+// The peer's recent stats samples, oldest first, passed to completion on the delegate queue. Empty until
+// sampling has run, or when there is no such peer
+- (void)statsHistoryForPeerWithID:(NSString *)peerID completion:(void (^)(NSArray *history))completion;
+
 // Add a STUN or TURN server, adding a STUN server replaces the previous STUN server, adding a TURN server appends it to the list
 - (void)addICEServer:(RTCICEServer *)server;
 
@@ -50,4 +128,26 @@
 - (void)webRTC:(TLKWebRTC *)webRTC addedStream:(RTCMediaStream *)stream forPeerWithID:(NSString *)peerID;
 - (void)webRTC:(TLKWebRTC *)webRTC removedStream:(RTCMediaStream *)stream forPeerWithID:(NSString *)peerID;
 
+@optional
+// A batch of local candidates when candidateBatchInterval is set. Delegates that don't implement this get
+// webRTC:didSendICECandidate:forPeerWithID: for each candidate in the batch instead
+- (void)webRTC:(TLKWebRTC *)webRTC didSendICECandidates:(NSArray *)candidates forPeerWithID:(NSString *)peerID;
+
+// End of candidates: gathering has finished for the peer and every local candidate has already been sent
+- (void)webRTC:(TLKWebRTC *)webRTC didFinishSendingICECandidatesForPeerWithID:(NSString *)peerID;
+
+// The peer opened a data channel. Set its delegate here; with a serial delegate queue no message is delivered before this returns
+- (void)webRTC:(TLKWebRTC *)webRTC didOpenDataChannel:(TLKDataChannel *)dataChannel forPeerWithID:(NSString *)peerID;
+
+// A new stats sample for the peer, every statsInterval while sampling is on
+- (void)webRTC:(TLKWebRTC *)webRTC didSampleStats:(TLKPeerStats *)stats forPeerWithID:(NSString *)peerID;
+
+// The quality controller moved the peer to another level
+- (void)webRTC:(TLKWebRTC *)webRTC didChangeQualityLevel:(NSUInteger)level forPeerWithID:(NSString *)peerID;
+
+// This side needs a new offer, for an ICE restart or a changed cap, but the peer made the first offer so it has to
+// send it. Signal the peer to call renegotiateForPeerWithID:restartingICE:. Without this only the side that made
+// the first offer can renegotiate
+- (void)webRTC:(TLKWebRTC *)webRTC didRequestRenegotiationRestartingICE:(BOOL)restartICE forPeerWithID:(NSString *)peerID;
+
 @end
@@ -4,8 +4,16 @@
 //
 
 #import "TLKWebRTC.h"
+#import "TLKPeerSession.h"
+#import "TLKPeerConnectionPool.h"
+#import "TLKMediaProfile.h"
+#import "TLKEncodingPolicy.h"
+#import "TLKDataChannel.h"
+#import "TLKPeerStats.h"
+#import "TLKQualityController.h"
 
 #import <AVFoundation/AVFoundation.h>
+#import <mach/mach_time.h>
 
 #import "RTCPeerConnectionFactory.h"
 #import "RTCPeerConnection.h"
@@ -15,6 +23,9 @@
 #import "RTCSessionDescription.h"
 #import "RTCSessionDescriptionDelegate.h"
 #import "RTCPeerConnectionDelegate.h"
+#import "RTCDataChannel.h"
+#import "RTCStatsDelegate.h"
+#import "RTCStatsReport.h"
 
 #import "RTCAudioTrack.h"
 #import "RTCAVFoundationVideoSource.h"
@@ -22,33 +33,59 @@
 
 @interface TLKWebRTC () <
     RTCSessionDescriptionDelegate,
-    RTCPeerConnectionDelegate>
+    RTCPeerConnectionDelegate,
+    RTCStatsDelegate>
 
 @property (readwrite, nonatomic) RTCMediaStream *localMediaStream;
 
 @property (nonatomic, strong) RTCPeerConnectionFactory *peerFactory;
-@property (nonatomic, strong) NSMutableDictionary *peerConnections;
-@property (nonatomic, strong) NSMutableDictionary *peerToRoleMap;
-@property (nonatomic, strong) NSMutableDictionary *peerToICEMap;
+@property (nonatomic, strong) TLKPeerSessionTable *sessions;
+@property (nonatomic, strong) TLKPeerConnectionPool *connectionPool;
+// Candidates that arrived before addPeerConnectionForID:, by peer ID, handed to the session once it exists
+@property (nonatomic, strong) NSMutableDictionary *unclaimedICECandidates;
+@property (nonatomic, strong) dispatch_source_t statsTimer;
 
 @property (nonatomic) BOOL allowVideo;
 @property (nonatomic, strong) AVCaptureDevice *videoDevice;
+@property (nonatomic, strong) RTCAVFoundationVideoSource *videoSource;
+// The quality level the camera was last set up for
+@property (nonatomic) NSUInteger captureLevel;
 
 @property (nonatomic, strong) NSMutableArray *iceServers;
 
 @end
 
-static NSString * const TLKPeerConnectionRoleInitiator = @"TLKPeerConnectionRoleInitiator";
-static NSString * const TLKPeerConnectionRoleReceiver = @"TLKPeerConnectionRoleReceiver";
 static NSString * const TLKWebRTCSTUNHostname = @"stun:stun.l.google.com:19302";
 
+// Automatic restarts give up after this many attempts without the connection coming back
+static const NSUInteger TLKWebRTCMaxICERestarts = 3;
+
+// Candidates held for a peer that hasn't been added yet: at most this many, for this long after the first,
+// so a peer that goes away before it is added doesn't leave them behind for good
+static const NSUInteger TLKWebRTCMaxUnclaimedICECandidates = 50;
+static const NSTimeInterval TLKWebRTCUnclaimedICECandidateLifetime = 30;
+
 @implementation TLKWebRTC
 
 #pragma mark - object lifecycle
 
 - (instancetype)initWithVideoDevice:(AVCaptureDevice *)device {
+	return [self initWithVideoDevice:device workQueue:NULL];
+}
+
+- (instancetype)initWithVideoDevice:(AVCaptureDevice *)device workQueue:(dispatch_queue_t)workQueue {
+	return [self initWithVideoDevice:device workQueue:workQueue mediaProfile:nil];
+}
+
+- (instancetype)initWithVideoDevice:(AVCaptureDevice *)device workQueue:(dispatch_queue_t)workQueue mediaProfile:(TLKMediaProfile *)mediaProfile {
 	self = [super init];
 	if (self) {
+		_workQueue = workQueue ?: dispatch_queue_create("TLKWebRTC.work", DISPATCH_QUEUE_SERIAL);
+		_mediaProfile = [mediaProfile copy] ?: [TLKMediaProfile defaultProfile];
+		_delegateQueue = dispatch_get_main_queue();
+		_restartsICEAutomatically = YES;
+		_disconnectGracePeriod = 3.0;
+		_statsHistoryLength = 60;
 		if (device) {
 			_allowVideo = YES;
 			_videoDevice = device;
@@ -74,9 +111,12 @@ static NSString * const TLKWebRTCSTUNHostname = @"stun:stun.l.google.com:19302";
 
 - (void)_commonSetup {
     _peerFactory = [[RTCPeerConnectionFactory alloc] init];
-    _peerConnections = [NSMutableDictionary dictionary];
-    _peerToRoleMap = [NSMutableDictionary dictionary];
-    _peerToICEMap = [NSMutableDictionary dictionary];
+    _sessions = [[TLKPeerSessionTable alloc] init];
+    _unclaimedICECandidates = [NSMutableDictionary dictionary];
+    __weak TLKWebRTC *weakSelf = self;
+    _connectionPool = [[TLKPeerConnectionPool alloc] initWithQueue:_workQueue factory:^RTCPeerConnection *{
+        return [weakSelf _createPeerConnection];
+    }];
 
     self.iceServers = [NSMutableArray new];
     RTCICEServer *defaultStunServer = [[RTCICEServer alloc] initWithURI:[NSURL URLWithString:TLKWebRTCSTUNHostname] username:@"" password:@""];
@@ -94,130 +134,564 @@ static NSString * const TLKWebRTCSTUNHostname = @"stun:stun.l.google.com:19302";
     [self.localMediaStream addAudioTrack:audioTrack];
 
     if (self.allowVideo) {
-        RTCAVFoundationVideoSource *videoSource = [[RTCAVFoundationVideoSource alloc] initWithFactory:self.peerFactory constraints:nil];
+        RTCAVFoundationVideoSource *videoSource = [[RTCAVFoundationVideoSource alloc] initWithFactory:self.peerFactory constraints:[self.mediaProfile videoSourceConstraints]];
         videoSource.useBackCamera = NO;
+        self.videoSource = videoSource;
         RTCVideoTrack *videoTrack = [[RTCVideoTrack alloc] initWithFactory:self.peerFactory source:videoSource trackId:[[NSUUID UUID] UUIDString]];
         [self.localMediaStream addVideoTrack:videoTrack];
     }
 }
 
 - (RTCMediaConstraints *)_mediaConstraints {
+    return [self _mediaConstraintsRestartingICE:NO];
+}
+
+- (RTCMediaConstraints *)_mediaConstraintsRestartingICE:(BOOL)restartICE {
     RTCPair *audioConstraint = [[RTCPair alloc] initWithKey:@"OfferToReceiveAudio" value:@"true"];
     RTCPair *videoConstraint = [[RTCPair alloc] initWithKey:@"OfferToReceiveVideo" value:self.allowVideo ? @"true" : @"false"];
     RTCPair *sctpConstraint = [[RTCPair alloc] initWithKey:@"internalSctpDataChannels" value:@"true"];
     RTCPair *dtlsConstraint = [[RTCPair alloc] initWithKey:@"DtlsSrtpKeyAgreement" value:@"true"];
 
-    return [[RTCMediaConstraints alloc] initWithMandatoryConstraints:@[audioConstraint, videoConstraint] optionalConstraints:@[sctpConstraint, dtlsConstraint]];
+    NSArray *mandatory = @[audioConstraint, videoConstraint];
+    if (restartICE) {
+        mandatory = [mandatory arrayByAddingObject:[[RTCPair alloc] initWithKey:@"IceRestart" value:@"true"]];
+    }
+    return [[RTCMediaConstraints alloc] initWithMandatoryConstraints:mandatory optionalConstraints:@[sctpConstraint, dtlsConstraint]];
+}
+
+// Delegate calls are the only thing that leaves the work queue. The delegate is read when the
+// call is made, so one that goes away in the meantime is simply skipped.
+- (void)_notifyDelegate:(void (^)(id <TLKWebRTCDelegate> delegate))block {
+    dispatch_async(self.delegateQueue, ^{
+        id <TLKWebRTCDelegate> delegate = self.delegate;
+        if (delegate) {
+            block(delegate);
+        }
+    });
 }
 
 #pragma mark - ICE server
 
 - (void)addICEServer:(RTCICEServer *)server {
-    BOOL isStun = [server.URI.scheme isEqualToString:@"stun"];
-    if (isStun) {
-        // Array of servers is always stored with stun server in first index, and we only want one,
-        // so if this is a stun server, replace it
-        [self.iceServers replaceObjectAtIndex:0 withObject:server];
-    }
-    else {
-        [self.iceServers addObject:server];
-    }
+    dispatch_async(self.workQueue, ^{
+        BOOL isStun = [server.URI.scheme isEqualToString:@"stun"];
+        if (isStun) {
+            // Array of servers is always stored with stun server in first index, and we only want one,
+            // so if this is a stun server, replace it
+            [self.iceServers replaceObjectAtIndex:0 withObject:server];
+        }
+        else {
+            [self.iceServers addObject:server];
+        }
+        // Pooled connections were made with the old server list
+        [self.connectionPool.drain makeObjectsPerformSelector:@selector(close)];
+    });
+}
+
+#pragma mark - Connection pool
+
+- (void)setPeerConnectionPoolSize:(NSUInteger)peerConnectionPoolSize {
+    _peerConnectionPoolSize = peerConnectionPoolSize;
+    dispatch_async(self.workQueue, ^{
+        [[self.connectionPool resizeToCapacity:peerConnectionPoolSize] makeObjectsPerformSelector:@selector(close)];
+    });
+}
+
+// Connections made here get every WebRTC callback like any other, but until one is claimed it
+// has no session, so those callbacks find nothing and are dropped
+- (RTCPeerConnection *)_createPeerConnection {
+    RTCPeerConnection *peer = [self.peerFactory peerConnectionWithICEServers:[self iceServers] constraints:[self _mediaConstraints] delegate:self];
+    [peer addStream:self.localMediaStream];
+    return peer;
 }
 
 #pragma mark - Peer Connections
 
+// The public methods below may be called from any thread; the work they do, and everything that
+// touches self.sessions, happens on the work queue.
+
 - (NSString *)identifierForPeer:(RTCPeerConnection *)peer {
-    NSArray *keys = [self.peerConnections allKeysForObject:peer];
-    return (keys.count == 0) ? nil : keys[0];
+    return [self.sessions sessionForPeerConnection:peer].identifier;
 }
 
 - (void)addPeerConnectionForID:(NSString *)identifier {
-    RTCPeerConnection *peer = [self.peerFactory peerConnectionWithICEServers:[self iceServers] constraints:[self _mediaConstraints] delegate:self];
-    [peer addStream:self.localMediaStream];
-    [self.peerConnections setObject:peer forKey:identifier];
+    dispatch_async(self.workQueue, ^{
+        RTCPeerConnection *peer = [self.connectionPool claimPeerConnection] ?: [self _createPeerConnection];
+        TLKPeerSession *session = [[TLKPeerSession alloc] initWithIdentifier:identifier peerConnection:peer];
+        [session.pendingICECandidates addObjectsFromArray:self.unclaimedICECandidates[identifier]];
+        [self.unclaimedICECandidates removeObjectForKey:identifier];
+        [self.sessions addSession:session];
+        [self.qualityController removePeerWithID:identifier];
+        [self _applyEncodingPolicy];
+        [self _applyCaptureLevel];
+    });
 }
 
 - (void)removePeerConnectionForID:(NSString *)identifier {
-    RTCPeerConnection* peer = self.peerConnections[identifier];
-    [self.peerConnections removeObjectForKey:identifier];
-    [self.peerToRoleMap removeObjectForKey:identifier];
-    [peer close];
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions removeSessionForID:identifier];
+        [session.peerConnection close];
+        [self.unclaimedICECandidates removeObjectForKey:identifier];
+        [self.qualityController removePeerWithID:identifier];
+        [self _applyEncodingPolicy];
+        [self _applyCaptureLevel];
+    });
+}
+
+#pragma mark - Encoding tiers
+
+- (void)setEncodingPolicy:(TLKEncodingPolicy *)encodingPolicy {
+    dispatch_async(self.workQueue, ^{
+        self->_encodingPolicy = encodingPolicy;
+        [self _applyEncodingPolicy];
+    });
+}
+
+- (void)refreshEncodingTiers {
+    dispatch_async(self.workQueue, ^{
+        [self _applyEncodingPolicy];
+    });
+}
+
+// A peer's cap reaches the encoder through the b=AS we write into its description, so a peer that
+// changes tier after the first exchange is renegotiated to carry the new cap
+- (void)_applyEncodingPolicy {
+    NSArray *sessions = [self.sessions.allSessions sortedArrayUsingComparator:^NSComparisonResult(TLKPeerSession *a, TLKPeerSession *b) {
+        return a.createdAt < b.createdAt ? NSOrderedAscending : a.createdAt > b.createdAt ? NSOrderedDescending : NSOrderedSame;
+    }];
+    NSDictionary *tiers = [self.encodingPolicy tiersForPeerIDs:[sessions valueForKey:@"identifier"]];
+
+    for (TLKPeerSession *session in sessions) {
+        TLKEncodingTier tier = tiers[session.identifier] ? [tiers[session.identifier] integerValue] : TLKEncodingTierFull;
+        if (tier == session.encodingTier) {
+            continue;
+        }
+        session.encodingTier = tier;
+        if (session.peerConnection.remoteDescription) {
+            session.renegotiationNeeded = YES;
+            [self _renegotiateIfNeededForSession:session];
+        }
+    }
+}
+
+- (TLKMediaProfile *)_mediaProfileForSession:(TLKPeerSession *)session {
+    TLKMediaProfile *profile = self.mediaProfile;
+    NSUInteger cap = [self.encodingPolicy videoBitrateForTier:session.encodingTier];
+    NSUInteger qualityCap = [self.qualityController profileForLevel:session.qualityLevel].maxVideoBitrate;
+    if (qualityCap && (cap == 0 || qualityCap < cap)) {
+        cap = qualityCap;
+    }
+    if (cap == 0 || (profile.maxVideoBitrate && profile.maxVideoBitrate <= cap)) {
+        return profile;
+    }
+    profile = [profile copy];
+    profile.maxVideoBitrate = cap;
+    return profile;
+}
+
+#pragma mark - Stats
+
+- (void)dealloc {
+    if (_statsTimer) {
+        dispatch_source_cancel(_statsTimer);
+    }
+}
+
+- (void)setStatsInterval:(NSTimeInterval)statsInterval {
+    _statsInterval = statsInterval;
+    dispatch_async(self.workQueue, ^{
+        if (self.statsTimer) {
+            dispatch_source_cancel(self.statsTimer);
+            self.statsTimer = nil;
+        }
+        if (statsInterval <= 0) {
+            return;
+        }
+        uint64_t interval = (uint64_t)(statsInterval * NSEC_PER_SEC);
+        // The timer holds self weakly, so a TLKWebRTC that goes away stops sampling with it
+        __weak TLKWebRTC *weakSelf = self;
+        self.statsTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.workQueue);
+        dispatch_source_set_timer(self.statsTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+        dispatch_source_set_event_handler(self.statsTimer, ^{
+            [weakSelf _requestStats];
+        });
+        dispatch_resume(self.statsTimer);
+    });
+}
+
+- (void)_requestStats {
+    for (TLKPeerSession *session in self.sessions.allSessions) {
+        if (session.peerConnection.iceConnectionState != RTCICEConnectionClosed) {
+            [session.peerConnection getStatsWithDelegate:self mediaStreamTrack:nil statsOutputLevel:RTCStatsOutputLevelStandard];
+        }
+    }
+}
+
+- (void)statsHistoryForPeerWithID:(NSString *)peerID completion:(void (^)(NSArray *history))completion {
+    dispatch_async(self.workQueue, ^{
+        NSArray *history = [[self.sessions sessionForID:peerID].statsHistory allStats] ?: @[];
+        dispatch_async(self.delegateQueue, ^{
+            completion(history);
+        });
+    });
+}
+
+#pragma mark - Quality adaptation
+
+// The tighter of two limits where 0 means none
+static NSUInteger TLKTighterLimit(NSUInteger a, NSUInteger b)
+{
+    return a && b ? MIN(a, b) : MAX(a, b);
+}
+
+// WebRTC's capturer starts out at 640x480, so limits only ever take it down from there
+static NSString *TLKCapturePresetForSize(NSUInteger width, NSUInteger height)
+{
+    if ((width == 0 || width >= 640) && (height == 0 || height >= 480)) {
+        return AVCaptureSessionPreset640x480;
+    }
+    if ((width == 0 || width >= 352) && (height == 0 || height >= 288)) {
+        return AVCaptureSessionPreset352x288;
+    }
+    return AVCaptureSessionPresetLow;
+}
+
+// The frame duration nearest 1/framerate that the device's active format supports, since setting one outside
+// every supported range throws. Invalid, which means the device's default, when there's no limit or no ranges
+static CMTime TLKSupportedFrameDuration(AVCaptureDevice *device, NSUInteger framerate)
+{
+    if (!framerate) {
+        return kCMTimeInvalid;
+    }
+    CMTime wanted = CMTimeMake(1, (int32_t)framerate);
+    CMTime best = kCMTimeInvalid;
+    double bestDistance = INFINITY;
+    for (AVFrameRateRange *range in device.activeFormat.videoSupportedFrameRateRanges) {
+        CMTime clamped = CMTimeMaximum(range.minFrameDuration, CMTimeMinimum(wanted, range.maxFrameDuration));
+        double distance = fabs(CMTimeGetSeconds(clamped) - CMTimeGetSeconds(wanted));
+        if (distance < bestDistance) {
+            best = clamped;
+            bestDistance = distance;
+        }
+    }
+    return best;
+}
+
+- (void)setQualityController:(TLKQualityController *)qualityController {
+    dispatch_async(self.workQueue, ^{
+        self->_qualityController = qualityController;
+        // Every peer starts again at the top of the new ladder
+        for (TLKPeerSession *session in self.sessions.allSessions) {
+            if (session.qualityLevel == 0) {
+                continue;
+            }
+            session.qualityLevel = 0;
+            if (session.peerConnection.remoteDescription) {
+                session.renegotiationNeeded = YES;
+                [self _renegotiateIfNeededForSession:session];
+            }
+        }
+        [self _applyCaptureLevel];
+    });
+}
+
+- (void)_adaptQualityForSession:(TLKPeerSession *)session toStats:(TLKPeerStats *)stats {
+    TLKQualityController *controller = self.qualityController;
+    if (!controller) {
+        return;
+    }
+    NSUInteger level = [controller levelAfterStats:stats forPeerWithID:session.identifier];
+    if (level == session.qualityLevel) {
+        return;
+    }
+    BOOL bitrateChanged = [controller profileForLevel:level].maxVideoBitrate != [controller profileForLevel:session.qualityLevel].maxVideoBitrate;
+    session.qualityLevel = level;
+    [self _applyCaptureLevel];
+    if (bitrateChanged && session.peerConnection.remoteDescription) {
+        session.renegotiationNeeded = YES;
+        [self _renegotiateIfNeededForSession:session];
+    }
+
+    NSString *peerID = session.identifier;
+    [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+        if ([delegate respondsToSelector:@selector(webRTC:didChangeQualityLevel:forPeerWithID:)]) {
+            [delegate webRTC:self didChangeQualityLevel:level forPeerWithID:peerID];
+        }
+    }];
+}
+
+// One camera feeds every peer, so it runs at the level of the worst-off one, never above what the media profile allows
+- (void)_applyCaptureLevel {
+    NSUInteger level = 0;
+    for (TLKPeerSession *session in self.sessions.allSessions) {
+        level = MAX(level, session.qualityLevel);
+    }
+    AVCaptureSession *captureSession = self.videoSource.captureSession;
+    if (level == self.captureLevel || !captureSession) {
+        return;
+    }
+    self.captureLevel = level;
+
+    TLKMediaProfile *limits = [self.qualityController profileForLevel:level];
+    TLKMediaProfile *profile = self.mediaProfile;
+    NSUInteger width = TLKTighterLimit(limits.maxVideoWidth, profile.maxVideoWidth);
+    NSUInteger height = TLKTighterLimit(limits.maxVideoHeight, profile.maxVideoHeight);
+    NSUInteger framerate = TLKTighterLimit(limits.maxVideoFramerate, profile.maxVideoFramerate);
+
+    [captureSession beginConfiguration];
+    NSString *preset = TLKCapturePresetForSize(width, height);
+    if ([captureSession canSetSessionPreset:preset]) {
+        captureSession.sessionPreset = preset;
+    }
+    [captureSession commitConfiguration];
+
+    // After the commit, so the active format is the one the preset picked and the preset change
+    // doesn't reset the frame duration again
+    for (AVCaptureDeviceInput *input in captureSession.inputs) {
+        if (![input isKindOfClass:[AVCaptureDeviceInput class]] || ![input.device hasMediaType:AVMediaTypeVideo]) {
+            continue;
+        }
+        if ([input.device lockForConfiguration:NULL]) {
+            // An invalid duration hands the framerate back to the device's default
+            input.device.activeVideoMinFrameDuration = TLKSupportedFrameDuration(input.device, framerate);
+            [input.device unlockForConfiguration];
+        }
+    }
 }
 
 #pragma mark -
 
 - (void)createOfferForPeerWithID:(NSString *)peerID {
-    RTCPeerConnection *peerConnection = [self.peerConnections objectForKey:peerID];
-    [self.peerToRoleMap setObject:TLKPeerConnectionRoleInitiator forKey:peerID];
-    [peerConnection createOfferWithDelegate:self constraints:[self _mediaConstraints]];
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForID:peerID];
+        if (session.role == TLKPeerRoleNone) {
+            session.offersRenegotiation = YES;
+        }
+        session.role = TLKPeerRoleInitiator;
+        session.lastActivityAt = CFAbsoluteTimeGetCurrent();
+        [session.peerConnection createOfferWithDelegate:self constraints:[self _mediaConstraints]];
+    });
+}
+
+- (TLKDataChannel *)createDataChannelWithLabel:(NSString *)label ordered:(BOOL)ordered forPeerWithID:(NSString *)peerID {
+    TLKDataChannel *dataChannel = [[TLKDataChannel alloc] initWithLabel:label peerID:peerID ordered:ordered workQueue:self.workQueue delegateQueue:self.delegateQueue];
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForID:peerID];
+        RTCDataChannelInit *config = [[RTCDataChannelInit alloc] init];
+        config.isOrdered = ordered;
+        [dataChannel attachChannel:[session.peerConnection createDataChannelWithLabel:label config:config]];
+    });
+    return dataChannel;
+}
+
+- (void)restartICEForPeerWithID:(NSString *)peerID {
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForID:peerID];
+        if (session) {
+            session.iceRestartNeeded = YES;
+            [self _renegotiateIfNeededForSession:session];
+        }
+    });
+}
+
+- (void)renegotiateForPeerWithID:(NSString *)peerID restartingICE:(BOOL)restartICE {
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForID:peerID];
+        if (session) {
+            session.renegotiationNeeded = YES;
+            session.iceRestartNeeded = session.iceRestartNeeded || restartICE;
+            [self _renegotiateIfNeededForSession:session];
+        }
+    });
 }
 
 - (void)setRemoteDescription:(RTCSessionDescription *)remoteSDP forPeerWithID:(NSString *)peerID receiver:(BOOL)isReceiver {
-    RTCPeerConnection *peerConnection = [self.peerConnections objectForKey:peerID];
-    if (isReceiver) {
-        [self.peerToRoleMap setObject:TLKPeerConnectionRoleReceiver forKey:peerID];
-    }
-    [peerConnection setRemoteDescriptionWithDelegate:self sessionDescription:remoteSDP];
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForID:peerID];
+        // An offer that crossed ours, which only a peer not following the one-offerer rule sends. Ours stands
+        // and the peer has to answer it; whatever its offer was for goes out in a fresh round after this one
+        if (isReceiver && session.peerConnection.signalingState == RTCSignalingHaveLocalOffer) {
+            session.renegotiationNeeded = YES;
+            return;
+        }
+        if (isReceiver) {
+            session.role = TLKPeerRoleReceiver;
+        }
+        session.lastActivityAt = CFAbsoluteTimeGetCurrent();
+        NSString *munged = [[self _mediaProfileForSession:session] remoteSDPFromSDP:remoteSDP.description];
+        RTCSessionDescription *sessionDescription = [[RTCSessionDescription alloc] initWithType:remoteSDP.type sdp:munged];
+        [session.peerConnection setRemoteDescriptionWithDelegate:self sessionDescription:sessionDescription];
+    });
 }
 
 - (void)addICECandidate:(RTCICECandidate*)candidate forPeerWithID:(NSString *)peerID {
-    RTCPeerConnection *peerConnection = [self.peerConnections objectForKey:peerID];
-    if (peerConnection.iceGatheringState == RTCICEGatheringNew) {
-        NSMutableArray *candidates = [self.peerToICEMap objectForKey:peerID];
-        if (!candidates) {
-            candidates = [NSMutableArray array];
-            [self.peerToICEMap setObject:candidates forKey:peerID];
-        }
-        [candidates addObject:candidate];
-    } else {
-        [peerConnection addICECandidate:candidate];
-    }
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForID:peerID];
+        // Signaling can outrun addPeerConnectionForID:, so a candidate for a peer we don't know yet is
+        // kept until the peer is added rather than dropped
+        if (!session) {
+            NSMutableArray *unclaimed = self.unclaimedICECandidates[peerID];
+            if (!unclaimed) {
+                unclaimed = [NSMutableArray array];
+                self.unclaimedICECandidates[peerID] = unclaimed;
+                dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(TLKWebRTCUnclaimedICECandidateLifetime * NSEC_PER_SEC)), self.workQueue, ^{
+                    // Only if it's still the same list, not one started after the peer came and went
+                    if (self.unclaimedICECandidates[peerID] == unclaimed) {
+                        [self.unclaimedICECandidates removeObjectForKey:peerID];
+                    }
+                });
+            }
+            if (unclaimed.count < TLKWebRTCMaxUnclaimedICECandidates) {
+                [unclaimed addObject:candidate];
+            }
+            return;
+        }
+        session.lastActivityAt = CFAbsoluteTimeGetCurrent();
+        // A candidate can't be applied before the remote description, so until then it waits in the
+        // session and goes in as soon as the description has been set
+        if (session.peerConnection.remoteDescription) {
+            [session.peerConnection addICECandidate:candidate];
+        } else {
+            [session.pendingICECandidates addObject:candidate];
+        }
+    });
 }
 
 #pragma mark - RTCSessionDescriptionDelegate
 
 // Note: all these delegate calls come back on a random background thread inside WebRTC,
-// so all are bridged across to the main thread
+// so all are bridged across to the work queue
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection didCreateSessionDescription:(RTCSessionDescription *)sdp error:(NSError *)error {
-    dispatch_async(dispatch_get_main_queue(), ^{
-        RTCSessionDescription* sessionDescription = [[RTCSessionDescription alloc] initWithType:sdp.type sdp:sdp.description];        
+    dispatch_async(self.workQueue, ^{
+        if (error) {
+            NSLog(@"TLKWebRTC: couldn't create a session description: %@", error);
+            return;
+        }
+        NSString *munged = [self.mediaProfile localSDPFromSDP:sdp.description];
+        RTCSessionDescription* sessionDescription = [[RTCSessionDescription alloc] initWithType:sdp.type sdp:munged];
         [peerConnection setLocalDescriptionWithDelegate:self sessionDescription:sessionDescription];
     });
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection didSetSessionDescriptionWithError:(NSError *)error {
-    dispatch_async(dispatch_get_main_queue(), ^{
-        if (peerConnection.iceGatheringState == RTCICEGatheringGathering) {
-            NSArray *keys = [self.peerConnections allKeysForObject:peerConnection];
-            if ([keys count] > 0) {
-                NSArray *candidates = [self.peerToICEMap objectForKey:keys[0]];
-                for (RTCICECandidate* candidate in candidates) {
-                    [peerConnection addICECandidate:candidate];
-                }
-                [self.peerToICEMap removeObjectForKey:keys[0]];
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForPeerConnection:peerConnection];
+        if (!session) {
+            return;
+        }
+        session.lastActivityAt = CFAbsoluteTimeGetCurrent();
+
+        // The description didn't go in and the signaling state is where it was, so there's nothing new to send.
+        // Renegotiation still waiting on a stable state can go ahead if we're there
+        if (error) {
+            NSLog(@"TLKWebRTC: couldn't set a session description for %@: %@", session.identifier, error);
+            if (peerConnection.signalingState == RTCSignalingStable) {
+                [self _renegotiateIfNeededForSession:session];
             }
+            return;
         }
 
-        if (peerConnection.signalingState == RTCSignalingHaveLocalOffer) {
-            NSArray *keys = [self.peerConnections allKeysForObject:peerConnection];
-            if ([keys count] > 0) {
-                [self.delegate webRTC:self didSendSDPOffer:peerConnection.localDescription forPeerWithID:keys[0]];
+        if (peerConnection.remoteDescription) {
+            for (RTCICECandidate* candidate in session.pendingICECandidates) {
+                [peerConnection addICECandidate:candidate];
             }
+            [session.pendingICECandidates removeAllObjects];
+        }
+
+        NSString *peerID = session.identifier;
+        if (peerConnection.signalingState == RTCSignalingHaveLocalOffer) {
+            RTCSessionDescription *offer = peerConnection.localDescription;
+            [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+                [delegate webRTC:self didSendSDPOffer:offer forPeerWithID:peerID];
+            }];
         } else if (peerConnection.signalingState == RTCSignalingHaveRemoteOffer) {
             [peerConnection createAnswerWithDelegate:self constraints:[self _mediaConstraints]];
         } else if (peerConnection.signalingState == RTCSignalingStable) {
-            NSArray* keys = [self.peerConnections allKeysForObject:peerConnection];
-            if ([keys count] > 0) {
-                NSString* role = [self.peerToRoleMap objectForKey:keys[0]];
-                if (role == TLKPeerConnectionRoleReceiver) {
-                    [self.delegate webRTC:self didSendSDPAnswer:peerConnection.localDescription forPeerWithID:keys[0]];
-                }
+            if (session.role == TLKPeerRoleReceiver) {
+                RTCSessionDescription *answer = peerConnection.localDescription;
+                [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+                    [delegate webRTC:self didSendSDPAnswer:answer forPeerWithID:peerID];
+                }];
             }
+            // Anything that came up while this negotiation was in flight goes out now
+            [self _renegotiateIfNeededForSession:session];
+        }
+    });
+}
+
+#pragma mark - Recovery
+
+// Only the side that sent the first offer offers again, the other answers through the usual HaveRemoteOffer
+// path. Without a rollback in this WebRTC build a side can't back out of an offer it has sent, so two crossing
+// offers would leave both stuck; with one offerer they never cross. The other side asks for its offers through
+// the delegate. Either way nothing goes out before the stable state, anything asked for before then waits in the
+// session until the current negotiation completes.
+- (void)_renegotiateIfNeededForSession:(TLKPeerSession *)session {
+    RTCPeerConnection *peerConnection = session.peerConnection;
+    if (!(session.renegotiationNeeded || session.iceRestartNeeded) || peerConnection.signalingState != RTCSignalingStable) {
+        return;
+    }
+    BOOL restartICE = session.iceRestartNeeded;
+    session.renegotiationNeeded = NO;
+    session.iceRestartNeeded = NO;
+
+    if (!session.offersRenegotiation) {
+        NSString *peerID = session.identifier;
+        [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+            if ([delegate respondsToSelector:@selector(webRTC:didRequestRenegotiationRestartingICE:forPeerWithID:)]) {
+                [delegate webRTC:self didRequestRenegotiationRestartingICE:restartICE forPeerWithID:peerID];
+            }
+        }];
+        return;
+    }
+
+    session.role = TLKPeerRoleInitiator;
+    session.lastActivityAt = CFAbsoluteTimeGetCurrent();
+    [peerConnection createOfferWithDelegate:self constraints:[self _mediaConstraintsRestartingICE:restartICE]];
+}
+
+- (void)_scheduleICERestartForSession:(TLKPeerSession *)session afterDelay:(NSTimeInterval)delay {
+    NSUInteger generation = ++session.iceRecoveryGeneration;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), self.workQueue, ^{
+        if (session.iceRecoveryGeneration != generation || [self.sessions sessionForID:session.identifier] != session) {
+            return;
         }
+        RTCICEConnectionState state = session.peerConnection.iceConnectionState;
+        if ((state != RTCICEConnectionDisconnected && state != RTCICEConnectionFailed) || session.iceRestartCount >= TLKWebRTCMaxICERestarts) {
+            return;
+        }
+        session.iceRestartCount++;
+        session.iceRestartNeeded = YES;
+        [self _renegotiateIfNeededForSession:session];
     });
 }
 
+- (void)_recoverSession:(TLKPeerSession *)session fromICEConnectionState:(RTCICEConnectionState)state {
+    switch (state) {
+        case RTCICEConnectionConnected:
+        case RTCICEConnectionCompleted:
+            // Back up: forget the restart budget and drop any pending restart
+            session.iceRestartCount = 0;
+            session.iceRecoveryGeneration++;
+            break;
+        case RTCICEConnectionDisconnected:
+            if (self.restartsICEAutomatically) {
+                [self _scheduleICERestartForSession:session afterDelay:self.disconnectGracePeriod];
+            }
+            break;
+        case RTCICEConnectionFailed:
+            // Both ends usually see the failure; the offering side restarts straight away, the other only asks
+            // for a restart if that hasn't happened within the grace period
+            if (self.restartsICEAutomatically) {
+                [self _scheduleICERestartForSession:session afterDelay:session.offersRenegotiation ? 0 : self.disconnectGracePeriod];
+            }
+            break;
+        default:
+            break;
+    }
+}
+
 #pragma mark - String utilities
 
 - (NSString *)stringForSignalingState:(RTCSignalingState)state {
@@ -296,64 +770,197 @@ static NSString * const TLKWebRTCSTUNHostname = @"stun:stun.l.google.com:19302";
 #pragma mark - RTCPeerConnectionDelegate
 
 // Note: all these delegate calls come back on a random background thread inside WebRTC,
-// so all are bridged across to the main thread
+// so all are bridged across to the work queue
 
 - (void)peerConnectionOnError:(RTCPeerConnection *)peerConnection {
-//    dispatch_async(dispatch_get_main_queue(), ^{
+//    dispatch_async(self.workQueue, ^{
 //    });
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection signalingStateChanged:(RTCSignalingState)stateChanged {
-    dispatch_async(dispatch_get_main_queue(), ^{
+    dispatch_async(self.workQueue, ^{
         // I'm seeing this, but not sure what to do with it yet
     });
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection addedStream:(RTCMediaStream *)stream {
-    dispatch_async(dispatch_get_main_queue(), ^{
-        [self.delegate webRTC:self addedStream:stream forPeerWithID:[self identifierForPeer:peerConnection]];
+    dispatch_async(self.workQueue, ^{
+        NSString *peerID = [self identifierForPeer:peerConnection];
+        [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+            [delegate webRTC:self addedStream:stream forPeerWithID:peerID];
+        }];
     });
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection removedStream:(RTCMediaStream *)stream {
-    dispatch_async(dispatch_get_main_queue(), ^{
-        [self.delegate webRTC:self removedStream:stream forPeerWithID:[self identifierForPeer:peerConnection]];
+    dispatch_async(self.workQueue, ^{
+        NSString *peerID = [self identifierForPeer:peerConnection];
+        [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+            [delegate webRTC:self removedStream:stream forPeerWithID:peerID];
+        }];
     });
 }
 
 - (void)peerConnectionOnRenegotiationNeeded:(RTCPeerConnection *)peerConnection {
-    dispatch_async(dispatch_get_main_queue(), ^{
-        //    [self.peerConnection createOfferWithDelegate:self constraints:[self mediaConstraints]];
-        // Is this delegate called when creating a PC that is going to *receive* an offer and return an answer?
-        NSLog(@"peerConnectionOnRenegotiationNeeded ?");
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForPeerConnection:peerConnection];
+        // This also fires when the local stream is added to a brand new connection. Until the first offer/answer
+        // has completed there's nothing to renegotiate, that exchange will carry the change anyway
+        if (!session || session.role == TLKPeerRoleNone || !peerConnection.remoteDescription) {
+            return;
+        }
+        session.renegotiationNeeded = YES;
+        [self _renegotiateIfNeededForSession:session];
     });
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection iceConnectionChanged:(RTCICEConnectionState)newState {
-    dispatch_async(dispatch_get_main_queue(), ^{
-        [self.delegate webRTC:self didObserveICEConnectionStateChange:newState forPeerWithID:[self identifierForPeer:peerConnection]];
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForPeerConnection:peerConnection];
+        if (session) {
+            [self _recoverSession:session fromICEConnectionState:newState];
+        }
+        NSString *peerID = session.identifier;
+        [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+            [delegate webRTC:self didObserveICEConnectionStateChange:newState forPeerWithID:peerID];
+        }];
     });
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection iceGatheringChanged:(RTCICEGatheringState)newState {
-    dispatch_async(dispatch_get_main_queue(), ^{
-        NSLog(@"peerConnection iceGatheringChanged?");
+    dispatch_async(self.workQueue, ^{
+        if (newState != RTCICEGatheringComplete) {
+            return;
+        }
+        TLKPeerSession *session = [self.sessions sessionForPeerConnection:peerConnection];
+        if (!session) {
+            return;
+        }
+        // Anything still inside the batch window goes out now, ahead of the end marker
+        [self _sendOutboundICECandidatesForSession:session];
+        NSString *peerID = session.identifier;
+        [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+            if ([delegate respondsToSelector:@selector(webRTC:didFinishSendingICECandidatesForPeerWithID:)]) {
+                [delegate webRTC:self didFinishSendingICECandidatesForPeerWithID:peerID];
+            }
+        }];
     });
 }
 
 - (void)peerConnection:(RTCPeerConnection *)peerConnection gotICECandidate:(RTCICECandidate *)candidate {
-    dispatch_async(dispatch_get_main_queue(), ^{
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForPeerConnection:peerConnection];
+        if (!session) {
+            return;
+        }
+        NSTimeInterval batchInterval = self.candidateBatchInterval;
+        if (batchInterval <= 0) {
+            NSString *peerID = session.identifier;
+            [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+                [delegate webRTC:self didSendICECandidate:candidate forPeerWithID:peerID];
+            }];
+            return;
+        }
 
-        NSArray* keys = [self.peerConnections allKeysForObject:peerConnection];
-        if ([keys count] > 0) {
-            [self.delegate webRTC:self didSendICECandidate:candidate forPeerWithID:keys[0]];
+        // The first candidate of a batch starts the window, the rest ride along with it
+        [session.outboundICECandidates addObject:candidate];
+        if (session.outboundICECandidates.count == 1) {
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(batchInterval * NSEC_PER_SEC)), self.workQueue, ^{
+                [self _sendOutboundICECandidatesForSession:session];
+            });
         }
     });
 }
 
+- (void)_sendOutboundICECandidatesForSession:(TLKPeerSession *)session {
+    if (session.outboundICECandidates.count == 0 || [self.sessions sessionForID:session.identifier] != session) {
+        return;
+    }
+    NSArray *candidates = [session.outboundICECandidates copy];
+    [session.outboundICECandidates removeAllObjects];
+
+    NSString *peerID = session.identifier;
+    [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+        if ([delegate respondsToSelector:@selector(webRTC:didSendICECandidates:forPeerWithID:)]) {
+            [delegate webRTC:self didSendICECandidates:candidates forPeerWithID:peerID];
+        } else {
+            for (RTCICECandidate *candidate in candidates) {
+                [delegate webRTC:self didSendICECandidate:candidate forPeerWithID:peerID];
+            }
+        }
+    }];
+}
+
 - (void)peerConnection:(RTCPeerConnection *)peerConnection didOpenDataChannel:(RTCDataChannel *)dataChannel {
-    dispatch_async(dispatch_get_main_queue(), ^{
-        NSLog(@"peerConnection didOpenDataChannel?");
+    // Attached right here on WebRTC's thread, so nothing the peer sends can slip past before the wrapper is listening
+    TLKDataChannel *wrapper = [[TLKDataChannel alloc] initWithLabel:dataChannel.label peerID:nil ordered:dataChannel.isOrdered workQueue:self.workQueue delegateQueue:self.delegateQueue];
+    [wrapper attachChannel:dataChannel];
+    dispatch_async(self.workQueue, ^{
+        NSString *peerID = [self identifierForPeer:peerConnection];
+        wrapper.peerID = peerID;
+        [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+            if ([delegate respondsToSelector:@selector(webRTC:didOpenDataChannel:forPeerWithID:)]) {
+                [delegate webRTC:self didOpenDataChannel:wrapper forPeerWithID:peerID];
+            }
+        }];
+    });
+}
+
+#pragma mark - RTCStatsDelegate
+
+// Comes in on WebRTC's signaling thread. The reports are flattened there, into the dictionaries
+// TLKPeerStatsSampler reads, and sampled on the work queue
+// Stats rates and the quality controller's hold times are differences between samples, which a wall clock
+// set back or forward would throw off
+static NSTimeInterval TLKMonotonicTime(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (NSTimeInterval)mach_absolute_time() * timebase.numer / timebase.denom / NSEC_PER_SEC;
+}
+
+- (void)peerConnection:(RTCPeerConnection *)peerConnection didGetStats:(NSArray *)stats {
+    NSTimeInterval time = TLKMonotonicTime();
+    NSMutableArray *reports = [NSMutableArray arrayWithCapacity:stats.count];
+    for (RTCStatsReport *statsReport in stats) {
+        NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:statsReport.values.count + 2];
+        for (RTCPair *pair in statsReport.values) {
+            report[pair.key] = pair.value;
+        }
+        report[TLKStatsReportTypeKey] = statsReport.type;
+        report[TLKStatsReportIDKey] = statsReport.reportId;
+        [reports addObject:report];
+    }
+
+    dispatch_async(self.workQueue, ^{
+        TLKPeerSession *session = [self.sessions sessionForPeerConnection:peerConnection];
+        if (!session) {
+            return;
+        }
+        if (!session.statsSampler) {
+            session.statsSampler = [[TLKPeerStatsSampler alloc] init];
+        }
+        if (session.statsHistory.capacity != self.statsHistoryLength) {
+            TLKStatsHistory *history = [[TLKStatsHistory alloc] initWithCapacity:self.statsHistoryLength];
+            for (TLKPeerStats *old in [session.statsHistory allStats]) {
+                [history addStats:old];
+            }
+            session.statsHistory = history;
+        }
+
+        TLKPeerStats *sample = [session.statsSampler statsFromReports:reports atTime:time];
+        sample.peerID = session.identifier;
+        [session.statsHistory addStats:sample];
+        [self _adaptQualityForSession:session toStats:sample];
+
+        NSString *peerID = session.identifier;
+        [self _notifyDelegate:^(id <TLKWebRTCDelegate> delegate) {
+            if ([delegate respondsToSelector:@selector(webRTC:didSampleStats:forPeerWithID:)]) {
+                [delegate webRTC:self didSampleStats:sample forPeerWithID:peerID];
+            }
+        }];
     });
 }
 
@@ -0,0 +1,783 @@
+//
+//  AZSocketIOTests.m
+//  Copyright (c) 2014 &yet, LLC and otalk contributors
+//
+
+#import <XCTest/XCTest.h>
+
+#import "AZSocketIO.h"
+#import "AZSocketIOAckRegistry.h"
+#import "AZSocketIOPacket.h"
+#import "AZSocketIOTransport.h"
+#import "AZWebsocketTransport.h"
+
+// What -[AZSocketIOPacket initWithString:] did with NSRegularExpression, kept as the reference.
+@interface AZLegacyPacket : NSObject
+@property (nonatomic, assign) int type;
+@property (nonatomic, copy) NSString *Id;
+@property (nonatomic, assign) BOOL ack;
+@property (nonatomic, copy) NSString *endpoint;
+@property (nonatomic, copy) NSString *data;
+@end
+
+@implementation AZLegacyPacket
+
+static NSString *AZCaptureOrEmptyString(NSString *whole, NSRange range)
+{
+    return range.length == 0 ? @"" : [whole substringWithRange:range];
+}
+
+- (id)initWithString:(NSString *)packetString
+{
+    self = [super init];
+    if (self) {
+        static NSRegularExpression *regex;
+        static dispatch_once_t onceToken;
+        dispatch_once(&onceToken, ^{
+            regex = [NSRegularExpression regularExpressionWithPattern:@"([^:]+):([0-9]+)?(\\+)?:([^:]+)?:?([\\s\\S]*)?" options:NSRegularExpressionCaseInsensitive error:nil];
+        });
+        NSTextCheckingResult *result = [regex firstMatchInString:packetString options:0 range:NSMakeRange(0, packetString.length)];
+
+        NSString *typeString = result ? [packetString substringWithRange:[result rangeAtIndex:1]] : @"";
+        self.type = typeString.length == 0 ? -1 : [typeString intValue];
+        self.Id = result ? AZCaptureOrEmptyString(packetString, [result rangeAtIndex:2]) : @"";
+        self.ack = self.Id.length > 0 && [[self.Id substringFromIndex:self.Id.length - 1] isEqualToString:@"+"];
+        self.endpoint = result ? AZCaptureOrEmptyString(packetString, [result rangeAtIndex:4]) : @"";
+        self.data = result ? AZCaptureOrEmptyString(packetString, [result rangeAtIndex:5]) : @"";
+    }
+    return self;
+}
+
+// messageId and args the way AZSocketIOACKMessage used to get them.
++ (NSArray *)ackFieldsForData:(NSString *)ackString
+{
+    static NSRegularExpression *regex;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        regex = [NSRegularExpression regularExpressionWithPattern:@"([0-9]+)\\+?(.*)" options:NSRegularExpressionCaseInsensitive error:nil];
+    });
+    NSTextCheckingResult *result = [regex firstMatchInString:ackString options:0 range:NSMakeRange(0, ackString.length)];
+    if (!result) {
+        return @[@"", [NSNull null]];
+    }
+
+    id args = nil;
+    if ([result rangeAtIndex:1].length != [result range].length) {
+        NSString *ackData = [ackString substringWithRange:[result rangeAtIndex:2]];
+        args = [NSJSONSerialization JSONObjectWithData:[ackData dataUsingEncoding:NSUTF8StringEncoding] options:NSJSONReadingMutableContainers error:nil];
+    }
+    return @[[ackString substringWithRange:[result rangeAtIndex:1]], args ?: [NSNull null]];
+}
+
+@end
+
+// Packets seen from a socket.io 0.9 server, plus the odd shapes the parser has to agree on.
+static NSArray *AZPacketCorpus(void)
+{
+    return @[
+        @"", @":", @"::", @":::", @"1::", @"2::", @"0::", @"7:::1+0", @"8::",
+        @"1::/chat", @"0::/chat", @"3:::hello", @"3:1::hello", @"3:1+::hello", @"3:1+:/chat:hello",
+        @"4:::{\"a\":1}", @"5:::{\"name\":\"message\",\"args\":[{\"type\":\"offer\"}]}",
+        @"5:12+::{\"name\":\"join\",\"args\":[\"room\"]}", @"6:::12+[\"ok\",{\"id\":\"abc\"}]", @"6:::12[\"ok\"]",
+        @"6:::12", @"6:::12+", @"6:::+12", @"6:::abc", @"6:::12+[1]\n[2]",
+        @"3:::a:b:c", @"3::end:point:data", @"3:::\nmulti\nline", @"3:x:y:z", @"::3:::data", @"a:b:c:d",
+        @"x:12a:3::rest", @"12345678901:::huge type", @"-4:::negative", @" 3:::space", @"+3:::plus",
+        @"3", @"3:", @"3:1", @"3:1+", @"3:1+:", @"3:+:", @"3:++::", @"é:::unicode", @"3:::héllo wörld ✓",
+        @"3:::\U0001F600", @":a::b", @"1:2:3:4:5",
+    ];
+}
+
+// What -[AZSocketIOPacket encode] returned when it was built with stringWithFormat:.
+static NSString *AZLegacyEncode(AZSocketIOPacket *packet)
+{
+    NSString *idString = packet.Id ? (packet.ack ? [packet.Id stringByAppendingString:@"+"] : packet.Id) : @"";
+    return [NSString stringWithFormat:@"%d:%@:%@:%@", packet.type, idString, packet.endpoint, packet.data];
+}
+
+static AZSocketIOPacket *AZCandidatePacket(NSUInteger index)
+{
+    AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] init];
+    packet.type = EVENT;
+    packet.Id = [NSString stringWithFormat:@"%lu", (unsigned long)index];
+    packet.data = [NSString stringWithFormat:@"{\"name\":\"message\",\"args\":[{\"to\":\"%08x\",\"type\":\"candidate\",\"payload\":{\"candidate\":\"a=candidate:%u 1 udp 2122260223 192.168.1.%lu 5%04lu typ host\"}}]}", arc4random(), arc4random(), (unsigned long)index % 255, (unsigned long)index % 10000];
+    return packet;
+}
+
+// Stands in for a transport and records each batch AZSocketIO hands it.
+@interface AZRecordingTransport : NSObject <AZSocketIOTransport>
+@property (nonatomic, assign) BOOL secureConnections;
+@property (nonatomic, readonly, getter = isConnected) BOOL connected;
+@property (nonatomic, weak) id<AZSocketIOTransportDelegate> delegate;
+@property (nonatomic, strong) NSMutableArray *batches;
+@property (nonatomic, strong) XCTestExpectation *batchExpectation;
+// Batches to refuse, as a websocket with a full buffer would, before accepting any.
+@property (nonatomic, assign) NSUInteger batchesToRefuse;
+@property (nonatomic, assign) NSUInteger refusedBatchCount;
+@property (nonatomic, copy) void (^disconnectHandler)(void);
+@end
+
+@implementation AZRecordingTransport
+
+- (id)initWithDelegate:(id<AZSocketIOTransportDelegate>)delegate secureConnections:(BOOL)secureConnections
+{
+    self = [super init];
+    if (self) {
+        _delegate = delegate;
+        _secureConnections = secureConnections;
+        _batches = [NSMutableArray array];
+    }
+    return self;
+}
+
+- (void)connect
+{
+    _connected = YES;
+}
+
+- (void)disconnect
+{
+    _connected = NO;
+    if (self.disconnectHandler) {
+        self.disconnectHandler();
+    }
+}
+
+- (void)send:(NSString *)msg
+{
+    [self sendPackets:@[[[AZSocketIOPacket alloc] initWithString:msg]]];
+}
+
+- (BOOL)sendPackets:(NSArray *)packets
+{
+    @synchronized(self.batches) {
+        if (self.refusedBatchCount < self.batchesToRefuse) {
+            self.refusedBatchCount++;
+            return NO;
+        }
+    }
+    NSMutableString *payload = [NSMutableString string];
+    [AZSocketIOPacket encodePayload:packets intoString:payload];
+    @synchronized(self.batches) {
+        [self.batches addObject:payload];
+    }
+    [self.batchExpectation fulfill];
+    return YES;
+}
+
+@end
+
+@interface AZSocketIOTests : XCTestCase
+
+@end
+
+@implementation AZSocketIOTests
+
+- (void)assertPacket:(AZSocketIOPacket *)packet matchesLegacy:(AZLegacyPacket *)legacy input:(NSString *)input
+{
+    XCTAssertEqual((int)packet.type, legacy.type, @"%@", input);
+    XCTAssertEqualObjects(packet.Id, legacy.Id, @"%@", input);
+    XCTAssertEqual(packet.ack, legacy.ack, @"%@", input);
+    XCTAssertEqualObjects(packet.endpoint, legacy.endpoint, @"%@", input);
+    XCTAssertEqualObjects(packet.data, legacy.data, @"%@", input);
+}
+
+- (void)testPacketParserMatchesRegexOnCorpus
+{
+    for (NSString *input in AZPacketCorpus()) {
+        [self assertPacket:[[AZSocketIOPacket alloc] initWithString:input] matchesLegacy:[[AZLegacyPacket alloc] initWithString:input] input:input];
+    }
+}
+
+- (void)testPacketParserMatchesRegexOnRandomInput
+{
+    NSArray *alphabet = @[@":", @":", @":", @"+", @"0", @"1", @"9", @"a", @"/", @"\n", @" ", @"-", @"é", @" "];
+    for (int i = 0; i < 20000; i++) {
+        NSMutableString *input = [NSMutableString string];
+        uint32_t length = arc4random_uniform(16);
+        for (uint32_t j = 0; j < length; j++) {
+            [input appendString:alphabet[arc4random_uniform((uint32_t)alphabet.count)]];
+        }
+        [self assertPacket:[[AZSocketIOPacket alloc] initWithString:input] matchesLegacy:[[AZLegacyPacket alloc] initWithString:input] input:input];
+    }
+}
+
+- (void)testACKParserMatchesRegex
+{
+    NSMutableArray *inputs = [@[@"", @"12", @"12+", @"+12", @"12+[\"ok\"]", @"12[\"ok\"]", @"12+[1]\r\n[2]", @"12+[1] ",
+                                @"abc12+[true]", @"12+not json", @"007+[{\"a\":[1,2]}]", @"x", @"12+{}"] mutableCopy];
+    NSArray *alphabet = @[@"1", @"2", @"+", @"[", @"]", @"\"", @"a", @"\n", @","];
+    for (int i = 0; i < 5000; i++) {
+        NSMutableString *input = [NSMutableString string];
+        uint32_t length = arc4random_uniform(10);
+        for (uint32_t j = 0; j < length; j++) {
+            [input appendString:alphabet[arc4random_uniform((uint32_t)alphabet.count)]];
+        }
+        [inputs addObject:input];
+    }
+
+    for (NSString *input in inputs) {
+        AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] init];
+        packet.data = input;
+        AZSocketIOACKMessage *message = [[AZSocketIOACKMessage alloc] initWithPacket:packet];
+        NSArray *expected = [AZLegacyPacket ackFieldsForData:input];
+        XCTAssertEqualObjects(message.messageId, expected[0], @"%@", input);
+        XCTAssertEqualObjects(message.args ?: [NSNull null], expected[1], @"%@", input);
+    }
+}
+
+- (void)testLazyFieldsCanBeReplaced
+{
+    AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] initWithString:@"5:7::{\"name\":\"x\"}"];
+    packet.data = nil;
+    packet.Id = @"8";
+    XCTAssertNil(packet.data);
+    XCTAssertEqualObjects(packet.Id, @"8");
+    XCTAssertEqualObjects(packet.endpoint, @"");
+    XCTAssertEqualObjects([packet encode], @"5:8::(null)");
+}
+
+- (void)testEncodeMatchesFormatString
+{
+    NSArray *ids = @[[NSNull null], @"", @"7", @"12"];
+    NSArray *strings = @[[NSNull null], @"", @"/chat", @"{\"name\":\"x\"}", @"héllo \U0001F600 \ufffd"];
+    for (int type = -1; type <= NOOP; type++) {
+        for (id packetId in ids) {
+            for (id endpoint in strings) {
+                for (id data in strings) {
+                    for (int ack = 0; ack < 2; ack++) {
+                        AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] init];
+                        packet.type = type;
+                        packet.Id = packetId == [NSNull null] ? nil : packetId;
+                        packet.ack = ack;
+                        packet.endpoint = endpoint == [NSNull null] ? nil : endpoint;
+                        packet.data = data == [NSNull null] ? nil : data;
+                        XCTAssertEqualObjects([packet encode], AZLegacyEncode(packet));
+                    }
+                }
+            }
+        }
+    }
+}
+
+- (void)testPayloadRoundTrip
+{
+    NSMutableArray *packets = [NSMutableArray array];
+    NSMutableArray *encoded = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 50; i++) {
+        AZSocketIOPacket *packet = AZCandidatePacket(i);
+        if (i % 7 == 0) {
+            // Lengths count UTF-16 units, like the JavaScript side does.
+            packet.data = [packet.data stringByAppendingString:@" \U0001F600 \ufffd12\ufffd"];
+        }
+        [packets addObject:packet];
+        [encoded addObject:[packet encode]];
+    }
+    
+    NSMutableString *payload = [NSMutableString stringWithString:@"leftover"];
+    [payload setString:@""];
+    [AZSocketIOPacket encodePayload:packets intoString:payload];
+    XCTAssertTrue([payload hasPrefix:[NSString stringWithFormat:@"\ufffd%lu\ufffd", (unsigned long)[encoded[0] length]]]);
+    XCTAssertEqualObjects([AZSocketIOPacket decodePayload:payload], encoded);
+    
+    // A lone packet isn't framed.
+    [payload setString:@""];
+    [AZSocketIOPacket encodePayload:@[packets[0]] intoString:payload];
+    XCTAssertEqualObjects(payload, encoded[0]);
+    XCTAssertEqualObjects([AZSocketIOPacket decodePayload:payload], @[encoded[0]]);
+}
+
+- (void)testDecodePayload
+{
+    XCTAssertEqualObjects([AZSocketIOPacket decodePayload:@"\ufffd3\ufffd2::\ufffd7\ufffd3:::abc"], (@[@"2::", @"3:::abc"]));
+    XCTAssertEqualObjects([AZSocketIOPacket decodePayload:@"\ufffd0\ufffd"], @[@""]);
+    XCTAssertEqualObjects([AZSocketIOPacket decodePayload:@"1::"], @[@"1::"]);
+    XCTAssertEqualObjects([AZSocketIOPacket decodePayload:@""], @[@""]);
+    
+    for (NSString *malformed in @[@"\ufffd", @"\ufffd3", @"\ufffd3\ufffd", @"\ufffd3\ufffdab", @"\ufffdx\ufffd2::",
+                                  @"\ufffd2\ufffdabc", @"\ufffd\ufffd", @"\ufffd99999999999\ufffd2::"]) {
+        XCTAssertEqualObjects([AZSocketIOPacket decodePayload:malformed], @[], @"%@", malformed);
+    }
+}
+
+- (AZSocketIO *)_connectedSocketWithTransport:(AZRecordingTransport *)transport
+{
+    AZSocketIO *socket = [[AZSocketIO alloc] initWithHost:@"localhost" andPort:@"0" secure:NO];
+    socket.transport = transport;
+    transport.delegate = socket;
+    [socket setValue:@60 forKey:@"heartbeatInterval"];
+    [socket setValue:^{} forKey:@"connectionBlock"];
+    return socket;
+}
+
+- (void)testBurstIsCoalescedIntoOneWrite
+{
+    AZRecordingTransport *transport = [[AZRecordingTransport alloc] initWithDelegate:nil secureConnections:NO];
+    AZSocketIO *socket = [self _connectedSocketWithTransport:transport];
+    socket.coalescingInterval = 0.2;
+    
+    // Everything sent before the connect packet goes out in the first flush.
+    NSMutableArray *expected = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 40; i++) {
+        NSError *error = nil;
+        XCTAssertFalse([socket emit:@"message" args:@[@{@"candidate": @(i)}] error:&error]);
+        XCTAssertNil(error);
+    }
+    transport.batchExpectation = [self expectationWithDescription:@"first batch"];
+    [socket didReceiveMessage:@"1::"];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    // Then a burst inside the coalescing window.
+    transport.batchExpectation = [self expectationWithDescription:@"second batch"];
+    for (NSUInteger i = 40; i < 80; i++) {
+        XCTAssertTrue([socket emit:@"message" args:@[@{@"candidate": @(i)}] error:nil]);
+    }
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    XCTAssertEqual(transport.batches.count, (NSUInteger)2);
+    NSMutableArray *candidates = [NSMutableArray array];
+    for (NSString *batch in transport.batches) {
+        NSArray *messages = [AZSocketIOPacket decodePayload:batch];
+        XCTAssertEqual(messages.count, (NSUInteger)40);
+        for (NSString *message in messages) {
+            AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] initWithString:message];
+            XCTAssertEqual(packet.type, EVENT);
+            NSDictionary *event = [NSJSONSerialization JSONObjectWithData:[packet.data dataUsingEncoding:NSUTF8StringEncoding] options:0 error:nil];
+            [candidates addObject:event[@"args"][0][@"candidate"]];
+        }
+    }
+    for (NSUInteger i = 0; i < 80; i++) {
+        [expected addObject:@(i)];
+    }
+    XCTAssertEqualObjects(candidates, expected);
+    [socket disconnect];
+}
+
+- (void)testRefusedBatchIsOfferedAgain
+{
+    AZRecordingTransport *transport = [[AZRecordingTransport alloc] initWithDelegate:nil secureConnections:NO];
+    AZSocketIO *socket = [self _connectedSocketWithTransport:transport];
+    socket.coalescingInterval = 0;
+    transport.batchesToRefuse = 1;
+    
+    for (NSUInteger i = 0; i < 10; i++) {
+        XCTAssertFalse([socket emit:@"message" args:@[@{@"candidate": @(i)}] error:nil]);
+    }
+    
+    // The first flush is refused, and the same packets go out again, still in order.
+    transport.batchExpectation = [self expectationWithDescription:@"retried batch"];
+    [socket didReceiveMessage:@"1::"];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    XCTAssertEqual(transport.refusedBatchCount, (NSUInteger)1);
+    XCTAssertEqual(transport.batches.count, (NSUInteger)1);
+    
+    NSMutableArray *candidates = [NSMutableArray array];
+    NSMutableArray *expected = [NSMutableArray array];
+    for (NSString *message in [AZSocketIOPacket decodePayload:transport.batches[0]]) {
+        AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] initWithString:message];
+        NSDictionary *event = [NSJSONSerialization JSONObjectWithData:[packet.data dataUsingEncoding:NSUTF8StringEncoding] options:0 error:nil];
+        [candidates addObject:event[@"args"][0][@"candidate"]];
+        [expected addObject:@(expected.count)];
+    }
+    XCTAssertEqual(candidates.count, (NSUInteger)10);
+    XCTAssertEqualObjects(candidates, expected);
+    [socket disconnect];
+}
+
+- (void)testGetUTF8DataMatchesDataUsingEncoding
+{
+    NSMutableData *buffer = [NSMutableData data];
+    for (NSString *input in AZPacketCorpus()) {
+        AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] initWithString:input];
+        NSUInteger length = [packet getUTF8Data:buffer];
+        XCTAssertEqualObjects([buffer subdataWithRange:NSMakeRange(0, length)], [packet.data dataUsingEncoding:NSUTF8StringEncoding], @"%@", input);
+        
+        // Once data has been read, or replaced, the bytes come from the new string.
+        packet.data = [packet.data stringByAppendingString:@" \U0001F600"];
+        length = [packet getUTF8Data:buffer];
+        XCTAssertEqualObjects([buffer subdataWithRange:NSMakeRange(0, length)], [packet.data dataUsingEncoding:NSUTF8StringEncoding], @"%@", input);
+    }
+    
+    AZSocketIOPacket *empty = [[AZSocketIOPacket alloc] init];
+    empty.data = nil;
+    XCTAssertEqual([empty getUTF8Data:buffer], (NSUInteger)0);
+}
+
+- (void)testDataPacketsAreDeliveredInArrivalOrder
+{
+    AZRecordingTransport *transport = [[AZRecordingTransport alloc] initWithDelegate:nil secureConnections:NO];
+    AZSocketIO *socket = [self _connectedSocketWithTransport:transport];
+    
+    NSMutableArray *received = [NSMutableArray array];
+    XCTestExpectation *delivered = [self expectationWithDescription:@"delivered"];
+    NSUInteger total = 400;
+    void (^record)(id) = ^(id value) {
+        XCTAssertTrue([NSThread isMainThread]);
+        [received addObject:value];
+        if (received.count == total) {
+            [delivered fulfill];
+        }
+    };
+    [socket setMessageReceivedBlock:^(id data) {
+        record([data isKindOfClass:[NSString class]] ? @([data integerValue]) : data[@"seq"]);
+    }];
+    [socket addCallbackForEventName:@"candidate" callback:^(NSString *eventName, id args) {
+        record(args[0][@"seq"]);
+    }];
+    
+    // Big and small payloads, plain and JSON, events and acks, all interleaved.
+    NSString *padding = [@"" stringByPaddingToLength:20000 withString:@"x" startingAtIndex:0];
+    NSUInteger ackId = 0;
+    for (NSUInteger i = 0; i < total; i++) {
+        NSString *pad = i % 5 == 0 ? padding : @"";
+        switch (i % 4) {
+            case 0:
+                [socket didReceiveMessage:[NSString stringWithFormat:@"5:::{\"name\":\"candidate\",\"args\":[{\"seq\":%lu,\"pad\":\"%@\"}]}", (unsigned long)i, pad]];
+                break;
+            case 1:
+                [socket didReceiveMessage:[NSString stringWithFormat:@"3:::%lu", (unsigned long)i]];
+                break;
+            case 2:
+                [socket didReceiveMessage:[NSString stringWithFormat:@"4:::{\"seq\":%lu,\"pad\":\"%@\"}", (unsigned long)i, pad]];
+                break;
+            default:
+            {
+                NSNumber *seq = @(i);
+                [socket send:@"ping" error:nil ackWithArgs:^(NSArray *args) {
+                    record(seq);
+                }];
+                [socket didReceiveMessage:[NSString stringWithFormat:@"6:::%lu+[\"%@\"]", (unsigned long)++ackId, pad]];
+                break;
+            }
+        }
+    }
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    
+    for (NSUInteger i = 0; i < total; i++) {
+        XCTAssertEqualObjects(received[i], @(i));
+    }
+    [socket disconnect];
+}
+
+- (void)testDisconnectWaitsForEarlierPackets
+{
+    AZRecordingTransport *transport = [[AZRecordingTransport alloc] initWithDelegate:nil secureConnections:NO];
+    AZSocketIO *socket = [self _connectedSocketWithTransport:transport];
+    
+    NSMutableArray *received = [NSMutableArray array];
+    XCTestExpectation *closed = [self expectationWithDescription:@"closed"];
+    [socket setMessageReceivedBlock:^(id data) {
+        [received addObject:data[@"seq"]];
+    }];
+    transport.disconnectHandler = ^{
+        XCTAssertTrue([NSThread isMainThread]);
+        [received addObject:@"closed"];
+        [closed fulfill];
+    };
+    
+    // Large JSON messages take a while to decode; the DISCONNECT right behind them must wait.
+    NSString *padding = [@"" stringByPaddingToLength:50000 withString:@"x" startingAtIndex:0];
+    NSMutableArray *expected = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 50; i++) {
+        [socket didReceiveMessage:[NSString stringWithFormat:@"4:::{\"seq\":%lu,\"pad\":\"%@\"}", (unsigned long)i, padding]];
+        [expected addObject:@(i)];
+    }
+    [socket didReceiveMessage:@"0::"];
+    [expected addObject:@"closed"];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    
+    XCTAssertEqualObjects(received, expected);
+    transport.disconnectHandler = nil;
+}
+
+- (void)testAckRegistryTimesOutOnTheWheel
+{
+    __block NSTimeInterval now = 1000;
+    AZSocketIOAckRegistry *registry = [[AZSocketIOAckRegistry alloc] initWithTickInterval:1 slotCount:8];
+    registry.clock = ^{
+        return now;
+    };
+    
+    NSMutableArray *failed = [NSMutableArray array];
+    NSMutableDictionary *ids = [NSMutableDictionary dictionary];
+    for (NSNumber *timeout in @[@0.5, @3, @3, @20, @0]) {
+        __block NSUInteger ackId = 0;
+        ackId = [registry registerCallback:^{} failure:^(NSError *error) {
+            XCTAssertEqualObjects(error.domain, AZDOMAIN);
+            XCTAssertEqual(error.code, (NSInteger)AZSocketIOErrorAckTimeout);
+            [failed addObject:@(ackId)];
+        } timeout:[timeout doubleValue]];
+        ids[@(ackId)] = timeout;
+    }
+    XCTAssertEqualObjects([[ids allKeys] sortedArrayUsingSelector:@selector(compare:)], (@[@1, @2, @3, @4, @5]));
+    XCTAssertEqual(registry.count, (NSUInteger)5);
+    
+    // Nothing fails early, and nothing later than a tick after its deadline.
+    now += 0.4;
+    XCTAssertEqual([registry expireAcks], (NSUInteger)0);
+    now += 0.7;
+    XCTAssertEqual([registry expireAcks], (NSUInteger)1);
+    XCTAssertEqualObjects(failed, @[@1]);
+    
+    XCTAssertNotNil([registry takeCallbackForAckId:2]);
+    XCTAssertNil([registry takeCallbackForAckId:2]);
+    now += 3;
+    XCTAssertEqual([registry expireAcks], (NSUInteger)1);
+    XCTAssertEqualObjects(failed, (@[@1, @3]));
+    
+    // 20 seconds is more than one turn of an 8 second wheel.
+    for (int i = 0; i < 15; i++) {
+        now += 1;
+        [registry expireAcks];
+    }
+    XCTAssertEqualObjects(failed, (@[@1, @3]));
+    now += 1;
+    [registry expireAcks];
+    XCTAssertEqualObjects(failed, (@[@1, @3, @4]));
+    
+    // The one without a timeout waits until it is cancelled.
+    now += 1000;
+    XCTAssertEqual([registry expireAcks], (NSUInteger)0);
+    XCTAssertEqual(registry.count, (NSUInteger)1);
+    NSError *cancelled = [NSError errorWithDomain:AZDOMAIN code:AZSocketIOErrorAckCancelled userInfo:nil];
+    __block NSError *cancelError = nil;
+    [registry registerCallback:^{} failure:^(NSError *error) {
+        cancelError = error;
+    } timeout:5];
+    XCTAssertEqual([registry cancelAllWithError:cancelled], (NSUInteger)2);
+    XCTAssertEqual(cancelError, cancelled);
+    XCTAssertEqual(registry.count, (NSUInteger)0);
+}
+
+- (void)testAckRegistryCatchesUpAfterALongGap
+{
+    __block NSTimeInterval now = 0;
+    AZSocketIOAckRegistry *registry = [[AZSocketIOAckRegistry alloc] initWithTickInterval:0.25 slotCount:16];
+    registry.clock = ^{
+        return now;
+    };
+    
+    NSMutableArray *failed = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 200; i++) {
+        __block NSUInteger ackId = 0;
+        ackId = [registry registerCallback:^{} failure:^(NSError *error) {
+            [failed addObject:@(ackId)];
+        } timeout:1 + (i % 50) * 0.5];
+    }
+    NSMutableArray *expected = [NSMutableArray array];
+    for (NSUInteger timeoutIndex = 0; timeoutIndex < 50; timeoutIndex++) {
+        for (NSUInteger i = timeoutIndex; i < 200; i += 50) {
+            [expected addObject:@(i + 1)];
+        }
+    }
+    
+    // Asleep for an hour: everything fails at once, soonest deadline first.
+    now = 3600;
+    XCTAssertEqual([registry expireAcks], (NSUInteger)200);
+    XCTAssertEqualObjects(failed, expected);
+    XCTAssertEqual(registry.count, (NSUInteger)0);
+}
+
+- (void)testAcksAreCancelledWhenTheConnectionCloses
+{
+    AZRecordingTransport *transport = [[AZRecordingTransport alloc] initWithDelegate:nil secureConnections:NO];
+    AZSocketIO *socket = [self _connectedSocketWithTransport:transport];
+    
+    __block NSError *failure = nil;
+    __block BOOL acked = NO;
+    XCTAssertFalse([socket emit:@"join" args:@[@"room"] error:nil ackWithArgs:^(NSArray *data) {
+        acked = YES;
+    } failure:^(NSError *error) {
+        failure = error;
+    }]);
+    [socket didClose];
+    XCTAssertEqual(failure.code, (NSInteger)AZSocketIOErrorAckCancelled);
+    
+    // An ACK that turns up afterwards has nothing to call.
+    XCTestExpectation *delivered = [self expectationWithDescription:@"delivered"];
+    [socket setMessageReceivedBlock:^(id data) {
+        [delivered fulfill];
+    }];
+    [socket didReceiveMessage:@"6:::1+[\"ok\"]"];
+    [socket didReceiveMessage:@"3:::done"];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    XCTAssertFalse(acked);
+}
+
+- (void)testAckTimesOut
+{
+    AZRecordingTransport *transport = [[AZRecordingTransport alloc] initWithDelegate:nil secureConnections:NO];
+    AZSocketIO *socket = [self _connectedSocketWithTransport:transport];
+    socket.ackTimeout = 0.3;
+    
+    XCTestExpectation *timedOut = [self expectationWithDescription:@"timed out"];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    [socket send:@"ping" error:nil ackWithArgs:^(NSArray *data) {
+        XCTFail(@"Unexpected ACK");
+    } failure:^(NSError *error) {
+        XCTAssertEqual(error.code, (NSInteger)AZSocketIOErrorAckTimeout);
+        XCTAssertGreaterThanOrEqual(CFAbsoluteTimeGetCurrent() - start, 0.3);
+        [timedOut fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    [socket disconnect];
+}
+
+static NSArray *AZBenchmarkPackets(void)
+{
+    NSMutableArray *packets = [NSMutableArray array];
+    for (int i = 0; i < 100000; i++) {
+        switch (i % 4) {
+            case 0: [packets addObject:@"2::"]; break;
+            case 1: [packets addObject:[NSString stringWithFormat:@"6:::%d+[null,{\"id\":\"%08x\"}]", i, arc4random()]]; break;
+            default: [packets addObject:[NSString stringWithFormat:@"5:::{\"name\":\"message\",\"args\":[{\"to\":\"%08x\",\"type\":\"candidate\",\"payload\":{\"candidate\":\"a=candidate:%u 1 udp 2122260223 192.168.1.%u 5%04u typ host\"}}]}", arc4random(), arc4random(), i % 255, i % 10000]]; break;
+        }
+    }
+    return packets;
+}
+
+- (void)testPacketParseThroughput
+{
+    NSArray *packets = AZBenchmarkPackets();
+
+    [self measureBlock:^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for (NSString *input in packets) {
+            @autoreleasepool {
+                AZSocketIOPacket *packet = [[AZSocketIOPacket alloc] initWithString:input];
+                (void)packet.data;
+            }
+        }
+        NSLog(@"%.0f packets/s", packets.count / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+}
+
+- (void)testPayloadEncodeThroughput
+{
+    NSMutableArray *packets = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 50; i++) {
+        [packets addObject:AZCandidatePacket(i)];
+    }
+    NSMutableString *buffer = [NSMutableString string];
+    
+    [self measureBlock:^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for (int i = 0; i < 2000; i++) {
+            @autoreleasepool {
+                [buffer setString:@""];
+                [AZSocketIOPacket encodePayload:packets intoString:buffer];
+            }
+        }
+        NSLog(@"%.0f packets/s", 2000 * packets.count / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+}
+
+- (void)testLegacyPacketEncodeThroughput
+{
+    NSMutableArray *packets = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 50; i++) {
+        [packets addObject:AZCandidatePacket(i)];
+    }
+    
+    [self measureBlock:^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for (int i = 0; i < 2000; i++) {
+            @autoreleasepool {
+                for (AZSocketIOPacket *packet in packets) {
+                    (void)AZLegacyEncode(packet);
+                }
+            }
+        }
+        NSLog(@"%.0f packets/s", 2000 * packets.count / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+}
+
+- (void)testEventDecodeThroughput
+{
+    AZRecordingTransport *transport = [[AZRecordingTransport alloc] initWithDelegate:nil secureConnections:NO];
+    AZSocketIO *socket = [self _connectedSocketWithTransport:transport];
+    NSMutableArray *messages = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 20000; i++) {
+        NSMutableString *message = [NSMutableString string];
+        [AZCandidatePacket(i) encodeIntoString:message];
+        [messages addObject:message];
+    }
+    
+    __block NSUInteger received = 0;
+    __block XCTestExpectation *delivered = nil;
+    [socket addCallbackForEventName:@"message" callback:^(NSString *eventName, id args) {
+        if (++received == messages.count) {
+            [delivered fulfill];
+        }
+    }];
+    
+    [self measureBlock:^{
+        received = 0;
+        delivered = [self expectationWithDescription:@"delivered"];
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for (NSString *message in messages) {
+            [socket didReceiveMessage:message];
+        }
+        [self waitForExpectationsWithTimeout:30 handler:nil];
+        NSLog(@"%.0f events/s", messages.count / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+    [socket disconnect];
+}
+
+- (void)testAckRegistryThroughput
+{
+    __block NSTimeInterval now = 0;
+    AZSocketIOAckRegistry *registry = [[AZSocketIOAckRegistry alloc] init];
+    registry.clock = ^{
+        return now;
+    };
+    
+    [self measureBlock:^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        // Most ACKs arrive in time; one in ten is left to expire.
+        for (NSUInteger i = 0; i < 100000; i++) {
+            NSUInteger ackId = [registry registerCallback:^{} failure:nil timeout:30];
+            if (i % 10) {
+                [registry takeCallbackForAckId:ackId];
+            }
+            if (i % 1000 == 0) {
+                now += 0.25;
+                [registry expireAcks];
+            }
+        }
+        now += 60;
+        [registry expireAcks];
+        XCTAssertEqual(registry.count, (NSUInteger)0);
+        NSLog(@"%.0f acks/s", 100000 / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+}
+
+- (void)testRegexPacketParseThroughput
+{
+    NSArray *packets = AZBenchmarkPackets();
+
+    [self measureBlock:^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for (NSString *input in packets) {
+            @autoreleasepool {
+                AZLegacyPacket *packet = [[AZLegacyPacket alloc] initWithString:input];
+                (void)packet.data;
+            }
+        }
+        NSLog(@"%.0f packets/s", packets.count / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+}
+
+// The websocket keeps SocketRocket's own default backend unless the socket asks for the socket backend
+- (void)testSocketBackendIsOptIn
+{
+    AZSocketIO *socket = [[AZSocketIO alloc] initWithHost:@"localhost" andPort:@"0" secure:NO];
+    XCTAssertFalse(socket.usesSocketBackend);
+    AZWebsocketTransport *transport = [[AZWebsocketTransport alloc] initWithDelegate:socket secureConnections:NO];
+    XCTAssertNil(transport.websocket.ioBackend);
+    
+    socket.usesSocketBackend = YES;
+    transport = [[AZWebsocketTransport alloc] initWithDelegate:socket secureConnections:NO];
+    XCTAssertEqual(transport.websocket.ioBackend, [SRSocketBackend sharedBackend]);
+}
+
+@end
@@ -0,0 +1,1800 @@
+//
+//  SRWebSocketTests.m
+//  Copyright (c) 2014 &yet, LLC and otalk contributors
+//
+
+#import <XCTest/XCTest.h>
+
+#import "SRWebSocket.h"
+#import "SRMask.h"
+#import "SRRingBuffer.h"
+#import "SRUTF8.h"
+#import "SRDeflate.h"
+#import "SRFrameDecoder.h"
+#import "../tests/SRMalformedFrameCorpus.h"
+
+#import <CommonCrypto/CommonDigest.h>
+#import <arpa/inet.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <sys/resource.h>
+#import <sys/socket.h>
+#import <unicode/utf8.h>
+
+// Unmasked server frames: count frames of payloadLength bytes each.
+static NSData *SRSyntheticFrameStream(NSUInteger count, size_t payloadLength)
+{
+    NSMutableData *stream = [NSMutableData data];
+    NSMutableData *payload = [NSMutableData dataWithLength:payloadLength];
+    memset(payload.mutableBytes, 'a', payloadLength);
+
+    for (NSUInteger i = 0; i < count; i++) {
+        uint8_t header[10] = {0x81};
+        size_t headerLength = 2;
+        if (payloadLength < 126) {
+            header[1] = (uint8_t)payloadLength;
+        } else if (payloadLength <= UINT16_MAX) {
+            header[1] = 126;
+            header[2] = (uint8_t)(payloadLength >> 8);
+            header[3] = (uint8_t)payloadLength;
+            headerLength += 2;
+        } else {
+            header[1] = 127;
+            for (int b = 0; b < 8; b++) {
+                header[2 + b] = (uint8_t)((uint64_t)payloadLength >> (56 - 8 * b));
+            }
+            headerLength += 8;
+        }
+        [stream appendBytes:header length:headerLength];
+        [stream appendData:payload];
+    }
+    return stream;
+}
+
+// Mirrors the socket's read path: the stream is read into the ring in chunkSize pieces, the
+// frame decoder runs over the front of it, and each payload chunk is appended to frameData
+// straight out of the ring.
+static NSUInteger SRScanFrameStream(NSData *stream, size_t chunkSize)
+{
+    SRRingBuffer ring;
+    SRRingBufferInit(&ring, chunkSize * 2);
+    SRFrameDecoder decoder;
+    SRFrameDecoderInit(&decoder, false);
+    NSMutableData *frameData = [NSMutableData data];
+    NSUInteger frames = 0;
+
+    const uint8_t *src = stream.bytes;
+    size_t remaining = stream.length;
+    while (remaining || ring.length) {
+        if (remaining) {
+            uint8_t *dst = NULL;
+            SRRingBufferReserve(&ring, chunkSize);
+            size_t length = MIN(MIN(SRRingBufferWritableBytes(&ring, &dst), chunkSize), remaining);
+            memcpy(dst, src, length);
+            SRRingBufferCommit(&ring, length);
+            src += length;
+            remaining -= length;
+        }
+
+        while (YES) {
+            uint8_t *bytes = NULL;
+            size_t length = SRRingBufferReadableBytes(&ring, (const uint8_t **)&bytes);
+            size_t consumed = 0;
+            uint8_t *payload = NULL;
+            size_t payloadLength = 0;
+            SRFrameEvent event = SRFrameDecoderDecode(&decoder, bytes, length, &consumed, &payload, &payloadLength);
+            if (event == SRFrameEventHeader) {
+                [frameData setLength:0];
+            } else if (event == SRFrameEventPayload) {
+                [frameData appendBytes:payload length:payloadLength];
+            } else if (event == SRFrameEventFrameEnd) {
+                frames++;
+            }
+            SRRingBufferConsume(&ring, consumed);
+            if (event == SRFrameEventError || (event == SRFrameEventNone && consumed == 0)) {
+                break;
+            }
+        }
+        if (decoder.state == SRFrameDecoderStateFailed) {
+            break;
+        }
+    }
+
+    SRRingBufferFree(&ring);
+    return frames;
+}
+
+// Decodes input fed to the decoder chunkSize bytes at a time and returns what it reported:
+// H for a header, E for the end of a frame, !n for error n. Payload bytes go to payloads.
+static NSString *SRDecodeFrames(NSData *input, size_t chunkSize, BOOL expectsMasking, BOOL allowsCompression, NSMutableData *payloads)
+{
+    NSMutableData *buffer = [input mutableCopy];
+    SRFrameDecoder decoder;
+    SRFrameDecoderInit(&decoder, expectsMasking);
+    decoder.allowsCompression = allowsCompression;
+    NSMutableString *trace = [NSMutableString string];
+
+    size_t offset = 0;
+    size_t available = 0;
+    while (YES) {
+        // Bytes arrive chunkSize at a time; whatever the decoder hasn't used is offered again.
+        available = MAX(available, MIN(chunkSize, buffer.length - offset));
+        size_t consumed = 0;
+        uint8_t *payload = NULL;
+        size_t payloadLength = 0;
+        SRFrameEvent event = SRFrameDecoderDecode(&decoder, (uint8_t *)buffer.mutableBytes + offset, available, &consumed, &payload, &payloadLength);
+        offset += consumed;
+        available -= consumed;
+
+        if (event == SRFrameEventHeader) {
+            [trace appendString:@"H"];
+        } else if (event == SRFrameEventPayload) {
+            [payloads appendBytes:payload length:payloadLength];
+        } else if (event == SRFrameEventFrameEnd) {
+            [trace appendString:@"E"];
+        } else if (event == SRFrameEventError) {
+            [trace appendFormat:@"!%d", decoder.error];
+            break;
+        } else if (offset == buffer.length) {
+            break;
+        }
+    }
+    return trace;
+}
+
+// The ICU based validator SRWebSocket used before SRUTF8.h, kept as the reference.
+// Returns the length of the longest prefix ending on a code point boundary, or -1.
+static int32_t SRLegacyValidatePartialString(NSData *data)
+{
+    if ([data length] > INT32_MAX) {
+        return -1;
+    }
+
+    int32_t size = (int32_t)[data length];
+    const uint8_t *str = (const uint8_t *)[data bytes];
+
+    UChar32 codepoint = 1;
+    int32_t offset = 0;
+    int32_t lastOffset = 0;
+    while (offset < size && codepoint > 0) {
+        lastOffset = offset;
+        U8_NEXT(str, offset, size, codepoint);
+    }
+
+    if (codepoint == -1) {
+        if (!U8_IS_LEAD(str[lastOffset]) || U8_COUNT_TRAIL_BYTES(str[lastOffset]) + lastOffset < (int32_t)size) {
+            size = -1;
+        } else {
+            for (int i = lastOffset + 1; i < offset; i++) {
+                if (U8_IS_SINGLE(str[i]) || U8_IS_LEAD(str[i]) || !U8_IS_TRAIL(str[i])) {
+                    size = -1;
+                }
+            }
+
+            if (size != -1) {
+                size = lastOffset;
+            }
+        }
+    }
+
+    if (size != -1 && ![[NSString alloc] initWithBytesNoCopy:(char *)[data bytes] length:size encoding:NSUTF8StringEncoding freeWhenDone:NO]) {
+        size = -1;
+    }
+
+    return size;
+}
+
+// Valid UTF-8 made of count code points; asciiPercent of them are ASCII, the rest are
+// spread over the 2, 3 and 4 byte forms.
+static NSData *SRRandomUTF8(NSUInteger count, uint32_t asciiPercent)
+{
+    NSMutableData *text = [NSMutableData dataWithCapacity:count * 2];
+    for (NSUInteger i = 0; i < count; i++) {
+        uint8_t bytes[4];
+        size_t length;
+        uint32_t codepoint;
+        if (arc4random_uniform(100) < asciiPercent) {
+            codepoint = arc4random_uniform(0x80);
+        } else {
+            switch (arc4random_uniform(3)) {
+                case 0: codepoint = 0x80 + arc4random_uniform(0x800 - 0x80); break;
+                case 1:
+                    do {
+                        codepoint = 0x800 + arc4random_uniform(0x10000 - 0x800);
+                    } while (codepoint >= 0xD800 && codepoint <= 0xDFFF);
+                    break;
+                default: codepoint = 0x10000 + arc4random_uniform(0x110000 - 0x10000); break;
+            }
+        }
+
+        if (codepoint < 0x80) {
+            bytes[0] = (uint8_t)codepoint;
+            length = 1;
+        } else if (codepoint < 0x800) {
+            bytes[0] = (uint8_t)(0xC0 | (codepoint >> 6));
+            bytes[1] = (uint8_t)(0x80 | (codepoint & 0x3F));
+            length = 2;
+        } else if (codepoint < 0x10000) {
+            bytes[0] = (uint8_t)(0xE0 | (codepoint >> 12));
+            bytes[1] = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+            bytes[2] = (uint8_t)(0x80 | (codepoint & 0x3F));
+            length = 3;
+        } else {
+            bytes[0] = (uint8_t)(0xF0 | (codepoint >> 18));
+            bytes[1] = (uint8_t)(0x80 | ((codepoint >> 12) & 0x3F));
+            bytes[2] = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+            bytes[3] = (uint8_t)(0x80 | (codepoint & 0x3F));
+            length = 4;
+        }
+        [text appendBytes:bytes length:length];
+    }
+    return text;
+}
+
+// Offer, answer and candidate messages shaped like the ones the signaling server relays.
+static NSArray *SRSignalingCorpus(NSUInteger count)
+{
+    NSMutableArray *messages = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        NSString *peer = [NSString stringWithFormat:@"%08x%08x", arc4random(), arc4random()];
+        if (i % 5 == 0) {
+            NSString *sdp = [NSString stringWithFormat:
+                @"v=0\\r\\no=- %u 2 IN IP4 127.0.0.1\\r\\ns=-\\r\\nt=0 0\\r\\na=group:BUNDLE audio video\\r\\na=msid-semantic: WMS %08x\\r\\n"
+                @"m=audio 9 UDP/TLS/RTP/SAVPF 111 103 104 9 0 8 106 105 13 126\\r\\nc=IN IP4 0.0.0.0\\r\\na=rtcp:9 IN IP4 0.0.0.0\\r\\n"
+                @"a=ice-ufrag:%04x\\r\\na=ice-pwd:%08x%08x%08x\\r\\na=fingerprint:sha-256 %02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X\\r\\n"
+                @"a=setup:actpass\\r\\na=mid:audio\\r\\na=extmap:1 urn:ietf:params:rtp-hdrext:ssrc-audio-level\\r\\na=sendrecv\\r\\na=rtcp-mux\\r\\n"
+                @"a=rtpmap:111 opus/48000/2\\r\\na=fmtp:111 minptime=10;useinbandfec=1\\r\\na=rtpmap:103 ISAC/16000\\r\\na=rtpmap:104 ISAC/32000\\r\\n"
+                @"a=rtpmap:9 G722/8000\\r\\na=rtpmap:0 PCMU/8000\\r\\na=rtpmap:8 PCMA/8000\\r\\na=ssrc:%u cname:%08x\\r\\n"
+                @"m=video 9 UDP/TLS/RTP/SAVPF 100 116 117 96\\r\\nc=IN IP4 0.0.0.0\\r\\na=rtcp:9 IN IP4 0.0.0.0\\r\\na=ice-ufrag:%04x\\r\\n"
+                @"a=setup:actpass\\r\\na=mid:video\\r\\na=extmap:2 urn:ietf:params:rtp-hdrext:toffset\\r\\na=sendrecv\\r\\na=rtcp-mux\\r\\n"
+                @"a=rtpmap:100 VP8/90000\\r\\na=rtcp-fb:100 ccm fir\\r\\na=rtcp-fb:100 nack\\r\\na=rtcp-fb:100 nack pli\\r\\na=rtcp-fb:100 goog-remb\\r\\n"
+                @"a=rtpmap:116 red/90000\\r\\na=rtpmap:117 ulpfec/90000\\r\\na=rtpmap:96 rtx/90000\\r\\na=fmtp:96 apt=100\\r\\na=ssrc:%u cname:%08x\\r\\n",
+                arc4random(), arc4random(), arc4random_uniform(0x10000), arc4random(), arc4random(), arc4random(),
+                arc4random_uniform(256), arc4random_uniform(256), arc4random_uniform(256), arc4random_uniform(256),
+                arc4random_uniform(256), arc4random_uniform(256), arc4random_uniform(256), arc4random_uniform(256),
+                arc4random(), arc4random(), arc4random_uniform(0x10000), arc4random(), arc4random()];
+            [messages addObject:[NSString stringWithFormat:@"5:::{\"name\":\"message\",\"args\":[{\"to\":\"%@\",\"type\":\"%@\",\"payload\":{\"type\":\"%@\",\"sdp\":\"%@\"}}]}", peer, i % 2 ? @"answer" : @"offer", i % 2 ? @"answer" : @"offer", sdp]];
+        } else {
+            [messages addObject:[NSString stringWithFormat:@"5:::{\"name\":\"message\",\"args\":[{\"to\":\"%@\",\"type\":\"candidate\",\"payload\":{\"candidate\":{\"sdpMLineIndex\":%u,\"sdpMid\":\"%@\",\"candidate\":\"a=candidate:%u 1 udp %u 192.168.%u.%u %u typ host generation 0\\r\\n\"}}}]}", peer, (unsigned)(i % 2), i % 2 ? @"video" : @"audio", arc4random(), 2122260223 - arc4random_uniform(1000), arc4random_uniform(256), arc4random_uniform(256), 1024 + arc4random_uniform(60000)]];
+        }
+    }
+    return messages;
+}
+
+static BOOL SRSocketRead(int fd, void *buffer, size_t length)
+{
+    uint8_t *bytes = buffer;
+    while (length) {
+        ssize_t count = recv(fd, bytes, length, 0);
+        if (count <= 0) {
+            return NO;
+        }
+        bytes += count;
+        length -= count;
+    }
+    return YES;
+}
+
+static BOOL SRSocketWrite(int fd, const void *buffer, size_t length)
+{
+    const uint8_t *bytes = buffer;
+    while (length) {
+        ssize_t count = send(fd, bytes, length, 0);
+        if (count <= 0) {
+            return NO;
+        }
+        bytes += count;
+        length -= count;
+    }
+    return YES;
+}
+
+static NSString *SRWebSocketAcceptForKey(NSString *key)
+{
+    NSData *acceptSource = [[key stringByAppendingString:@"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"] dataUsingEncoding:NSUTF8StringEncoding];
+    uint8_t digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1(acceptSource.bytes, (CC_LONG)acceptSource.length, digest);
+    return [[NSData dataWithBytes:digest length:sizeof(digest)] base64EncodedStringWithOptions:0];
+}
+
+static NSData *SRIPv4Address(const char *string)
+{
+    struct sockaddr_in address = {0};
+    address.sin_len = sizeof(address);
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, string, &address.sin_addr);
+    return [NSData dataWithBytes:&address length:sizeof(address)];
+}
+
+static NSData *SRInflateMessage(SRInflater *inflater, NSData *payload)
+{
+    NSMutableData *message = [NSMutableData data];
+    uint8_t chunk[16384];
+    for (int pass = 0; pass < 2; pass++) {
+        const uint8_t *src = pass ? SRDeflateMessageTail : payload.bytes;
+        size_t length = pass ? sizeof(SRDeflateMessageTail) : payload.length;
+        ptrdiff_t written;
+        do {
+            written = SRInflaterInflate(inflater, &src, &length, chunk, sizeof(chunk));
+            if (written < 0) {
+                return nil;
+            }
+            [message appendBytes:chunk length:written];
+        } while (length || written == sizeof(chunk));
+    }
+    SRInflaterEndMessage(inflater);
+    return message;
+}
+
+// WebSocket server on 127.0.0.1 that echoes every data message back, compressed if
+// permessage-deflate was negotiated, and counts the frame bytes each way. Each connection is
+// served on a thread of its own. The counters are only meant to be read once the echoes have
+// arrived, and only with a single connection.
+@interface SRLoopbackServer : NSObject
+
+@property (nonatomic, readonly) NSURL *url;
+
+// Sent back as Sec-WebSocket-Extensions when the client offers compression; nil declines it.
+@property (nonatomic, copy) NSString *extensionsResponse;
+
+// Set to leave pings unanswered, like a peer that has gone away without closing.
+@property (nonatomic, assign) BOOL ignoresPings;
+
+// Raw bytes written once the handshake is done, each NSData in its own write 50 ms after the
+// last, so the client reads them separately. Echoing starts after the last one.
+@property (nonatomic, copy) NSArray *scriptedWrites;
+
+@property (nonatomic, readonly) NSUInteger bytesReceived;
+@property (nonatomic, readonly) NSUInteger bytesSent;
+@property (nonatomic, readonly) NSUInteger compressedMessagesReceived;
+
+// Accepts one connection.
+- (void)start;
+- (void)startWithConnectionCount:(NSUInteger)connectionCount;
+
+@end
+
+@implementation SRLoopbackServer {
+    int _listenSocket;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        _extensionsResponse = @"permessage-deflate";
+        
+        _listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address = {0};
+        address.sin_len = sizeof(address);
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof(address);
+        if (bind(_listenSocket, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(_listenSocket, SOMAXCONN) != 0 || getsockname(_listenSocket, (struct sockaddr *)&address, &addressLength) != 0) {
+            return nil;
+        }
+        _url = [NSURL URLWithString:[NSString stringWithFormat:@"ws://127.0.0.1:%d/", ntohs(address.sin_port)]];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    close(_listenSocket);
+}
+
+- (void)start
+{
+    [self startWithConnectionCount:1];
+}
+
+- (void)startWithConnectionCount:(NSUInteger)connectionCount
+{
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        for (NSUInteger i = 0; i < connectionCount; i++) {
+            int fd = accept(_listenSocket, NULL, NULL);
+            if (fd < 0) {
+                break;
+            }
+            // Not a global queue: hundreds of connections blocked in read would exhaust its threads.
+            [NSThread detachNewThreadSelector:@selector(_serveConnectionOnThread:) toTarget:self withObject:@(fd)];
+        }
+    });
+}
+
+- (void)_serveConnectionOnThread:(NSNumber *)fd
+{
+    @autoreleasepool {
+        [self _serveConnection:fd.intValue];
+        close(fd.intValue);
+    }
+}
+
+- (void)_serveConnection:(int)fd
+{
+    CFHTTPMessageRef request = CFHTTPMessageCreateEmpty(NULL, YES);
+    uint8_t byte;
+    while (!CFHTTPMessageIsHeaderComplete(request) && SRSocketRead(fd, &byte, 1)) {
+        CFHTTPMessageAppendBytes(request, &byte, 1);
+    }
+    NSString *key = CFBridgingRelease(CFHTTPMessageCopyHeaderFieldValue(request, CFSTR("Sec-WebSocket-Key")));
+    NSString *offer = CFBridgingRelease(CFHTTPMessageCopyHeaderFieldValue(request, CFSTR("Sec-WebSocket-Extensions")));
+    CFRelease(request);
+    
+    NSString *accept = SRWebSocketAcceptForKey(key);
+    
+    BOOL compression = [offer hasPrefix:@"permessage-deflate"] && _extensionsResponse;
+    NSMutableString *response = [NSMutableString stringWithFormat:@"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %@\r\n", accept];
+    if (compression) {
+        [response appendFormat:@"Sec-WebSocket-Extensions: %@\r\n", _extensionsResponse];
+    }
+    [response appendString:@"\r\n"];
+    NSData *responseData = [response dataUsingEncoding:NSUTF8StringEncoding];
+    if (!SRSocketWrite(fd, responseData.bytes, responseData.length)) {
+        return;
+    }
+    
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    for (NSData *chunk in _scriptedWrites) {
+        [NSThread sleepForTimeInterval:0.05];
+        if (!SRSocketWrite(fd, chunk.bytes, chunk.length)) {
+            return;
+        }
+    }
+    
+    SRDeflater deflater = {0};
+    SRInflater inflater = {0};
+    if (compression) {
+        SRDeflaterInit(&deflater, 15, 8, [_extensionsResponse rangeOfString:@"server_no_context_takeover"].location != NSNotFound);
+        SRInflaterInit(&inflater, 15, [_extensionsResponse rangeOfString:@"client_no_context_takeover"].location != NSNotFound);
+    }
+    
+    NSMutableData *message = [NSMutableData data];
+    uint8_t messageOpcode = 0;
+    BOOL messageCompressed = NO;
+    while (YES) {
+        uint8_t header[2];
+        uint8_t extendedLength[8];
+        uint8_t maskKey[4] = {0};
+        if (!SRSocketRead(fd, header, sizeof(header))) {
+            break;
+        }
+        
+        uint64_t payloadLength = header[1] & 0x7F;
+        size_t extendedSize = payloadLength == 126 ? 2 : payloadLength == 127 ? 8 : 0;
+        BOOL masked = !!(header[1] & 0x80);
+        if (!SRSocketRead(fd, extendedLength, extendedSize) || (masked && !SRSocketRead(fd, maskKey, sizeof(maskKey)))) {
+            break;
+        }
+        if (extendedSize) {
+            payloadLength = 0;
+            for (size_t i = 0; i < extendedSize; i++) {
+                payloadLength = (payloadLength << 8) | extendedLength[i];
+            }
+        }
+        
+        NSMutableData *payload = [NSMutableData dataWithLength:(NSUInteger)payloadLength];
+        if (!SRSocketRead(fd, payload.mutableBytes, payload.length)) {
+            break;
+        }
+        SRMaskBytes(payload.mutableBytes, payload.bytes, payload.length, maskKey, 0);
+        _bytesReceived += sizeof(header) + extendedSize + (masked ? sizeof(maskKey) : 0) + payload.length;
+        
+        uint8_t opcode = header[0] & 0x0F;
+        if (opcode == 0x9 && _ignoresPings) {
+            continue;
+        }
+        if (opcode == 0x8 || opcode == 0x9) {
+            // Close is echoed back as is; ping gets its pong.
+            [self _writeFrameWithOpcode:opcode == 0x8 ? 0x8 : 0xA payload:payload compressed:NO fd:fd];
+            if (opcode == 0x8) {
+                break;
+            }
+            continue;
+        }
+        
+        if (opcode != 0) {
+            messageOpcode = opcode;
+            messageCompressed = !!(header[0] & 0x40);
+            [message setLength:0];
+        }
+        [message appendData:payload];
+        if (!(header[0] & 0x80)) {
+            continue;
+        }
+        
+        NSData *plain = message;
+        if (messageCompressed) {
+            _compressedMessagesReceived++;
+            plain = SRInflateMessage(&inflater, message);
+            if (!plain) {
+                break;
+            }
+        }
+        
+        if (compression) {
+            NSMutableData *compressed = [NSMutableData dataWithLength:SRDeflaterBound(&deflater, plain.length)];
+            compressed.length = SRDeflaterCompressMessage(&deflater, plain.bytes, plain.length, compressed.mutableBytes, compressed.length);
+            [self _writeFrameWithOpcode:messageOpcode payload:compressed compressed:YES fd:fd];
+        } else {
+            [self _writeFrameWithOpcode:messageOpcode payload:plain compressed:NO fd:fd];
+        }
+    }
+    
+    SRDeflaterFree(&deflater);
+    SRInflaterFree(&inflater);
+}
+
+- (void)_writeFrameWithOpcode:(uint8_t)opcode payload:(NSData *)payload compressed:(BOOL)compressed fd:(int)fd
+{
+    uint8_t header[10] = {0x80 | opcode | (compressed ? 0x40 : 0)};
+    size_t headerLength = 2;
+    if (payload.length < 126) {
+        header[1] = (uint8_t)payload.length;
+    } else if (payload.length <= UINT16_MAX) {
+        header[1] = 126;
+        header[2] = (uint8_t)(payload.length >> 8);
+        header[3] = (uint8_t)payload.length;
+        headerLength += 2;
+    } else {
+        header[1] = 127;
+        for (int b = 0; b < 8; b++) {
+            header[2 + b] = (uint8_t)((uint64_t)payload.length >> (56 - 8 * b));
+        }
+        headerLength += 8;
+    }
+    
+    SRSocketWrite(fd, header, headerLength);
+    SRSocketWrite(fd, payload.bytes, payload.length);
+    _bytesSent += headerLength + payload.length;
+}
+
+@end
+
+// Stands in for a TLS-terminating WebSocket server on 127.0.0.1, to count what setting up a
+// connection costs. It gets through the TLS handshake and the opening handshake, then answers the
+// client's close. For each connection it records the round trips it saw the client wait for.
+@interface SRTLSStandInServer : NSObject
+
+@property (nonatomic, readonly) uint16_t port;
+@property (nonatomic, readonly) NSUInteger acceptedCount;
+
+// Round trips from the client's first TLS record to its upgrade request, one NSNumber for each
+// connection that got that far, in order. The TCP handshake before them isn't included.
+@property (nonatomic, readonly) NSArray *roundTrips;
+
+- (void)startWithConnectionCount:(NSUInteger)connectionCount;
+
+@end
+
+// A self-signed identity for CN=localhost: PKCS#12, password "standin".
+static NSString *const SRStandInIdentity =
+    @"MIIJSQIBAzCCCQ8GCSqGSIb3DQEHAaCCCQAEggj8MIII+DCCA68GCSqGSIb3DQEHBqCCA6AwggOcAgEAMIIDlQYJKoZIhvcN"
+    @"AQcBMBwGCiqGSIb3DQEMAQMwDgQIbWE64g28azACAggAgIIDaKZq3URxGejd9NHr0DiqQy0icDVxlgJGXiFJ9wWpsU8wPb24"
+    @"cPev3YUXi3Q9JbJfMAld8u27bEq4s0xCbHt96SE1kvg9WMVbfazZnxF9vDPmG3nydIQcDStPPqx91NGXgVWWADff5vs1TATm"
+    @"dugdG8z5+hxXwcx0ESYJKNQeefuaBl8qDbbKGKF4qRoVJDcJHn4EVGlBjxerl2HU1qOmomOLWzBdf9COkx2UPk6ZSfDTocXL"
+    @"925V4jrI/YQVU+eLU7QTMjQZ7um4iMXLMMxTi3hRKzq/WFS0XsH2oWteGxOQdLm2R8q3Qiy4Acdr0TthPtp6YKUXtbutiE+g"
+    @"C7+HXxu1BlQX/VdqxthI5sslFpvL3O8WZi4YCkNSt3ckMUrjaaBvT+W5iOaf1HaV1NR7Ble9JeKcb7+UiIubr9kjjZQZyPQv"
+    @"GEi+rhkkwMCm9aXFbwayz90Uv/6qpfNl7ZXdSmMV4nR4m6u+cAeXVxMIAIOuiam4QsHeRqlDQqwk5bsrEI/IR5FHugWXXRp/"
+    @"nbkLVk9rlZzNN0SP9o1KU4xqHl9inidVm2frf6XT/luF/sqsI3Ski1inndUMex9To8mtYWX+7yiHhX5Yb6QHYN2GqbUFV48n"
+    @"stQ5f8c5m3PQA6Pfgw25FBkyNPaaKbr7YJFvdUI8pUKp/bT1G9AMZkcI3wTmrs0t4Ktjtrg7ThNiLsv0QAAH5pPz8ItXV9vz"
+    @"yf5NC8IL0aQhKSsof97aPz1fL5bWdEed/GOahKMuvQ7ITr4kOsApnugmlCrUbfX0i//lDXof9/iFu02rPCHXqjY0rI7iAEAo"
+    @"W4ZTOsL2LLyMkIpiEI7iTGxK6nZT8g2NXBhz7+1JSlOQ3YYSs/fvalFuDUsLeCSqOmxa3g+YQpXQ0FFN6KwO3GLH3jijPHz6"
+    @"vMce9W9VUtZpp+DjrYeYZVnDOcPtDKvhSKZg26YftIjqk9nCH7Jie1r3EpwNiCRg5uwLpbzA2TjXUTO56hhrh524N9Mx9cl7"
+    @"dTa9hNmoYVMYiC+nJM2aZyQ3osI8dIE4a5wfoFa49tIryhxxLv9Mp0ekF72BhfrWBtyZXm5M2GFICeetGjUejVw+qKq1zdlR"
+    @"W7Xb/2Ek/QczxjLV+0aFi3c+FODLKX2INGAQ/t2EjUicK1a/qOL733WRkLDuMIIFQQYJKoZIhvcNAQcBoIIFMgSCBS4wggUq"
+    @"MIIFJgYLKoZIhvcNAQwKAQKgggTuMIIE6jAcBgoqhkiG9w0BDAEDMA4ECI1/SWzC/ZVZAgIIAASCBMgkCeGopvoL6R0SkKOg"
+    @"LOxdK2MkkJxkebmRAi/daThSO7NMvGb0Do+vBr3FLvb08k0MywdqUdzv+XbfB1nPmFZYokkUf24XVN4+5dkuG6Sla4WnNZxS"
+    @"W76LXEh5+X+YyyZlv8mf5ZO6Ss/YngVSgcTaWvROqt12qipwhApDOLyY83sCt/E9KTEsE1qV9xD03HOCzTg+JT4SUyT1Qt2q"
+    @"yIbFDvcc0yjMum3fp+hbRQqM5ifQjXtX/nnXDcIRPObGsliMmgDRr9yC45Dge/XqebBThazWWaFvs/xKkNw8WdXnoF7XDhuT"
+    @"aon85eiYSozbauaSgW11vyTp9Cmt0NbIDGM/Vp1bXBXcpzYVxv8frEAEHgCNghdS2ZRQLVLpUJ4ucC0n267KvZbdPxbte4g1"
+    @"eXWbZ0hCxNeNgnUXjUd/CHQJhwTZvaDXc4EpeRmobvBR6RcpBWXCS6at0/pRjskyxrdH7ZRTSEiugmqaP/5ywY9B2+lijvko"
+    @"7j0XT/j1Q+VUb0wuZO94dgbC4gCNR33cJfWaqphvs1qPb5JzQfiKWQC07xKE3l/oECt8s3Fs2ZopWQLjqCKXLzgEtGLqfBD9"
+    @"nILgrvF34mnna629gIViMGkPaaByBTCbV8hXQMLwiFoCLb46zoGnkbZM4QiC1lOlkd1jPnunpjtwLbrRJKt3P8nMEvX2z5cG"
+    @"QFBsvcfu/TJy9MVZxCklT5HKV2r5GR+vpXty4AfWGYvMiCyyAPFiIg4ai3eXhnUf+qzFS3R8ZJprNrAm5EHr61BogIBpL1DH"
+    @"ZaNcw/IwTeF4w/8/CCV1qt11NgeIbeLhlxX8bHrsu1sl3wG8poQ82aXKMRY9ckjJl/Vs1dm4SaoYSaC5cfQndvu1/Qcx5KZM"
+    @"DeKrmitpKc/kV4XSjfDtqbslVmgXBKcrD70iq4UAqy/rXC9wdZQ0is/vJZl9J2W/BCFABOwrSavV47iUDTJxpdXJ0h+qttnD"
+    @"zXb9Bkiq2bfZY1HjmEpurdOYAz4aH2kAJhvS4XH5tqAduWVVUrA8Vcg/L8ZfuxLVgtm8MhRfhQvkRa+52K1hPo0kX8Sc9qhy"
+    @"LPxGuG9jKdVpkr/IMd8yvcTIN+NXgoyFH7/07TWGruSPKOYnjFNBAQ2F6YkiXxwvfCq1qo+eoLw+mhOBxtwLIEDnk1czYUqd"
+    @"uLr31zP3bD3kBGAZMqzbWFUegf5E5o49jN5wACAHw326bq3RwRLT3nKKaUPF2wHCm+Wso78k+c8/AQq0bH9Swt2hdWJzlSbu"
+    @"oN9tmEpowDOx5EmtlkOzpvDZ26vaaTjPV+coV8V5V0IQb8wRAQVzlRBMRwe9b667Wqrwi0IpMgIw7N+lYCipzwb15I8z3wae"
+    @"uBEQ79YwLloDyZb3a/hVlvlL6ZkWSfMphPVrDBSTBkG3UZIgNtZ+KEXzI/5O+SXuVZ6BWqmaWRn4IG9pYoTtXVB+ZZ/XJlDY"
+    @"ptPpwUXuIyVPtUR8ThteyiB0uVSFpTY6s+MAXGy45d2qXOd/INy3PIwBX32W3ZZtOgKRx4KMCM17Bejns+u/wUWoQSKf+F5q"
+    @"RJyLWctcDEz5Wjx3svHzQVoIP1GCNAcskd2/vFduoT2DycKKzlCetuMB/YLmaSyXCtjXBuByteGI3eMxJTAjBgkqhkiG9w0B"
+    @"CRUxFgQUSwx4lVVZPuEeBduS89rY+FxjyWMwMTAhMAkGBSsOAwIaBQAEFPrYPmJLS/O+yssFRlkT73YZhKXuBAgoZ/jWtxys"
+    @"MAICCAA=";
+
+// What the stand-in's Secure Transport context reads and writes through. Going back to reading
+// after having written is a round trip, since the client had to wait for what was written.
+typedef struct {
+    int fd;
+    BOOL wroteLast;
+    NSUInteger roundTrips;
+} SRStandInIO;
+
+static OSStatus SRStandInRead(SSLConnectionRef connection, void *data, size_t *length)
+{
+    SRStandInIO *io = (SRStandInIO *)connection;
+    if (io->roundTrips == 0 || io->wroteLast) {
+        io->roundTrips++;
+        io->wroteLast = NO;
+    }
+    if (!SRSocketRead(io->fd, data, *length)) {
+        *length = 0;
+        return errSSLClosedGraceful;
+    }
+    return noErr;
+}
+
+static OSStatus SRStandInWrite(SSLConnectionRef connection, const void *data, size_t *length)
+{
+    SRStandInIO *io = (SRStandInIO *)connection;
+    io->wroteLast = YES;
+    if (!SRSocketWrite(io->fd, data, *length)) {
+        *length = 0;
+        return errSSLClosedAbort;
+    }
+    return noErr;
+}
+
+static BOOL SRStandInWriteAll(SSLContextRef ssl, const void *bytes, size_t length)
+{
+    size_t processed = 0;
+    return SSLWrite(ssl, bytes, length, &processed) == noErr && processed == length;
+}
+
+@implementation SRTLSStandInServer {
+    int _listenSocket;
+    SecIdentityRef _identity;
+    NSUInteger _acceptedCount;
+    NSMutableArray *_roundTrips;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        NSData *identityData = [[NSData alloc] initWithBase64EncodedString:SRStandInIdentity options:0];
+        CFArrayRef items = NULL;
+        OSStatus status = SecPKCS12Import((__bridge CFDataRef)identityData, (__bridge CFDictionaryRef)@{(__bridge id)kSecImportExportPassphrase:@"standin"}, &items);
+        if (status != errSecSuccess || CFArrayGetCount(items) == 0) {
+            if (items) {
+                CFRelease(items);
+            }
+            return nil;
+        }
+        NSDictionary *item = (__bridge NSDictionary *)CFArrayGetValueAtIndex(items, 0);
+        _identity = (SecIdentityRef)CFRetain((__bridge CFTypeRef)[item objectForKey:(__bridge id)kSecImportItemIdentity]);
+        CFRelease(items);
+        
+        _roundTrips = [NSMutableArray array];
+        _listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address = {0};
+        address.sin_len = sizeof(address);
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof(address);
+        if (bind(_listenSocket, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(_listenSocket, SOMAXCONN) != 0 || getsockname(_listenSocket, (struct sockaddr *)&address, &addressLength) != 0) {
+            return nil;
+        }
+        _port = ntohs(address.sin_port);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    close(_listenSocket);
+    if (_identity) {
+        CFRelease(_identity);
+    }
+}
+
+- (NSUInteger)acceptedCount
+{
+    @synchronized(self) {
+        return _acceptedCount;
+    }
+}
+
+- (NSArray *)roundTrips
+{
+    @synchronized(self) {
+        return [_roundTrips copy];
+    }
+}
+
+- (void)startWithConnectionCount:(NSUInteger)connectionCount
+{
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        for (NSUInteger i = 0; i < connectionCount; i++) {
+            int fd = accept(_listenSocket, NULL, NULL);
+            if (fd < 0) {
+                break;
+            }
+            @synchronized(self) {
+                _acceptedCount++;
+            }
+            [NSThread detachNewThreadSelector:@selector(_serveConnectionOnThread:) toTarget:self withObject:@(fd)];
+        }
+    });
+}
+
+- (void)_serveConnectionOnThread:(NSNumber *)fd
+{
+    @autoreleasepool {
+        [self _serveConnection:fd.intValue];
+        close(fd.intValue);
+    }
+}
+
+- (void)_serveConnection:(int)fd
+{
+    SRStandInIO io = {fd, NO, 0};
+    SSLContextRef ssl = SSLCreateContext(NULL, kSSLServerSide, kSSLStreamType);
+    SSLSetIOFuncs(ssl, SRStandInRead, SRStandInWrite);
+    SSLSetConnection(ssl, &io);
+    SSLSetCertificate(ssl, (__bridge CFArrayRef)@[(__bridge id)_identity]);
+    // The server side finds sessions to resume by peer ID as well; all clients share one.
+    SSLSetPeerID(ssl, "standin", strlen("standin"));
+    
+    OSStatus status;
+    do {
+        status = SSLHandshake(ssl);
+    } while (status == errSSLWouldBlock);
+    if (status != noErr) {
+        CFRelease(ssl);
+        return;
+    }
+    
+    CFHTTPMessageRef request = CFHTTPMessageCreateEmpty(NULL, YES);
+    uint8_t byte;
+    size_t processed = 0;
+    while (!CFHTTPMessageIsHeaderComplete(request) && SSLRead(ssl, &byte, 1, &processed) == noErr && processed == 1) {
+        CFHTTPMessageAppendBytes(request, &byte, 1);
+    }
+    NSString *key = CFBridgingRelease(CFHTTPMessageCopyHeaderFieldValue(request, CFSTR("Sec-WebSocket-Key")));
+    CFRelease(request);
+    if (!key) {
+        CFRelease(ssl);
+        return;
+    }
+    
+    @synchronized(self) {
+        [_roundTrips addObject:@(io.roundTrips)];
+    }
+    NSString *response = [NSString stringWithFormat:@"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %@\r\n\r\n", SRWebSocketAcceptForKey(key)];
+    NSData *responseData = [response dataUsingEncoding:NSUTF8StringEncoding];
+    
+    // The next thing from the client is its close frame, which is read whole so that closing the
+    // socket doesn't reset the connection under it.
+    static const uint8_t closeFrame[] = {0x88, 0x00};
+    uint8_t header[2];
+    uint8_t rest[4 + 125];
+    if (SRStandInWriteAll(ssl, responseData.bytes, responseData.length)
+        && SSLRead(ssl, header, sizeof(header), &processed) == noErr && processed == sizeof(header)
+        && SSLRead(ssl, rest, 4 + (header[1] & 0x7F), &processed) == noErr) {
+        SRStandInWriteAll(ssl, closeFrame, sizeof(closeFrame));
+    }
+    SSLClose(ssl);
+    CFRelease(ssl);
+}
+
+@end
+
+// Delegate for one of many sockets: leaves openGroup once open, and echoGroup once
+// expectedCount messages have come back.
+@interface SREchoCounter : NSObject <SRWebSocketDelegate>
+
+- (id)initWithExpectedCount:(NSUInteger)expectedCount openGroup:(dispatch_group_t)openGroup echoGroup:(dispatch_group_t)echoGroup;
+
+@end
+
+@implementation SREchoCounter {
+    NSUInteger _expectedCount;
+    NSUInteger _receivedCount;
+    dispatch_group_t _openGroup;
+    dispatch_group_t _echoGroup;
+}
+
+- (id)initWithExpectedCount:(NSUInteger)expectedCount openGroup:(dispatch_group_t)openGroup echoGroup:(dispatch_group_t)echoGroup
+{
+    self = [super init];
+    if (self) {
+        _expectedCount = expectedCount;
+        _openGroup = openGroup;
+        _echoGroup = echoGroup;
+        dispatch_group_enter(_openGroup);
+        dispatch_group_enter(_echoGroup);
+    }
+    return self;
+}
+
+- (void)webSocketDidOpen:(SRWebSocket *)webSocket
+{
+    dispatch_group_leave(_openGroup);
+}
+
+- (void)webSocket:(SRWebSocket *)webSocket didReceiveMessage:(id)message
+{
+    if (++_receivedCount == _expectedCount) {
+        dispatch_group_leave(_echoGroup);
+    }
+}
+
+- (void)webSocket:(SRWebSocket *)webSocket didFailWithError:(NSError *)error
+{
+    NSLog(@"Socket failed: %@", error);
+}
+
+@end
+
+@interface SRWebSocketTests : XCTestCase <SRWebSocketDelegate>
+
+@end
+
+@implementation SRWebSocketTests {
+    XCTestExpectation *_openExpectation;
+    XCTestExpectation *_messagesExpectation;
+    NSMutableArray *_receivedMessages;
+    NSUInteger _expectedMessageCount;
+    XCTestExpectation *_highWaterExpectation;
+    XCTestExpectation *_lowWaterExpectation;
+    uint64_t _highWaterAmount;
+    XCTestExpectation *_failExpectation;
+    NSError *_failError;
+    XCTestExpectation *_roundTripExpectation;
+    NSUInteger _roundTripCount;
+    XCTestExpectation *_pongExpectation;
+    NSData *_pongPayload;
+    NSMutableArray *_receivedFragments;
+    NSMutableArray *_receivedFinalFlags;
+}
+
+#pragma mark - SRWebSocketDelegate
+
+- (void)webSocketDidOpen:(SRWebSocket *)webSocket
+{
+    [_openExpectation fulfill];
+}
+
+- (void)webSocket:(SRWebSocket *)webSocket didReceiveMessage:(id)message
+{
+    [_receivedMessages addObject:message];
+    if (_receivedMessages.count == _expectedMessageCount) {
+        [_messagesExpectation fulfill];
+    }
+}
+
+- (void)webSocket:(SRWebSocket *)webSocket didReceiveMessageFragment:(id)fragment isFinal:(BOOL)isFinal
+{
+    // A text fragment that isn't valid UTF-8 on its own comes out of NSString as nil.
+    [_receivedFragments addObject:fragment ?: [NSNull null]];
+    [_receivedFinalFlags addObject:@(isFinal)];
+    if (isFinal) {
+        [_messagesExpectation fulfill];
+    }
+}
+
+- (void)webSocket:(SRWebSocket *)webSocket didFailWithError:(NSError *)error
+{
+    if (!_failExpectation) {
+        XCTFail(@"%@", error);
+        return;
+    }
+    _failError = error;
+    [_failExpectation fulfill];
+}
+
+- (void)webSocket:(SRWebSocket *)webSocket didMeasureRoundTripTime:(NSTimeInterval)roundTripTime
+{
+    XCTAssertGreaterThan(roundTripTime, 0.0);
+    if (++_roundTripCount == 5) {
+        [_roundTripExpectation fulfill];
+    }
+}
+
+- (void)webSocket:(SRWebSocket *)webSocket didReceivePong:(NSData *)pongPayload
+{
+    _pongPayload = pongPayload;
+    [_pongExpectation fulfill];
+}
+
+- (void)webSocket:(SRWebSocket *)webSocket bufferedAmountDidRiseAboveHighWaterMark:(uint64_t)bufferedAmount
+{
+    _highWaterAmount = bufferedAmount;
+    [_highWaterExpectation fulfill];
+}
+
+- (void)webSocket:(SRWebSocket *)webSocket bufferedAmountDidFallToLowWaterMark:(uint64_t)bufferedAmount
+{
+    XCTAssertLessThanOrEqual(bufferedAmount, webSocket.lowWaterMark);
+    [_lowWaterExpectation fulfill];
+}
+
+- (SRWebSocket *)_openSocketToServer:(SRLoopbackServer *)server options:(SRPerMessageDeflateOptions *)options
+{
+    [server start];
+    SRWebSocket *socket = [[SRWebSocket alloc] initWithURL:server.url];
+    socket.delegate = self;
+    socket.perMessageDeflateOptions = options;
+    
+    _openExpectation = [self expectationWithDescription:@"open"];
+    [socket open];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    return socket;
+}
+
+- (NSArray *)_echoMessages:(NSArray *)messages throughSocket:(SRWebSocket *)socket
+{
+    _receivedMessages = [NSMutableArray array];
+    _expectedMessageCount = messages.count;
+    _messagesExpectation = [self expectationWithDescription:@"echoes"];
+    for (id message in messages) {
+        [socket send:message];
+    }
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    return _receivedMessages;
+}
+
+#pragma mark - Masking
+
+- (void)testMaskMatchesScalarLoop
+{
+    const uint8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    uint8_t src[512 + 8];
+    uint8_t expected[sizeof(src)];
+    uint8_t actual[sizeof(src)];
+
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = (uint8_t)arc4random();
+    }
+
+    // Cover every SIMD/word/tail split, all key rotations and unaligned buffers.
+    for (size_t length = 0; length <= 512; length++) {
+        for (size_t offset = 0; offset < 8; offset++) {
+            for (size_t align = 0; align < 8; align++) {
+                SRMaskBytesScalar(expected + align, src + align, length, key, offset);
+                SRMaskBytes(actual + align, src + align, length, key, offset);
+                XCTAssertEqual(memcmp(expected + align, actual + align, length), 0, @"length %zu offset %zu align %zu", length, offset, align);
+            }
+        }
+    }
+}
+
+- (void)testMaskInPlaceAcrossReads
+{
+    const uint8_t key[4] = {0x01, 0x02, 0x03, 0x04};
+    NSMutableData *payload = [NSMutableData dataWithLength:1000];
+    arc4random_buf(payload.mutableBytes, payload.length);
+
+    NSMutableData *expected = [payload mutableCopy];
+    SRMaskBytesScalar(expected.mutableBytes, expected.bytes, expected.length, key, 0);
+
+    // Unmask in uneven slices the way the read path does.
+    uint8_t *bytes = payload.mutableBytes;
+    size_t offset = 0;
+    size_t slices[] = {1, 2, 13, 64, 3, 500, 417};
+    for (size_t i = 0; i < sizeof(slices) / sizeof(slices[0]); i++) {
+        SRMaskBytes(bytes + offset, bytes + offset, slices[i], key, offset);
+        offset += slices[i];
+    }
+
+    XCTAssertEqual(offset, payload.length);
+    XCTAssertEqualObjects(payload, expected);
+}
+
+- (void)testMaskThroughput
+{
+    const uint8_t key[4] = {0xde, 0xad, 0xbe, 0xef};
+    NSMutableData *payload = [NSMutableData dataWithLength:4 * 1024 * 1024];
+
+    [self measureBlock:^{
+        for (int i = 0; i < 16; i++) {
+            SRMaskBytes(payload.mutableBytes, payload.bytes, payload.length, key, i);
+        }
+    }];
+}
+
+- (void)testScalarMaskThroughput
+{
+    const uint8_t key[4] = {0xde, 0xad, 0xbe, 0xef};
+    NSMutableData *payload = [NSMutableData dataWithLength:4 * 1024 * 1024];
+
+    [self measureBlock:^{
+        for (int i = 0; i < 16; i++) {
+            SRMaskBytesScalar(payload.mutableBytes, payload.bytes, payload.length, key, i);
+        }
+    }];
+}
+
+#pragma mark - Read buffer
+
+- (void)testRingBufferMatchesLinearBuffer
+{
+    SRRingBuffer ring;
+    SRRingBufferInit(&ring, 16);
+    NSMutableData *model = [NSMutableData data];
+    uint8_t scratch[1024];
+    uint8_t counter = 0;
+
+    for (int i = 0; i < 20000; i++) {
+        size_t length = arc4random_uniform(sizeof(scratch));
+        if (arc4random_uniform(2) && model.length < 64 * 1024) {
+            for (size_t j = 0; j < length; j++) {
+                scratch[j] = counter++;
+            }
+            XCTAssertTrue(SRRingBufferAppend(&ring, scratch, length));
+            [model appendBytes:scratch length:length];
+        } else {
+            length = MIN(length, model.length);
+            SRRingBufferCopyBytes(&ring, scratch, length);
+            XCTAssertEqual(memcmp(scratch, model.bytes, length), 0);
+            SRRingBufferConsume(&ring, length);
+            [model replaceBytesInRange:NSMakeRange(0, length) withBytes:NULL length:0];
+        }
+        XCTAssertEqual(ring.length, model.length);
+    }
+
+    const uint8_t *linear = SRRingBufferLinearize(&ring);
+    XCTAssertEqual(memcmp(linear, model.bytes, model.length), 0);
+    SRRingBufferFree(&ring);
+}
+
+- (void)testScanSyntheticFrameStream
+{
+    NSData *stream = SRSyntheticFrameStream(100, 70000);
+    XCTAssertEqual(SRScanFrameStream(stream, 2048), (NSUInteger)100);
+    XCTAssertEqual(SRScanFrameStream(stream, 65536), (NSUInteger)100);
+}
+
+- (void)testFrameDecoderRejectsMalformedFrames
+{
+    for (size_t i = 0; i < SRMalformedFrameCorpusCount; i++) {
+        SRMalformedFrame frame = SRMalformedFrameCorpus[i];
+        NSData *input = [NSData dataWithBytes:frame.bytes length:frame.length];
+        for (size_t chunkSize = 1; chunkSize <= frame.length; chunkSize++) {
+            NSString *trace = SRDecodeFrames(input, chunkSize, NO, frame.allowsCompression, [NSMutableData data]);
+            NSString *error = [NSString stringWithFormat:@"!%d", frame.error];
+            if (frame.error == SRFrameErrorNone) {
+                XCTAssertEqual([trace rangeOfString:@"!"].location, (NSUInteger)NSNotFound, @"%s: %@", frame.name, trace);
+            } else {
+                XCTAssertTrue([trace hasSuffix:error], @"%s in %zu byte chunks: %@", frame.name, chunkSize, trace);
+            }
+        }
+    }
+}
+
+- (void)testFrameDecoderUnmasksAcrossChunks
+{
+    // "Hello" from RFC 6455 section 5.7, masked as a client sends it.
+    NSData *frame = [NSData dataWithBytes:"\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58" length:11];
+    for (size_t chunkSize = 1; chunkSize <= frame.length; chunkSize++) {
+        NSMutableData *payloads = [NSMutableData data];
+        XCTAssertEqualObjects(SRDecodeFrames(frame, chunkSize, YES, NO, payloads), @"HE");
+        XCTAssertEqualObjects(payloads, [@"Hello" dataUsingEncoding:NSUTF8StringEncoding]);
+    }
+    XCTAssertTrue([SRDecodeFrames(frame, frame.length, NO, NO, [NSMutableData data]) hasPrefix:@"!"]);
+}
+
+// Random bytes, and valid streams with bytes flipped, decoded whole and in random pieces must
+// give the same events, payload and error, without the decoder reading past what it was given.
+- (void)testFrameDecoderFuzz
+{
+    NSData *valid = SRSyntheticFrameStream(20, 130);
+    
+    for (int i = 0; i < 20000; i++) {
+        NSMutableData *input;
+        if (arc4random_uniform(2)) {
+            input = [NSMutableData dataWithLength:arc4random_uniform(512)];
+            arc4random_buf(input.mutableBytes, input.length);
+        } else {
+            input = [valid mutableCopy];
+            for (uint32_t flips = 1 + arc4random_uniform(4); flips; flips--) {
+                ((uint8_t *)input.mutableBytes)[arc4random_uniform((uint32_t)input.length)] ^= (uint8_t)(1 + arc4random_uniform(255));
+            }
+            input.length = arc4random_uniform((uint32_t)input.length + 1);
+        }
+        BOOL allowsCompression = arc4random_uniform(2);
+        
+        NSMutableData *wholePayloads = [NSMutableData data];
+        NSMutableData *splitPayloads = [NSMutableData data];
+        NSString *whole = SRDecodeFrames(input, MAX(input.length, (NSUInteger)1), NO, allowsCompression, wholePayloads);
+        NSString *split = SRDecodeFrames(input, 1 + arc4random_uniform(9), NO, allowsCompression, splitPayloads);
+        
+        XCTAssertEqualObjects(whole, split, @"%@", input);
+        XCTAssertEqualObjects(wholePayloads, splitPayloads, @"%@", input);
+        if (![whole isEqualToString:split]) {
+            break;
+        }
+    }
+}
+
+- (void)testSmallFrameReadThroughput
+{
+    NSData *stream = SRSyntheticFrameStream(200000, 20);
+
+    [self measureBlock:^{
+        SRScanFrameStream(stream, 16384);
+    }];
+}
+
+- (void)testLargeFrameReadThroughput
+{
+    NSData *stream = SRSyntheticFrameStream(8, 4 * 1024 * 1024);
+
+    [self measureBlock:^{
+        SRScanFrameStream(stream, 16384);
+    }];
+}
+
+
+#pragma mark - UTF-8 validation
+
+- (void)testUTF8MatchesLegacyValidatorAcrossChunks
+{
+    for (int i = 0; i < 200; i++) {
+        NSData *text = SRRandomUTF8(1 + arc4random_uniform(2000), arc4random_uniform(101));
+        const uint8_t *bytes = text.bytes;
+
+        // Feed the text in random slices, the way it comes off the socket, and check that both
+        // validators agree on how much of it ends on a code point boundary after every slice.
+        SRUTF8State state = SRUTF8Accept;
+        size_t scanPosition = 0;
+        size_t legacyScanPosition = 0;
+        size_t offset = 0;
+        while (offset < text.length) {
+            size_t length = MIN(1 + arc4random_uniform(64), text.length - offset);
+            size_t completeSize = 0;
+            state = SRUTF8Validate(state, bytes + offset, length, &completeSize);
+            if (completeSize) {
+                scanPosition = offset + completeSize;
+            }
+            offset += length;
+
+            NSData *scanData = [text subdataWithRange:NSMakeRange(legacyScanPosition, offset - legacyScanPosition)];
+            int32_t validSize = SRLegacyValidatePartialString(scanData);
+            XCTAssertNotEqual(validSize, -1);
+            legacyScanPosition += validSize;
+
+            XCTAssertNotEqual(state, (SRUTF8State)SRUTF8Reject);
+            XCTAssertEqual(scanPosition, legacyScanPosition);
+        }
+        XCTAssertEqual(state, (SRUTF8State)SRUTF8Accept);
+        XCTAssertEqual(scanPosition, text.length);
+    }
+}
+
+- (void)testUTF8RejectsWhateverLegacyValidatorRejects
+{
+    uint8_t bytes[48];
+    for (int i = 0; i < 100000; i++) {
+        size_t length = arc4random_uniform(sizeof(bytes));
+        for (size_t j = 0; j < length; j++) {
+            // Bias towards lead and continuation bytes so most inputs aren't plain ASCII.
+            uint32_t kind = arc4random_uniform(4);
+            bytes[j] = kind == 0 ? arc4random_uniform(0x80) : kind == 1 ? 0x80 + arc4random_uniform(0x40) : kind == 2 ? 0xC0 + arc4random_uniform(0x40) : arc4random_uniform(0x100);
+        }
+
+        NSData *data = [NSData dataWithBytes:bytes length:length];
+        int32_t legacySize = SRLegacyValidatePartialString(data);
+        SRUTF8State state = SRUTF8Validate(SRUTF8Accept, bytes, length, NULL);
+
+        if (legacySize == -1) {
+            XCTAssertEqual(state, (SRUTF8State)SRUTF8Reject, @"%@", data);
+        }
+        if (state == SRUTF8Accept) {
+            XCTAssertEqual(legacySize, (int32_t)length, @"%@", data);
+        }
+    }
+}
+
+- (void)testUTF8RejectsMalformedSequences
+{
+    const char *invalid[] = {
+        "\xC0\x80",                 // Overlong NUL.
+        "\xE0\x80\xAF",            // Overlong '/'.
+        "\xED\xA0\x80",            // UTF-16 surrogate.
+        "\xF4\x90\x80\x80",       // Past U+10FFFF.
+        "\xF5\x80\x80\x80",
+        "\x80",                    // Continuation without a lead byte.
+        "a\xE2\x82z",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        XCTAssertEqual(SRUTF8Validate(SRUTF8Accept, (const uint8_t *)invalid[i], strlen(invalid[i]), NULL), (SRUTF8State)SRUTF8Reject, @"case %zu", i);
+    }
+
+    // Truncated, but the rest could still arrive.
+    size_t completeSize = 0;
+    SRUTF8State state = SRUTF8Validate(SRUTF8Accept, (const uint8_t *)"ab\xF0\x9F\x98", 5, &completeSize);
+    XCTAssertNotEqual(state, (SRUTF8State)SRUTF8Accept);
+    XCTAssertNotEqual(state, (SRUTF8State)SRUTF8Reject);
+    XCTAssertEqual(completeSize, (size_t)2);
+    state = SRUTF8Validate(state, (const uint8_t *)"\x80", 1, &completeSize);
+    XCTAssertEqual(state, (SRUTF8State)SRUTF8Accept);
+    XCTAssertEqual(completeSize, (size_t)1);
+}
+
+- (void)testUTF8ValidationThroughput
+{
+    NSData *text = SRRandomUTF8(2 * 1024 * 1024, 90);
+
+    [self measureBlock:^{
+        SRUTF8State state = SRUTF8Accept;
+        for (size_t offset = 0; offset < text.length; offset += 16384) {
+            state = SRUTF8Validate(state, (const uint8_t *)text.bytes + offset, MIN(16384, text.length - offset), NULL);
+        }
+        XCTAssertEqual(state, (SRUTF8State)SRUTF8Accept);
+    }];
+}
+
+- (void)testLegacyUTF8ValidationThroughput
+{
+    NSData *text = SRRandomUTF8(2 * 1024 * 1024, 90);
+
+    [self measureBlock:^{
+        size_t scanPosition = 0;
+        for (size_t offset = 0; offset < text.length; offset += 16384) {
+            size_t end = MIN(offset + 16384, text.length);
+            NSData *scanData = [text subdataWithRange:NSMakeRange(scanPosition, end - scanPosition)];
+            scanPosition += SRLegacyValidatePartialString(scanData);
+        }
+        XCTAssertEqual(scanPosition, text.length);
+    }];
+}
+
+#pragma mark - Message fragments
+
+// Opens a socket that delivers fragments to a server that writes each of writes separately,
+// and returns the fragments of the first message. finalFlags gets each one's isFinal.
+- (NSArray *)_fragmentsFromServerWrites:(NSArray *)writes finalFlags:(NSArray **)finalFlags
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    server.scriptedWrites = writes;
+    [server start];
+    SRWebSocket *socket = [[SRWebSocket alloc] initWithURL:server.url];
+    socket.deliversMessageFragments = YES;
+    socket.delegate = self;
+    
+    _receivedFragments = [NSMutableArray array];
+    _receivedFinalFlags = [NSMutableArray array];
+    _openExpectation = [self expectationWithDescription:@"open"];
+    _messagesExpectation = [self expectationWithDescription:@"final fragment"];
+    [socket open];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    [socket close];
+    
+    *finalFlags = _receivedFinalFlags;
+    return _receivedFragments;
+}
+
+- (void)testFragmentsHoldBackSplitCodePoints
+{
+    // One text frame cut inside the two byte e-acute, then a fragmented message whose frames
+    // are cut inside the three byte euro sign.
+    NSString *text = @"h\u00e9llo \u20ac";
+    NSData *utf8 = [text dataUsingEncoding:NSUTF8StringEncoding];
+    XCTAssertEqual(utf8.length, (NSUInteger)10);
+    
+    NSMutableData *frame = [NSMutableData dataWithBytes:"\x81\x0A" length:2];
+    [frame appendData:utf8];
+    NSArray *finalFlags = nil;
+    NSArray *fragments = [self _fragmentsFromServerWrites:@[[frame subdataWithRange:NSMakeRange(0, 4)], [frame subdataWithRange:NSMakeRange(4, 8)]] finalFlags:&finalFlags];
+    XCTAssertEqualObjects(fragments, (@[@"h", @"\u00e9llo \u20ac"]));
+    XCTAssertEqualObjects(finalFlags, (@[@NO, @YES]));
+    
+    NSMutableData *first = [NSMutableData dataWithBytes:"\x01\x08" length:2];
+    [first appendData:[utf8 subdataWithRange:NSMakeRange(0, 8)]];
+    NSMutableData *last = [NSMutableData dataWithBytes:"\x80\x02" length:2];
+    [last appendData:[utf8 subdataWithRange:NSMakeRange(8, 2)]];
+    fragments = [self _fragmentsFromServerWrites:@[first, last] finalFlags:&finalFlags];
+    XCTAssertEqualObjects(fragments, (@[@"h\u00e9llo ", @"\u20ac"]));
+    XCTAssertEqualObjects(finalFlags, (@[@NO, @YES]));
+}
+
+- (void)testBinaryFragmentsConcatenateToMessage
+{
+    NSMutableData *message = [NSMutableData dataWithLength:300];
+    arc4random_buf(message.mutableBytes, message.length);
+    
+    // Three frames, the second of them written in two halves.
+    NSMutableData *first = [NSMutableData dataWithBytes:"\x02\x64" length:2];
+    [first appendData:[message subdataWithRange:NSMakeRange(0, 100)]];
+    NSMutableData *second = [NSMutableData dataWithBytes:"\x00\x64" length:2];
+    [second appendData:[message subdataWithRange:NSMakeRange(100, 50)]];
+    NSData *secondRest = [message subdataWithRange:NSMakeRange(150, 50)];
+    NSMutableData *last = [NSMutableData dataWithBytes:"\x80\x64" length:2];
+    [last appendData:[message subdataWithRange:NSMakeRange(200, 100)]];
+    
+    NSArray *finalFlags = nil;
+    NSArray *fragments = [self _fragmentsFromServerWrites:@[first, second, secondRest, last] finalFlags:&finalFlags];
+    XCTAssertGreaterThan(fragments.count, (NSUInteger)1);
+    
+    NSMutableData *joined = [NSMutableData data];
+    for (NSData *fragment in fragments) {
+        XCTAssertTrue([fragment isKindOfClass:[NSData class]]);
+        [joined appendData:fragment];
+    }
+    XCTAssertEqualObjects(joined, message);
+    XCTAssertEqualObjects(finalFlags.lastObject, @YES);
+    XCTAssertFalse([[finalFlags subarrayWithRange:NSMakeRange(0, finalFlags.count - 1)] containsObject:@YES]);
+}
+
+- (void)testEmptyFinalFragment
+{
+    NSArray *finalFlags = nil;
+    NSArray *fragments = [self _fragmentsFromServerWrites:@[[NSData dataWithBytes:"\x01\x03" "abc" length:5], [NSData dataWithBytes:"\x80\x00" length:2]] finalFlags:&finalFlags];
+    XCTAssertEqualObjects(fragments, (@[@"abc", @""]));
+    XCTAssertEqualObjects(finalFlags, (@[@NO, @YES]));
+}
+
+#pragma mark - permessage-deflate
+
+- (void)testDeflateMatchesRFCExample
+{
+    // RFC 7692 section 7.2.3.1: "Hello" in a single compressed frame.
+    const uint8_t expected[] = {0xf2, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00};
+    SRDeflater deflater;
+    SRInflater inflater;
+    XCTAssertTrue(SRDeflaterInit(&deflater, 15, 8, false));
+    XCTAssertTrue(SRInflaterInit(&inflater, 15, false));
+    
+    uint8_t compressed[64];
+    size_t length = SRDeflaterCompressMessage(&deflater, (const uint8_t *)"Hello", 5, compressed, SRDeflaterBound(&deflater, 5));
+    XCTAssertEqual(length, sizeof(expected));
+    XCTAssertEqual(memcmp(compressed, expected, sizeof(expected)), 0);
+    
+    NSData *message = SRInflateMessage(&inflater, [NSData dataWithBytes:expected length:sizeof(expected)]);
+    XCTAssertEqualObjects(message, [@"Hello" dataUsingEncoding:NSUTF8StringEncoding]);
+    
+    SRDeflaterFree(&deflater);
+    SRInflaterFree(&inflater);
+}
+
+- (void)testPerMessageDeflateLoopbackEcho
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    SRWebSocket *socket = [self _openSocketToServer:server options:[[SRPerMessageDeflateOptions alloc] init]];
+    XCTAssertTrue(socket.perMessageDeflateEnabled);
+    
+    // Short messages go out uncompressed; the large binary one spans many inflate calls.
+    NSMutableArray *messages = [SRSignalingCorpus(40) mutableCopy];
+    [messages addObject:@"2::"];
+    [messages addObject:SRRandomUTF8(100000, 50)];
+    
+    NSArray *echoes = [self _echoMessages:messages throughSocket:socket];
+    XCTAssertEqualObjects(echoes, messages);
+    XCTAssertEqual(server.compressedMessagesReceived, (NSUInteger)41);
+    [socket close];
+}
+
+- (void)testPerMessageDeflateWithoutContextTakeover
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    server.extensionsResponse = @"permessage-deflate; client_no_context_takeover; server_no_context_takeover; client_max_window_bits=10";
+    SRPerMessageDeflateOptions *options = [[SRPerMessageDeflateOptions alloc] init];
+    options.serverNoContextTakeover = YES;
+    SRWebSocket *socket = [self _openSocketToServer:server options:options];
+    XCTAssertTrue(socket.perMessageDeflateEnabled);
+    
+    NSArray *messages = SRSignalingCorpus(40);
+    XCTAssertEqualObjects([self _echoMessages:messages throughSocket:socket], messages);
+    [socket close];
+}
+
+- (void)testPerMessageDeflateServerIgnoresWindowBits
+{
+    // We ask for a 512 byte window; the server leaves server_max_window_bits out of its answer
+    // and compresses with 32 KB, as it is then allowed to.
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    server.extensionsResponse = @"permessage-deflate";
+    SRPerMessageDeflateOptions *options = [[SRPerMessageDeflateOptions alloc] init];
+    options.serverMaxWindowBits = 9;
+    SRWebSocket *socket = [self _openSocketToServer:server options:options];
+    XCTAssertTrue(socket.perMessageDeflateEnabled);
+    
+    // A random block repeated, so the server's matches reach back 4 KB.
+    NSMutableData *block = [NSMutableData dataWithLength:4096];
+    arc4random_buf(block.mutableBytes, block.length);
+    NSMutableData *message = [block mutableCopy];
+    [message appendData:block];
+    [message appendData:block];
+    XCTAssertEqualObjects([self _echoMessages:@[message] throughSocket:socket], @[message]);
+    [socket close];
+}
+
+- (void)testPerMessageDeflateDeclinedByServer
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    server.extensionsResponse = nil;
+    SRWebSocket *socket = [self _openSocketToServer:server options:[[SRPerMessageDeflateOptions alloc] init]];
+    XCTAssertFalse(socket.perMessageDeflateEnabled);
+    
+    NSArray *messages = SRSignalingCorpus(10);
+    XCTAssertEqualObjects([self _echoMessages:messages throughSocket:socket], messages);
+    XCTAssertEqual(server.compressedMessagesReceived, (NSUInteger)0);
+    [socket close];
+}
+
+- (NSUInteger)_wireBytesForMessages:(NSArray *)messages options:(SRPerMessageDeflateOptions *)options
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    SRWebSocket *socket = [self _openSocketToServer:server options:options];
+    XCTAssertEqualObjects([self _echoMessages:messages throughSocket:socket], messages);
+    NSUInteger wireBytes = server.bytesReceived + server.bytesSent;
+    [socket close];
+    return wireBytes;
+}
+
+- (void)testSignalingBytesOnTheWire
+{
+    NSArray *messages = SRSignalingCorpus(500);
+    NSUInteger plainBytes = [self _wireBytesForMessages:messages options:nil];
+    NSUInteger deflateBytes = [self _wireBytesForMessages:messages options:[[SRPerMessageDeflateOptions alloc] init]];
+    
+    SRPerMessageDeflateOptions *noContextTakeover = [[SRPerMessageDeflateOptions alloc] init];
+    noContextTakeover.clientNoContextTakeover = YES;
+    noContextTakeover.serverNoContextTakeover = YES;
+    NSUInteger noContextTakeoverBytes = [self _wireBytesForMessages:messages options:noContextTakeover];
+    
+    NSLog(@"Signaling bytes on the wire: %lu plain, %lu deflate (%.1f%%), %lu deflate without context takeover (%.1f%%)",
+          (unsigned long)plainBytes,
+          (unsigned long)deflateBytes, 100.0 * deflateBytes / plainBytes,
+          (unsigned long)noContextTakeoverBytes, 100.0 * noContextTakeoverBytes / plainBytes);
+    XCTAssertLessThan(deflateBytes, plainBytes / 2);
+    XCTAssertLessThan(deflateBytes, noContextTakeoverBytes);
+}
+
+- (void)testPerMessageDeflateEchoThroughput
+{
+    NSArray *messages = SRSignalingCorpus(500);
+
+    [self measureBlock:^{
+        [self _wireBytesForMessages:messages options:[[SRPerMessageDeflateOptions alloc] init]];
+    }];
+}
+
+#pragma mark - Batched sends
+
+- (void)testSendMessagesKeepsOrder
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    SRWebSocket *socket = [self _openSocketToServer:server options:nil];
+    
+    NSMutableArray *messages = [SRSignalingCorpus(60) mutableCopy];
+    [messages insertObject:[NSData dataWithBytes:"\x00\x01\x02" length:3] atIndex:30];
+    
+    _receivedMessages = [NSMutableArray array];
+    _expectedMessageCount = messages.count;
+    _messagesExpectation = [self expectationWithDescription:@"echoes"];
+    [socket sendMessages:messages];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    
+    XCTAssertEqualObjects(_receivedMessages, messages);
+    [socket close];
+}
+
+#pragma mark - Backpressure
+
+- (void)testBoundedSendRefusesOverflow
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    SRWebSocket *socket = [self _openSocketToServer:server options:nil];
+    socket.maxBufferedAmount = 1024;
+    
+    NSData *small = [NSMutableData dataWithLength:100];
+    NSData *large = [NSMutableData dataWithLength:2000];
+    
+    // Nothing is buffered before each phase, so whether a send fits doesn't depend on timing.
+    socket.overflowPolicy = SROverflowPolicyDropLowPriority;
+    _receivedMessages = [NSMutableArray array];
+    _expectedMessageCount = 2;
+    _messagesExpectation = [self expectationWithDescription:@"echoes"];
+    XCTAssertTrue([socket send:small priority:SRMessagePriorityLow]);
+    XCTAssertFalse([socket send:large priority:SRMessagePriorityLow]);
+    XCTAssertTrue([socket send:large priority:SRMessagePriorityNormal]);
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    XCTAssertEqualObjects(_receivedMessages, (@[small, large]));
+    
+    socket.overflowPolicy = SROverflowPolicyReject;
+    _receivedMessages = [NSMutableArray array];
+    _expectedMessageCount = 1;
+    _messagesExpectation = [self expectationWithDescription:@"echoes"];
+    XCTAssertFalse([socket send:large priority:SRMessagePriorityNormal]);
+    XCTAssertFalse([socket sendMessages:@[small, large]]);
+    XCTAssertTrue([socket send:small priority:SRMessagePriorityNormal]);
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    XCTAssertEqualObjects(_receivedMessages, @[small]);
+    XCTAssertEqual(socket.bufferedAmount, 0ULL);
+    [socket close];
+}
+
+- (void)testWaterMarkCallbacks
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    SRWebSocket *socket = [self _openSocketToServer:server options:nil];
+    socket.highWaterMark = 64 * 1024;
+    socket.lowWaterMark = 16 * 1024;
+    
+    // Far more than the loopback socket's send buffer, so most of it has to wait.
+    NSMutableData *large = [NSMutableData dataWithLength:8 << 20];
+    memset(large.mutableBytes, 'w', large.length);
+    
+    _highWaterExpectation = [self expectationWithDescription:@"high water"];
+    _lowWaterExpectation = [self expectationWithDescription:@"low water"];
+    NSArray *echoed = [self _echoMessages:@[large] throughSocket:socket];
+    
+    XCTAssertGreaterThan(_highWaterAmount, socket.highWaterMark);
+    XCTAssertEqualObjects(echoed, @[large]);
+    [socket close];
+}
+
+#pragma mark - Keepalive
+
+- (void)testKeepaliveMeasuresRoundTripTime
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    [server start];
+    SRWebSocket *socket = [[SRWebSocket alloc] initWithURL:server.url];
+    socket.delegate = self;
+    socket.keepaliveInterval = 0.05;
+    
+    _openExpectation = [self expectationWithDescription:@"open"];
+    _roundTripExpectation = [self expectationWithDescription:@"round trips"];
+    [socket open];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    XCTAssertGreaterThan(socket.smoothedRoundTripTime, 0.0);
+    XCTAssertGreaterThanOrEqual(socket.roundTripTimeVariation, 0.0);
+    XCTAssertEqual(socket.missedPongCount, (NSUInteger)0);
+    
+    // Pongs to the delegate's own pings still reach it.
+    NSData *payload = [@"mine" dataUsingEncoding:NSUTF8StringEncoding];
+    _pongExpectation = [self expectationWithDescription:@"pong"];
+    [socket sendPing:payload];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    XCTAssertEqualObjects(_pongPayload, payload);
+    
+    [socket close];
+}
+
+- (void)testKeepaliveDetectsDeadConnection
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    server.ignoresPings = YES;
+    [server start];
+    SRWebSocket *socket = [[SRWebSocket alloc] initWithURL:server.url];
+    socket.delegate = self;
+    socket.keepaliveInterval = 0.1;
+    socket.maxMissedPongs = 2;
+    
+    _openExpectation = [self expectationWithDescription:@"open"];
+    [socket open];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    _failExpectation = [self expectationWithDescription:@"fail"];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    XCTAssertEqual(_failError.code, 2148L);
+    XCTAssertEqual(socket.readyState, SR_CLOSED);
+    XCTAssertLessThan(CFAbsoluteTimeGetCurrent() - start, 1.0);
+    _failExpectation = nil;
+}
+
+#pragma mark - I/O backends
+
+- (void)testRunLoopBackendDealsOutThreads
+{
+    SRRunLoopBackend *backend = [[SRRunLoopBackend alloc] initWithThreadCount:4];
+    XCTAssertEqual(backend.threadCount, (NSUInteger)4);
+    
+    NSMutableSet *runLoops = [NSMutableSet set];
+    for (NSUInteger i = 0; i < 4; i++) {
+        [runLoops addObject:[backend runLoopForAffinityKey:nil]];
+    }
+    XCTAssertEqual(runLoops.count, (NSUInteger)4);
+    XCTAssertEqualObjects([backend runLoopForAffinityKey:@"room"], [backend runLoopForAffinityKey:@"room"]);
+    XCTAssertEqualObjects([NSRunLoop SR_networkRunLoop], [[SRRunLoopBackend sharedBackend] runLoopAtIndex:0]);
+}
+
+- (void)testSocketBackendLoopbackEcho
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    [server start];
+    SRWebSocket *socket = [[SRWebSocket alloc] initWithURL:server.url];
+    socket.ioBackend = [SRSocketBackend sharedBackend];
+    socket.delegate = self;
+    
+    _openExpectation = [self expectationWithDescription:@"open"];
+    [socket open];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    NSMutableArray *messages = [SRSignalingCorpus(40) mutableCopy];
+    NSMutableData *large = [NSMutableData dataWithLength:1 << 20];
+    memset(large.mutableBytes, 'x', large.length);
+    [messages addObject:large];
+    
+    XCTAssertEqualObjects([self _echoMessages:messages throughSocket:socket], messages);
+    [socket close];
+}
+
+// Messages echoed per second over connectionCount loopback sockets sharing one backend, each
+// socket with its own delegate queue so nothing funnels through the main thread.
+- (double)_echoRateWithBackend:(id <SRIOBackend>)backend connections:(NSUInteger)connectionCount messages:(NSUInteger)messageCount
+{
+    // Two descriptors per connection, one at each end.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < 4 * connectionCount) {
+        limit.rlim_cur = MIN(limit.rlim_max, (rlim_t)(4 * connectionCount));
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    [server startWithConnectionCount:connectionCount];
+    
+    dispatch_group_t openGroup = dispatch_group_create();
+    dispatch_group_t echoGroup = dispatch_group_create();
+    NSMutableArray *sockets = [NSMutableArray array];
+    NSMutableArray *counters = [NSMutableArray array];
+    for (NSUInteger i = 0; i < connectionCount; i++) {
+        SREchoCounter *counter = [[SREchoCounter alloc] initWithExpectedCount:messageCount openGroup:openGroup echoGroup:echoGroup];
+        SRWebSocket *socket = [[SRWebSocket alloc] initWithURL:server.url];
+        socket.ioBackend = backend;
+        socket.delegate = counter;
+        [socket setDelegateDispatchQueue:dispatch_queue_create(NULL, DISPATCH_QUEUE_SERIAL)];
+        [socket open];
+        [sockets addObject:socket];
+        [counters addObject:counter];
+    }
+    XCTAssertEqual(dispatch_group_wait(openGroup, dispatch_time(DISPATCH_TIME_NOW, 30 * NSEC_PER_SEC)), 0L);
+    
+    NSMutableData *payload = [NSMutableData dataWithLength:256];
+    memset(payload.mutableBytes, 'p', payload.length);
+    
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for (SRWebSocket *socket in sockets) {
+        for (NSUInteger i = 0; i < messageCount; i++) {
+            [socket send:payload];
+        }
+    }
+    XCTAssertEqual(dispatch_group_wait(echoGroup, dispatch_time(DISPATCH_TIME_NOW, 60 * NSEC_PER_SEC)), 0L);
+    CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+    
+    for (SRWebSocket *socket in sockets) {
+        [socket close];
+    }
+    return connectionCount * messageCount / elapsed;
+}
+
+- (void)testHostResolverCachesAndCoalesces
+{
+    SRHostResolver *resolver = [[SRHostResolver alloc] init];
+    resolver.cacheLifetime = 0.2;
+    
+    __block NSArray *first = nil;
+    __block NSArray *second = nil;
+    XCTestExpectation *firstExpectation = [self expectationWithDescription:@"first"];
+    XCTestExpectation *secondExpectation = [self expectationWithDescription:@"second"];
+    [resolver resolveHost:@"localhost" queue:dispatch_get_main_queue() completion:^(NSArray *addresses, NSError *error) {
+        first = addresses;
+        [firstExpectation fulfill];
+    }];
+    [resolver resolveHost:@"localhost" queue:dispatch_get_main_queue() completion:^(NSArray *addresses, NSError *error) {
+        second = addresses;
+        [secondExpectation fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    XCTAssertGreaterThan(first.count, (NSUInteger)0);
+    XCTAssertEqualObjects(first, second);
+    XCTAssertEqual(resolver.lookupCount, (NSUInteger)1);
+    
+    [NSThread sleepForTimeInterval:0.3];
+    XCTestExpectation *expiredExpectation = [self expectationWithDescription:@"expired"];
+    [resolver resolveHost:@"localhost" queue:dispatch_get_main_queue() completion:^(NSArray *addresses, NSError *error) {
+        [expiredExpectation fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    XCTAssertEqual(resolver.lookupCount, (NSUInteger)2);
+}
+
+- (void)testConnectorSkipsUnreachableAddress
+{
+    SRLoopbackServer *server = [[SRLoopbackServer alloc] init];
+    [server start];
+    
+    // 192.0.2.1 is reserved for documentation (RFC 5737), so nothing answers there.
+    SRHostResolver *resolver = [[SRHostResolver alloc] init];
+    [resolver setAddresses:@[SRIPv4Address("192.0.2.1"), SRIPv4Address("127.0.0.1")] forHost:@"eyeballs.test"];
+    SRConnector *connector = [[SRConnector alloc] initWithResolver:resolver];
+    connector.attemptDelay = 0.1;
+    
+    NSURL *url = [NSURL URLWithString:[NSString stringWithFormat:@"ws://eyeballs.test:%@/", server.url.port]];
+    SRWebSocket *socket = [[SRWebSocket alloc] initWithURL:url];
+    socket.ioBackend = [[SRSocketBackend alloc] initWithConnector:connector];
+    socket.delegate = self;
+    
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    _openExpectation = [self expectationWithDescription:@"open"];
+    [socket open];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    XCTAssertLessThan(CFAbsoluteTimeGetCurrent() - start, 2.0);
+    XCTAssertEqual(resolver.lookupCount, (NSUInteger)0);
+    XCTAssertEqualObjects([self _echoMessages:@[@"hello"] throughSocket:socket], @[@"hello"]);
+    [socket close];
+}
+
+// Opens a socket to the stand-in and returns how many round trips it waited for: host lookups, the
+// TCP handshake unless the connection was pre-warmed, and the TLS handshake up to the upgrade.
+- (NSUInteger)_roundTripsOpeningSocketTo:(SRTLSStandInServer *)server backend:(SRSocketBackend *)backend connectionIndex:(NSUInteger)index prewarmed:(BOOL)prewarmed
+{
+    SRHostResolver *resolver = backend.connector.resolver;
+    NSUInteger lookups = resolver.lookupCount;
+    NSURL *url = [NSURL URLWithString:[NSString stringWithFormat:@"wss://localhost:%d/", server.port]];
+    SRWebSocket *socket = [[SRWebSocket alloc] initWithURL:url protocols:nil allowsUntrustedSSLCertificates:YES];
+    socket.ioBackend = backend;
+    socket.delegate = self;
+    
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    _openExpectation = [self expectationWithDescription:@"open"];
+    [socket open];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+    [socket close];
+    
+    lookups = resolver.lookupCount - lookups;
+    NSUInteger roundTrips = lookups + (prewarmed ? 0 : 1) + [server.roundTrips[index] unsignedIntegerValue];
+    NSLog(@"connection %lu: %lu lookups, %lu round trips, opened in %.1f ms", (unsigned long)index, (unsigned long)lookups, (unsigned long)roundTrips, elapsed * 1000);
+    return roundTrips;
+}
+
+- (void)testReconnectRoundTrips
+{
+    SRTLSStandInServer *server = [[SRTLSStandInServer alloc] init];
+    XCTAssertNotNil(server);
+    [server startWithConnectionCount:3];
+    SRSocketBackend *backend = [[SRSocketBackend alloc] initWithConnector:[[SRConnector alloc] initWithResolver:[[SRHostResolver alloc] init]]];
+    
+    // A lookup, TCP, and a full TLS handshake.
+    NSUInteger cold = [self _roundTripsOpeningSocketTo:server backend:backend connectionIndex:0 prewarmed:NO];
+    
+    // The address is cached and the TLS session resumed.
+    NSUInteger lookups = backend.connector.resolver.lookupCount;
+    NSUInteger reconnect = [self _roundTripsOpeningSocketTo:server backend:backend connectionIndex:1 prewarmed:NO];
+    XCTAssertEqual(backend.connector.resolver.lookupCount, lookups);
+    
+    // TCP is already connected as well.
+    [backend prewarmConnectionToHost:@"localhost" port:server.port];
+    [self expectationForPredicate:[NSPredicate predicateWithFormat:@"acceptedCount == 3"] evaluatedWithObject:server handler:nil];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    NSUInteger prewarmed = [self _roundTripsOpeningSocketTo:server backend:backend connectionIndex:2 prewarmed:YES];
+    
+    NSLog(@"Round trips before the upgrade: cold %lu, reconnect %lu, pre-warmed %lu", (unsigned long)cold, (unsigned long)reconnect, (unsigned long)prewarmed);
+    XCTAssertLessThan(reconnect, cold);
+    XCTAssertLessThan(prewarmed, reconnect);
+    XCTAssertEqual(server.acceptedCount, (NSUInteger)3);
+}
+
+- (void)testManyConnectionEchoThroughput
+{
+    NSUInteger connections = 200;
+    NSUInteger messages = 200;
+    NSUInteger cores = [NSProcessInfo processInfo].activeProcessorCount;
+    
+    double single = [self _echoRateWithBackend:[[SRRunLoopBackend alloc] initWithThreadCount:1] connections:connections messages:messages];
+    double sharded = [self _echoRateWithBackend:[[SRRunLoopBackend alloc] initWithThreadCount:cores] connections:connections messages:messages];
+    double sockets = [self _echoRateWithBackend:[SRSocketBackend sharedBackend] connections:connections messages:messages];
+    
+    NSLog(@"%lu connections on %lu cores: 1 network thread %.0f messages/s, %lu threads %.0f messages/s (%.2fx), socket backend %.0f messages/s (%.2fx)",
+          (unsigned long)connections, (unsigned long)cores, single, (unsigned long)cores, sharded, sharded / single, sockets, sockets / single);
+    
+    // With one core there is nothing to scale onto, so only a clear regression fails.
+    XCTAssertGreaterThan(sharded, single * 0.75);
+    XCTAssertGreaterThan(sockets, single * 0.75);
+}
+
+@end
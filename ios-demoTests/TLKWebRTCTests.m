@@ -0,0 +1,1190 @@
+//
+//  TLKWebRTCTests.m
+//  Copyright (c) 2014 &yet, LLC and otalk contributors
+//
+
+#import <XCTest/XCTest.h>
+
+#import "TLKPeerSession.h"
+#import "TLKPeerConnectionPool.h"
+#import "TLKMediaProfile.h"
+#import "TLKEncodingPolicy.h"
+#import "TLKDataChannel.h"
+#import "TLKPeerStats.h"
+#import "TLKQualityController.h"
+#import "TLKWebRTC.h"
+
+// The table only ever compares connections by identity, so plain objects stand in for them here.
+static RTCPeerConnection *TLKFakePeerConnection(void)
+{
+    return (RTCPeerConnection *)[[NSObject alloc] init];
+}
+
+// Signals between two TLKWebRTC instances in the same process, with both sides using the same
+// peer ID for each other. offerer sends the first offer, and with it every renegotiation offer;
+// requests for one from answerer are passed across.
+@interface TLKLoopbackSignaling : NSObject <TLKWebRTCDelegate>
+
+@property (nonatomic, strong) TLKWebRTC *offerer;
+@property (nonatomic, strong) TLKWebRTC *answerer;
+@property (nonatomic, copy) void (^answerBlock)(NSString *peerID);
+// Called on the delegate queue after every candidate, end marker and ICE state change
+@property (nonatomic, copy) void (^progressBlock)(void);
+@property (nonatomic, copy) void (^dataChannelBlock)(TLKDataChannel *dataChannel);
+@property (nonatomic, copy) void (^statsBlock)(TLKWebRTC *webRTC, TLKPeerStats *stats);
+
+@property (nonatomic) NSUInteger offerCount;
+@property (nonatomic) NSUInteger answererOfferCount;
+@property (nonatomic) NSUInteger requestCount;
+@property (nonatomic) NSUInteger answerCount;
+@property (nonatomic, strong) RTCSessionDescription *lastOffer;
+@property (nonatomic, strong) RTCSessionDescription *lastAnswer;
+@property (nonatomic) NSUInteger candidateCount;
+@property (nonatomic) NSUInteger batchCount;
+@property (nonatomic) NSUInteger finishedCount;
+@property (nonatomic) BOOL offererConnected;
+@property (nonatomic) BOOL answererConnected;
+
+@end
+
+@implementation TLKLoopbackSignaling
+
+- (TLKWebRTC *)_otherSide:(TLKWebRTC *)webRTC
+{
+    return webRTC == self.offerer ? self.answerer : self.offerer;
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC didSendSDPOffer:(RTCSessionDescription *)offer forPeerWithID:(NSString *)peerID
+{
+    self.offerCount++;
+    if (webRTC == self.answerer) {
+        self.answererOfferCount++;
+    }
+    self.lastOffer = offer;
+    [[self _otherSide:webRTC] setRemoteDescription:offer forPeerWithID:peerID receiver:YES];
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC didSendSDPAnswer:(RTCSessionDescription *)answer forPeerWithID:(NSString *)peerID
+{
+    self.answerCount++;
+    self.lastAnswer = answer;
+    [[self _otherSide:webRTC] setRemoteDescription:answer forPeerWithID:peerID receiver:NO];
+    if (self.answerBlock) {
+        self.answerBlock(peerID);
+    }
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC didRequestRenegotiationRestartingICE:(BOOL)restartICE forPeerWithID:(NSString *)peerID
+{
+    self.requestCount++;
+    [[self _otherSide:webRTC] renegotiateForPeerWithID:peerID restartingICE:restartICE];
+}
+
+- (void)_progress
+{
+    if (self.progressBlock) {
+        self.progressBlock();
+    }
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC didSendICECandidate:(RTCICECandidate *)candidate forPeerWithID:(NSString *)peerID
+{
+    self.candidateCount++;
+    [[self _otherSide:webRTC] addICECandidate:candidate forPeerWithID:peerID];
+    [self _progress];
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC didSendICECandidates:(NSArray *)candidates forPeerWithID:(NSString *)peerID
+{
+    self.batchCount++;
+    self.candidateCount += candidates.count;
+    for (RTCICECandidate *candidate in candidates) {
+        [[self _otherSide:webRTC] addICECandidate:candidate forPeerWithID:peerID];
+    }
+    [self _progress];
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC didFinishSendingICECandidatesForPeerWithID:(NSString *)peerID
+{
+    self.finishedCount++;
+    [self _progress];
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC didObserveICEConnectionStateChange:(RTCICEConnectionState)state forPeerWithID:(NSString *)peerID
+{
+    BOOL connected = state == RTCICEConnectionConnected || state == RTCICEConnectionCompleted;
+    if (webRTC == self.offerer) {
+        self.offererConnected = connected;
+    } else {
+        self.answererConnected = connected;
+    }
+    [self _progress];
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC didOpenDataChannel:(TLKDataChannel *)dataChannel forPeerWithID:(NSString *)peerID
+{
+    if (self.dataChannelBlock) {
+        self.dataChannelBlock(dataChannel);
+    }
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC didSampleStats:(TLKPeerStats *)stats forPeerWithID:(NSString *)peerID
+{
+    if (self.statsBlock) {
+        self.statsBlock(webRTC, stats);
+    }
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC addedStream:(RTCMediaStream *)stream forPeerWithID:(NSString *)peerID
+{
+}
+
+- (void)webRTC:(TLKWebRTC *)webRTC removedStream:(RTCMediaStream *)stream forPeerWithID:(NSString *)peerID
+{
+}
+
+@end
+
+// Counts what arrives on a data channel, and how often the sending side drains
+@interface TLKDataSink : NSObject <TLKDataChannelDelegate>
+
+@property (nonatomic) NSUInteger byteCount;
+@property (nonatomic) NSUInteger lowWaterCount;
+@property (nonatomic, strong) NSMutableArray *strings;
+@property (nonatomic, strong) NSMutableArray *messages;
+@property (nonatomic, copy) void (^progressBlock)(void);
+
+@end
+
+@implementation TLKDataSink
+
+- (void)dataChannel:(TLKDataChannel *)dataChannel didReceiveData:(NSData *)data binary:(BOOL)isBinary
+{
+    self.byteCount += data.length;
+    if (!isBinary) {
+        [self.strings addObject:[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding]];
+    }
+    [self.messages addObject:data];
+    if (self.progressBlock) {
+        self.progressBlock();
+    }
+}
+
+- (void)dataChannelDidReachLowWater:(TLKDataChannel *)dataChannel
+{
+    self.lowWaterCount++;
+    if (self.progressBlock) {
+        self.progressBlock();
+    }
+}
+
+@end
+
+@interface TLKWebRTCTests : XCTestCase
+
+@end
+
+@implementation TLKWebRTCTests
+
+#pragma mark - Peer sessions
+
+- (void)testSessionTableFindsSessionsBothWays
+{
+    TLKPeerSessionTable *table = [[TLKPeerSessionTable alloc] init];
+    NSMutableArray *sessions = [NSMutableArray array];
+    for (int i = 0; i < 50; i++) {
+        TLKPeerSession *session = [[TLKPeerSession alloc] initWithIdentifier:[NSString stringWithFormat:@"peer-%d", i] peerConnection:TLKFakePeerConnection()];
+        [table addSession:session];
+        [sessions addObject:session];
+    }
+    XCTAssertEqual(table.count, (NSUInteger)50);
+    
+    for (TLKPeerSession *session in sessions) {
+        XCTAssertEqual([table sessionForID:[session.identifier mutableCopy]], session);
+        XCTAssertEqual([table sessionForPeerConnection:session.peerConnection], session);
+    }
+    XCTAssertNil([table sessionForID:@"nobody"]);
+    XCTAssertNil([table sessionForID:nil]);
+    XCTAssertNil([table sessionForPeerConnection:TLKFakePeerConnection()]);
+    XCTAssertNil([table sessionForPeerConnection:nil]);
+    
+    TLKPeerSession *removed = sessions[7];
+    XCTAssertEqual([table removeSessionForID:@"peer-7"], removed);
+    XCTAssertNil([table removeSessionForID:@"peer-7"]);
+    XCTAssertNil([table sessionForID:@"peer-7"]);
+    XCTAssertNil([table sessionForPeerConnection:removed.peerConnection]);
+    XCTAssertEqual(table.count, (NSUInteger)49);
+    XCTAssertEqual(table.allSessions.count, (NSUInteger)49);
+}
+
+- (void)testAddingASessionReplacesTheOldOne
+{
+    TLKPeerSessionTable *table = [[TLKPeerSessionTable alloc] init];
+    TLKPeerSession *first = [[TLKPeerSession alloc] initWithIdentifier:@"peer" peerConnection:TLKFakePeerConnection()];
+    TLKPeerSession *second = [[TLKPeerSession alloc] initWithIdentifier:@"peer" peerConnection:TLKFakePeerConnection()];
+    [first.pendingICECandidates addObject:@"candidate"];
+    first.role = TLKPeerRoleReceiver;
+    
+    [table addSession:first];
+    [table addSession:second];
+    XCTAssertEqual(table.count, (NSUInteger)1);
+    XCTAssertEqual([table sessionForID:@"peer"], second);
+    XCTAssertNil([table sessionForPeerConnection:first.peerConnection]);
+    XCTAssertEqual([table sessionForPeerConnection:second.peerConnection], second);
+    XCTAssertEqual(second.role, TLKPeerRoleNone);
+    XCTAssertEqual(second.pendingICECandidates.count, (NSUInteger)0);
+    XCTAssertGreaterThanOrEqual(second.lastActivityAt, second.createdAt);
+}
+
+static NSArray *TLKMeshSessions(NSUInteger count)
+{
+    NSMutableArray *sessions = [NSMutableArray array];
+    for (NSUInteger i = 0; i < count; i++) {
+        [sessions addObject:[[TLKPeerSession alloc] initWithIdentifier:[[NSUUID UUID] UUIDString] peerConnection:TLKFakePeerConnection()]];
+    }
+    return sessions;
+}
+
+// A candidate storm: every peer in a 64 peer mesh reports 20 candidates.
+- (void)testCandidateLookupThroughput
+{
+    NSArray *sessions = TLKMeshSessions(64);
+    TLKPeerSessionTable *table = [[TLKPeerSessionTable alloc] init];
+    for (TLKPeerSession *session in sessions) {
+        [table addSession:session];
+    }
+    
+    [self measureBlock:^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        NSUInteger found = 0;
+        for (int round = 0; round < 1000; round++) {
+            for (TLKPeerSession *session in sessions) {
+                found += [table sessionForPeerConnection:session.peerConnection] != nil;
+            }
+        }
+        XCTAssertEqual(found, 1000 * sessions.count);
+        NSLog(@"%.0f lookups/s", found / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+}
+
+- (void)testAllKeysForObjectLookupThroughput
+{
+    NSArray *sessions = TLKMeshSessions(64);
+    NSMutableDictionary *peerConnections = [NSMutableDictionary dictionary];
+    for (TLKPeerSession *session in sessions) {
+        peerConnections[session.identifier] = session.peerConnection;
+    }
+    
+    [self measureBlock:^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        NSUInteger found = 0;
+        for (int round = 0; round < 1000; round++) {
+            for (TLKPeerSession *session in sessions) {
+                found += [peerConnections allKeysForObject:session.peerConnection].count;
+            }
+        }
+        XCTAssertEqual(found, 1000 * sessions.count);
+        NSLog(@"%.0f lookups/s", found / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+}
+
+#pragma mark - Negotiation
+
+static TLKLoopbackSignaling *TLKLoopbackPair(dispatch_queue_t workQueue)
+{
+    TLKLoopbackSignaling *signaling = [[TLKLoopbackSignaling alloc] init];
+    signaling.offerer = [[TLKWebRTC alloc] initWithVideoDevice:nil workQueue:workQueue];
+    signaling.answerer = [[TLKWebRTC alloc] initWithVideoDevice:nil workQueue:workQueue];
+    signaling.offerer.delegate = signaling;
+    signaling.answerer.delegate = signaling;
+    return signaling;
+}
+
+// Negotiates "peer" between the pair and waits on the delegate queue until condition holds
+- (void)_connectLoopbackSignaling:(TLKLoopbackSignaling *)signaling until:(BOOL (^)(TLKLoopbackSignaling *progress))condition
+{
+    XCTestExpectation *reached = [self expectationWithDescription:@"connected"];
+    __weak TLKLoopbackSignaling *weakSignaling = signaling;
+    __block BOOL done = NO;
+    signaling.progressBlock = ^{
+        if (!done && condition(weakSignaling)) {
+            done = YES;
+            [reached fulfill];
+        }
+    };
+    
+    [signaling.offerer addPeerConnectionForID:@"peer"];
+    [signaling.answerer addPeerConnectionForID:@"peer"];
+    [signaling.offerer createOfferForPeerWithID:@"peer"];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    signaling.progressBlock = nil;
+}
+
+static NSString *TLKICEUfrag(RTCSessionDescription *sdp)
+{
+    NSRegularExpression *ufrag = [NSRegularExpression regularExpressionWithPattern:@"a=ice-ufrag:(\\S+)" options:0 error:NULL];
+    NSString *description = sdp.description;
+    NSTextCheckingResult *match = [ufrag firstMatchInString:description options:0 range:NSMakeRange(0, description.length)];
+    return match ? [description substringWithRange:[match rangeAtIndex:1]] : nil;
+}
+
+- (void)testBatchedCandidatesConnectLoopbackPeers
+{
+    TLKLoopbackSignaling *signaling = TLKLoopbackPair(NULL);
+    signaling.offerer.candidateBatchInterval = 0.05;
+    signaling.answerer.candidateBatchInterval = 0.05;
+    
+    [self _connectLoopbackSignaling:signaling until:^BOOL(TLKLoopbackSignaling *progress) {
+        return progress.finishedCount == 2 && progress.offererConnected && progress.answererConnected;
+    }];
+    
+    XCTAssertGreaterThan(signaling.batchCount, (NSUInteger)0);
+    XCTAssertLessThanOrEqual(signaling.batchCount, signaling.candidateCount);
+    NSLog(@"%lu candidates in %lu batches", (unsigned long)signaling.candidateCount, (unsigned long)signaling.batchCount);
+    
+    [signaling.offerer removePeerConnectionForID:@"peer"];
+    [signaling.answerer removePeerConnectionForID:@"peer"];
+}
+
+// The side that answered first asks for the restart, and the side that offered first sends it.
+- (void)testICERestartTakesOneRoundTrip
+{
+    TLKLoopbackSignaling *signaling = TLKLoopbackPair(NULL);
+    [self _connectLoopbackSignaling:signaling until:^BOOL(TLKLoopbackSignaling *progress) {
+        return progress.offererConnected && progress.answererConnected;
+    }];
+    NSString *ufrag = TLKICEUfrag(signaling.lastAnswer);
+    XCTAssertNotNil(ufrag);
+    XCTAssertEqual(signaling.offerCount, (NSUInteger)1);
+    XCTAssertEqual(signaling.answerCount, (NSUInteger)1);
+    
+    XCTestExpectation *answered = [self expectationWithDescription:@"restart answered"];
+    signaling.answerBlock = ^(NSString *peerID) {
+        [answered fulfill];
+    };
+    [signaling.answerer restartICEForPeerWithID:@"peer"];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    signaling.answerBlock = nil;
+    
+    XCTAssertEqual(signaling.offerCount, (NSUInteger)2);
+    XCTAssertEqual(signaling.answerCount, (NSUInteger)2);
+    XCTAssertEqual(signaling.requestCount, (NSUInteger)1);
+    XCTAssertEqual(signaling.answererOfferCount, (NSUInteger)0);
+    NSString *restartUfrag = TLKICEUfrag(signaling.lastOffer);
+    XCTAssertNotNil(restartUfrag);
+    XCTAssertNotEqualObjects(restartUfrag, ufrag);
+    
+    [signaling.offerer removePeerConnectionForID:@"peer"];
+    [signaling.answerer removePeerConnectionForID:@"peer"];
+}
+
+// Both sides restart at once. Their offers would cross and neither could back out of its own, so the
+// answering side only asks; every offer comes from one side and each is answered.
+- (void)testSimultaneousRenegotiationSettles
+{
+    TLKLoopbackSignaling *signaling = TLKLoopbackPair(NULL);
+    [self _connectLoopbackSignaling:signaling until:^BOOL(TLKLoopbackSignaling *progress) {
+        return progress.offererConnected && progress.answererConnected;
+    }];
+    
+    XCTestExpectation *answered = [self expectationWithDescription:@"renegotiations answered"];
+    __weak TLKLoopbackSignaling *weakSignaling = signaling;
+    __block BOOL done = NO;
+    signaling.answerBlock = ^(NSString *peerID) {
+        if (!done && weakSignaling.answerCount >= 2 && weakSignaling.requestCount == 1) {
+            done = YES;
+            [answered fulfill];
+        }
+    };
+    [signaling.offerer restartICEForPeerWithID:@"peer"];
+    [signaling.answerer restartICEForPeerWithID:@"peer"];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    signaling.answerBlock = nil;
+    
+    // The request may fold into the restart already under way or get a round of its own; either
+    // way nothing should still be going back and forth a second later
+    XCTestExpectation *settled = [self expectationWithDescription:@"settled"];
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)NSEC_PER_SEC), dispatch_get_main_queue(), ^{
+        [settled fulfill];
+    });
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    NSUInteger offers = signaling.offerCount;
+    XCTAssertEqual(signaling.answererOfferCount, (NSUInteger)0);
+    XCTAssertEqual(signaling.answerCount, offers);
+    XCTAssertLessThanOrEqual(offers, (NSUInteger)3);
+    
+    [signaling.offerer removePeerConnectionForID:@"peer"];
+    [signaling.answerer removePeerConnectionForID:@"peer"];
+}
+
+// Candidates can arrive before the app gets round to adding the peer; they wait for it, and go
+// once the peer is removed again
+- (void)testCandidatesForUnknownPeerWaitForIt
+{
+    dispatch_queue_t queue = dispatch_queue_create("TLKWebRTCTests.early", DISPATCH_QUEUE_SERIAL);
+    TLKWebRTC *webRTC = [[TLKWebRTC alloc] initWithVideoDevice:nil workQueue:queue];
+    TLKPeerSessionTable *sessions = [webRTC valueForKey:@"sessions"];
+    RTCICECandidate *candidate = [[RTCICECandidate alloc] initWithMid:@"audio" index:0 sdp:@"candidate:1 1 udp 2122260223 192.168.1.2 50000 typ host"];
+    
+    [webRTC addICECandidate:candidate forPeerWithID:@"early"];
+    [webRTC addICECandidate:candidate forPeerWithID:@"early"];
+    [webRTC addPeerConnectionForID:@"early"];
+    dispatch_sync(queue, ^{
+        XCTAssertEqual([sessions sessionForID:@"early"].pendingICECandidates.count, (NSUInteger)2);
+    });
+    
+    [webRTC addICECandidate:candidate forPeerWithID:@"gone"];
+    [webRTC removePeerConnectionForID:@"gone"];
+    [webRTC addPeerConnectionForID:@"gone"];
+    dispatch_sync(queue, ^{
+        XCTAssertEqual([sessions sessionForID:@"gone"].pendingICECandidates.count, (NSUInteger)0);
+    });
+    
+    // Only so many are held for one peer
+    for (int i = 0; i < 60; i++) {
+        [webRTC addICECandidate:candidate forPeerWithID:@"chatty"];
+    }
+    [webRTC addPeerConnectionForID:@"chatty"];
+    dispatch_sync(queue, ^{
+        XCTAssertEqual([sessions sessionForID:@"chatty"].pendingICECandidates.count, (NSUInteger)50);
+    });
+    
+    [webRTC removePeerConnectionForID:@"early"];
+    [webRTC removePeerConnectionForID:@"gone"];
+    [webRTC removePeerConnectionForID:@"chatty"];
+}
+
+// Offer to answer-in-hand time for a newly joined peer, a fresh one each round
+- (void)_measureNegotiationOfSignaling:(TLKLoopbackSignaling *)signaling
+{
+    __block NSUInteger round = 0;
+    [self measureBlock:^{
+        NSString *peerID = [NSString stringWithFormat:@"peer-%lu", (unsigned long)round++];
+        XCTestExpectation *answered = [self expectationWithDescription:@"answer"];
+        signaling.answerBlock = ^(NSString *answeredID) {
+            if ([answeredID isEqualToString:peerID]) {
+                [answered fulfill];
+            }
+        };
+        
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        [signaling.offerer addPeerConnectionForID:peerID];
+        [signaling.answerer addPeerConnectionForID:peerID];
+        [signaling.offerer createOfferForPeerWithID:peerID];
+        [self waitForExpectationsWithTimeout:10 handler:nil];
+        NSLog(@"offer/answer in %.1f ms", (CFAbsoluteTimeGetCurrent() - start) * 1000);
+        
+        signaling.answerBlock = nil;
+        [signaling.offerer removePeerConnectionForID:peerID];
+        [signaling.answerer removePeerConnectionForID:peerID];
+    }];
+}
+
+// The same while the main thread spends 12ms of every 16ms frame busy, as it would laying out
+// and drawing a call UI. Delegate calls go to the main queue either way.
+- (void)_measureNegotiationWithWorkQueue:(dispatch_queue_t)workQueue
+{
+    dispatch_source_t busy = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+    dispatch_source_set_timer(busy, DISPATCH_TIME_NOW, 16 * NSEC_PER_MSEC, NSEC_PER_MSEC);
+    dispatch_source_set_event_handler(busy, ^{
+        usleep(12000);
+    });
+    dispatch_resume(busy);
+    
+    [self _measureNegotiationOfSignaling:TLKLoopbackPair(workQueue)];
+    
+    dispatch_source_cancel(busy);
+}
+
+- (void)testNegotiationLatencyOnWorkQueueWithBusyMainThread
+{
+    [self _measureNegotiationWithWorkQueue:NULL];
+}
+
+// Everything on the main queue, the way TLKWebRTC used to run.
+- (void)testNegotiationLatencyOnMainQueueWithBusyMainThread
+{
+    [self _measureNegotiationWithWorkQueue:dispatch_get_main_queue()];
+}
+
+- (void)testJoinLatencyWithConnectionPool
+{
+    TLKLoopbackSignaling *signaling = TLKLoopbackPair(NULL);
+    signaling.offerer.peerConnectionPoolSize = 2;
+    signaling.answerer.peerConnectionPoolSize = 2;
+    // Let the pools fill before the clock starts
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.5]];
+    
+    [self _measureNegotiationOfSignaling:signaling];
+}
+
+- (void)testJoinLatencyWithoutConnectionPool
+{
+    [self _measureNegotiationOfSignaling:TLKLoopbackPair(NULL)];
+}
+
+#pragma mark - Connection pool
+
+static NSUInteger TLKPoolCountOnQueue(TLKPeerConnectionPool *pool, dispatch_queue_t queue, NSUInteger expected)
+{
+    // Refills go one connection per block, so give the queue a few turns to catch up
+    __block NSUInteger count = 0;
+    for (int turn = 0; turn < 100; turn++) {
+        dispatch_sync(queue, ^{
+            count = pool.count;
+        });
+        if (count == expected) {
+            break;
+        }
+    }
+    return count;
+}
+
+- (void)testPoolRefillsAfterClaims
+{
+    dispatch_queue_t queue = dispatch_queue_create("TLKWebRTCTests.pool", DISPATCH_QUEUE_SERIAL);
+    __block NSUInteger created = 0;
+    TLKPeerConnectionPool *pool = [[TLKPeerConnectionPool alloc] initWithQueue:queue factory:^RTCPeerConnection *{
+        created++;
+        return TLKFakePeerConnection();
+    }];
+    
+    dispatch_sync(queue, ^{
+        XCTAssertNil([pool claimPeerConnection]);
+        XCTAssertEqual([pool resizeToCapacity:3].count, (NSUInteger)0);
+    });
+    XCTAssertEqual(TLKPoolCountOnQueue(pool, queue, 3), (NSUInteger)3);
+    
+    __block RTCPeerConnection *first = nil;
+    __block RTCPeerConnection *second = nil;
+    dispatch_sync(queue, ^{
+        first = [pool claimPeerConnection];
+        second = [pool claimPeerConnection];
+        XCTAssertEqual(pool.count, (NSUInteger)1);
+    });
+    XCTAssertNotNil(first);
+    XCTAssertNotNil(second);
+    XCTAssertNotEqual(first, second);
+    XCTAssertEqual(TLKPoolCountOnQueue(pool, queue, 3), (NSUInteger)3);
+    XCTAssertEqual(created, (NSUInteger)5);
+}
+
+- (void)testPoolDrainsAndShrinks
+{
+    dispatch_queue_t queue = dispatch_queue_create("TLKWebRTCTests.pool", DISPATCH_QUEUE_SERIAL);
+    TLKPeerConnectionPool *pool = [[TLKPeerConnectionPool alloc] initWithQueue:queue factory:^RTCPeerConnection *{
+        return TLKFakePeerConnection();
+    }];
+    dispatch_sync(queue, ^{
+        [pool resizeToCapacity:4];
+    });
+    XCTAssertEqual(TLKPoolCountOnQueue(pool, queue, 4), (NSUInteger)4);
+    
+    dispatch_sync(queue, ^{
+        XCTAssertEqual([pool resizeToCapacity:1].count, (NSUInteger)3);
+        XCTAssertEqual(pool.count, (NSUInteger)1);
+        XCTAssertEqual([pool drain].count, (NSUInteger)1);
+        XCTAssertEqual(pool.count, (NSUInteger)0);
+    });
+    XCTAssertEqual(TLKPoolCountOnQueue(pool, queue, 1), (NSUInteger)1);
+    
+    dispatch_sync(queue, ^{
+        XCTAssertEqual([pool resizeToCapacity:0].count, (NSUInteger)1);
+        XCTAssertNil([pool claimPeerConnection]);
+    });
+    XCTAssertEqual(TLKPoolCountOnQueue(pool, queue, 0), (NSUInteger)0);
+}
+
+#pragma mark - Media profiles
+
+// What a browser offers for audio, video and a data channel, trimmed down
+static NSString *TLKSampleSDP(void)
+{
+    NSArray *lines = @[@"v=0",
+                       @"o=- 4611731400430051336 2 IN IP4 127.0.0.1",
+                       @"s=-",
+                       @"t=0 0",
+                       @"a=group:BUNDLE audio video data",
+                       @"m=audio 9 UDP/TLS/RTP/SAVPF 111 103 9 0 8 126",
+                       @"c=IN IP4 0.0.0.0",
+                       @"a=rtcp:9 IN IP4 0.0.0.0",
+                       @"a=mid:audio",
+                       @"a=rtpmap:111 opus/48000/2",
+                       @"a=fmtp:111 minptime=10;useinbandfec=1",
+                       @"a=rtpmap:103 ISAC/16000",
+                       @"a=rtpmap:9 G722/8000",
+                       @"a=rtpmap:0 PCMU/8000",
+                       @"a=rtpmap:8 PCMA/8000",
+                       @"a=rtpmap:126 telephone-event/8000",
+                       @"a=maxptime:60",
+                       @"m=video 9 UDP/TLS/RTP/SAVPF 100 101 116 117 96",
+                       @"c=IN IP4 0.0.0.0",
+                       @"b=AS:2000",
+                       @"a=rtcp:9 IN IP4 0.0.0.0",
+                       @"a=mid:video",
+                       @"a=rtpmap:100 VP8/90000",
+                       @"a=rtpmap:101 VP9/90000",
+                       @"a=rtpmap:116 red/90000",
+                       @"a=rtpmap:117 ulpfec/90000",
+                       @"a=rtpmap:96 rtx/90000",
+                       @"a=fmtp:96 apt=100",
+                       @"m=application 9 DTLS/SCTP 5000",
+                       @"c=IN IP4 0.0.0.0",
+                       @"a=mid:data"];
+    return [[lines componentsJoinedByString:@"\r\n"] stringByAppendingString:@"\r\n"];
+}
+
+static NSArray *TLKSDPLines(NSString *sdp)
+{
+    // Everything after the final CRLF is an empty string
+    NSArray *lines = [sdp componentsSeparatedByString:@"\r\n"];
+    return [lines subarrayWithRange:NSMakeRange(0, lines.count - 1)];
+}
+
+static TLKMediaProfile *TLKTestProfile(void)
+{
+    TLKMediaProfile *profile = [[TLKMediaProfile alloc] initWithName:@"test"];
+    profile.maxVideoBitrate = 500;
+    profile.maxAudioBitrate = 24;
+    profile.videoCodecPreference = @[@"VP9", @"H264"];
+    profile.audioCodecPreference = @[@"PCMU", @"opus"];
+    profile.opusFEC = @NO;
+    profile.opusDTX = @YES;
+    profile.opusPacketTime = 60;
+    return profile;
+}
+
+- (void)testDefaultProfileLeavesSDPAlone
+{
+    TLKMediaProfile *profile = [TLKMediaProfile defaultProfile];
+    NSString *sdp = TLKSampleSDP();
+    XCTAssertEqualObjects([profile localSDPFromSDP:sdp], sdp);
+    XCTAssertEqualObjects([profile remoteSDPFromSDP:sdp], sdp);
+    XCTAssertNil([profile videoSourceConstraints]);
+    XCTAssertNotNil([[TLKMediaProfile cellularProfile] videoSourceConstraints]);
+}
+
+- (void)testBitrateCapsReplaceExistingOnes
+{
+    NSArray *lines = TLKSDPLines([TLKTestProfile() localSDPFromSDP:TLKSampleSDP()]);
+    
+    NSUInteger audio = [lines indexOfObject:@"m=audio 9 UDP/TLS/RTP/SAVPF 0 111 103 9 8 126"];
+    XCTAssertNotEqual(audio, (NSUInteger)NSNotFound);
+    NSArray *expectedAudio = @[@"c=IN IP4 0.0.0.0", @"b=AS:24", @"b=TIAS:24000", @"a=rtcp:9 IN IP4 0.0.0.0"];
+    XCTAssertEqualObjects([lines subarrayWithRange:NSMakeRange(audio + 1, 4)], expectedAudio);
+    
+    NSUInteger video = [lines indexOfObject:@"m=video 9 UDP/TLS/RTP/SAVPF 101 100 116 117 96"];
+    XCTAssertNotEqual(video, (NSUInteger)NSNotFound);
+    NSArray *expectedVideo = @[@"c=IN IP4 0.0.0.0", @"b=AS:500", @"b=TIAS:500000", @"a=rtcp:9 IN IP4 0.0.0.0"];
+    XCTAssertEqualObjects([lines subarrayWithRange:NSMakeRange(video + 1, 4)], expectedVideo);
+    XCTAssertFalse([lines containsObject:@"b=AS:2000"]);
+    
+    // The data channel section has no bitrate of its own to cap
+    NSArray *expectedData = @[@"m=application 9 DTLS/SCTP 5000", @"c=IN IP4 0.0.0.0", @"a=mid:data"];
+    XCTAssertEqualObjects([lines subarrayWithRange:NSMakeRange(lines.count - 3, 3)], expectedData);
+}
+
+- (void)testOpusParametersAreRewritten
+{
+    NSArray *lines = TLKSDPLines([TLKTestProfile() localSDPFromSDP:TLKSampleSDP()]);
+    NSUInteger rtpmap = [lines indexOfObject:@"a=rtpmap:111 opus/48000/2"];
+    XCTAssertNotEqual(rtpmap, (NSUInteger)NSNotFound);
+    XCTAssertEqualObjects(lines[rtpmap + 1], @"a=fmtp:111 minptime=10;useinbandfec=0;maxaveragebitrate=24000;usedtx=1");
+    XCTAssertEqualObjects(lines[rtpmap + 2], @"a=ptime:60");
+    XCTAssertEqualObjects(lines[rtpmap + 3], @"a=rtpmap:103 ISAC/16000");
+}
+
+- (void)testOpusFormatLineIsAddedWhenMissing
+{
+    NSString *sdp = [TLKSampleSDP() stringByReplacingOccurrencesOfString:@"a=fmtp:111 minptime=10;useinbandfec=1\r\n" withString:@""];
+    TLKMediaProfile *profile = [[TLKMediaProfile alloc] initWithName:@"dtx"];
+    profile.opusDTX = @YES;
+    
+    NSArray *lines = TLKSDPLines([profile localSDPFromSDP:sdp]);
+    NSUInteger rtpmap = [lines indexOfObject:@"a=rtpmap:111 opus/48000/2"];
+    XCTAssertEqualObjects(lines[rtpmap + 1], @"a=fmtp:111 usedtx=1");
+    XCTAssertEqualObjects(lines[rtpmap + 2], @"a=rtpmap:103 ISAC/16000");
+}
+
+- (void)testRewritingIsIdempotent
+{
+    TLKMediaProfile *profile = TLKTestProfile();
+    NSString *once = [profile localSDPFromSDP:TLKSampleSDP()];
+    XCTAssertEqualObjects([profile localSDPFromSDP:once], once);
+}
+
+- (void)testRemoteSDPOnlyGetsBitrateCaps
+{
+    NSArray *lines = TLKSDPLines([TLKTestProfile() remoteSDPFromSDP:TLKSampleSDP()]);
+    XCTAssertTrue([lines containsObject:@"m=audio 9 UDP/TLS/RTP/SAVPF 111 103 9 0 8 126"]);
+    XCTAssertTrue([lines containsObject:@"m=video 9 UDP/TLS/RTP/SAVPF 100 101 116 117 96"]);
+    XCTAssertTrue([lines containsObject:@"a=fmtp:111 minptime=10;useinbandfec=1"]);
+    XCTAssertFalse([lines containsObject:@"a=ptime:60"]);
+    XCTAssertTrue([lines containsObject:@"b=AS:500"]);
+    XCTAssertTrue([lines containsObject:@"b=TIAS:24000"]);
+    
+    // A peer that asks for less than our cap keeps its own limit
+    NSString *lowSDP = [TLKSampleSDP() stringByReplacingOccurrencesOfString:@"b=AS:2000" withString:@"b=AS:150"];
+    lines = TLKSDPLines([TLKTestProfile() remoteSDPFromSDP:lowSDP]);
+    XCTAssertTrue([lines containsObject:@"b=AS:150"]);
+    XCTAssertTrue([lines containsObject:@"b=TIAS:150000"]);
+    XCTAssertFalse([lines containsObject:@"b=AS:500"]);
+}
+
+- (void)testBareLineFeedsComeOutAsCRLF
+{
+    NSString *sdp = [TLKSampleSDP() stringByReplacingOccurrencesOfString:@"\r\n" withString:@"\n"];
+    TLKMediaProfile *profile = TLKTestProfile();
+    XCTAssertEqualObjects([profile localSDPFromSDP:sdp], [profile localSDPFromSDP:TLKSampleSDP()]);
+}
+
+#pragma mark - Encoding policy
+
+static NSArray *TLKMeshPeerIDs(NSUInteger count)
+{
+    NSMutableArray *peerIDs = [NSMutableArray array];
+    for (NSUInteger i = 0; i < count; i++) {
+        [peerIDs addObject:[NSString stringWithFormat:@"peer-%lu", (unsigned long)i]];
+    }
+    return peerIDs;
+}
+
+- (void)testFiveWayMeshIsSplitIntoTiers
+{
+    TLKEncodingPolicy *policy = [[TLKEncodingPolicy alloc] init];
+    NSDictionary *tiers = [policy tiersForPeerIDs:TLKMeshPeerIDs(4)];
+    NSDictionary *expected = @{@"peer-0": @(TLKEncodingTierFull),
+                               @"peer-1": @(TLKEncodingTierFull),
+                               @"peer-2": @(TLKEncodingTierReduced),
+                               @"peer-3": @(TLKEncodingTierReduced)};
+    XCTAssertEqualObjects(tiers, expected);
+    
+    tiers = [policy tiersForPeerIDs:TLKMeshPeerIDs(6)];
+    XCTAssertEqualObjects(tiers[@"peer-4"], @(TLKEncodingTierThumbnail));
+    XCTAssertEqualObjects(tiers[@"peer-5"], @(TLKEncodingTierThumbnail));
+    XCTAssertEqual([[policy tiersForPeerIDs:@[]] count], (NSUInteger)0);
+}
+
+- (void)testPrioritizedPeersGoFirst
+{
+    TLKEncodingPolicy *policy = [[TLKEncodingPolicy alloc] init];
+    policy.maxFullQualityPeers = 1;
+    policy.maxReducedPeers = 1;
+    policy.prioritizedPeerIDs = @[@"gone", @"peer-3", @"peer-3"];
+    
+    NSDictionary *tiers = [policy tiersForPeerIDs:TLKMeshPeerIDs(4)];
+    XCTAssertEqual(tiers.count, (NSUInteger)4);
+    XCTAssertNil(tiers[@"gone"]);
+    XCTAssertEqualObjects(tiers[@"peer-3"], @(TLKEncodingTierFull));
+    XCTAssertEqualObjects(tiers[@"peer-0"], @(TLKEncodingTierReduced));
+    XCTAssertEqualObjects(tiers[@"peer-1"], @(TLKEncodingTierThumbnail));
+    XCTAssertEqualObjects(tiers[@"peer-2"], @(TLKEncodingTierThumbnail));
+}
+
+- (void)testTierBitrates
+{
+    TLKEncodingPolicy *policy = [[TLKEncodingPolicy alloc] init];
+    XCTAssertEqual([policy videoBitrateForTier:TLKEncodingTierFull], (NSUInteger)0);
+    XCTAssertEqual([policy videoBitrateForTier:TLKEncodingTierReduced], (NSUInteger)300);
+    XCTAssertEqual([policy videoBitrateForTier:TLKEncodingTierThumbnail], (NSUInteger)100);
+}
+
+#pragma mark - Stats
+
+static NSDictionary *TLKSSRCReport(NSString *reportID, NSString *mediaType, BOOL sending, long long bytes, long long packets, long long lost)
+{
+    NSString *direction = sending ? @"Sent" : @"Received";
+    return @{TLKStatsReportTypeKey: @"ssrc",
+             TLKStatsReportIDKey: reportID,
+             @"mediaType": mediaType,
+             [@"bytes" stringByAppendingString:direction]: [@(bytes) stringValue],
+             [@"packets" stringByAppendingString:direction]: [@(packets) stringValue],
+             @"packetsLost": [@(lost) stringValue],
+             @"googRtt": @"80",
+             @"googJitterReceived": @"12",
+             @"googFrameRateSent": @"30",
+             @"googFrameRateReceived": @"24"};
+}
+
+static NSDictionary *TLKCandidatePairReport(BOOL active)
+{
+    return @{TLKStatsReportTypeKey: @"googCandidatePair",
+             TLKStatsReportIDKey: active ? @"Conn-audio-1-0" : @"Conn-audio-1-1",
+             @"googActiveConnection": active ? @"true" : @"false",
+             @"googRtt": active ? @"42" : @"500",
+             @"googLocalAddress": @"10.0.0.2:5000",
+             @"googRemoteAddress": @"10.0.0.3:6000",
+             @"googLocalCandidateType": @"local",
+             @"googRemoteCandidateType": @"stun"};
+}
+
+- (void)testSamplerComputesRatesFromDeltas
+{
+    TLKPeerStatsSampler *sampler = [[TLKPeerStatsSampler alloc] init];
+    NSDictionary *bwe = @{TLKStatsReportTypeKey: @"VideoBwe", TLKStatsReportIDKey: @"bweforvideo",
+                          @"googAvailableSendBandwidth": @"1200000", @"googAvailableReceiveBandwidth": @"900000"};
+    
+    TLKPeerStats *first = [sampler statsFromReports:@[TLKSSRCReport(@"ssrc_1_send", @"video", YES, 10000, 100, 0),
+                                                      TLKSSRCReport(@"ssrc_2_recv", @"audio", NO, 4000, 50, 0),
+                                                      TLKCandidatePairReport(NO),
+                                                      TLKCandidatePairReport(YES), bwe] atTime:100];
+    XCTAssertEqual(first.interval, 0.0);
+    XCTAssertEqual(first.videoSendBitrate, 0.0);
+    XCTAssertEqual(first.roundTripTime, 42.0);
+    XCTAssertEqualObjects(first.remoteAddress, @"10.0.0.3:6000");
+    XCTAssertEqualObjects(first.remoteCandidateType, @"stun");
+    XCTAssertEqual(first.availableSendBandwidth, 1200000.0);
+    XCTAssertEqual(first.audioJitter, 12.0);
+    XCTAssertEqual(first.videoSendFramerate, 30.0);
+    
+    // Two seconds on: 250 KB more sent with 10 of 200 packets lost, 8 KB more received with 10 of 100 missing
+    TLKPeerStats *second = [sampler statsFromReports:@[TLKSSRCReport(@"ssrc_1_send", @"video", YES, 260000, 300, 10),
+                                                       TLKSSRCReport(@"ssrc_2_recv", @"audio", NO, 12000, 140, 10)] atTime:102];
+    XCTAssertEqual(second.interval, 2.0);
+    XCTAssertEqual(second.videoSendBitrate, 1000000.0);
+    XCTAssertEqual(second.videoSendLoss, 0.05);
+    XCTAssertEqual(second.audioReceiveBitrate, 32000.0);
+    XCTAssertEqual(second.audioReceiveLoss, 0.1);
+    // No candidate pair this time, so RTT comes from the sender report
+    XCTAssertEqual(second.roundTripTime, 80.0);
+    XCTAssertNil(second.localAddress);
+}
+
+- (void)testSamplerRebaselinesWhenCountersGoBackwards
+{
+    TLKPeerStatsSampler *sampler = [[TLKPeerStatsSampler alloc] init];
+    [sampler statsFromReports:@[TLKSSRCReport(@"ssrc_1_send", @"audio", YES, 50000, 500, 5)] atTime:10];
+    
+    TLKPeerStats *restarted = [sampler statsFromReports:@[TLKSSRCReport(@"ssrc_1_send", @"audio", YES, 1000, 10, 0),
+                                                          TLKSSRCReport(@"ssrc_3_send", @"audio", YES, 2000, 20, 0)] atTime:11];
+    XCTAssertEqual(restarted.audioSendBitrate, 0.0);
+    XCTAssertEqual(restarted.audioSendLoss, 0.0);
+    
+    // Both streams count from here, added together
+    TLKPeerStats *next = [sampler statsFromReports:@[TLKSSRCReport(@"ssrc_1_send", @"audio", YES, 2000, 20, 0),
+                                                     TLKSSRCReport(@"ssrc_3_send", @"audio", YES, 3000, 30, 0)] atTime:12];
+    XCTAssertEqual(next.audioSendBitrate, 16000.0);
+}
+
+- (void)testStatsHistoryKeepsNewestSamples
+{
+    TLKStatsHistory *history = [[TLKStatsHistory alloc] initWithCapacity:3];
+    XCTAssertNil([history latestStats]);
+    XCTAssertEqualObjects([history allStats], @[]);
+    
+    NSMutableArray *samples = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 8; i++) {
+        TLKPeerStats *stats = [[TLKPeerStats alloc] init];
+        stats.timestamp = i;
+        [samples addObject:stats];
+        [history addStats:stats];
+        XCTAssertEqual([history latestStats], stats);
+        XCTAssertEqualObjects([history allStats], [samples subarrayWithRange:NSMakeRange(samples.count - history.count, history.count)]);
+    }
+    XCTAssertEqual(history.count, (NSUInteger)3);
+}
+
+- (void)testLoopbackPeersReportStats
+{
+    TLKLoopbackSignaling *signaling = TLKLoopbackPair(NULL);
+    [self _connectLoopbackSignaling:signaling until:^BOOL(TLKLoopbackSignaling *progress) {
+        return progress.offererConnected && progress.answererConnected;
+    }];
+    
+    XCTestExpectation *sampled = [self expectationWithDescription:@"sampled"];
+    __block NSUInteger samples = 0;
+    signaling.statsBlock = ^(TLKWebRTC *webRTC, TLKPeerStats *stats) {
+        if (webRTC == signaling.offerer && ++samples == 3) {
+            XCTAssertEqualObjects(stats.peerID, @"peer");
+            XCTAssertGreaterThan(stats.interval, 0.0);
+            XCTAssertNotNil(stats.remoteAddress);
+            XCTAssertGreaterThan(stats.audioSendBitrate, 0.0);
+            [sampled fulfill];
+        }
+    };
+    signaling.offerer.statsHistoryLength = 2;
+    signaling.offerer.statsInterval = 0.2;
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    signaling.offerer.statsInterval = 0;
+    signaling.statsBlock = nil;
+    
+    XCTestExpectation *pulled = [self expectationWithDescription:@"history"];
+    [signaling.offerer statsHistoryForPeerWithID:@"peer" completion:^(NSArray *history) {
+        XCTAssertEqual(history.count, (NSUInteger)2);
+        [pulled fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    
+    [signaling.offerer removePeerConnectionForID:@"peer"];
+    [signaling.answerer removePeerConnectionForID:@"peer"];
+}
+
+#pragma mark - Quality adaptation
+
+// A stats trace as runs of one sample a second with the same send loss, RTT (ms) and bandwidth estimate (kbps).
+// A capped run reports no more than the b=AS of the level the peer is at, as WebRTC's estimate does
+typedef struct {
+    NSUInteger seconds;
+    double loss;
+    double roundTripTime;
+    double bandwidth;
+    BOOL capped;
+} TLKStatsTraceRun;
+
+// Plays the trace into the controller for one peer and spells out the level after each sample, "0012..."
+static NSString *TLKReplayTrace(TLKQualityController *controller, NSString *peerID, const TLKStatsTraceRun *runs, NSUInteger count)
+{
+    NSMutableString *levels = [NSMutableString string];
+    CFAbsoluteTime time = 1000;
+    for (NSUInteger i = 0; i < count; i++) {
+        for (NSUInteger second = 0; second < runs[i].seconds; second++) {
+            TLKPeerStats *stats = [[TLKPeerStats alloc] init];
+            stats.timestamp = ++time;
+            stats.interval = 1;
+            stats.videoSendLoss = runs[i].loss;
+            stats.roundTripTime = runs[i].roundTripTime;
+            double bandwidth = runs[i].bandwidth;
+            NSUInteger cap = [controller profileForLevel:[controller levelForPeerWithID:peerID]].maxVideoBitrate;
+            if (runs[i].capped && cap) {
+                bandwidth = MIN(bandwidth, cap);
+            }
+            stats.availableSendBandwidth = bandwidth * 1000;
+            [levels appendFormat:@"%lu", (unsigned long)[controller levelAfterStats:stats forPeerWithID:peerID]];
+        }
+    }
+    return levels;
+}
+
+#define TLKReplay(controller, runs) TLKReplayTrace(controller, @"peer", runs, sizeof(runs) / sizeof(runs[0]))
+
+// Four seconds of 15% loss on a link with plenty of bandwidth
+static const TLKStatsTraceRun TLKLossBurstTrace[] = {{3, 0, 50, 2000}, {4, 0.15, 50, 2000}, {23, 0, 50, 2000}};
+
+// The bandwidth estimate falls to 250 kbps for ten seconds without any loss
+static const TLKStatsTraceRun TLKBandwidthDipTrace[] = {{2, 0, 80, 2000}, {10, 0, 80, 250}, {28, 0, 80, 2000}};
+
+- (void)testLossBurstStepsDownAndRecoversSlowly
+{
+    TLKQualityController *controller = [[TLKQualityController alloc] init];
+    // Down a level every two bad samples; back up after five clean ones, no sooner than ten seconds after the last step down
+    XCTAssertEqualObjects(TLKReplay(controller, TLKLossBurstTrace), @"000011222222222211111000000000");
+}
+
+- (void)testBandwidthDipStopsAtALevelThatFits
+{
+    TLKQualityController *controller = [[TLKQualityController alloc] init];
+    // Level 3 needs 150 kbps, the first that fits in 250; going back up needs 30% more than the level above needs
+    XCTAssertEqualObjects(TLKReplay(controller, TLKBandwidthDipTrace), @"0001122333333333322222111110000000000000");
+    XCTAssertEqual([controller profileForLevel:3].maxVideoBitrate, (NSUInteger)150);
+}
+
+// The same loss burst with the estimate held at each level's cap, as on a real link. It never shows the
+// headroom the level above needs, so the way back up rests on loss and RTT
+- (void)testCappedEstimateDoesNotHoldBackRecovery
+{
+    static const TLKStatsTraceRun capped[] = {{3, 0, 50, 2000, YES}, {4, 0.15, 50, 2000, YES}, {23, 0, 50, 2000, YES}};
+    TLKQualityController *controller = [[TLKQualityController alloc] init];
+    XCTAssertEqualObjects(TLKReplay(controller, capped), @"000011222222222211111000000000");
+}
+
+- (void)testIsolatedBadSamplesAreIgnored
+{
+    static const TLKStatsTraceRun flapping[] = {{1, 0.15, 50, 2000}, {1, 0, 50, 2000}, {1, 0, 600, 2000}, {1, 0, 50, 2000},
+                                                {1, 0.15, 50, 2000}, {1, 0, 50, 2000}, {1, 0, 600, 2000}, {1, 0, 50, 2000}};
+    TLKQualityController *controller = [[TLKQualityController alloc] init];
+    XCTAssertEqualObjects(TLKReplay(controller, flapping), @"00000000");
+}
+
+- (void)testBottomLevelHolds
+{
+    static const TLKStatsTraceRun collapse[] = {{15, 0.3, 900, 0}};
+    TLKQualityController *controller = [[TLKQualityController alloc] init];
+    XCTAssertEqualObjects(TLKReplay(controller, collapse), @"011223344444444");
+    XCTAssertEqual([controller levelForPeerWithID:@"peer"], controller.levels.count - 1);
+}
+
+- (void)testReplayIsDeterministicPerPeer
+{
+    TLKQualityController *controller = [[TLKQualityController alloc] init];
+    NSString *first = TLKReplay(controller, TLKLossBurstTrace);
+    
+    // Another peer's trace on the same controller, and a fresh run after forgetting the first peer, change nothing
+    TLKReplayTrace(controller, @"other", TLKBandwidthDipTrace, sizeof(TLKBandwidthDipTrace) / sizeof(TLKBandwidthDipTrace[0]));
+    [controller removePeerWithID:@"peer"];
+    XCTAssertEqual([controller levelForPeerWithID:@"peer"], (NSUInteger)0);
+    XCTAssertEqualObjects(TLKReplay(controller, TLKLossBurstTrace), first);
+    XCTAssertEqualObjects(TLKReplay([[TLKQualityController alloc] init], TLKLossBurstTrace), first);
+    
+    // The first sample from a sampler has no rates and must not count
+    TLKPeerStats *unsampled = [[TLKPeerStats alloc] init];
+    unsampled.videoSendLoss = 1;
+    XCTAssertEqual([controller levelAfterStats:unsampled forPeerWithID:@"new"], (NSUInteger)0);
+}
+
+#pragma mark - Data channels
+
+// Connects the pair, then opens a channel from the offerer. Adding the first channel to a live
+// connection renegotiates it, so this goes through that path as well.
+- (TLKDataChannel *)_openDataChannelOnSignaling:(TLKLoopbackSignaling *)signaling ordered:(BOOL)ordered receiver:(TLKDataSink *)receiver
+{
+    [self _connectLoopbackSignaling:signaling until:^BOOL(TLKLoopbackSignaling *progress) {
+        return progress.offererConnected && progress.answererConnected;
+    }];
+    
+    XCTestExpectation *opened = [self expectationWithDescription:@"channel opened"];
+    signaling.dataChannelBlock = ^(TLKDataChannel *dataChannel) {
+        dataChannel.delegate = receiver;
+        [opened fulfill];
+    };
+    TLKDataChannel *channel = [signaling.offerer createDataChannelWithLabel:@"test" ordered:ordered forPeerWithID:@"peer"];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    signaling.dataChannelBlock = nil;
+    return channel;
+}
+
+- (void)testOrderedChannelKeepsMessageOrder
+{
+    TLKLoopbackSignaling *signaling = TLKLoopbackPair(NULL);
+    TLKDataSink *receiver = [[TLKDataSink alloc] init];
+    receiver.strings = [NSMutableArray array];
+    TLKDataChannel *channel = [self _openDataChannelOnSignaling:signaling ordered:YES receiver:receiver];
+    XCTAssertTrue(channel.isOrdered);
+    XCTAssertEqualObjects(channel.peerID, @"peer");
+    
+    NSMutableArray *sent = [NSMutableArray array];
+    for (int i = 0; i < 500; i++) {
+        NSString *message = [NSString stringWithFormat:@"%d", i];
+        [sent addObject:message];
+        [channel sendString:message];
+    }
+    
+    XCTestExpectation *received = [self expectationWithDescription:@"received"];
+    __weak TLKDataSink *weakReceiver = receiver;
+    receiver.progressBlock = ^{
+        if (weakReceiver.strings.count == sent.count) {
+            [received fulfill];
+        }
+    };
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    XCTAssertEqualObjects(receiver.strings, sent);
+    
+    [signaling.offerer removePeerConnectionForID:@"peer"];
+    [signaling.answerer removePeerConnectionForID:@"peer"];
+}
+
+// Data queued when the channel closes is dropped, and so is anything sent afterwards
+- (void)testSendsAfterCloseAreNotCounted
+{
+    dispatch_queue_t queue = dispatch_queue_create("TLKWebRTCTests.closed", DISPATCH_QUEUE_SERIAL);
+    TLKDataChannel *channel = [[TLKDataChannel alloc] initWithLabel:@"closed" peerID:@"peer" ordered:YES workQueue:queue delegateQueue:queue];
+    NSData *data = [NSMutableData dataWithLength:1024];
+    
+    [channel sendData:data];
+    XCTAssertEqual(channel.bufferedAmount, data.length);
+    [channel attachChannel:nil];
+    [channel sendData:data];
+    dispatch_sync(queue, ^{});
+    XCTAssertEqual(channel.bufferedAmount, (NSUInteger)0);
+    
+    for (int i = 0; i < 10; i++) {
+        XCTAssertFalse([channel sendData:data]);
+    }
+    dispatch_sync(queue, ^{});
+    XCTAssertEqual(channel.bufferedAmount, (NSUInteger)0);
+}
+
+// Payloads several default chunks long go whole on an unordered channel, so each arrives intact
+// whatever order they come in; one longer than chunkSize is refused
+- (void)testUnorderedChannelDeliversWholePayloads
+{
+    TLKLoopbackSignaling *signaling = TLKLoopbackPair(NULL);
+    TLKDataSink *receiver = [[TLKDataSink alloc] init];
+    receiver.messages = [NSMutableArray array];
+    TLKDataChannel *channel = [self _openDataChannelOnSignaling:signaling ordered:NO receiver:receiver];
+    XCTAssertFalse(channel.isOrdered);
+    
+    NSMutableData *tooLong = [NSMutableData dataWithLength:channel.chunkSize + 1];
+    XCTAssertFalse([channel sendData:tooLong]);
+    
+    channel.chunkSize = 64 * 1024;
+    NSMutableSet *sent = [NSMutableSet set];
+    for (int i = 0; i < 20; i++) {
+        NSMutableData *payload = [NSMutableData dataWithLength:48 * 1024];
+        arc4random_buf(payload.mutableBytes, payload.length);
+        [sent addObject:payload];
+        XCTAssertTrue([channel sendData:payload]);
+    }
+    
+    XCTestExpectation *received = [self expectationWithDescription:@"received"];
+    __weak TLKDataSink *weakReceiver = receiver;
+    receiver.progressBlock = ^{
+        if (weakReceiver.messages.count == sent.count) {
+            [received fulfill];
+        }
+    };
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    XCTAssertEqualObjects([NSSet setWithArray:receiver.messages], sent);
+    
+    [signaling.offerer removePeerConnectionForID:@"peer"];
+    [signaling.answerer removePeerConnectionForID:@"peer"];
+}
+
+- (void)_measureThroughputOrdered:(BOOL)ordered
+{
+    TLKLoopbackSignaling *signaling = TLKLoopbackPair(NULL);
+    TLKDataSink *receiver = [[TLKDataSink alloc] init];
+    TLKDataSink *sender = [[TLKDataSink alloc] init];
+    TLKDataChannel *channel = [self _openDataChannelOnSignaling:signaling ordered:ordered receiver:receiver];
+    channel.delegate = sender;
+    
+    NSMutableData *block = [NSMutableData dataWithLength:64 * 1024];
+    if (!ordered) {
+        // Unordered messages aren't split, so each block has to fit in one
+        channel.chunkSize = block.length;
+    }
+    arc4random_buf(block.mutableBytes, block.length);
+    const NSUInteger total = 16 * 1024 * 1024;
+    
+    [self measureBlock:^{
+        receiver.byteCount = 0;
+        sender.lowWaterCount = 0;
+        XCTestExpectation *done = [self expectationWithDescription:@"transferred"];
+        __block BOOL fulfilled = NO;
+        void (^check)(void) = ^{
+            // Everything arrived, and the sender has been told it may go again
+            if (!fulfilled && receiver.byteCount == total && sender.lowWaterCount > 0) {
+                fulfilled = YES;
+                [done fulfill];
+            }
+        };
+        receiver.progressBlock = check;
+        sender.progressBlock = check;
+        
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for (NSUInteger sent = 0; sent < total; sent += block.length) {
+            [channel sendData:block];
+        }
+        [self waitForExpectationsWithTimeout:60 handler:nil];
+        NSLog(@"%.1f MB/s", total / (CFAbsoluteTimeGetCurrent() - start) / (1024 * 1024));
+        XCTAssertLessThanOrEqual(channel.bufferedAmount, channel.lowWaterMark);
+        
+        receiver.progressBlock = nil;
+        sender.progressBlock = nil;
+    }];
+    
+    [signaling.offerer removePeerConnectionForID:@"peer"];
+    [signaling.answerer removePeerConnectionForID:@"peer"];
+}
+
+- (void)testOrderedChannelThroughput
+{
+    [self _measureThroughputOrdered:YES];
+}
+
+- (void)testUnorderedChannelThroughput
+{
+    [self _measureThroughputOrdered:NO];
+}
+
+@end
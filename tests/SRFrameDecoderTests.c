@@ -0,0 +1,313 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Runs SRFrameDecoder over the malformed frame corpus and a chunked fuzz, then measures how fast
+// it gets through streams of small and large frames on the socket's ring buffer read path.
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "SRFrameDecoder.h"
+#include "SRRingBuffer.h"
+#include "SRMalformedFrameCorpus.h"
+#include "SRTestSupport.h"
+
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+} SRTestBuffer;
+
+static void SRTestBufferAppend(SRTestBuffer *buffer, const void *bytes, size_t length)
+{
+    if (buffer->length + length > buffer->capacity) {
+        buffer->capacity = (buffer->length + length) * 2;
+        buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+    }
+    memcpy(buffer->bytes + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+static bool SRTestBufferEqual(const SRTestBuffer *a, const SRTestBuffer *b)
+{
+    return a->length == b->length && (a->length == 0 || memcmp(a->bytes, b->bytes, a->length) == 0);
+}
+
+// Unmasked server frames: count frames of payloadLength bytes each.
+static SRTestBuffer SRSyntheticFrameStream(size_t count, size_t payloadLength)
+{
+    SRTestBuffer stream = {0};
+    uint8_t *payload = malloc(payloadLength);
+    memset(payload, 'a', payloadLength);
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t header[10] = {0x81};
+        size_t headerLength = 2;
+        if (payloadLength < 126) {
+            header[1] = (uint8_t)payloadLength;
+        } else if (payloadLength <= UINT16_MAX) {
+            header[1] = 126;
+            header[2] = (uint8_t)(payloadLength >> 8);
+            header[3] = (uint8_t)payloadLength;
+            headerLength += 2;
+        } else {
+            header[1] = 127;
+            for (int b = 0; b < 8; b++) {
+                header[2 + b] = (uint8_t)((uint64_t)payloadLength >> (56 - 8 * b));
+            }
+            headerLength += 8;
+        }
+        SRTestBufferAppend(&stream, header, headerLength);
+        SRTestBufferAppend(&stream, payload, payloadLength);
+    }
+    free(payload);
+    return stream;
+}
+
+// Decodes input fed to the decoder chunkSize bytes at a time and records what it reported in
+// trace: H for a header, E for the end of a frame, !n for error n. Payload bytes go to payloads.
+// Each call gets a heap copy of exactly the bytes offered, so a sanitizer build catches the
+// decoder reading past them.
+static void SRDecodeFrames(const uint8_t *input, size_t length, size_t chunkSize, bool expectsMasking, bool allowsCompression, SRTestBuffer *trace, SRTestBuffer *payloads)
+{
+    SRFrameDecoder decoder;
+    SRFrameDecoderInit(&decoder, expectsMasking);
+    decoder.allowsCompression = allowsCompression;
+
+    size_t offset = 0;
+    size_t available = 0;
+    while (true) {
+        // Bytes arrive chunkSize at a time; whatever the decoder hasn't used is offered again.
+        size_t arriving = length - offset < chunkSize ? length - offset : chunkSize;
+        if (arriving > available) {
+            available = arriving;
+        }
+        uint8_t *offered = malloc(available ? available : 1);
+        memcpy(offered, input + offset, available);
+        size_t consumed = 0;
+        uint8_t *payload = NULL;
+        size_t payloadLength = 0;
+        SRFrameEvent event = SRFrameDecoderDecode(&decoder, offered, available, &consumed, &payload, &payloadLength);
+        offset += consumed;
+        available -= consumed;
+
+        if (event == SRFrameEventHeader) {
+            SRTestBufferAppend(trace, "H", 1);
+        } else if (event == SRFrameEventPayload) {
+            SRTestBufferAppend(payloads, payload, payloadLength);
+        } else if (event == SRFrameEventFrameEnd) {
+            SRTestBufferAppend(trace, "E", 1);
+        }
+        free(offered);
+
+        if (event == SRFrameEventError) {
+            char error[16];
+            int errorLength = snprintf(error, sizeof(error), "!%d", decoder.error);
+            SRTestBufferAppend(trace, error, (size_t)errorLength);
+            break;
+        } else if (event == SRFrameEventNone && offset == length) {
+            break;
+        }
+    }
+}
+
+static void SRTestRejectsMalformedFrames(void)
+{
+    for (size_t i = 0; i < SRMalformedFrameCorpusCount; i++) {
+        SRMalformedFrame frame = SRMalformedFrameCorpus[i];
+        char error[16];
+        int errorLength = snprintf(error, sizeof(error), "!%d", frame.error);
+
+        for (size_t chunkSize = 1; chunkSize <= frame.length; chunkSize++) {
+            SRTestBuffer trace = {0};
+            SRTestBuffer payloads = {0};
+            SRDecodeFrames((const uint8_t *)frame.bytes, frame.length, chunkSize, false, frame.allowsCompression, &trace, &payloads);
+            if (frame.error == SRFrameErrorNone) {
+                SR_CHECK(trace.length == 0 || memchr(trace.bytes, '!', trace.length) == NULL, "%s in %zu byte chunks: %.*s", frame.name, chunkSize, (int)trace.length, trace.bytes);
+            } else {
+                SR_CHECK(trace.length >= (size_t)errorLength && memcmp(trace.bytes + trace.length - errorLength, error, (size_t)errorLength) == 0, "%s in %zu byte chunks: %.*s", frame.name, chunkSize, (int)trace.length, trace.bytes);
+            }
+            free(trace.bytes);
+            free(payloads.bytes);
+        }
+    }
+}
+
+static void SRTestUnmasksAcrossChunks(void)
+{
+    // "Hello" from RFC 6455 section 5.7, masked as a client sends it.
+    static const uint8_t frame[] = {0x81, 0x85, 0x37, 0xfa, 0x21, 0x3d, 0x7f, 0x9f, 0x4d, 0x51, 0x58};
+    for (size_t chunkSize = 1; chunkSize <= sizeof(frame); chunkSize++) {
+        SRTestBuffer trace = {0};
+        SRTestBuffer payloads = {0};
+        SRDecodeFrames(frame, sizeof(frame), chunkSize, true, false, &trace, &payloads);
+        SR_CHECK(trace.length == 2 && memcmp(trace.bytes, "HE", 2) == 0, "%zu byte chunks: %.*s", chunkSize, (int)trace.length, trace.bytes);
+        SR_CHECK(payloads.length == 5 && memcmp(payloads.bytes, "Hello", 5) == 0, "%zu byte chunks", chunkSize);
+        free(trace.bytes);
+        free(payloads.bytes);
+    }
+
+    // A client must never be sent a masked frame.
+    SRTestBuffer trace = {0};
+    SRTestBuffer payloads = {0};
+    SRDecodeFrames(frame, sizeof(frame), sizeof(frame), false, false, &trace, &payloads);
+    SR_CHECK(trace.length > 0 && trace.bytes[0] == '!', "%.*s", (int)trace.length, trace.bytes);
+    free(trace.bytes);
+    free(payloads.bytes);
+}
+
+// Random bytes, and valid streams with bytes flipped, decoded whole and in random pieces must
+// give the same events, payload and error.
+static void SRTestFuzz(uint64_t seed)
+{
+    SRTestBuffer valid = SRSyntheticFrameStream(20, 130);
+    uint8_t *input = malloc(valid.length > 512 ? valid.length : 512);
+    uint64_t state = seed;
+
+    for (int i = 0; i < 20000; i++) {
+        size_t length;
+        if (SRTestRandomUniform(&state, 2)) {
+            length = SRTestRandomUniform(&state, 512);
+            SRTestRandomBytes(&state, input, length);
+        } else {
+            memcpy(input, valid.bytes, valid.length);
+            for (uint32_t flips = 1 + SRTestRandomUniform(&state, 4); flips; flips--) {
+                input[SRTestRandomUniform(&state, (uint32_t)valid.length)] ^= (uint8_t)(1 + SRTestRandomUniform(&state, 255));
+            }
+            length = SRTestRandomUniform(&state, (uint32_t)valid.length + 1);
+        }
+        bool allowsCompression = SRTestRandomUniform(&state, 2);
+
+        SRTestBuffer wholeTrace = {0}, wholePayloads = {0}, splitTrace = {0}, splitPayloads = {0};
+        size_t chunkSize = 1 + SRTestRandomUniform(&state, 9);
+        SRDecodeFrames(input, length, length ? length : 1, false, allowsCompression, &wholeTrace, &wholePayloads);
+        SRDecodeFrames(input, length, chunkSize, false, allowsCompression, &splitTrace, &splitPayloads);
+
+        bool same = SRTestBufferEqual(&wholeTrace, &splitTrace) && SRTestBufferEqual(&wholePayloads, &splitPayloads);
+        SR_CHECK(same, "seed %llu, case %d, %zu byte chunks: %.*s whole, %.*s split", (unsigned long long)seed, i, chunkSize,
+                 (int)wholeTrace.length, wholeTrace.bytes, (int)splitTrace.length, splitTrace.bytes);
+        free(wholeTrace.bytes);
+        free(wholePayloads.bytes);
+        free(splitTrace.bytes);
+        free(splitPayloads.bytes);
+        if (!same) {
+            break;
+        }
+    }
+
+    free(input);
+    free(valid.bytes);
+}
+
+// Mirrors the socket's read path: the stream is read into the ring in chunkSize pieces, the
+// decoder runs over the front of it, and each payload chunk is copied out into frameData.
+static size_t SRScanFrameStream(const SRTestBuffer *stream, size_t chunkSize)
+{
+    SRRingBuffer ring;
+    SRRingBufferInit(&ring, chunkSize * 2);
+    SRFrameDecoder decoder;
+    SRFrameDecoderInit(&decoder, false);
+    SRTestBuffer frameData = {0};
+    size_t frames = 0;
+
+    const uint8_t *src = stream->bytes;
+    size_t remaining = stream->length;
+    while (remaining || ring.length) {
+        if (remaining) {
+            uint8_t *dst = NULL;
+            SRRingBufferReserve(&ring, chunkSize);
+            size_t length = SRRingBufferWritableBytes(&ring, &dst);
+            length = length < chunkSize ? length : chunkSize;
+            length = length < remaining ? length : remaining;
+            memcpy(dst, src, length);
+            SRRingBufferCommit(&ring, length);
+            src += length;
+            remaining -= length;
+        }
+
+        while (true) {
+            uint8_t *bytes = NULL;
+            size_t length = SRRingBufferReadableBytes(&ring, (const uint8_t **)&bytes);
+            size_t consumed = 0;
+            uint8_t *payload = NULL;
+            size_t payloadLength = 0;
+            SRFrameEvent event = SRFrameDecoderDecode(&decoder, bytes, length, &consumed, &payload, &payloadLength);
+            if (event == SRFrameEventHeader) {
+                frameData.length = 0;
+            } else if (event == SRFrameEventPayload) {
+                SRTestBufferAppend(&frameData, payload, payloadLength);
+            } else if (event == SRFrameEventFrameEnd) {
+                frames++;
+            }
+            SRRingBufferConsume(&ring, consumed);
+            if (event == SRFrameEventError || (event == SRFrameEventNone && consumed == 0)) {
+                break;
+            }
+        }
+        if (decoder.state == SRFrameDecoderStateFailed) {
+            break;
+        }
+    }
+
+    free(frameData.bytes);
+    SRRingBufferFree(&ring);
+    return frames;
+}
+
+static void SRTestScanSyntheticFrameStream(void)
+{
+    SRTestBuffer stream = SRSyntheticFrameStream(100, 70000);
+    SR_CHECK(SRScanFrameStream(&stream, 2048) == 100, "2048 byte reads");
+    SR_CHECK(SRScanFrameStream(&stream, 65536) == 100, "65536 byte reads");
+    free(stream.bytes);
+}
+
+// Frames and MB per second through the read path in 16 KB reads, best of a few runs.
+static void SRBenchmarkFrameStream(const char *name, size_t count, size_t payloadLength)
+{
+    SRTestBuffer stream = SRSyntheticFrameStream(count, payloadLength);
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        double start = SRTestNow();
+        size_t frames = SRScanFrameStream(&stream, 16384);
+        double elapsed = SRTestNow() - start;
+        SR_CHECK(frames == count, "%s: %zu frames", name, frames);
+        if (best == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    printf("SRFrameDecoderTests: %s: %.0f frames/s, %.0f MB/s\n", name, count / best, stream.length / best / (1024 * 1024));
+    free(stream.bytes);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 0) : (uint64_t)time(NULL);
+    if (seed == 0) {
+        seed = 1;
+    }
+    printf("SRFrameDecoderTests: fuzz seed %llu\n", (unsigned long long)seed);
+
+    SRTestRejectsMalformedFrames();
+    SRTestUnmasksAcrossChunks();
+    SRTestFuzz(seed);
+    SRTestScanSyntheticFrameStream();
+
+    SRBenchmarkFrameStream("200000 20 byte frames", 200000, 20);
+    SRBenchmarkFrameStream("8 4 MB frames", 8, 4 * 1024 * 1024);
+
+    return SRTestExitStatus();
+}
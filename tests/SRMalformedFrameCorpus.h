@@ -0,0 +1,63 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Server to client frames SRFrameDecoder must refuse, each after a valid prefix where it helps,
+// and a few valid ones it must accept. Shared by the XCTest suite and the plain C tests.
+
+#ifndef SRMalformedFrameCorpus_h
+#define SRMalformedFrameCorpus_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "SRFrameDecoder.h"
+
+typedef struct {
+    const char *name;
+    const char *bytes;
+    size_t length;
+    bool allowsCompression;
+    SRFrameError error;
+} SRMalformedFrame;
+
+#define SR_MALFORMED_FRAME(name, bytes, allowsCompression, error) {name, bytes, sizeof(bytes) - 1, allowsCompression, error}
+
+static const SRMalformedFrame SRMalformedFrameCorpus[] = {
+    SR_MALFORMED_FRAME("reserved data opcode", "\x83\x00", false, SRFrameErrorReservedOpcode),
+    SR_MALFORMED_FRAME("reserved control opcode", "\x8B\x00", false, SRFrameErrorReservedOpcode),
+    SR_MALFORMED_FRAME("opcode 0xF", "\x8F\x00", false, SRFrameErrorReservedOpcode),
+    SR_MALFORMED_FRAME("RSV2", "\xA1\x00", false, SRFrameErrorReservedBits),
+    SR_MALFORMED_FRAME("RSV3", "\x91\x00", false, SRFrameErrorReservedBits),
+    SR_MALFORMED_FRAME("RSV1 without permessage-deflate", "\xC1\x00", false, SRFrameErrorReservedBits),
+    SR_MALFORMED_FRAME("RSV1 on a continuation", "\x41\x00\xC0\x00", true, SRFrameErrorReservedBits),
+    SR_MALFORMED_FRAME("RSV1 on a control frame", "\xC9\x00", true, SRFrameErrorReservedBits),
+    SR_MALFORMED_FRAME("continuation with no message", "\x80\x00", false, SRFrameErrorUnexpectedContinuation),
+    SR_MALFORMED_FRAME("continuation after a final frame", "\x81\x01" "a\x80\x00", false, SRFrameErrorUnexpectedContinuation),
+    SR_MALFORMED_FRAME("new message inside a message", "\x01\x01" "a\x82\x00", false, SRFrameErrorExpectedContinuation),
+    SR_MALFORMED_FRAME("new message after a ping", "\x01\x01" "a\x89\x00\x81\x00", false, SRFrameErrorExpectedContinuation),
+    SR_MALFORMED_FRAME("fragmented ping", "\x09\x00", false, SRFrameErrorFragmentedControl),
+    SR_MALFORMED_FRAME("fragmented close", "\x08\x02\x03\xE8", false, SRFrameErrorFragmentedControl),
+    SR_MALFORMED_FRAME("ping with 16 bit length", "\x89\x7E\x00\x7D", false, SRFrameErrorControlTooLong),
+    SR_MALFORMED_FRAME("close with 64 bit length", "\x88\x7F\x00\x00\x00\x00\x00\x00\x00\x02", false, SRFrameErrorControlTooLong),
+    SR_MALFORMED_FRAME("masked server frame", "\x81\x81\x01\x02\x03\x04\x60", false, SRFrameErrorMasking),
+    SR_MALFORMED_FRAME("length with the top bit set", "\x82\x7F\x80\x00\x00\x00\x00\x00\x00\x00", false, SRFrameErrorLengthTooLarge),
+    SR_MALFORMED_FRAME("valid, with a ping inside a message", "\x01\x01" "a\x89\x00\x80\x01" "b", false, SRFrameErrorNone),
+    SR_MALFORMED_FRAME("valid, compressed", "\xC1\x01" "a\x81\x00", true, SRFrameErrorNone),
+};
+
+static const size_t SRMalformedFrameCorpusCount = sizeof(SRMalformedFrameCorpus) / sizeof(SRMalformedFrameCorpus[0]);
+
+#endif
@@ -0,0 +1,100 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Checks SRMaskBytes against the byte at a time loop and compares their throughput. The file is
+// built once per code path SRMask.h can take (see CMakeLists.txt), so each run covers one path.
+
+#include <stdlib.h>
+
+#include "SRMask.h"
+#include "SRTestSupport.h"
+
+#if defined(SR_MASK_AVX2)
+static const char *const SRMaskPath = "AVX2";
+#elif defined(SR_MASK_SSE2)
+static const char *const SRMaskPath = "SSE2";
+#elif defined(SR_MASK_NEON)
+static const char *const SRMaskPath = "NEON";
+#else
+static const char *const SRMaskPath = "word loop";
+#endif
+
+// Every SIMD/word/tail split, all key rotations and unaligned buffers.
+static void SRTestMaskMatchesScalarLoop(void)
+{
+    const uint8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    uint8_t src[512 + 8];
+    uint8_t expected[sizeof(src)];
+    uint8_t actual[sizeof(src)];
+    uint64_t seed = 0x5EED;
+    SRTestRandomBytes(&seed, src, sizeof(src));
+
+    for (size_t length = 0; length <= 512; length++) {
+        for (size_t offset = 0; offset < 8; offset++) {
+            for (size_t align = 0; align < 8; align++) {
+                SRMaskBytesScalar(expected + align, src + align, length, key, offset);
+                SRMaskBytes(actual + align, src + align, length, key, offset);
+                SR_CHECK(memcmp(expected + align, actual + align, length) == 0, "length %zu offset %zu align %zu", length, offset, align);
+
+                // In place, as the receive path unmasks.
+                memcpy(actual + align, src + align, length);
+                SRMaskBytes(actual + align, actual + align, length, key, offset);
+                SR_CHECK(memcmp(expected + align, actual + align, length) == 0, "in place, length %zu offset %zu align %zu", length, offset, align);
+            }
+        }
+    }
+}
+
+typedef void (*SRMaskFunction)(uint8_t *dst, const uint8_t *src, size_t length, const uint8_t *maskKey, size_t maskOffset);
+
+// MB/s masking a 4 MB payload in place, best of a few runs.
+static double SRMaskThroughput(SRMaskFunction mask, uint8_t *payload, size_t length)
+{
+    const uint8_t key[4] = {0xde, 0xad, 0xbe, 0xef};
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        double start = SRTestNow();
+        for (int i = 0; i < 16; i++) {
+            mask(payload, payload, length, key, i);
+        }
+        double rate = 16 * length / (SRTestNow() - start) / (1024 * 1024);
+        if (rate > best) {
+            best = rate;
+        }
+    }
+    return best;
+}
+
+int main(void)
+{
+#if defined(SR_MASK_AVX2) && (defined(__GNUC__) || defined(__clang__))
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("SRMaskTests: this CPU has no AVX2, skipping\n");
+        return SR_TEST_SKIPPED;
+    }
+#endif
+
+    SRTestMaskMatchesScalarLoop();
+
+    size_t length = 4 * 1024 * 1024;
+    uint8_t *payload = calloc(length, 1);
+    double scalar = SRMaskThroughput(SRMaskBytesScalar, payload, length);
+    double kernel = SRMaskThroughput(SRMaskBytes, payload, length);
+    free(payload);
+    printf("SRMaskTests (%s): %.0f MB/s, byte loop %.0f MB/s (%.1fx)\n", SRMaskPath, kernel, scalar, kernel / scalar);
+
+    return SRTestExitStatus();
+}
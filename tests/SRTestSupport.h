@@ -0,0 +1,79 @@
+//
+//   Copyright 2012 Square Inc.
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Helpers for the plain C tests, which build with CMake outside of Xcode so the C parts of
+// SocketRocket can be checked and benchmarked on Linux too.
+
+#ifndef SRTestSupport_h
+#define SRTestSupport_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// ctest treats this exit status as a skipped test.
+#define SR_TEST_SKIPPED 77
+
+static int SRTestFailureCount = 0;
+
+// Reports a failure and carries on, so one run shows every broken case.
+#define SR_CHECK(condition, ...) do { \
+    if (!(condition)) { \
+        SRTestFailureCount++; \
+        fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #condition); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+    } \
+} while (0)
+
+static inline int SRTestExitStatus(void)
+{
+    if (SRTestFailureCount) {
+        fprintf(stderr, "%d checks failed\n", SRTestFailureCount);
+        return 1;
+    }
+    return 0;
+}
+
+static inline double SRTestNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// xorshift64*, seeded explicitly so a failing run can be repeated.
+static inline uint64_t SRTestRandom(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline uint32_t SRTestRandomUniform(uint64_t *state, uint32_t bound)
+{
+    return bound ? (uint32_t)(SRTestRandom(state) >> 32) % bound : 0;
+}
+
+static inline void SRTestRandomBytes(uint64_t *state, uint8_t *bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        bytes[i] = (uint8_t)(SRTestRandom(state) >> 56);
+    }
+}
+
+#endif